@@ -0,0 +1,1546 @@
+/**
+ * Shared Non-Blocking HTTP Transport for the C Agent Pattern Templates
+ * One event loop multiplexes every in-flight Messages API request
+ *
+ * Requests are submitted with transport_submit() and complete through a
+ * callback and/or a TransportFuture. Built with -DAGENT_TRANSPORT_CURL the
+ * transport drives a libcurl multi handle from a single loop thread: all
+ * requests share its connection cache, and HTTP/2 multiplexing puts many
+ * concurrent requests on a few connections to api.anthropic.com. Hundreds
+ * of voter, section and worker calls therefore cost one thread, not one
+ * thread each.
+ *
+ * transport_submit_stream() requests a server-sent event stream instead
+ * and hands each text delta to a callback as it arrives; the callback can
+ * stop the request early by returning false. transport_cancel() aborts an
+ * in-flight request from any thread.
+ *
+ * Without AGENT_TRANSPORT_CURL the transport answers every request inline
+ * from the mock responder registered by the template, so the templates
+ * still build and run with no dependencies. Streaming requests replay the
+ * mock text through the same SSE parser in small chunks.
+ *
+ * Stable blocks can be marked for the API's prompt caching: cache_system
+ * marks the system prompt, and cached_prefix is sent as its own marked
+ * block ahead of the prompt. Each response reports its token usage,
+ * including cache reads and writes.
+ *
+ * A prompt can be given as an iovec list (prompt_iov) instead of one
+ * string: each piece is escaped straight into the request body, so a
+ * template can send a large document without copying it into a prompt
+ * buffer first.
+ *
+ * transport_set_cache() puts a response cache (response_cache.h) in front
+ * of the transport: hits complete inline without a request, and successful
+ * responses are stored. Requests with no_cache set bypass it.
+ *
+ * transport_set_governor() puts a rate governor (rate_governor.h) in
+ * front of the network: submits block until the requests-per-minute and
+ * tokens-per-minute buckets have room, so bursts queue on the client
+ * instead of coming back as 429s. Submits from completion callbacks on
+ * the libcurl loop thread never block; the loop queues them and admits
+ * them as the buckets refill. A request can also carry a TokenBudget;
+ * it reserves its estimated cost on submit, is refused when that does not
+ * fit, and settles to the reported usage on completion. Cache hits are
+ * free and skip both.
+ *
+ * Every request runs under a TransportPolicy, the transport's own or one
+ * it carries. The policy sets a deadline for the whole call, retries 429,
+ * 529, other 5xx responses and dropped connections with exponential
+ * backoff and jitter (a Retry-After header is honoured), and can hedge:
+ * once an attempt has run for a fixed delay, or for the p95 of recent
+ * latencies, a duplicate is sent and whichever answers first wins. Streams
+ * are retried only before their first delta and never hedged. Under a
+ * rate governor each retry is admitted again like a new request, and a
+ * hedge is sent only if the governor has room for it at once. The mock
+ * build treats a NULL from the responder as an overloaded attempt, so
+ * retries can be exercised without a network.
+ *
+ * Each request is a "chat" span (a child of the submitting thread's
+ * current span) and feeds the request, error, retry, cache and token
+ * counters and the latency histograms in metrics.h.
+ *
+ * Compile with (production):
+ * gcc ... -DAGENT_TRANSPORT_CURL -pthread -lcurl
+ */
+
+#ifndef ANTHROPIC_TRANSPORT_H
+#define ANTHROPIC_TRANSPORT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#ifdef AGENT_TRANSPORT_CURL
+#include <curl/curl.h>
+#endif
+
+#include "response_cache.h"
+#include "json_tokenizer.h"
+#include "string_builder.h"
+#include "rate_governor.h"
+#include "metrics.h"
+
+#define TRANSPORT_API_URL "https://api.anthropic.com/v1/messages"
+#define TRANSPORT_API_VERSION "2023-06-01"
+#define TRANSPORT_MAX_HOST_CONNECTIONS 4
+#define TRANSPORT_MAX_CONCURRENT_STREAMS 100
+#define TRANSPORT_POLL_TIMEOUT_MS 1000
+#define TRANSPORT_MOCK_STREAM_CHUNK 24
+#define TRANSPORT_HEDGE_P95 -1            // hedge_after_ms: hedge after the observed p95
+#define TRANSPORT_LATENCY_SAMPLES 128     // Recent latencies kept for the p95
+#define TRANSPORT_HEDGE_MIN_SAMPLES 20    // Adaptive hedging waits for this many
+
+/**
+ * Deadline, retry and hedging policy for a request
+ */
+typedef struct TransportPolicy {
+    int timeout_ms;      // Deadline for the whole call, retries included; 0 for none
+    int max_retries;     // Attempts after a 429, 529, other 5xx or dropped connection
+    int backoff_ms;      // Delay before the first retry; doubles per retry, with jitter
+    int backoff_max_ms;
+    int hedge_after_ms;  // Duplicate an attempt running this long; 0 never,
+                         // TRANSPORT_HEDGE_P95 for the observed p95 latency
+} TransportPolicy;
+
+static const TransportPolicy transport_default_policy = {
+    .timeout_ms = 0, .max_retries = 3, .backoff_ms = 500, .backoff_max_ms = 16000,
+    .hedge_after_ms = 0};
+
+/**
+ * One Messages API request (strings are copied on submit)
+ */
+typedef struct AnthropicRequest {
+    const char* api_key;
+    const char* model;
+    const char* system_prompt;  // Optional
+    const char* prompt;
+    // Optional scatter list sent as the prompt in place of prompt, so a
+    // large document goes into the body without being joined first
+    const struct iovec* prompt_iov;
+    int prompt_iovcnt;
+    int max_tokens;
+    bool no_cache;  // Always send, e.g. for independent voting samples
+    const char* cached_prefix;  // Optional stable block sent before prompt, marked cacheable
+    bool cache_system;  // Mark system_prompt as a prompt-cache breakpoint
+    TokenBudget* budget;  // Optional ceiling the request is charged to
+    const TransportPolicy* policy;  // Optional; NULL uses the transport's
+} AnthropicRequest;
+
+/**
+ * Token usage reported by the API
+ */
+typedef struct AnthropicUsage {
+    int input_tokens;  // Uncached input only
+    int output_tokens;
+    int cache_creation_input_tokens;  // Written to the prompt cache
+    int cache_read_input_tokens;      // Served from the prompt cache
+} AnthropicUsage;
+
+/**
+ * Completed response
+ */
+typedef struct AnthropicResponse {
+    char* text;    // First text content block; NULL on failure
+    int status;    // HTTP status, 0 if the request never completed
+    char* error;   // Failure description; NULL on success
+    bool cancelled;  // Stopped early by the caller
+    AnthropicUsage usage;
+    int attempts;    // Requests sent, retries and hedges included; 0 for a cache hit
+    bool hedged;     // A duplicate was sent
+} AnthropicResponse;
+
+/**
+ * Completion callback, run on the transport thread. It may take ownership
+ * of response->text by setting it to NULL.
+ */
+typedef void (*TransportCallback)(AnthropicResponse* response, void* user_data);
+
+/**
+ * Mock responder used when the transport is built without libcurl
+ */
+typedef char* (*TransportMockFunc)(const AnthropicRequest* request);
+
+/**
+ * Add one call's usage to a running total
+ */
+static inline void anthropic_usage_add(AnthropicUsage* total, const AnthropicUsage* usage) {
+    total->input_tokens += usage->input_tokens;
+    total->output_tokens += usage->output_tokens;
+    total->cache_creation_input_tokens += usage->cache_creation_input_tokens;
+    total->cache_read_input_tokens += usage->cache_read_input_tokens;
+}
+
+/**
+ * Tokens a call counts against rate limits; cache reads are not metered
+ */
+static inline long anthropic_usage_rate_tokens(const AnthropicUsage* usage) {
+    return (long)usage->input_tokens + usage->cache_creation_input_tokens + usage->output_tokens;
+}
+
+/**
+ * Tokens a call is charged to a budget, with cache reads at a tenth
+ */
+static inline long anthropic_usage_budget_tokens(const AnthropicUsage* usage) {
+    return anthropic_usage_rate_tokens(usage) + usage->cache_read_input_tokens / 10;
+}
+
+/**
+ * Upper bound on a request's tokens before it is sent: its text at about
+ * four bytes a token plus max_tokens of output
+ */
+static inline long anthropic_request_estimate_tokens(const AnthropicRequest* request) {
+    size_t bytes = 0;
+    if (request->system_prompt) bytes += strlen(request->system_prompt);
+    if (request->cached_prefix) bytes += strlen(request->cached_prefix);
+    if (request->prompt_iov) {
+        for (int i = 0; i < request->prompt_iovcnt; i++) bytes += request->prompt_iov[i].iov_len;
+    } else if (request->prompt) {
+        bytes += strlen(request->prompt);
+    }
+    return (long)((bytes + 3) / 4) + request->max_tokens;
+}
+
+/**
+ * Streaming text delta callback, run on the transport thread. text holds
+ * everything received so far. Return false to stop the request.
+ */
+typedef bool (*TransportDeltaFunc)(const char* delta, size_t delta_length,
+                                   const char* text, size_t text_length,
+                                   void* user_data);
+
+/**
+ * Incremental server-sent events parser
+ */
+typedef struct SseParser {
+    StringBuilder line;   // Partial line carried across chunks
+    StringBuilder data;   // data: lines of the current event
+    char event[64];
+} SseParser;
+
+#ifdef AGENT_TRANSPORT_CURL
+/**
+ * One HTTP request made for a future; a retry or a hedge is a new attempt
+ */
+typedef struct TransportAttempt {
+    struct TransportFuture* future;
+    CURL* easy;
+    struct curl_slist* headers;
+    StringBuilder received;
+    double started_ms;
+} TransportAttempt;
+#endif
+
+/**
+ * Handle for one in-flight request
+ */
+typedef struct TransportFuture {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    atomic_int refs;  // Caller + transport
+    atomic_bool cancel_requested;
+    AnthropicResponse response;
+    TransportCallback callback;
+    void* user_data;
+    struct TransportFuture* next;  // Submission or backoff queue link
+    char* api_key_header;
+    StringBuilder body;
+    TransportDeltaFunc on_delta;  // Set for streaming requests
+    SseParser sse;
+    StringBuilder streamed;
+    ResponseCache* cache;  // Set when the response should be stored
+    ResponseCacheKey cache_key;
+    TokenBudget* budget;     // Charged on completion
+    RateGovernor* governor;  // Corrected on completion
+    long estimated_tokens;   // Reserved from the budget and the governor
+    TransportPolicy policy;
+    double submitted_ms;  // Monotonic; the deadline counts from here
+    double retry_at_ms;   // End of the current backoff
+    int retries;
+    uint64_t started_ns;  // metrics_now_ns() at submit
+    MetricsSpan span;
+#ifdef AGENT_TRANSPORT_CURL
+    TransportAttempt* attempts[2];  // Primary and hedge; NULL when not running
+    struct TransportFuture* next_hedge;  // Hedge watch list link
+    bool hedge_watched;
+    bool awaiting_admission;  // Submitted on the loop thread, or a retry; not yet admitted
+    double queued_ms;         // When it joined the admission queue
+    struct Transport* transport;          // Owner, woken by transport_cancel()
+    struct TransportFuture* next_cancel;  // Cancel list link
+#endif
+} TransportFuture;
+
+/**
+ * Transport instance
+ */
+typedef struct Transport {
+    pthread_mutex_t lock;
+    TransportFuture* submit_head;
+    TransportFuture* submit_tail;
+    atomic_bool shutting_down;
+    atomic_int in_flight;
+    ResponseCache* cache;  // Not owned; NULL disables caching
+    RateGovernor* governor;  // Not owned; NULL admits every request at once
+    TransportPolicy policy;  // For requests that carry none
+#ifdef AGENT_TRANSPORT_CURL
+    CURLM* multi;
+    pthread_t loop_thread;
+    TransportFuture* cancelled;  // Guarded by lock; each entry holds a reference
+    // Owned by the loop thread
+    TransportFuture* admission;       // Waiting for the governor, oldest first
+    TransportFuture* admission_tail;
+    TransportFuture* backoff;     // Waiting to retry
+    TransportFuture* hedge_watch; // Running and eligible for a hedge
+    double latency_ms[TRANSPORT_LATENCY_SAMPLES];  // Recent successful attempts
+    int latency_count;
+    int latency_next;
+    double latency_p95_ms;
+    bool latency_dirty;
+    unsigned int jitter_seed;
+#endif
+} Transport;
+
+static TransportMockFunc transport_mock_responder = NULL;
+
+// Budget and policy for requests that carry none, for the calling thread
+static _Thread_local TokenBudget* transport_thread_budget = NULL;
+static _Thread_local const TransportPolicy* transport_thread_policy = NULL;
+
+/**
+ * Charge this thread's requests that carry no budget of their own to
+ * budget (NULL stops it); returns the previous one so callers can nest.
+ * Lets a pattern cover callbacks, such as worker handlers, that build
+ * their own requests.
+ */
+static inline TokenBudget* transport_set_thread_budget(TokenBudget* budget) {
+    TokenBudget* previous = transport_thread_budget;
+    transport_thread_budget = budget;
+    return previous;
+}
+
+/**
+ * Run this thread's requests that carry no policy under policy (NULL
+ * reverts to the transport's); returns the previous one
+ */
+static inline const TransportPolicy* transport_set_thread_policy(const TransportPolicy* policy) {
+    const TransportPolicy* previous = transport_thread_policy;
+    transport_thread_policy = policy;
+    return previous;
+}
+
+static inline double transport_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec * 1000.0 + (double)now.tv_nsec / 1e6;
+}
+
+/**
+ * Whether an attempt that failed this way is worth repeating
+ */
+static inline bool transport_retryable_status(int status) {
+    return status == 429 || status == 529 || (status >= 500 && status <= 504);
+}
+
+/**
+ * Start the next backoff: the delay doubles per retry up to the policy's
+ * maximum, jittered over its upper half, and at least retry_after_ms.
+ * Returns -1 when the retries are used up or the delay would pass the
+ * deadline.
+ */
+static inline double transport_next_backoff_ms(TransportFuture* future, unsigned int* seed,
+                                               double retry_after_ms) {
+    const TransportPolicy* policy = &future->policy;
+    if (future->retries >= policy->max_retries) return -1;
+
+    double delay = policy->backoff_ms;
+    for (int i = 0; i < future->retries && delay < policy->backoff_max_ms; i++) delay *= 2;
+    if (delay > policy->backoff_max_ms) delay = policy->backoff_max_ms;
+    delay = delay / 2 + (delay / 2) * ((double)rand_r(seed) / RAND_MAX);
+    if (delay < retry_after_ms) delay = retry_after_ms;
+
+    double now = transport_now_ms();
+    if (policy->timeout_ms > 0 && now + delay >= future->submitted_ms + policy->timeout_ms) {
+        return -1;
+    }
+    future->retries++;
+    future->retry_at_ms = now + delay;
+    return delay;
+}
+
+/**
+ * Register the mock responder for builds without libcurl
+ */
+static inline void transport_set_mock_responder(TransportMockFunc responder) {
+    transport_mock_responder = responder;
+}
+
+/**
+ * Append the prompt as one JSON string; prompt_iov pieces are escaped
+ * into the body one after another
+ */
+static inline void transport_append_prompt(StringBuilder* body, const AnthropicRequest* request) {
+    if (!request->prompt_iov) {
+        string_builder_append_json_string(body, request->prompt);
+        return;
+    }
+    string_builder_append(body, "\"", 1);
+    for (int i = 0; i < request->prompt_iovcnt; i++) {
+        string_builder_append_json(body, (const char*)request->prompt_iov[i].iov_base,
+                                   request->prompt_iov[i].iov_len);
+    }
+    string_builder_append(body, "\"", 1);
+}
+
+/**
+ * Response cache key of a request
+ */
+static inline ResponseCacheKey transport_cache_key(const AnthropicRequest* request) {
+    if (!request->prompt_iov) {
+        return response_cache_key(request->model, request->system_prompt, request->cached_prefix,
+                                  request->prompt, request->max_tokens);
+    }
+    return response_cache_key_iov(request->model, request->system_prompt, request->cached_prefix,
+                                  request->prompt_iov, request->prompt_iovcnt,
+                                  request->max_tokens);
+}
+
+/**
+ * Build the Messages API request body
+ */
+static inline void transport_build_body(const AnthropicRequest* request, bool stream,
+                                        StringBuilder* body) {
+    char number[32];
+    string_builder_append_str(body, "{\"model\":");
+    string_builder_append_json_string(body, request->model);
+    snprintf(number, sizeof(number), ",\"max_tokens\":%d", request->max_tokens);
+    string_builder_append_str(body, number);
+    if (stream) {
+        string_builder_append_str(body, ",\"stream\":true");
+    }
+    if (request->system_prompt && request->cache_system) {
+        string_builder_append_str(body, ",\"system\":[{\"type\":\"text\",\"text\":");
+        string_builder_append_json_string(body, request->system_prompt);
+        string_builder_append_str(body, ",\"cache_control\":{\"type\":\"ephemeral\"}}]");
+    } else if (request->system_prompt) {
+        string_builder_append_str(body, ",\"system\":");
+        string_builder_append_json_string(body, request->system_prompt);
+    }
+    string_builder_append_str(body, ",\"messages\":[{\"role\":\"user\",\"content\":");
+    if (request->cached_prefix) {
+        // The prefix must stay byte-identical between calls to hit the cache
+        string_builder_append_str(body, "[{\"type\":\"text\",\"text\":");
+        string_builder_append_json_string(body, request->cached_prefix);
+        string_builder_append_str(body, ",\"cache_control\":{\"type\":\"ephemeral\"}},"
+                                          "{\"type\":\"text\",\"text\":");
+        transport_append_prompt(body, request);
+        string_builder_append_str(body, "}]");
+    } else {
+        transport_append_prompt(body, request);
+    }
+    string_builder_append_str(body, "}]}");
+}
+
+/**
+ * Read the usage object of a message (token index) or stream event;
+ * message_start nests it under "message"
+ */
+static inline void transport_parse_usage(const JsonDoc* doc, int message, AnthropicUsage* usage) {
+    int object = json_object_get(doc, message, "usage");
+    if (object < 0) object = json_object_get(doc, json_object_get(doc, message, "message"), "usage");
+    if (object < 0) return;
+
+    int value;
+    if ((value = json_object_get(doc, object, "input_tokens")) >= 0) {
+        usage->input_tokens = (int)json_number(doc, value, 0);
+    }
+    if ((value = json_object_get(doc, object, "output_tokens")) >= 0) {
+        usage->output_tokens = (int)json_number(doc, value, 0);
+    }
+    if ((value = json_object_get(doc, object, "cache_creation_input_tokens")) >= 0) {
+        usage->cache_creation_input_tokens = (int)json_number(doc, value, 0);
+    }
+    if ((value = json_object_get(doc, object, "cache_read_input_tokens")) >= 0) {
+        usage->cache_read_input_tokens = (int)json_number(doc, value, 0);
+    }
+}
+
+/**
+ * Extract the first text block from a parsed message (token index; 0 for
+ * a Messages API response body)
+ */
+static inline char* transport_extract_text(const JsonDoc* doc, int message) {
+    int content = json_object_get(doc, message, "content");
+    if (content < 0 || doc->tokens[content].type != JSON_ARRAY) return NULL;
+    for (int block = json_first_child(doc, content); block >= 0;
+         block = json_next_child(doc, content, block)) {
+        if (json_string_equals(doc, json_object_get(doc, block, "type"), "text")) {
+            return json_string_dup(doc, json_object_get(doc, block, "text"));
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Handle one complete SSE event; returns false to stop the stream
+ */
+static inline bool transport_sse_dispatch(TransportFuture* future) {
+    SseParser* sse = &future->sse;
+    bool keep_going = true;
+
+    // Events are small; a partial parse still leaves complete fields usable
+    JsonToken tokens[64];
+    JsonDoc doc;
+    json_parse(&doc, sse->data.data ? sse->data.data : "", sse->data.length, tokens, 64);
+
+    if (!sse->data.data) {
+        // An event without data carries nothing to act on
+    } else if (strcmp(sse->event, "content_block_delta") == 0) {
+        char* text = json_string_dup(&doc, json_object_get(&doc, json_object_get(&doc, 0, "delta"), "text"));
+        if (text && *text) {
+            size_t length = strlen(text);
+            string_builder_append(&future->streamed, text, length);
+            keep_going = future->on_delta(text, length, future->streamed.data,
+                                          future->streamed.length, future->user_data);
+        }
+        free(text);
+    } else if (strcmp(sse->event, "message_start") == 0 ||
+               strcmp(sse->event, "message_delta") == 0) {
+        // message_start carries the input and cache counts, message_delta
+        // the final output count
+        transport_parse_usage(&doc, 0, &future->response.usage);
+    } else if (strcmp(sse->event, "error") == 0) {
+        free(future->response.error);
+        future->response.error = json_string_dup(&doc, json_object_get(&doc, json_object_get(&doc, 0, "error"), "message"));
+        if (!future->response.error) future->response.error = strdup(sse->data.data);
+    }
+
+    sse->event[0] = '\0';
+    sse->data.length = 0;
+    if (sse->data.data) sse->data.data[0] = '\0';
+    return keep_going;
+}
+
+/**
+ * Feed raw stream bytes; returns false once the stream should stop
+ */
+static inline bool transport_sse_feed(TransportFuture* future, const char* bytes, size_t length) {
+    SseParser* sse = &future->sse;
+    const char* end = bytes + length;
+
+    while (bytes < end) {
+        const char* newline = (const char*)memchr(bytes, '\n', end - bytes);
+        if (!newline) {
+            string_builder_append(&sse->line, bytes, end - bytes);
+            break;
+        }
+        string_builder_append(&sse->line, bytes, newline - bytes);
+        bytes = newline + 1;
+
+        char* line = sse->line.data ? sse->line.data : (char*)"";
+        size_t line_length = sse->line.length;
+        if (line_length > 0 && line[line_length - 1] == '\r') line[--line_length] = '\0';
+
+        bool keep_going = true;
+        if (line_length == 0) {
+            keep_going = transport_sse_dispatch(future);
+        } else if (strncmp(line, "event:", 6) == 0) {
+            const char* value = line + 6;
+            while (*value == ' ') value++;
+            snprintf(sse->event, sizeof(sse->event), "%s", value);
+        } else if (strncmp(line, "data:", 5) == 0) {
+            const char* value = line + 5;
+            while (*value == ' ') value++;
+            if (sse->data.length > 0) string_builder_append(&sse->data, "\n", 1);
+            string_builder_append_str(&sse->data, value);
+        }
+
+        sse->line.length = 0;
+        if (!keep_going) return false;
+    }
+    return true;
+}
+
+/**
+ * Turn the accumulated stream into the final response
+ */
+static inline void transport_finish_stream(TransportFuture* future) {
+    if (future->response.cancelled) {
+        if (!future->response.error) future->response.error = strdup("Stream stopped by callback");
+        return;
+    }
+    if (future->response.error) return;
+    future->response.text = future->streamed.data ? strdup(future->streamed.data) : strdup("");
+}
+
+/**
+ * Replay mock text as SSE events, in small chunks, through the parser
+ */
+static inline void transport_mock_stream(TransportFuture* future, const char* text) {
+    const char* p = text;
+    bool keep_going = true;
+
+    while (*p && keep_going) {
+        const char* chunk_end = p;
+        for (int i = 0; i < TRANSPORT_MOCK_STREAM_CHUNK && *chunk_end; i++) chunk_end++;
+        while ((*chunk_end & 0xC0) == 0x80) chunk_end++;  // Keep UTF-8 sequences whole
+
+        char* chunk = strndup(p, chunk_end - p);
+        StringBuilder event = {0};
+        string_builder_append_str(&event, "event: content_block_delta\n"
+            "data: {\"type\":\"content_block_delta\",\"index\":0,"
+            "\"delta\":{\"type\":\"text_delta\",\"text\":");
+        string_builder_append_json_string(&event, chunk);
+        string_builder_append_str(&event, "}}\n\n");
+
+        // Split the event in two to exercise partial-line handling
+        size_t half = event.length / 2;
+        keep_going = transport_sse_feed(future, event.data, half) &&
+                     transport_sse_feed(future, event.data + half, event.length - half);
+
+        free(event.data);
+        free(chunk);
+        p = chunk_end;
+    }
+
+    future->response.cancelled = !keep_going;
+}
+
+#ifndef AGENT_TRANSPORT_CURL
+
+#define TRANSPORT_MOCK_CACHE_SLOTS 64
+
+// Cache breakpoints the mock has seen, to simulate prompt-cache writes and reads
+static uint64_t transport_mock_cached[TRANSPORT_MOCK_CACHE_SLOTS];
+static pthread_mutex_t transport_mock_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Count a cacheable block as a cache write the first time and a read after
+ */
+static inline void transport_mock_cache_block(const char* block, AnthropicUsage* usage) {
+    ResponseCacheKey key = response_cache_key("", NULL, NULL, block, 0);
+    int tokens = (int)(strlen(block) / 4) + 1;
+
+    pthread_mutex_lock(&transport_mock_cache_lock);
+    uint64_t* slot = &transport_mock_cached[key.lo % TRANSPORT_MOCK_CACHE_SLOTS];
+    if (*slot == key.hi) {
+        usage->cache_read_input_tokens += tokens;
+    } else {
+        *slot = key.hi;
+        usage->cache_creation_input_tokens += tokens;
+    }
+    pthread_mutex_unlock(&transport_mock_cache_lock);
+}
+
+/**
+ * Estimate usage for a mock response at roughly four characters per token
+ */
+static inline void transport_mock_usage(const AnthropicRequest* request, const char* text,
+                                        AnthropicUsage* usage) {
+    usage->input_tokens = (int)(strlen(request->prompt) / 4) + 1;
+    usage->output_tokens = (int)(strlen(text) / 4) + 1;
+    if (request->system_prompt && request->cache_system) {
+        transport_mock_cache_block(request->system_prompt, usage);
+    } else if (request->system_prompt) {
+        usage->input_tokens += (int)(strlen(request->system_prompt) / 4);
+    }
+    if (request->cached_prefix) transport_mock_cache_block(request->cached_prefix, usage);
+}
+
+#endif
+
+/**
+ * Drop one reference to a future
+ */
+static inline void transport_future_release(TransportFuture* future) {
+    if (atomic_fetch_sub(&future->refs, 1) != 1) return;
+
+    free(future->response.text);
+    free(future->response.error);
+    free(future->api_key_header);
+    free(future->body.data);
+    free(future->sse.line.data);
+    free(future->sse.data.data);
+    free(future->streamed.data);
+    pthread_mutex_destroy(&future->lock);
+    pthread_cond_destroy(&future->cond);
+    free(future);
+}
+
+/**
+ * Count a finished request and end its span
+ */
+static inline void transport_record_metrics(TransportFuture* future) {
+    const AnthropicResponse* response = &future->response;
+    const AnthropicUsage* usage = &response->usage;
+    bool failed = response->error && !response->cancelled;
+
+    if (response->attempts > 0) {
+        metrics_count(METRIC_API_REQUESTS, 1);
+        metrics_observe_since(METRIC_CALL_LATENCY, future->started_ns);
+    }
+    if (failed) metrics_count(METRIC_API_ERRORS, 1);
+    metrics_count(METRIC_RETRIES, (uint64_t)future->retries);
+    if (response->hedged) metrics_count(METRIC_HEDGES, 1);
+    metrics_count(METRIC_INPUT_TOKENS, (uint64_t)usage->input_tokens);
+    metrics_count(METRIC_OUTPUT_TOKENS, (uint64_t)usage->output_tokens);
+    metrics_count(METRIC_CACHE_READ_TOKENS, (uint64_t)usage->cache_read_input_tokens);
+    metrics_count(METRIC_CACHE_WRITE_TOKENS, (uint64_t)usage->cache_creation_input_tokens);
+
+    MetricsSpan* span = &future->span;
+    metrics_span_set_int(span, "http.response.status_code", response->status);
+    metrics_span_set_int(span, "gen_ai.usage.input_tokens", usage->input_tokens);
+    metrics_span_set_int(span, "gen_ai.usage.output_tokens", usage->output_tokens);
+    metrics_span_set_int(span, "anthropic.cache_read_input_tokens", usage->cache_read_input_tokens);
+    metrics_span_set_int(span, "anthropic.attempts", response->attempts);
+    metrics_span_set_int(span, "anthropic.response_cache_hit",
+                         response->attempts == 0 && response->status == 200);
+    span->error = failed;
+    metrics_span_end(span);
+}
+
+/**
+ * Finish a request: run the callback, wake waiters, drop the transport's ref
+ */
+static inline void transport_complete(Transport* transport, TransportFuture* future) {
+    // Settle before the callback so it sees the budget it is left with
+    if (future->budget) {
+        token_budget_settle(future->budget, future->estimated_tokens,
+                            anthropic_usage_budget_tokens(&future->response.usage));
+    }
+    if (future->governor) {
+        rate_governor_settle(future->governor, future->estimated_tokens,
+                             anthropic_usage_rate_tokens(&future->response.usage));
+    }
+    transport_record_metrics(future);
+
+    // Store before the callback, which may take the text
+    if (future->cache && future->response.text && future->response.status == 200 &&
+        !future->response.cancelled) {
+        response_cache_put(future->cache, future->cache_key, future->response.text);
+    }
+
+    if (future->callback) {
+        future->callback(&future->response, future->user_data);
+    }
+
+    pthread_mutex_lock(&future->lock);
+    future->done = true;
+    pthread_cond_broadcast(&future->cond);
+    pthread_mutex_unlock(&future->lock);
+
+    atomic_fetch_sub(&transport->in_flight, 1);
+    transport_future_release(future);
+}
+
+#ifdef AGENT_TRANSPORT_CURL
+
+static size_t transport_write_callback(char* data, size_t size, size_t nmemb, void* user_data) {
+    TransportAttempt* attempt = (TransportAttempt*)user_data;
+    TransportFuture* future = attempt->future;
+    size_t length = size * nmemb;
+
+    long status = 0;
+    curl_easy_getinfo(attempt->easy, CURLINFO_RESPONSE_CODE, &status);
+    if (future->on_delta && status == 200) {
+        // Returning a short count makes curl abort the transfer
+        if (!transport_sse_feed(future, data, length)) {
+            future->response.cancelled = true;
+            return 0;
+        }
+        return length;
+    }
+
+    string_builder_append(&attempt->received, data, length);
+    return length;
+}
+
+/**
+ * Progress callback; a non-zero return aborts a cancelled transfer
+ */
+static int transport_progress_callback(void* user_data, curl_off_t dltotal, curl_off_t dlnow,
+                                       curl_off_t ultotal, curl_off_t ulnow) {
+    (void)dltotal;
+    (void)dlnow;
+    (void)ultotal;
+    (void)ulnow;
+    TransportAttempt* attempt = (TransportAttempt*)user_data;
+    return atomic_load(&attempt->future->cancel_requested) ? 1 : 0;
+}
+
+/**
+ * Whether a transfer that failed with this code is worth repeating
+ */
+static bool transport_retryable_code(CURLcode code) {
+    switch (code) {
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_HTTP2:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_GOT_NOTHING:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_HTTP2_STREAM:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Remember a successful attempt's latency for adaptive hedging
+ */
+static void transport_record_latency(Transport* transport, double latency_ms) {
+    transport->latency_ms[transport->latency_next] = latency_ms;
+    transport->latency_next = (transport->latency_next + 1) % TRANSPORT_LATENCY_SAMPLES;
+    if (transport->latency_count < TRANSPORT_LATENCY_SAMPLES) transport->latency_count++;
+    transport->latency_dirty = true;
+}
+
+static int transport_compare_latency(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * How long an attempt runs before it is hedged; -1 for not (yet)
+ */
+static double transport_hedge_delay_ms(Transport* transport, const TransportPolicy* policy) {
+    if (policy->hedge_after_ms > 0) return policy->hedge_after_ms;
+    if (policy->hedge_after_ms != TRANSPORT_HEDGE_P95 ||
+        transport->latency_count < TRANSPORT_HEDGE_MIN_SAMPLES) {
+        return -1;
+    }
+    if (transport->latency_dirty) {
+        double sorted[TRANSPORT_LATENCY_SAMPLES];
+        memcpy(sorted, transport->latency_ms, transport->latency_count * sizeof(double));
+        qsort(sorted, transport->latency_count, sizeof(double), transport_compare_latency);
+        transport->latency_p95_ms = sorted[transport->latency_count * 95 / 100];
+        transport->latency_dirty = false;
+    }
+    return transport->latency_p95_ms;
+}
+
+static void transport_unwatch_hedge(Transport* transport, TransportFuture* future) {
+    if (!future->hedge_watched) return;
+    TransportFuture** link = &transport->hedge_watch;
+    while (*link != future) link = &(*link)->next_hedge;
+    *link = future->next_hedge;
+    future->next_hedge = NULL;
+    future->hedge_watched = false;
+}
+
+/**
+ * Send one attempt of a request: slot 0 is the primary, slot 1 a hedge
+ */
+static void transport_attempt_start(Transport* transport, TransportFuture* future, int slot) {
+    TransportAttempt* attempt = (TransportAttempt*)calloc(1, sizeof(TransportAttempt));
+    attempt->future = future;
+    attempt->started_ms = transport_now_ms();
+    future->attempts[slot] = attempt;
+    future->response.attempts++;
+
+    CURL* easy = curl_easy_init();
+    attempt->easy = easy;
+    attempt->headers = curl_slist_append(NULL, "content-type: application/json");
+    attempt->headers = curl_slist_append(attempt->headers, "anthropic-version: " TRANSPORT_API_VERSION);
+    attempt->headers = curl_slist_append(attempt->headers, future->api_key_header);
+
+    curl_easy_setopt(easy, CURLOPT_URL, TRANSPORT_API_URL);
+    curl_easy_setopt(easy, CURLOPT_HTTPHEADER, attempt->headers);
+    curl_easy_setopt(easy, CURLOPT_POSTFIELDS, future->body.data);
+    curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, (long)future->body.length);
+    curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);  // Prefer an existing HTTP/2 connection
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, transport_write_callback);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, attempt);
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, attempt);
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(easy, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(easy, CURLOPT_XFERINFOFUNCTION, transport_progress_callback);
+    curl_easy_setopt(easy, CURLOPT_XFERINFODATA, attempt);
+    if (future->policy.timeout_ms > 0) {
+        // Each attempt gets whatever is left of the call's deadline
+        long remaining = (long)(future->submitted_ms + future->policy.timeout_ms -
+                                attempt->started_ms);
+        curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, remaining > 1 ? remaining : 1L);
+    }
+
+    curl_multi_add_handle(transport->multi, easy);
+
+    // A plain request is hedged at most once; streams never are
+    if (slot == 0 && !future->on_delta && !future->response.hedged &&
+        future->policy.hedge_after_ms != 0) {
+        future->next_hedge = transport->hedge_watch;
+        transport->hedge_watch = future;
+        future->hedge_watched = true;
+    }
+}
+
+/**
+ * Give back the governor estimate held by an attempt that is dropped or
+ * retried; the one that completes the request settles on completion
+ */
+static void transport_release_estimate(TransportFuture* future) {
+    if (future->governor) rate_governor_settle(future->governor, future->estimated_tokens, 0);
+}
+
+static void transport_attempt_free(Transport* transport, TransportAttempt* attempt) {
+    curl_multi_remove_handle(transport->multi, attempt->easy);
+    curl_easy_cleanup(attempt->easy);
+    curl_slist_free_all(attempt->headers);
+    free(attempt->received.data);
+    free(attempt);
+}
+
+/**
+ * Start a queued request or a retry whose backoff has run out
+ */
+static void transport_start_request(Transport* transport, TransportFuture* future) {
+    if (atomic_load(&future->cancel_requested)) {
+        future->response.cancelled = true;
+        future->response.error = strdup("Cancelled");
+        transport_complete(transport, future);
+        return;
+    }
+    if (future->awaiting_admission) {
+        future->queued_ms = transport_now_ms();
+        if (transport->admission_tail) {
+            transport->admission_tail->next = future;
+        } else {
+            transport->admission = future;
+        }
+        transport->admission_tail = future;
+        return;
+    }
+    transport_attempt_start(transport, future, 0);
+}
+
+/**
+ * Admit requests submitted on the loop thread in order, for as long as the
+ * governor has room, and drop cancelled ones wherever they are queued;
+ * returns when the next one may fit
+ */
+static double transport_admit_due(Transport* transport, double now, double next_due_ms) {
+    bool blocked = false;
+    TransportFuture* tail = NULL;
+    TransportFuture** link = &transport->admission;
+    while (*link) {
+        TransportFuture* future = *link;
+        bool start = atomic_load(&future->cancel_requested);
+        // A retry's deadline still counts from its first admission
+        bool late = !start && future->response.attempts > 0 && future->policy.timeout_ms > 0 &&
+                    now >= future->submitted_ms + future->policy.timeout_ms;
+        if (!start && !late && !blocked) {
+            double wait_ms = transport->governor
+                                 ? rate_governor_try_acquire(transport->governor,
+                                                             future->estimated_tokens,
+                                                             now - future->queued_ms)
+                                 : 0;
+            if (wait_ms > 0) {
+                // Later requests wait their turn behind this one
+                blocked = true;
+                if (now + wait_ms < next_due_ms) next_due_ms = now + wait_ms;
+            } else {
+                metrics_observe_ns(METRIC_ADMISSION_WAIT,
+                                   (uint64_t)((now - future->queued_ms) * 1e6));
+                future->governor = transport->governor;
+                if (future->response.attempts == 0) future->submitted_ms = now;
+                start = true;
+            }
+        }
+        if (!start && !late) {
+            if (future->response.attempts > 0 && future->policy.timeout_ms > 0) {
+                double deadline = future->submitted_ms + future->policy.timeout_ms;
+                if (deadline < next_due_ms) next_due_ms = deadline;
+            }
+            tail = future;
+            link = &future->next;
+            continue;
+        }
+        *link = future->next;
+        future->next = NULL;
+        future->awaiting_admission = false;
+        if (late) {
+            future->response.error = strdup("Deadline exceeded");
+            transport_complete(transport, future);
+        } else {
+            transport_start_request(transport, future);
+        }
+    }
+    transport->admission_tail = tail;
+    return next_due_ms;
+}
+
+/**
+ * Handle a finished attempt: let a running sibling carry on, back off for
+ * a retry, or turn it into the response
+ */
+static void transport_finish_attempt(Transport* transport, CURL* easy, CURLcode code) {
+    TransportAttempt* attempt = NULL;
+    curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char**)&attempt);
+    TransportFuture* future = attempt->future;
+    int slot = future->attempts[0] == attempt ? 0 : 1;
+    TransportAttempt* sibling = future->attempts[1 - slot];
+    future->attempts[slot] = NULL;
+
+    long status = 0;
+    curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+    bool cancelled = future->response.cancelled ||
+                     (code == CURLE_ABORTED_BY_CALLBACK && atomic_load(&future->cancel_requested));
+
+    if (!cancelled && (code != CURLE_OK || status != 200)) {
+        if (sibling) {
+            // The other attempt may still succeed
+            transport_release_estimate(future);
+            transport_attempt_free(transport, attempt);
+            return;
+        }
+
+        bool retryable = code == CURLE_OK ? transport_retryable_status((int)status)
+                                          : transport_retryable_code(code);
+        // A stream is only repeated if the caller has not seen any of it
+        if (retryable && (!future->on_delta || future->streamed.length == 0)) {
+            curl_off_t retry_after = 0;
+            if (code == CURLE_OK) curl_easy_getinfo(easy, CURLINFO_RETRY_AFTER, &retry_after);
+            if (transport_next_backoff_ms(future, &transport->jitter_seed,
+                                          (double)retry_after * 1000.0) >= 0) {
+                transport_unwatch_hedge(transport, future);
+                transport_attempt_free(transport, attempt);
+                if (future->governor) {
+                    // The retry is another request; it is admitted again
+                    // once its backoff runs out
+                    transport_release_estimate(future);
+                    future->governor = NULL;
+                    future->awaiting_admission = true;
+                }
+                memset(&future->response.usage, 0, sizeof(future->response.usage));
+                future->sse.line.length = 0;
+                future->sse.data.length = 0;
+                future->sse.event[0] = '\0';
+                future->next = transport->backoff;
+                transport->backoff = future;
+                return;
+            }
+        }
+    }
+
+    transport_unwatch_hedge(transport, future);
+    if (sibling) {
+        // The slower of a hedged pair is dropped
+        transport_release_estimate(future);
+        future->attempts[1 - slot] = NULL;
+        transport_attempt_free(transport, sibling);
+    }
+
+    future->response.status = (int)status;
+    if (future->response.cancelled) {
+        transport_finish_stream(future);
+    } else if (cancelled) {
+        future->response.cancelled = true;
+        future->response.error = strdup("Cancelled");
+    } else if (code == CURLE_OPERATION_TIMEDOUT && future->policy.timeout_ms > 0) {
+        future->response.error = strdup("Deadline exceeded");
+    } else if (code != CURLE_OK) {
+        future->response.error = strdup(curl_easy_strerror(code));
+    } else if (status != 200) {
+        future->response.error = attempt->received.data ? strdup(attempt->received.data)
+                                                        : strdup("Empty error response");
+    } else if (future->on_delta) {
+        transport_finish_stream(future);
+        transport_record_latency(transport, transport_now_ms() - attempt->started_ms);
+    } else {
+        uint64_t parse_started = metrics_now_ns();
+        JsonDoc doc = {0};
+        if (attempt->received.data &&
+            json_parse_alloc(&doc, attempt->received.data, attempt->received.length) == JSON_OK) {
+            future->response.text = transport_extract_text(&doc, 0);
+            transport_parse_usage(&doc, 0, &future->response.usage);
+        }
+        json_doc_free(&doc);
+        metrics_observe_since(METRIC_PARSE_TIME, parse_started);
+        if (!future->response.text) {
+            future->response.error = strdup("Response had no text content");
+        } else {
+            transport_record_latency(transport, transport_now_ms() - attempt->started_ms);
+        }
+    }
+
+    transport_attempt_free(transport, attempt);
+    transport_complete(transport, future);
+}
+
+/**
+ * Admit requests the governor now has room for, start retries whose
+ * backoff has run out and hedges whose primary has run long enough;
+ * returns when the next one is due
+ */
+static double transport_start_due(Transport* transport) {
+    double now = transport_now_ms();
+    double next_due_ms = now + TRANSPORT_POLL_TIMEOUT_MS;
+
+    // Retries that are due rejoin the admission queue when a governor is set
+    TransportFuture** link = &transport->backoff;
+    while (*link) {
+        TransportFuture* future = *link;
+        if (future->retry_at_ms <= now || atomic_load(&future->cancel_requested)) {
+            *link = future->next;
+            future->next = NULL;
+            transport_start_request(transport, future);
+        } else {
+            if (future->retry_at_ms < next_due_ms) next_due_ms = future->retry_at_ms;
+            link = &future->next;
+        }
+    }
+
+    next_due_ms = transport_admit_due(transport, now, next_due_ms);
+
+    link = &transport->hedge_watch;
+    while (*link) {
+        TransportFuture* future = *link;
+        double delay = transport_hedge_delay_ms(transport, &future->policy);
+        double due = future->attempts[0]->started_ms + delay;
+        if (delay >= 0 && due <= now) {
+            *link = future->next_hedge;
+            future->next_hedge = NULL;
+            future->hedge_watched = false;
+            // A hedge is one more request: it goes only if the governor
+            // has room now, since waiting for room would defeat it
+            if (!future->governor ||
+                rate_governor_try_acquire(future->governor, future->estimated_tokens, 0) <= 0) {
+                future->response.hedged = true;
+                transport_attempt_start(transport, future, 1);
+            }
+        } else {
+            if (delay >= 0 && due < next_due_ms) next_due_ms = due;
+            link = &future->next_hedge;
+        }
+    }
+
+    return next_due_ms;
+}
+
+/**
+ * Stop the running attempts of cancelled requests straight away rather
+ * than at their next progress callback. Queued, backed-off and
+ * unadmitted ones are dropped by transport_start_request and
+ * transport_start_due.
+ */
+static void transport_abort_cancelled(Transport* transport) {
+    pthread_mutex_lock(&transport->lock);
+    TransportFuture* future = transport->cancelled;
+    transport->cancelled = NULL;
+    pthread_mutex_unlock(&transport->lock);
+
+    while (future) {
+        TransportFuture* next = future->next_cancel;
+        future->next_cancel = NULL;
+        TransportAttempt* attempt = future->attempts[0] ? future->attempts[0]
+                                                        : future->attempts[1];
+        // Finishing one attempt of a hedged pair as cancelled drops both
+        if (attempt) transport_finish_attempt(transport, attempt->easy, CURLE_ABORTED_BY_CALLBACK);
+        transport_future_release(future);
+        future = next;
+    }
+}
+
+/**
+ * Event loop: start queued requests, retries and hedges, drive transfers,
+ * deliver completions
+ */
+static void* transport_loop_main(void* arg) {
+    Transport* transport = (Transport*)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&transport->lock);
+        TransportFuture* queued = transport->submit_head;
+        transport->submit_head = transport->submit_tail = NULL;
+        pthread_mutex_unlock(&transport->lock);
+
+        while (queued) {
+            TransportFuture* next = queued->next;
+            queued->next = NULL;
+            transport_start_request(transport, queued);
+            queued = next;
+        }
+        transport_abort_cancelled(transport);
+        transport_start_due(transport);
+
+        int running = 0;
+        curl_multi_perform(transport->multi, &running);
+
+        CURLMsg* msg;
+        int remaining;
+        while ((msg = curl_multi_info_read(transport->multi, &remaining))) {
+            if (msg->msg == CURLMSG_DONE) {
+                transport_finish_attempt(transport, msg->easy_handle, msg->data.result);
+            }
+        }
+
+        if (atomic_load(&transport->shutting_down) && atomic_load(&transport->in_flight) == 0) {
+            break;
+        }
+
+        // Sleeps until socket activity, the next retry or hedge, or curl_multi_wakeup()
+        double wait_ms = transport_start_due(transport) - transport_now_ms();
+        curl_multi_poll(transport->multi, NULL, 0, wait_ms > 0 ? (int)wait_ms + 1 : 0, NULL);
+    }
+
+    // Only references are left: every request has completed
+    transport_abort_cancelled(transport);
+    return NULL;
+}
+
+#endif // AGENT_TRANSPORT_CURL
+
+/**
+ * Create a transport (starts the event loop thread when using libcurl)
+ */
+static inline Transport* transport_create(void) {
+    Transport* transport = (Transport*)calloc(1, sizeof(Transport));
+    pthread_mutex_init(&transport->lock, NULL);
+    atomic_init(&transport->shutting_down, false);
+    atomic_init(&transport->in_flight, 0);
+    transport->policy = transport_default_policy;
+
+#ifdef AGENT_TRANSPORT_CURL
+    transport->jitter_seed = (unsigned int)time(NULL);
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    transport->multi = curl_multi_init();
+    curl_multi_setopt(transport->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(transport->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)TRANSPORT_MAX_HOST_CONNECTIONS);
+    curl_multi_setopt(transport->multi, CURLMOPT_MAX_CONCURRENT_STREAMS, (long)TRANSPORT_MAX_CONCURRENT_STREAMS);
+    pthread_create(&transport->loop_thread, NULL, transport_loop_main, transport);
+#endif
+
+    return transport;
+}
+
+/**
+ * Shared submit path for plain and streaming requests
+ */
+static inline TransportFuture* transport_submit_internal(Transport* transport,
+                                                         const AnthropicRequest* request,
+                                                         TransportDeltaFunc on_delta,
+                                                         TransportCallback callback,
+                                                         void* user_data) {
+    TransportFuture* future = (TransportFuture*)calloc(1, sizeof(TransportFuture));
+    pthread_mutex_init(&future->lock, NULL);
+    pthread_cond_init(&future->cond, NULL);
+    atomic_init(&future->refs, 2);
+    atomic_init(&future->cancel_requested, false);
+    future->callback = callback;
+    future->user_data = user_data;
+    future->on_delta = on_delta;
+    future->policy = request->policy          ? *request->policy
+                     : transport_thread_policy ? *transport_thread_policy
+                                               : transport->policy;
+    atomic_fetch_add(&transport->in_flight, 1);
+#ifdef AGENT_TRANSPORT_CURL
+    future->transport = transport;
+#endif
+
+    future->started_ns = metrics_now_ns();
+    metrics_span_begin_async(&future->span, "chat");
+    metrics_span_set_string(&future->span, "gen_ai.system", "anthropic");
+    metrics_span_set_string(&future->span, "gen_ai.request.model", request->model);
+
+    ResponseCache* cache = request->no_cache ? NULL : transport->cache;
+    if (cache) {
+        ResponseCacheKey key = transport_cache_key(request);
+        char* cached = response_cache_get(cache, key);
+        metrics_count(cached ? METRIC_CACHE_HITS : METRIC_CACHE_MISSES, 1);
+        if (cached) {
+            // A streaming caller sees the whole cached text as one delta
+            size_t length = strlen(cached);
+            if (on_delta && !on_delta(cached, length, cached, length, user_data)) {
+                future->response.cancelled = true;
+                future->response.error = strdup("Stream stopped by callback");
+                free(cached);
+            } else {
+                future->response.text = cached;
+            }
+            future->response.status = 200;
+            transport_complete(transport, future);
+            return future;
+        }
+        future->cache = cache;
+        future->cache_key = key;
+    }
+
+    TokenBudget* budget = request->budget ? request->budget : transport_thread_budget;
+    if (budget || transport->governor) {
+        future->estimated_tokens = anthropic_request_estimate_tokens(request);
+    }
+    if (budget) {
+        if (!token_budget_reserve(budget, future->estimated_tokens)) {
+            future->response.error = strdup("Token budget exhausted");
+            transport_complete(transport, future);
+            return future;
+        }
+        future->budget = budget;
+    }
+    future->submitted_ms = transport_now_ms();  // The deadline counts from admission
+#ifdef AGENT_TRANSPORT_CURL
+    // Completion callbacks submit from the loop thread, which must keep
+    // driving every other transfer; the loop admits these itself
+    if (transport->governor && pthread_equal(pthread_self(), transport->loop_thread)) {
+        future->awaiting_admission = true;
+    } else
+#endif
+    if (transport->governor) {
+        // Backpressure: the caller waits here until the limits have room
+        uint64_t admission_started = metrics_now_ns();
+        rate_governor_acquire(transport->governor, future->estimated_tokens);
+        metrics_observe_since(METRIC_ADMISSION_WAIT, admission_started);
+        future->governor = transport->governor;
+        future->submitted_ms = transport_now_ms();
+    }
+
+#ifdef AGENT_TRANSPORT_CURL
+    size_t header_size = strlen(request->api_key) + 16;
+    future->api_key_header = (char*)malloc(header_size);
+    snprintf(future->api_key_header, header_size, "x-api-key: %s", request->api_key);
+    transport_build_body(request, on_delta != NULL, &future->body);
+
+    pthread_mutex_lock(&transport->lock);
+    if (transport->submit_tail) {
+        transport->submit_tail->next = future;
+    } else {
+        transport->submit_head = future;
+    }
+    transport->submit_tail = future;
+    pthread_mutex_unlock(&transport->lock);
+
+    curl_multi_wakeup(transport->multi);
+#else
+    // Mock build: answer inline. Responders see a prompt_iov prompt joined.
+    AnthropicRequest joined = *request;
+    StringBuilder prompt = {0};
+    if (request->prompt_iov) {
+        for (int i = 0; i < request->prompt_iovcnt; i++) {
+            string_builder_append(&prompt, (const char*)request->prompt_iov[i].iov_base,
+                                  request->prompt_iov[i].iov_len);
+        }
+        joined.prompt = string_builder_cstr(&prompt);
+        joined.prompt_iov = NULL;
+    }
+    char* text = NULL;
+    unsigned int seed = (unsigned int)(uintptr_t)future;
+    while (transport_mock_responder) {
+        future->response.attempts++;
+        text = transport_mock_responder(&joined);
+        if (text) break;
+
+        // A NULL answer plays an overloaded API: back off and ask again
+        double delay_ms = transport_next_backoff_ms(future, &seed, 0);
+        if (delay_ms < 0) break;
+        long delay_ns = (long)(delay_ms * 1e6);
+        struct timespec pause = {delay_ns / 1000000000L, delay_ns % 1000000000L};
+        nanosleep(&pause, NULL);
+        if (future->governor) {
+            // Each retry is admitted like a new request
+            rate_governor_settle(future->governor, future->estimated_tokens, 0);
+            rate_governor_acquire(future->governor, future->estimated_tokens);
+        }
+    }
+    future->response.status = text ? 200 : transport_mock_responder ? 529 : 0;
+    if (text) transport_mock_usage(&joined, text, &future->response.usage);
+    string_builder_free(&prompt);
+    if (!text && !transport_mock_responder) {
+        future->response.error = strdup("No transport available");
+    } else if (!text) {
+        future->response.error = strdup(
+            "{\"type\":\"error\",\"error\":{\"type\":\"overloaded_error\",\"message\":\"Overloaded\"}}");
+    } else if (on_delta) {
+        transport_mock_stream(future, text);
+        transport_finish_stream(future);
+        free(text);
+    } else {
+        future->response.text = text;
+    }
+    transport_complete(transport, future);
+#endif
+
+    return future;
+}
+
+/**
+ * Serve requests from cache when possible (NULL detaches the cache). Set
+ * it before submitting requests; the cache must outlive the transport.
+ */
+static inline void transport_set_cache(Transport* transport, ResponseCache* cache) {
+    transport->cache = cache;
+}
+
+/**
+ * Set the deadline, retry and hedging policy for requests that carry
+ * none; set it before submitting requests
+ */
+static inline void transport_set_policy(Transport* transport, const TransportPolicy* policy) {
+    transport->policy = *policy;
+}
+
+/**
+ * Admit requests through a rate governor (NULL removes it). Set it before
+ * submitting requests; the governor must outlive the transport.
+ */
+static inline void transport_set_governor(Transport* transport, RateGovernor* governor) {
+    transport->governor = governor;
+}
+
+/**
+ * Create a governor for the given per-minute limits and attach it
+ */
+static inline RateGovernor* transport_enable_governor(Transport* transport,
+                                                      long requests_per_minute,
+                                                      long tokens_per_minute) {
+    RateGovernor* governor = rate_governor_create(requests_per_minute, tokens_per_minute);
+    transport_set_governor(transport, governor);
+    return governor;
+}
+
+/**
+ * Create a cache, optionally backed by disk_path, and attach it
+ */
+static inline ResponseCache* transport_enable_cache(Transport* transport, size_t max_entries,
+                                                    int ttl_seconds, const char* disk_path) {
+    ResponseCache* cache = response_cache_create(max_entries, ttl_seconds);
+    if (disk_path) response_cache_attach_disk(cache, disk_path, 0);
+    transport_set_cache(transport, cache);
+    return cache;
+}
+
+/**
+ * Submit a request; the returned future must be released or waited on
+ */
+static inline TransportFuture* transport_submit(Transport* transport, const AnthropicRequest* request,
+                                                TransportCallback callback, void* user_data) {
+    return transport_submit_internal(transport, request, NULL, callback, user_data);
+}
+
+/**
+ * Submit a streaming request; on_delta sees each text delta as it arrives
+ * and user_data is passed to both callbacks
+ */
+static inline TransportFuture* transport_submit_stream(Transport* transport,
+                                                       const AnthropicRequest* request,
+                                                       TransportDeltaFunc on_delta,
+                                                       TransportCallback callback,
+                                                       void* user_data) {
+    return transport_submit_internal(transport, request, on_delta, callback, user_data);
+}
+
+/**
+ * Ask the transport to abort a request; its callback still runs, with
+ * response->cancelled set. No effect once the request has completed.
+ */
+static inline void transport_cancel(TransportFuture* future) {
+#ifdef AGENT_TRANSPORT_CURL
+    if (atomic_exchange(&future->cancel_requested, true)) return;
+
+    // The loop may be asleep in curl_multi_poll; wake it so a running
+    // transfer, a backoff or an unadmitted request ends now
+    Transport* transport = future->transport;
+    atomic_fetch_add(&future->refs, 1);
+    pthread_mutex_lock(&transport->lock);
+    future->next_cancel = transport->cancelled;
+    transport->cancelled = future;
+    pthread_mutex_unlock(&transport->lock);
+    curl_multi_wakeup(transport->multi);
+#else
+    atomic_store(&future->cancel_requested, true);
+#endif
+}
+
+/**
+ * Block until a request completes
+ */
+static inline AnthropicResponse* transport_future_wait(TransportFuture* future) {
+    pthread_mutex_lock(&future->lock);
+    while (!future->done) {
+        pthread_cond_wait(&future->cond, &future->lock);
+    }
+    pthread_mutex_unlock(&future->lock);
+    return &future->response;
+}
+
+/**
+ * Wait, take ownership of the response text, and release the future.
+ * usage (optional) receives the call's token usage.
+ */
+static inline char* transport_future_take_text(TransportFuture* future, AnthropicUsage* usage) {
+    AnthropicResponse* response = transport_future_wait(future);
+    char* text = response->text;
+    response->text = NULL;
+    if (usage) *usage = response->usage;
+    transport_future_release(future);
+    return text;
+}
+
+/**
+ * Blocking call helper used by the templates' call_anthropic_api
+ */
+static inline char* transport_call(Transport* transport, const AnthropicRequest* request,
+                                   AnthropicUsage* usage) {
+    return transport_future_take_text(transport_submit(transport, request, NULL, NULL), usage);
+}
+
+/**
+ * Blocking streaming call; returns NULL if the request failed or on_delta
+ * stopped it
+ */
+static inline char* transport_call_stream(Transport* transport, const AnthropicRequest* request,
+                                          TransportDeltaFunc on_delta, void* user_data,
+                                          AnthropicUsage* usage) {
+    return transport_future_take_text(
+        transport_submit_stream(transport, request, on_delta, NULL, user_data), usage);
+}
+
+/**
+ * Wait for in-flight requests, stop the loop and free the transport
+ */
+static inline void transport_destroy(Transport* transport) {
+    if (!transport) return;
+    atomic_store(&transport->shutting_down, true);
+
+#ifdef AGENT_TRANSPORT_CURL
+    curl_multi_wakeup(transport->multi);
+    pthread_join(transport->loop_thread, NULL);
+    curl_multi_cleanup(transport->multi);
+    curl_global_cleanup();
+#endif
+
+    pthread_mutex_destroy(&transport->lock);
+    free(transport);
+}
+
+// Process-wide default transport shared by every template
+static Transport* transport_default_instance = NULL;
+static pthread_once_t transport_default_once = PTHREAD_ONCE_INIT;
+
+static void transport_default_shutdown(void) {
+    transport_destroy(transport_default_instance);
+    transport_default_instance = NULL;
+}
+
+static void transport_default_init(void) {
+    transport_default_instance = transport_create();
+    atexit(transport_default_shutdown);
+}
+
+/**
+ * Get the shared default transport, creating it on first use
+ */
+static inline Transport* transport_default(void) {
+    pthread_once(&transport_default_once, transport_default_init);
+    return transport_default_instance;
+}
+
+#endif // ANTHROPIC_TRANSPORT_H
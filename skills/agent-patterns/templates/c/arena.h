@@ -0,0 +1,133 @@
+/**
+ * Shared Arena Allocator for the C Agent Pattern Templates
+ * Bump allocator for data that lives exactly as long as one run
+ *
+ * Allocations are carved out of large blocks and are never freed one by
+ * one; arena_destroy() releases the whole run in one shot. Requests larger
+ * than a block get a block of their own. An arena is not thread-safe.
+ *
+ * Header-only: include it from a template.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#define ARENA_DEFAULT_BLOCK_SIZE 16384
+#define ARENA_ALIGNMENT _Alignof(max_align_t)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t capacity;
+    _Alignas(max_align_t) char data[];
+} ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock* head;   // Block currently being filled
+    ArenaBlock* spare;  // Empty regular blocks left by arena_reset()
+    size_t block_size;
+} Arena;
+
+/**
+ * Initialize an empty arena; block_size 0 uses the default
+ */
+static inline void arena_init(Arena* arena, size_t block_size) {
+    arena->head = NULL;
+    arena->spare = NULL;
+    arena->block_size = block_size > 0 ? block_size : ARENA_DEFAULT_BLOCK_SIZE;
+}
+
+/**
+ * Allocate size bytes aligned for any type; NULL only when out of memory
+ */
+static inline void* arena_alloc(Arena* arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+    ArenaBlock* block = arena->head;
+    if (!block || block->capacity - block->used < size) {
+        size_t capacity = size > arena->block_size ? size : arena->block_size;
+        ArenaBlock* fresh = arena->spare;
+        if (fresh && capacity == arena->block_size) {
+            arena->spare = fresh->next;
+        } else {
+            fresh = (ArenaBlock*)malloc(sizeof(ArenaBlock) + capacity);
+            if (!fresh) return NULL;
+            fresh->used = 0;
+            fresh->capacity = capacity;
+        }
+
+        // An oversized block goes behind the current one so the space left
+        // in the current block is not wasted
+        if (block && capacity > arena->block_size) {
+            fresh->next = block->next;
+            block->next = fresh;
+            fresh->used = size;
+            return fresh->data;
+        }
+        fresh->next = block;
+        arena->head = fresh;
+        block = fresh;
+    }
+
+    void* ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+/**
+ * Copy length bytes into the arena and NUL-terminate them
+ */
+static inline char* arena_strndup(Arena* arena, const char* str, size_t length) {
+    char* copy = (char*)arena_alloc(arena, length + 1);
+    if (!copy) return NULL;
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+/**
+ * Copy a string into the arena
+ */
+static inline char* arena_strdup(Arena* arena, const char* str) {
+    return arena_strndup(arena, str, strlen(str));
+}
+
+/**
+ * Release every allocation but keep the regular blocks for reuse, so an
+ * arena recycled run after run settles without touching the heap
+ */
+static inline void arena_reset(Arena* arena) {
+    ArenaBlock* block = arena->head;
+    while (block) {
+        ArenaBlock* next = block->next;
+        if (block->capacity == arena->block_size) {
+            block->used = 0;
+            block->next = arena->spare;
+            arena->spare = block;
+        } else {
+            free(block);
+        }
+        block = next;
+    }
+    arena->head = NULL;
+}
+
+/**
+ * Release every allocation made from the arena
+ */
+static inline void arena_destroy(Arena* arena) {
+    arena_reset(arena);
+    ArenaBlock* block = arena->spare;
+    while (block) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->spare = NULL;
+}
+
+#endif // ARENA_H
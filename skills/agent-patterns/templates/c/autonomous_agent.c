@@ -2,17 +2,29 @@
  * Autonomous Agent Pattern Implementation for C
  * Open-ended exploration with tool usage
  *
- * Note: This is a simplified example. In production, use libcurl
- * for HTTP and cJSON for JSON parsing.
+ * Note: This is a simplified example. API calls go through the shared
+ * transport in anthropic_transport.h. In production, use cJSON for JSON
+ * parsing.
  *
  * Compile with:
- * gcc -o autonomous_agent autonomous_agent.c -lcurl -ljson-c
+ * gcc -o autonomous_agent autonomous_agent.c -pthread -DAGENT_TRANSPORT_CURL -lcurl -ljson-c
+ * (drop -DAGENT_TRANSPORT_CURL -lcurl to run against the mock responder)
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "thread_pool.h"
+#include "arena.h"
+#include "anthropic_transport.h"
+#include "string_builder.h"
 
 // Maximum sizes
 #define MAX_TOOLS 20
@@ -20,8 +32,14 @@
 #define MAX_HISTORY 100
 #define MAX_CONVERSATION 50
 #define MAX_NAME_SIZE 64
-#define MAX_INPUT_SIZE 4096
+#define CONVERSATION_INITIAL_CAPACITY 4096  // Bytes; the conversation grows past it
 #define MAX_OUTPUT_SIZE 16384
+#define MAX_TOOL_CALLS_PER_STEP 8
+#define DEFAULT_TOOL_TIMEOUT_MS 30000
+#define DEFAULT_CONTEXT_BUDGET 8000  // Estimated tokens before older steps are summarized
+#define COMPACTION_KEEP_RECENT 4     // Newest messages that are never summarized
+#define COMPACTION_MAX_TOKENS 512
+#define TOKEN_ESTIMATE_BYTES 4       // Rough bytes per token for English and JSON
 
 /**
  * Tool parameter definition
@@ -38,6 +56,8 @@ typedef struct ToolParameter {
  */
 typedef char* (*ToolHandler)(const char* args_json, void* user_data);
 
+struct ToolMemo;
+
 /**
  * Agent tool definition
  */
@@ -48,10 +68,13 @@ typedef struct AgentTool {
     int param_count;
     ToolHandler handler;
     void* user_data;
+    int timeout_ms;  // 0 uses the agent's default
+    struct ToolMemo* memo;  // NULL unless results are memoized
 } AgentTool;
 
 /**
- * Action record
+ * Action record; its strings live in the run's arena, or in the result
+ * block once copied into an AgentResult
  */
 typedef struct ActionRecord {
     int step;
@@ -63,19 +86,35 @@ typedef struct ActionRecord {
 } ActionRecord;
 
 /**
- * Agent state
+ * Tool memo counters for one run
+ */
+typedef struct ToolMemoStats {
+    int hits;    // Answered from the memo
+    int misses;  // Ran the handler
+    int joined;  // Shared an identical call already running
+} ToolMemoStats;
+
+/**
+ * Agent state for one run. Every string it points to is carved from the
+ * arena, which is recycled when the next run starts.
  */
 typedef struct AgentState {
+    Arena arena;
     int total_steps;
     int tool_calls;
     ActionRecord history[MAX_HISTORY];
     int history_count;
     bool is_complete;
     char* final_result;
+    AnthropicUsage usage;  // Summed over every step, compaction included
+    ToolMemoStats memo;
+    int compactions;  // Summaries folded into the pinned context
+    bool budget_exhausted;  // Stopped because the next step did not fit the budget
 } AgentState;
 
 /**
- * Agent result
+ * Agent result; one allocation that owns its history and strings, so it
+ * outlives the agent and is released by agent_result_free()
  */
 typedef struct AgentResult {
     bool success;
@@ -84,16 +123,114 @@ typedef struct AgentResult {
     int tool_calls;
     ActionRecord* history;
     int history_count;
+    AnthropicUsage usage;
+    ToolMemoStats memo;
+    int compactions;
+    bool budget_exhausted;
 } AgentResult;
 
 /**
- * Conversation message
+ * Conversation message; its text lives in the conversation's serialized
+ * buffer as "role: content\n\n"
  */
 typedef struct ConversationMessage {
     char role[16];  // "user" or "assistant"
-    char* content;
+    size_t offset;  // Absolute offset of the entry, counting dropped bytes
+    size_t length;  // Serialized length of the entry
+    int tokens;     // Estimated tokens of the entry
 } ConversationMessage;
 
+/**
+ * Append-only conversation window. Messages sit in a ring of the last
+ * MAX_CONVERSATION entries and are serialized once, when appended, so the
+ * prompt for the next step is the cached buffer and never a rebuild.
+ * Dropping the oldest message only advances the start of the buffer.
+ *
+ * The task and the summary of dropped steps are pinned in front of the
+ * window and sent as a cached prefix block, so they are never dropped.
+ */
+typedef struct AgentConversation {
+    ConversationMessage messages[MAX_CONVERSATION];
+    int head;  // Ring index of the oldest message
+    int count;
+    char* text;
+    size_t start;  // Offset of the oldest message in text
+    size_t length;  // Bytes used in text, including dropped ones before start
+    size_t capacity;
+    size_t dropped;  // Bytes discarded from the front by compaction
+    int tokens;      // Estimated tokens in the window
+    StringBuilder pinned;  // Task entry, then the summary entry if any
+    size_t task_length;    // Bytes of pinned taken by the task
+} AgentConversation;
+
+/**
+ * Summary of the oldest window messages being written in the background
+ */
+typedef struct AgentCompaction {
+    TransportFuture* future;  // NULL when no summary is in flight
+    atomic_bool ready;
+    size_t covered_end;  // Absolute offset just past the last summarized message
+    int covered;         // Messages summarized
+} AgentCompaction;
+
+/**
+ * Streaming text delta callback
+ */
+typedef void (*AgentStreamCallback)(const char* delta, size_t length, void* user_data);
+
+/**
+ * Per-step streaming state; holds a tool call dispatched before the
+ * response finished streaming
+ */
+typedef struct AgentStream {
+    struct AutonomousAgent* agent;
+    AgentTool* tool;
+    struct ToolCall* call;  // NULL if answered from the tool's memo
+    char* tool_result;      // Memoized result
+    bool dispatched;
+} AgentStream;
+
+/**
+ * One tool call running on the pool, shared by the job and every step
+ * waiting on it. A waiter that times out drops its reference and the job
+ * frees the call when the handler returns.
+ */
+typedef struct ToolCall {
+    AgentTool* tool;
+    char* args_json;
+    char* result;
+    bool done;
+    int refs;
+    ResponseCacheKey key;  // Memo key if the tool is memoized
+    struct ToolCall* next_in_flight;
+    MetricsSpanContext parent_span;  // The step that started the call; copied
+    bool has_parent_span;            // because a timed-out call outlives it
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ToolCall;
+
+/**
+ * Memoized results of one tool plus the calls now running, so identical
+ * calls made at the same time run once
+ */
+typedef struct ToolMemo {
+    ResponseCache* cache;
+    pthread_mutex_t lock;
+    ToolCall* in_flight;
+} ToolMemo;
+
+/**
+ * A tool call requested in the current step
+ */
+typedef struct AgentToolCallSlot {
+    char name[MAX_NAME_SIZE];
+    AgentTool* tool;  // NULL if the model named an unknown tool
+    char* args_json;
+    ToolCall* call;
+    char* result;
+    bool finished;  // False if the call timed out
+} AgentToolCallSlot;
+
 /**
  * Autonomous agent
  */
@@ -103,20 +240,44 @@ typedef struct AutonomousAgent {
     AgentTool tools[MAX_TOOLS];
     int tool_count;
     AgentState state;
-    ConversationMessage conversation[MAX_CONVERSATION];
-    int conversation_count;
+    AgentConversation conversation;
+    bool streaming;
+    AgentStreamCallback stream_callback;
+    void* stream_user_data;
+    AgentStream* prefetch;  // Early-dispatched tool call for the current step
+    int tool_timeout_ms;    // For tools without their own timeout
+    TaskGroup tool_jobs;    // Every tool call started, including timed-out ones
+    int context_budget;     // Estimated prompt tokens before compaction starts
+    char* compaction_model;
+    AgentCompaction compaction;
+    TokenBudget* budget;    // Not owned; NULL leaves runs unlimited
 } AutonomousAgent;
 
 /**
- * Simplified API call
+ * Mock responder used when the transport is built without libcurl
  */
-char* call_anthropic_api(const char* api_key, const char* model,
-                         const char* prompt, const char* system_prompt,
-                         int max_tokens) {
-    printf("API Call (mock) - Model: %s\n", model);
+char* mock_anthropic_api(const AnthropicRequest* request) {
+    printf("API Call (mock) - Model: %s\n", request->model);
 
-    // Mock response - return a tool call action
+    // Mock response - fan out to two tools on the first step, then one
     char* response = (char*)malloc(MAX_OUTPUT_SIZE);
+    if (request->prompt && strstr(request->prompt, "Condense the earlier steps")) {
+        snprintf(response, MAX_OUTPUT_SIZE,
+            "Searched for quantum computing 2024 and read https://example.com/quantum; "
+            "found an overview of current progress. No note saved yet.");
+        return response;
+    }
+    if (request->prompt && !strstr(request->prompt, "result: ")) {
+        snprintf(response, MAX_OUTPUT_SIZE,
+            "{\n"
+            "  \"thought\": \"I can search and read the overview at the same time.\",\n"
+            "  \"actions\": [\n"
+            "    {\"action\": \"search\", \"args\": {\"query\": \"quantum computing 2024\"}},\n"
+            "    {\"action\": \"read_url\", \"args\": {\"url\": \"https://example.com/quantum\"}}\n"
+            "  ]\n"
+            "}");
+        return response;
+    }
     snprintf(response, MAX_OUTPUT_SIZE,
         "{\n"
         "  \"thought\": \"I need to search for information first.\",\n"
@@ -126,6 +287,33 @@ char* call_anthropic_api(const char* api_key, const char* model,
     return response;
 }
 
+/**
+ * Blocking API call through the shared transport. The system prompt is
+ * the same on every step, so it is marked for prompt caching.
+ */
+char* call_anthropic_api(const char* api_key, const char* model,
+                         const char* prefix, const char* prompt, const char* system_prompt,
+                         int max_tokens, AnthropicUsage* usage) {
+    AnthropicRequest request = {.api_key = api_key, .model = model, .system_prompt = system_prompt,
+                                .cached_prefix = prefix, .prompt = prompt,
+                                .max_tokens = max_tokens, .cache_system = system_prompt != NULL};
+    return transport_call(transport_default(), &request, usage);
+}
+
+/**
+ * Streaming API call through the shared transport
+ */
+char* call_anthropic_api_stream(const char* api_key, const char* model,
+                                const char* prefix, const char* prompt,
+                                const char* system_prompt, int max_tokens,
+                                TransportDeltaFunc on_delta, void* user_data,
+                                AnthropicUsage* usage) {
+    AnthropicRequest request = {.api_key = api_key, .model = model, .system_prompt = system_prompt,
+                                .cached_prefix = prefix, .prompt = prompt,
+                                .max_tokens = max_tokens, .cache_system = system_prompt != NULL};
+    return transport_call_stream(transport_default(), &request, on_delta, user_data, usage);
+}
+
 /**
  * Create autonomous agent
  */
@@ -134,10 +322,26 @@ AutonomousAgent* agent_create(const char* api_key, const char* model) {
     agent->api_key = strdup(api_key);
     agent->model = model ? strdup(model) : strdup("claude-sonnet-4-20250514");
     agent->tool_count = 0;
-    agent->conversation_count = 0;
+    agent->streaming = false;
+    agent->prefetch = NULL;
+    agent->tool_timeout_ms = DEFAULT_TOOL_TIMEOUT_MS;
+    agent->context_budget = DEFAULT_CONTEXT_BUDGET;
+    agent->compaction_model = strdup("claude-3-haiku-20240307");
+    arena_init(&agent->state.arena, 0);
+    task_group_init(&agent->tool_jobs);
     return agent;
 }
 
+/**
+ * Stream responses; callback (optional) receives every text delta. Tool
+ * calls are dispatched as soon as their action and args have streamed in.
+ */
+void agent_set_streaming(AutonomousAgent* agent, AgentStreamCallback callback, void* user_data) {
+    agent->streaming = true;
+    agent->stream_callback = callback;
+    agent->stream_user_data = user_data;
+}
+
 /**
  * Register a tool
  */
@@ -157,6 +361,69 @@ bool agent_register_tool(AutonomousAgent* agent, const char* name,
     return true;
 }
 
+/**
+ * Give a tool its own timeout (0 reverts to the agent default)
+ */
+bool agent_set_tool_timeout(AutonomousAgent* agent, const char* name, int timeout_ms) {
+    for (int i = 0; i < agent->tool_count; i++) {
+        if (strcmp(agent->tools[i].name, name) == 0) {
+            agent->tools[i].timeout_ms = timeout_ms;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Memoize a tool whose results depend only on its arguments. Calls whose
+ * args are the same JSON once keys are sorted are answered from the memo
+ * for ttl_seconds (0 until evicted), and an identical call already
+ * running is shared rather than started again. disk_path (optional) keeps
+ * the memo across runs and processes.
+ */
+bool agent_enable_tool_memo(AutonomousAgent* agent, const char* name, size_t max_entries,
+                            int ttl_seconds, const char* disk_path) {
+    AgentTool* tool = NULL;
+    for (int i = 0; i < agent->tool_count; i++) {
+        if (strcmp(agent->tools[i].name, name) == 0) tool = &agent->tools[i];
+    }
+    if (!tool || tool->memo) return false;
+
+    ToolMemo* memo = (ToolMemo*)calloc(1, sizeof(ToolMemo));
+    memo->cache = response_cache_create(max_entries, ttl_seconds);
+    if (disk_path) response_cache_attach_disk(memo->cache, disk_path, 0);
+    pthread_mutex_init(&memo->lock, NULL);
+    tool->memo = memo;
+    return true;
+}
+
+/**
+ * Timeout for tools that have none of their own
+ */
+void agent_set_default_tool_timeout(AutonomousAgent* agent, int timeout_ms) {
+    agent->tool_timeout_ms = timeout_ms > 0 ? timeout_ms : DEFAULT_TOOL_TIMEOUT_MS;
+}
+
+/**
+ * Charge every run's steps and summaries to a token budget (NULL removes
+ * it). A run stops before a step the budget can no longer pay for.
+ */
+void agent_set_budget(AutonomousAgent* agent, TokenBudget* budget) {
+    agent->budget = budget;
+}
+
+/**
+ * Estimated prompt tokens (system prompt, pinned task and window) at which
+ * the oldest steps are summarized; model (optional) writes the summaries
+ */
+void agent_set_context_budget(AutonomousAgent* agent, int tokens, const char* model) {
+    agent->context_budget = tokens > 0 ? tokens : DEFAULT_CONTEXT_BUDGET;
+    if (model) {
+        free(agent->compaction_model);
+        agent->compaction_model = strdup(model);
+    }
+}
+
 /**
  * Add parameter to most recently registered tool
  */
@@ -194,221 +461,707 @@ AgentTool* agent_find_tool(AutonomousAgent* agent, const char* name) {
  * Build system prompt
  */
 char* agent_build_system_prompt(AutonomousAgent* agent) {
-    char* prompt = (char*)malloc(MAX_INPUT_SIZE);
-    char tools_desc[MAX_INPUT_SIZE / 2];
-    tools_desc[0] = '\0';
+    StringBuilder prompt = {0};
+    string_builder_append_str(&prompt,
+        "You are an autonomous agent that can use tools to complete tasks.\n\n"
+        "Available tools:\n");
 
     for (int i = 0; i < agent->tool_count; i++) {
         AgentTool* tool = &agent->tools[i];
-
-        char params[512];
-        params[0] = '\0';
-
+        string_builder_appendf(&prompt, "- %s(", tool->name);
         for (int j = 0; j < tool->param_count; j++) {
-            char param_str[128];
-            snprintf(param_str, sizeof(param_str), "%s: %s",
-                     tool->parameters[j].name, tool->parameters[j].type);
-            if (j > 0) strcat(params, ", ");
-            strcat(params, param_str);
+            string_builder_appendf(&prompt, "%s%s: %s", j > 0 ? ", " : "",
+                                   tool->parameters[j].name, tool->parameters[j].type);
         }
-
-        char tool_line[512];
-        snprintf(tool_line, sizeof(tool_line), "- %s(%s): %s\n",
-                 tool->name, params, tool->description);
-        strcat(tools_desc, tool_line);
+        string_builder_appendf(&prompt, "): %s\n", tool->description);
     }
 
-    snprintf(prompt, MAX_INPUT_SIZE,
-        "You are an autonomous agent that can use tools to complete tasks.\n\n"
-        "Available tools:\n%s\n"
+    string_builder_append_str(&prompt,
+        "\n"
         "To use a tool, respond with JSON in this format:\n"
         "{\n"
         "  \"thought\": \"Your reasoning about what to do next\",\n"
         "  \"action\": \"tool_name\",\n"
         "  \"args\": { \"param\": \"value\" }\n"
         "}\n\n"
+        "To run several independent tools at once, respond with:\n"
+        "{\n"
+        "  \"thought\": \"Your reasoning\",\n"
+        "  \"actions\": [\n"
+        "    {\"action\": \"tool_name\", \"args\": { \"param\": \"value\" }},\n"
+        "    {\"action\": \"other_tool\", \"args\": { \"param\": \"value\" }}\n"
+        "  ]\n"
+        "}\n\n"
         "When you have completed the task, respond with:\n"
         "{\n"
         "  \"thought\": \"Task is complete because...\",\n"
         "  \"action\": \"complete\",\n"
         "  \"result\": \"Your final answer\"\n"
         "}\n\n"
-        "Always think step by step and use tools to gather information before providing a final answer.",
-        tools_desc);
+        "Always think step by step and use tools to gather information before providing a final answer.");
+
+    return string_builder_take(&prompt);
+}
+
+/**
+ * Forget every message but keep the buffer for reuse
+ */
+void agent_conversation_clear(AgentConversation* conv) {
+    conv->head = 0;
+    conv->count = 0;
+    conv->start = 0;
+    conv->length = 0;
+    conv->dropped = 0;
+    conv->tokens = 0;
+    conv->task_length = 0;
+    string_builder_clear(&conv->pinned);
+    if (conv->text) conv->text[0] = '\0';
+}
+
+/**
+ * Rough token count of a serialized entry
+ */
+int agent_estimate_tokens(size_t bytes) {
+    return (int)((bytes + TOKEN_ESTIMATE_BYTES - 1) / TOKEN_ESTIMATE_BYTES);
+}
+
+/**
+ * Drop the oldest message in the window
+ */
+void agent_conversation_drop_oldest(AgentConversation* conv) {
+    conv->start += conv->messages[conv->head].length;
+    conv->tokens -= conv->messages[conv->head].tokens;
+    conv->head = (conv->head + 1) % MAX_CONVERSATION;
+    conv->count--;
+}
+
+/**
+ * Append a message, dropping the oldest one when the window is full
+ */
+void agent_conversation_append(AgentConversation* conv, const char* role, const char* content) {
+    if (conv->count == MAX_CONVERSATION) {
+        agent_conversation_drop_oldest(conv);
+    }
+
+    size_t role_length = strnlen(role, 15);
+    size_t content_length = strlen(content);
+    size_t entry_length = role_length + 2 + content_length + 2;
+
+    // Reclaim dropped bytes only once they make up half the buffer, so
+    // each byte is moved at most once on average
+    if (conv->length + entry_length + 1 > conv->capacity && conv->start > conv->length / 2) {
+        memmove(conv->text, conv->text + conv->start, conv->length - conv->start);
+        conv->dropped += conv->start;
+        conv->length -= conv->start;
+        conv->start = 0;
+    }
+    if (conv->length + entry_length + 1 > conv->capacity) {
+        size_t capacity = conv->capacity ? conv->capacity : CONVERSATION_INITIAL_CAPACITY;
+        while (capacity < conv->length + entry_length + 1) capacity *= 2;
+        conv->text = (char*)realloc(conv->text, capacity);
+        conv->capacity = capacity;
+    }
+
+    ConversationMessage* msg = &conv->messages[(conv->head + conv->count) % MAX_CONVERSATION];
+    memcpy(msg->role, role, role_length);
+    msg->role[role_length] = '\0';
+    msg->offset = conv->dropped + conv->length;
+    msg->length = entry_length;
+    msg->tokens = agent_estimate_tokens(entry_length);
+    conv->tokens += msg->tokens;
+
+    char* out = conv->text + conv->length;
+    memcpy(out, role, role_length);
+    memcpy(out + role_length, ": ", 2);
+    memcpy(out + role_length + 2, content, content_length);
+    memcpy(out + role_length + 2 + content_length, "\n\n", 3);  // Includes the NUL
+    conv->length += entry_length;
+    conv->count++;
+}
+
+/**
+ * Serialized window; valid until the next append
+ */
+const char* agent_conversation_text(const AgentConversation* conv) {
+    return conv->text ? conv->text + conv->start : "";
+}
+
+/**
+ * Content of the index-th message in the window (0 is the oldest)
+ */
+const char* agent_conversation_content(const AgentConversation* conv, int index, size_t* length) {
+    const ConversationMessage* msg = &conv->messages[(conv->head + index) % MAX_CONVERSATION];
+    size_t prefix = strlen(msg->role) + 2;
+    *length = msg->length - prefix - 2;
+    return conv->text + (msg->offset - conv->dropped) + prefix;
+}
+
+/**
+ * Pin the task in front of the window; it survives every compaction
+ */
+void agent_conversation_pin_task(AgentConversation* conv, const char* task) {
+    string_builder_clear(&conv->pinned);
+    string_builder_appendf(&conv->pinned, "user: Task: %s\n\n", task);
+    conv->task_length = conv->pinned.length;
+}
+
+/**
+ * Replace the pinned summary of dropped steps
+ */
+void agent_conversation_set_summary(AgentConversation* conv, const char* summary) {
+    conv->pinned.length = conv->task_length;
+    conv->pinned.data[conv->pinned.length] = '\0';
+    string_builder_appendf(&conv->pinned, "user: Summary of earlier steps: %s\n\n", summary);
+}
 
-    return prompt;
+/**
+ * Pinned task and summary, sent as a cached block before the window
+ */
+const char* agent_conversation_pinned(const AgentConversation* conv) {
+    return string_builder_cstr(&conv->pinned);
+}
+
+/**
+ * Estimated tokens of the pinned block plus the window
+ */
+int agent_conversation_tokens(const AgentConversation* conv) {
+    return agent_estimate_tokens(conv->pinned.length) + conv->tokens;
+}
+
+void agent_conversation_free(AgentConversation* conv) {
+    free(conv->text);
+    string_builder_free(&conv->pinned);
+    memset(conv, 0, sizeof(AgentConversation));
 }
 
 /**
  * Add message to conversation
  */
 void agent_add_message(AutonomousAgent* agent, const char* role, const char* content) {
-    if (agent->conversation_count >= MAX_CONVERSATION) {
-        // Shift conversation (drop oldest)
-        free(agent->conversation[0].content);
-        for (int i = 0; i < agent->conversation_count - 1; i++) {
-            agent->conversation[i] = agent->conversation[i + 1];
-        }
-        agent->conversation_count--;
+    agent_conversation_append(&agent->conversation, role, content);
+}
+
+/**
+ * Compaction callback, run on the transport thread
+ */
+void agent_compaction_done(AnthropicResponse* response, void* user_data) {
+    (void)response;
+    AgentCompaction* compaction = (AgentCompaction*)user_data;
+    atomic_store(&compaction->ready, true);
+}
+
+/**
+ * Start summarizing the oldest steps once the prompt is over budget. The
+ * newest COMPACTION_KEEP_RECENT messages stay verbatim, and nothing is
+ * dropped until the summary is installed, so the step never waits on it.
+ */
+void agent_compaction_start(AutonomousAgent* agent, const char* system_prompt) {
+    AgentConversation* conv = &agent->conversation;
+    AgentCompaction* compaction = &agent->compaction;
+    if (compaction->future || conv->count <= COMPACTION_KEEP_RECENT) return;
+
+    int tokens = agent_estimate_tokens(strlen(system_prompt)) + agent_conversation_tokens(conv);
+    bool crowded = conv->count >= MAX_CONVERSATION - COMPACTION_KEEP_RECENT;
+    if (tokens <= agent->context_budget && !crowded) return;
+
+    int covered = conv->count - COMPACTION_KEEP_RECENT;
+    const ConversationMessage* last =
+        &conv->messages[(conv->head + covered - 1) % MAX_CONVERSATION];
+    size_t covered_end = last->offset + last->length;
+
+    StringBuilder prompt = {0};
+    string_builder_append_str(&prompt,
+        "Condense the earlier steps of an agent run into a short summary for the agent to "
+        "continue from. Keep every finding from tool results, the sources used, notes "
+        "saved and open questions; drop the wording.\n\n");
+    const char* pinned = agent_conversation_pinned(conv);
+    if (conv->pinned.length > conv->task_length) {
+        string_builder_append_str(&prompt, "Summary so far:\n");
+        string_builder_append(&prompt, pinned + conv->task_length,
+                              conv->pinned.length - conv->task_length);
     }
+    string_builder_append_str(&prompt, "Steps:\n");
+    string_builder_append(&prompt, agent_conversation_text(conv),
+                          covered_end - conv->dropped - conv->start);
+
+    AnthropicRequest request = {.api_key = agent->api_key, .model = agent->compaction_model,
+                                .prompt = string_builder_cstr(&prompt),
+                                .max_tokens = COMPACTION_MAX_TOKENS};
+    atomic_store(&compaction->ready, false);
+    compaction->covered_end = covered_end;
+    compaction->covered = covered;
+    compaction->future = transport_submit(transport_default(), &request,
+                                          agent_compaction_done, compaction);
+    string_builder_free(&prompt);
+}
 
-    ConversationMessage* msg = &agent->conversation[agent->conversation_count];
-    strncpy(msg->role, role, 15);
-    msg->content = strdup(content);
-    agent->conversation_count++;
+/**
+ * Install a finished summary and drop the messages it covers. With wait
+ * set, block for one still in flight; a failed summary drops nothing.
+ */
+void agent_compaction_finish(AutonomousAgent* agent, bool wait) {
+    AgentConversation* conv = &agent->conversation;
+    AgentCompaction* compaction = &agent->compaction;
+    if (!compaction->future || (!wait && !atomic_load(&compaction->ready))) return;
+
+    AnthropicUsage usage = {0};
+    char* summary = transport_future_take_text(compaction->future, &usage);
+    compaction->future = NULL;
+    anthropic_usage_add(&agent->state.usage, &usage);
+    if (!summary) {
+        fprintf(stderr, "Step %d: context compaction failed\n", agent->state.total_steps);
+        return;
+    }
+
+    // Messages may have left the ring since the summary started
+    while (conv->count > 0 && conv->messages[conv->head].offset < compaction->covered_end) {
+        agent_conversation_drop_oldest(conv);
+    }
+    agent_conversation_set_summary(conv, summary);
+    agent->state.compactions++;
+    free(summary);
 }
 
 /**
- * Build conversation prompt
+ * Stop a summary still in flight when the run ends
  */
-char* agent_build_conversation(AutonomousAgent* agent) {
-    char* conv = (char*)malloc(MAX_OUTPUT_SIZE);
-    conv[0] = '\0';
+void agent_compaction_abandon(AutonomousAgent* agent) {
+    if (!agent->compaction.future) return;
+    AnthropicUsage usage = {0};
+    transport_cancel(agent->compaction.future);
+    free(transport_future_take_text(agent->compaction.future, &usage));
+    anthropic_usage_add(&agent->state.usage, &usage);
+    agent->compaction.future = NULL;
+}
 
-    for (int i = 0; i < agent->conversation_count; i++) {
-        char msg[MAX_INPUT_SIZE];
-        snprintf(msg, sizeof(msg), "%s: %s\n\n",
-                 agent->conversation[i].role, agent->conversation[i].content);
-        strcat(conv, msg);
+void agent_tool_call_free(ToolCall* call) {
+    free(call->args_json);
+    free(call->result);
+    pthread_mutex_destroy(&call->lock);
+    pthread_cond_destroy(&call->cond);
+    free(call);
+}
+
+/**
+ * Drop one reference (call->lock held); frees the call after the last
+ */
+void agent_tool_call_unref(ToolCall* call) {
+    bool last = --call->refs == 0;
+    pthread_mutex_unlock(&call->lock);
+    if (last) agent_tool_call_free(call);
+}
+
+/**
+ * Pool job running one tool call
+ */
+void agent_tool_call_job(void* arg) {
+    ToolCall* call = (ToolCall*)arg;
+    MetricsSpan span;
+    metrics_span_begin(&span, "agent.tool", call->has_parent_span ? &call->parent_span : NULL);
+    metrics_span_set_string(&span, "agent.tool.name", call->tool->name);
+    char* result = call->tool->handler(call->args_json, call->tool->user_data);
+    span.error = result == NULL;
+    metrics_span_end(&span);
+
+    // Store and leave the in-flight list in one step, so a new identical
+    // call finds either this one or its memoized result
+    ToolMemo* memo = call->tool->memo;
+    if (memo) {
+        pthread_mutex_lock(&memo->lock);
+        if (result) response_cache_put(memo->cache, call->key, result);
+        for (ToolCall** link = &memo->in_flight; *link; link = &(*link)->next_in_flight) {
+            if (*link == call) {
+                *link = call->next_in_flight;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&memo->lock);
     }
 
-    return conv;
+    pthread_mutex_lock(&call->lock);
+    call->result = result;
+    call->done = true;
+    pthread_cond_broadcast(&call->cond);
+    agent_tool_call_unref(call);
 }
 
 /**
- * Extract JSON from text (handles markdown code blocks)
+ * Write a JSON value with object keys sorted and no insignificant
+ * whitespace, so equal arguments give equal memo keys
  */
-char* extract_json(const char* text) {
-    const char* start = strchr(text, '{');
-    if (!start) return strdup(text);
+void agent_json_canonical(const JsonDoc* doc, int index, StringBuilder* out) {
+    const JsonToken* token = &doc->tokens[index];
+    JsonView view = json_view(doc, index);
+
+    if (token->type == JSON_OBJECT) {
+        // Each member's key token sits just before its value
+        int* keys = (int*)malloc((token->size > 0 ? token->size : 1) * sizeof(int));
+        int count = 0;
+        for (int value = json_first_child(doc, index); value >= 0;
+             value = json_next_child(doc, index, value)) {
+            int key = value - 1;
+            JsonView name = json_view(doc, key);
+            int j = count++;
+            for (; j > 0; j--) {
+                JsonView other = json_view(doc, keys[j - 1]);
+                size_t n = name.length < other.length ? name.length : other.length;
+                int order = memcmp(other.data, name.data, n);
+                if (order < 0 || (order == 0 && other.length <= name.length)) break;
+                keys[j] = keys[j - 1];
+            }
+            keys[j] = key;
+        }
+        string_builder_append(out, "{", 1);
+        for (int i = 0; i < count; i++) {
+            JsonView name = json_view(doc, keys[i]);
+            string_builder_append_str(out, i > 0 ? ",\"" : "\"");
+            string_builder_append(out, name.data, name.length);
+            string_builder_append(out, "\":", 2);
+            agent_json_canonical(doc, keys[i] + 1, out);
+        }
+        string_builder_append(out, "}", 1);
+        free(keys);
+    } else if (token->type == JSON_ARRAY) {
+        string_builder_append(out, "[", 1);
+        int i = 0;
+        for (int item = json_first_child(doc, index); item >= 0;
+             item = json_next_child(doc, index, item)) {
+            if (i++ > 0) string_builder_append(out, ",", 1);
+            agent_json_canonical(doc, item, out);
+        }
+        string_builder_append(out, "]", 1);
+    } else if (token->type == JSON_STRING) {
+        string_builder_append(out, "\"", 1);
+        string_builder_append(out, view.data, view.length);
+        string_builder_append(out, "\"", 1);
+    } else {
+        string_builder_append(out, view.data, view.length);
+    }
+}
 
-    // Find matching closing brace
-    int depth = 0;
-    const char* end = start;
-    while (*end) {
-        if (*end == '{') depth++;
-        else if (*end == '}') {
-            depth--;
-            if (depth == 0) break;
+/**
+ * Memo key of a call: the tool name and its canonical arguments (the raw
+ * text if they do not parse)
+ */
+ResponseCacheKey agent_tool_memo_key(const AgentTool* tool, const char* args_json,
+                                     size_t args_length) {
+    StringBuilder canonical = {0};
+    JsonDoc doc = {0};
+    if (json_parse_alloc(&doc, args_json, args_length) == JSON_OK) {
+        agent_json_canonical(&doc, 0, &canonical);
+    } else {
+        string_builder_append(&canonical, args_json, args_length);
+    }
+    json_doc_free(&doc);
+
+    ResponseCacheKey key = response_cache_key(tool->name, NULL, "tool",
+                                              string_builder_cstr(&canonical), 0);
+    string_builder_free(&canonical);
+    return key;
+}
+
+/**
+ * Start a tool call on the pool; args_json is copied. For a memoized tool
+ * a fresh memo entry is returned in *memo_result instead (and the result
+ * is NULL), and an identical call already running is shared.
+ */
+ToolCall* agent_tool_call_start(AutonomousAgent* agent, AgentTool* tool, const char* args_json,
+                                size_t args_length, char** memo_result) {
+    *memo_result = NULL;
+    ToolMemo* memo = tool->memo;
+    ResponseCacheKey key = {0, 0};
+    if (memo) {
+        key = agent_tool_memo_key(tool, args_json, args_length);
+        pthread_mutex_lock(&memo->lock);
+        char* text = response_cache_get(memo->cache, key);
+        if (text) {
+            pthread_mutex_unlock(&memo->lock);
+            agent->state.memo.hits++;
+            *memo_result = text;
+            return NULL;
         }
-        end++;
+        for (ToolCall* running = memo->in_flight; running; running = running->next_in_flight) {
+            if (response_cache_key_equal(running->key, key)) {
+                pthread_mutex_lock(&running->lock);
+                running->refs++;
+                pthread_mutex_unlock(&running->lock);
+                pthread_mutex_unlock(&memo->lock);
+                agent->state.memo.joined++;
+                return running;
+            }
+        }
+        agent->state.memo.misses++;
     }
 
-    if (*end == '}') {
-        size_t len = end - start + 1;
-        char* json = (char*)malloc(len + 1);
-        strncpy(json, start, len);
-        json[len] = '\0';
-        return json;
+    ToolCall* call = (ToolCall*)calloc(1, sizeof(ToolCall));
+    call->tool = tool;
+    call->args_json = strndup(args_json, args_length);
+    call->refs = 2;  // The job and the caller
+    call->key = key;
+    const MetricsSpanContext* step_span = metrics_current_span_context();
+    if (step_span) {
+        call->parent_span = *step_span;
+        call->has_parent_span = true;
+    }
+    pthread_mutex_init(&call->lock, NULL);
+    pthread_cond_init(&call->cond, NULL);
+    if (memo) {
+        call->next_in_flight = memo->in_flight;
+        memo->in_flight = call;
+        pthread_mutex_unlock(&memo->lock);
     }
+    thread_pool_submit(thread_pool_default(), &agent->tool_jobs, agent_tool_call_job, call);
+    return call;
+}
+
+/**
+ * Wait for a call until deadline. Returns true with a copy of its result
+ * (which may be NULL); on timeout the call is left to finish in the
+ * background. Either way the caller's reference is dropped.
+ */
+bool agent_tool_call_wait(ToolCall* call, const struct timespec* deadline, char** result) {
+    pthread_mutex_lock(&call->lock);
+    while (!call->done) {
+        if (pthread_cond_timedwait(&call->cond, &call->lock, deadline) == ETIMEDOUT) break;
+    }
+    bool finished = call->done;
+    if (finished) *result = call->result ? strdup(call->result) : NULL;
+    agent_tool_call_unref(call);
+    return finished;
+}
+
+/**
+ * Delta callback: forward to the user, then dispatch the tool call as soon
+ * as both "action" and "args" are complete
+ */
+bool agent_stream_delta(const char* delta, size_t delta_length,
+                        const char* text, size_t text_length, void* user_data) {
+    AgentStream* stream = (AgentStream*)user_data;
+    AutonomousAgent* agent = stream->agent;
+
+    if (agent->stream_callback) {
+        agent->stream_callback(delta, delta_length, agent->stream_user_data);
+    }
+    if (stream->dispatched) return true;
+
+    // Re-tokenize what has arrived; the reply is small, and only members
+    // whose values are complete are visible in a partial parse
+    JsonToken tokens[JSON_DEFAULT_TOKENS];
+    JsonDoc doc;
+    const char* start = (const char*)memchr(text, '{', text_length);
+    if (!start) return true;
+    json_parse(&doc, start, text_length - (size_t)(start - text), tokens, JSON_DEFAULT_TOKENS);
+
+    char name[MAX_NAME_SIZE];
+    if (!json_get_string(&doc, 0, "action", name, sizeof(name))) return true;
+    int args = json_object_get(&doc, 0, "args");
+    if (args < 0) return true;
+
+    AgentTool* tool = agent_find_tool(agent, name);
+    if (!tool) return true;
+
+    JsonView view = json_view(&doc, args);
+    stream->tool = tool;
+    stream->dispatched = true;
+    stream->call = agent_tool_call_start(agent, tool, view.data, view.length,
+                                         &stream->tool_result);
+    return true;
+}
 
-    return strdup(text);
+/**
+ * Append a history record for the current step; NULL once the history
+ * is full
+ */
+ActionRecord* agent_history_add(AutonomousAgent* agent, const char* action_type) {
+    if (agent->state.history_count >= MAX_HISTORY) return NULL;
+    ActionRecord* record = &agent->state.history[agent->state.history_count++];
+    memset(record, 0, sizeof(ActionRecord));
+    record->step = agent->state.total_steps;
+    strncpy(record->action_type, action_type, sizeof(record->action_type) - 1);
+    return record;
 }
 
 /**
- * Parse JSON field (simplified)
+ * Decode a JSON string token into the run's arena
  */
-char* json_get_string(const char* json, const char* field) {
-    char pattern[128];
-    snprintf(pattern, sizeof(pattern), "\"%s\"", field);
+char* agent_arena_string(AutonomousAgent* agent, const JsonDoc* doc, int index) {
+    if (index < 0 || doc->tokens[index].type != JSON_STRING) return NULL;
+    size_t length = json_string_copy(doc, index, NULL, 0);
+    char* text = (char*)arena_alloc(&agent->state.arena, length + 1);
+    if (text) json_string_copy(doc, index, text, length + 1);
+    return text;
+}
 
-    const char* start = strstr(json, pattern);
-    if (!start) return NULL;
+/**
+ * Record a tool call in the history; args_json must already live in the
+ * run's arena
+ */
+void agent_record_tool_call(AutonomousAgent* agent, const char* name, char* args_json,
+                            const char* tool_result) {
+    ActionRecord* record = agent_history_add(agent, "tool_call");
+    if (!record) return;
+    strncpy(record->tool_name, name, MAX_NAME_SIZE - 1);
+    record->tool_args = args_json;
+    record->tool_result = tool_result ? arena_strdup(&agent->state.arena, tool_result) : NULL;
+}
 
-    start = strchr(start + strlen(pattern), '"');
-    if (!start) return NULL;
-    start++;
+/**
+ * Run the step's tool calls. Every known tool starts at once on the pool
+ * and is waited for until its own timeout; a call that overruns is left
+ * to finish in the background and reported as timed out. All results go
+ * back to the model in one user turn.
+ */
+void agent_execute_tool_calls(AutonomousAgent* agent, const JsonDoc* doc, const int* actions,
+                              int count, const char* response) {
+    AgentToolCallSlot slots[MAX_TOOL_CALLS_PER_STEP];
+    struct timespec started;
+    clock_gettime(CLOCK_REALTIME, &started);
+
+    for (int i = 0; i < count; i++) {
+        AgentToolCallSlot* slot = &slots[i];
+        memset(slot, 0, sizeof(AgentToolCallSlot));
+        json_get_string(doc, actions[i], "action", slot->name, sizeof(slot->name));
+        slot->tool = agent_find_tool(agent, slot->name);
+
+        // The tool gets the args object; empty if the model sent none
+        int args = json_object_get(doc, actions[i], "args");
+        JsonView args_view = args >= 0 ? json_view(doc, args) : (JsonView){"{}", 2};
+        slot->args_json = arena_strndup(&agent->state.arena, args_view.data, args_view.length);
+        if (!slot->tool) continue;
+
+        agent->state.tool_calls++;
+        if (i == 0 && agent->prefetch && agent->prefetch->tool == slot->tool) {
+            // Reuse a call dispatched while the response was streaming
+            slot->call = agent->prefetch->call;
+            slot->result = agent->prefetch->tool_result;
+            agent->prefetch->call = NULL;
+            agent->prefetch->tool_result = NULL;
+            slot->finished = slot->call == NULL;
+        } else {
+            slot->call = agent_tool_call_start(agent, slot->tool, args_view.data,
+                                               args_view.length, &slot->result);
+            slot->finished = slot->call == NULL;
+        }
+    }
 
-    const char* end = start;
-    while (*end && *end != '"') {
-        if (*end == '\\' && *(end + 1)) end++;  // Skip escaped chars
-        end++;
+    for (int i = 0; i < count; i++) {
+        AgentToolCallSlot* slot = &slots[i];
+        if (!slot->call) continue;
+
+        int timeout_ms = slot->tool->timeout_ms > 0 ? slot->tool->timeout_ms
+                                                    : agent->tool_timeout_ms;
+        struct timespec deadline = started;
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        slot->finished = agent_tool_call_wait(slot->call, &deadline, &slot->result);
+        slot->call = NULL;
+        if (!slot->finished) {
+            fprintf(stderr, "Tool %s timed out after %d ms\n", slot->name, timeout_ms);
+        }
     }
 
-    size_t len = end - start;
-    char* value = (char*)malloc(len + 1);
-    strncpy(value, start, len);
-    value[len] = '\0';
+    // Add to conversation
+    agent_add_message(agent, "assistant", response);
 
-    return value;
+    StringBuilder tool_msg = {0};
+    for (int i = 0; i < count; i++) {
+        AgentToolCallSlot* slot = &slots[i];
+        if (count == 1) {
+            string_builder_append_str(&tool_msg, "Tool result: ");
+        } else {
+            string_builder_appendf(&tool_msg, "%s[%d] %s result: ", i > 0 ? "\n\n" : "",
+                                   i + 1, slot->name);
+        }
+
+        if (!slot->tool) {
+            string_builder_appendf(&tool_msg, "Unknown action: %s", slot->name);
+        } else if (!slot->finished) {
+            string_builder_appendf(&tool_msg, "Timed out after %d ms",
+                                   slot->tool->timeout_ms > 0 ? slot->tool->timeout_ms
+                                                              : agent->tool_timeout_ms);
+        } else {
+            string_builder_append_str(&tool_msg, slot->result ? slot->result : "No result");
+        }
+
+        if (slot->tool) {
+            agent_record_tool_call(agent, slot->name, slot->args_json,
+                                   slot->finished ? slot->result : "Timed out");
+        }
+        free(slot->result);
+    }
+    agent_add_message(agent, "user", tool_msg.data);
+    string_builder_free(&tool_msg);
 }
 
 /**
  * Process agent response
  */
 void agent_process_response(AutonomousAgent* agent, const char* response) {
-    char* json = extract_json(response);
+    JsonToken tokens[JSON_DEFAULT_TOKENS];
+    JsonDoc doc;
+    uint64_t parse_started = metrics_now_ns();
+    bool parsed = json_parse_embedded(&doc, response, tokens, JSON_DEFAULT_TOKENS) == JSON_OK;
+    metrics_observe_since(METRIC_PARSE_TIME, parse_started);
 
     // Extract fields
-    char* thought = json_get_string(json, "thought");
-    char* action = json_get_string(json, "action");
-    char* result_str = json_get_string(json, "result");
+    char action[MAX_NAME_SIZE];
+    bool has_action = parsed && json_get_string(&doc, 0, "action", action, sizeof(action));
 
     // Record thought
-    if (thought) {
-        if (agent->state.history_count < MAX_HISTORY) {
-            ActionRecord* record = &agent->state.history[agent->state.history_count];
-            record->step = agent->state.total_steps;
-            strcpy(record->action_type, "thought");
-            record->thought = strdup(thought);
-            agent->state.history_count++;
-        }
+    int thought = parsed ? json_object_get(&doc, 0, "thought") : -1;
+    if (thought >= 0 && doc.tokens[thought].type == JSON_STRING) {
+        ActionRecord* record = agent_history_add(agent, "thought");
+        if (record) record->thought = agent_arena_string(agent, &doc, thought);
     }
 
     // Check if complete
-    if (action && strcasecmp(action, "complete") == 0) {
+    if (has_action && strcasecmp(action, "complete") == 0) {
+        char* result = agent_arena_string(agent, &doc, json_object_get(&doc, 0, "result"));
         agent->state.is_complete = true;
-        agent->state.final_result = result_str ? strdup(result_str) : strdup(response);
-        free(json);
-        free(thought);
-        free(action);
-        if (result_str) free(result_str);
+        agent->state.final_result = result ? result : arena_strdup(&agent->state.arena, response);
         return;
     }
 
-    // Try to execute tool
-    if (action) {
-        AgentTool* tool = agent_find_tool(agent, action);
-        if (tool) {
-            agent->state.tool_calls++;
-
-            // Extract args (simplified - just pass the whole json)
-            char* tool_result = tool->handler(json, tool->user_data);
-
-            // Record tool call
-            if (agent->state.history_count < MAX_HISTORY) {
-                ActionRecord* record = &agent->state.history[agent->state.history_count];
-                record->step = agent->state.total_steps;
-                strcpy(record->action_type, "tool_call");
-                strncpy(record->tool_name, action, MAX_NAME_SIZE - 1);
-                record->tool_args = strdup(json);
-                record->tool_result = tool_result ? strdup(tool_result) : NULL;
-                agent->state.history_count++;
+    // One action at the top level, or a list of independent actions
+    int actions[MAX_TOOL_CALLS_PER_STEP];
+    int action_count = 0;
+    int list = parsed ? json_object_get(&doc, 0, "actions") : -1;
+    if (list >= 0 && doc.tokens[list].type == JSON_ARRAY) {
+        for (int item = json_first_child(&doc, list); item >= 0;
+             item = json_next_child(&doc, list, item)) {
+            if (action_count == MAX_TOOL_CALLS_PER_STEP) {
+                fprintf(stderr, "Step %d: only the first %d tool calls are run\n",
+                        agent->state.total_steps, MAX_TOOL_CALLS_PER_STEP);
+                break;
             }
+            actions[action_count++] = item;
+        }
+    } else if (has_action) {
+        actions[action_count++] = 0;
+    }
 
-            // Add to conversation
-            agent_add_message(agent, "assistant", response);
-
-            char tool_msg[MAX_INPUT_SIZE];
-            snprintf(tool_msg, sizeof(tool_msg), "Tool result: %s",
-                     tool_result ? tool_result : "No result");
-            agent_add_message(agent, "user", tool_msg);
-
-            free(tool_result);
+    // Try to execute tools
+    if (action_count > 0) {
+        char first[MAX_NAME_SIZE] = "";
+        json_get_string(&doc, actions[0], "action", first, sizeof(first));
+        if (action_count > 1 || agent_find_tool(agent, first)) {
+            agent_execute_tool_calls(agent, &doc, actions, action_count, response);
         } else {
             // Unknown action
             agent_add_message(agent, "assistant", response);
 
-            char unknown_msg[512];
-            char tool_list[256];
-            tool_list[0] = '\0';
+            StringBuilder unknown_msg = {0};
+            string_builder_appendf(&unknown_msg, "Unknown action: %s. Available tools: ", first);
             for (int i = 0; i < agent->tool_count; i++) {
-                if (i > 0) strcat(tool_list, ", ");
-                strcat(tool_list, agent->tools[i].name);
+                string_builder_appendf(&unknown_msg, "%s%s", i > 0 ? ", " : "",
+                                       agent->tools[i].name);
             }
-            snprintf(unknown_msg, sizeof(unknown_msg),
-                     "Unknown action: %s. Available tools: %s", action, tool_list);
-            agent_add_message(agent, "user", unknown_msg);
+            agent_add_message(agent, "user", unknown_msg.data);
+            string_builder_free(&unknown_msg);
         }
     } else {
         // Non-JSON response
@@ -417,23 +1170,76 @@ void agent_process_response(AutonomousAgent* agent, const char* response) {
             "Please respond with a JSON action or mark the task as complete.");
 
         // Record as text response
-        if (agent->state.history_count < MAX_HISTORY) {
-            ActionRecord* record = &agent->state.history[agent->state.history_count];
-            record->step = agent->state.total_steps;
-            strcpy(record->action_type, "text_response");
+        ActionRecord* record = agent_history_add(agent, "text_response");
+        if (record) {
             size_t len = strlen(response);
             if (len > 200) len = 200;
-            record->thought = (char*)malloc(len + 1);
-            strncpy(record->thought, response, len);
-            record->thought[len] = '\0';
-            agent->state.history_count++;
+            record->thought = arena_strndup(&agent->state.arena, response, len);
         }
     }
+}
+
+/**
+ * Size of a string's copy in a result block, 0 for NULL
+ */
+size_t agent_result_string_size(const char* str) {
+    return str ? strlen(str) + 1 : 0;
+}
+
+/**
+ * Copy a string to the result block's cursor
+ */
+char* agent_result_string(char** cursor, const char* str) {
+    if (!str) return NULL;
+    size_t size = strlen(str) + 1;
+    char* copy = (char*)memcpy(*cursor, str, size);
+    *cursor += size;
+    return copy;
+}
+
+/**
+ * Copy a run's state into a single block: the result, then its history
+ * records, then every string they point to
+ */
+AgentResult* agent_result_create(const AgentState* state) {
+    const char* final_result = state->final_result ? state->final_result
+        : state->budget_exhausted ? "Token budget exhausted before the task was completed"
+        : "Task not completed within step limit";
+
+    size_t size = sizeof(AgentResult) + (size_t)state->history_count * sizeof(ActionRecord);
+    size += agent_result_string_size(final_result);
+    for (int i = 0; i < state->history_count; i++) {
+        const ActionRecord* record = &state->history[i];
+        size += agent_result_string_size(record->tool_args);
+        size += agent_result_string_size(record->tool_result);
+        size += agent_result_string_size(record->thought);
+    }
 
-    free(json);
-    if (thought) free(thought);
-    if (action) free(action);
-    if (result_str) free(result_str);
+    AgentResult* result = (AgentResult*)malloc(size);
+    if (!result) {
+        fprintf(stderr, "Failed to allocate agent result\n");
+        return NULL;
+    }
+    result->success = state->is_complete;
+    result->total_steps = state->total_steps;
+    result->tool_calls = state->tool_calls;
+    result->usage = state->usage;
+    result->memo = state->memo;
+    result->compactions = state->compactions;
+    result->budget_exhausted = state->budget_exhausted;
+    result->history_count = state->history_count;
+    result->history = (ActionRecord*)(result + 1);
+
+    char* cursor = (char*)(result->history + state->history_count);
+    result->final_result = agent_result_string(&cursor, final_result);
+    for (int i = 0; i < state->history_count; i++) {
+        ActionRecord* record = &result->history[i];
+        *record = state->history[i];
+        record->tool_args = agent_result_string(&cursor, record->tool_args);
+        record->tool_result = agent_result_string(&cursor, record->tool_result);
+        record->thought = agent_result_string(&cursor, record->thought);
+    }
+    return result;
 }
 
 /**
@@ -441,6 +1247,10 @@ void agent_process_response(AutonomousAgent* agent, const char* response) {
  */
 typedef bool (*StopCondition)(const AgentState* state, void* user_data);
 
+AgentResult* agent_run_with_stop(AutonomousAgent* agent, const char* task,
+                                   int max_steps, StopCondition should_stop,
+                                   void* stop_user_data);
+
 /**
  * Run the agent
  */
@@ -454,22 +1264,26 @@ AgentResult* agent_run(AutonomousAgent* agent, const char* task, int max_steps)
 AgentResult* agent_run_with_stop(AutonomousAgent* agent, const char* task,
                                    int max_steps, StopCondition should_stop,
                                    void* stop_user_data) {
-    // Reset state
+    // Reset state; the previous run's strings go back to the arena
+    Arena arena = agent->state.arena;
+    arena_reset(&arena);
     memset(&agent->state, 0, sizeof(AgentState));
+    agent->state.arena = arena;
 
     // Clear conversation
-    for (int i = 0; i < agent->conversation_count; i++) {
-        free(agent->conversation[i].content);
-    }
-    agent->conversation_count = 0;
+    agent_conversation_clear(&agent->conversation);
 
     // Build system prompt
     char* system_prompt = agent_build_system_prompt(agent);
 
-    // Add initial message
-    char task_msg[MAX_INPUT_SIZE];
-    snprintf(task_msg, sizeof(task_msg), "Task: %s", task);
-    agent_add_message(agent, "user", task_msg);
+    // Steps and summaries are all sent from this thread
+    TokenBudget* previous_budget = transport_set_thread_budget(agent->budget);
+    MetricsSpan run_span;
+    metrics_span_begin(&run_span, "agent.run", NULL);
+    metrics_span_set_string(&run_span, "gen_ai.request.model", agent->model);
+
+    // The task is pinned so compaction never drops it
+    agent_conversation_pin_task(&agent->conversation, task);
 
     // Main loop
     while (agent->state.total_steps < max_steps && !agent->state.is_complete) {
@@ -479,56 +1293,96 @@ AgentResult* agent_run_with_stop(AutonomousAgent* agent, const char* task,
         if (should_stop && should_stop(&agent->state, stop_user_data)) {
             break;
         }
+        MetricsSpan step_span;
+        metrics_span_begin(&step_span, "agent.step", NULL);
+        metrics_span_set_int(&step_span, "agent.step", agent->state.total_steps);
+
+        // Fold in a finished summary; wait for one only when the prompt
+        // has grown to twice the budget
+        agent_compaction_finish(agent, agent_estimate_tokens(strlen(system_prompt)) +
+                                       agent_conversation_tokens(&agent->conversation) >
+                                       2 * agent->context_budget);
+
+        // The serialized conversation is kept up to date by every append;
+        // before the first reply the pinned task is the whole prompt
+        const char* prefix = agent_conversation_pinned(&agent->conversation);
+        const char* conv = agent_conversation_text(&agent->conversation);
+        if (!conv[0]) {
+            conv = prefix;
+            prefix = NULL;
+        }
 
-        // Build conversation
-        char* conv = agent_build_conversation(agent);
+        // Stop rather than send a step the budget would refuse
+        AnthropicRequest step = {.system_prompt = system_prompt, .cached_prefix = prefix,
+                                 .prompt = conv, .max_tokens = 2048};
+        if (token_budget_remaining(agent->budget) < anthropic_request_estimate_tokens(&step)) {
+            agent->state.budget_exhausted = true;
+            step_span.error = true;
+            metrics_span_end(&step_span);
+            break;
+        }
 
         // Get next action
-        char* response = call_anthropic_api(agent->api_key, agent->model,
-                                            conv, system_prompt, 2048);
+        char* response;
+        AnthropicUsage step_usage = {0};
+        AgentStream stream;
+        memset(&stream, 0, sizeof(AgentStream));
+        stream.agent = agent;
+        if (agent->streaming) {
+            response = call_anthropic_api_stream(agent->api_key, agent->model,
+                                                 prefix, conv, system_prompt, 2048,
+                                                 agent_stream_delta, &stream, &step_usage);
+            if (stream.dispatched) agent->prefetch = &stream;
+        } else {
+            response = call_anthropic_api(agent->api_key, agent->model,
+                                          prefix, conv, system_prompt, 2048, &step_usage);
+        }
 
-        free(conv);
+        anthropic_usage_add(&agent->state.usage, &step_usage);
 
         // Process response
-        agent_process_response(agent, response);
-        free(response);
+        if (response) {
+            agent_process_response(agent, response);
+            free(response);
+        } else {
+            fprintf(stderr, "Step %d: API call failed\n", agent->state.total_steps);
+            step_span.error = true;
+        }
+
+        // A prefetched call the response did not use
+        agent->prefetch = NULL;
+        if (stream.call) {
+            pthread_mutex_lock(&stream.call->lock);
+            agent_tool_call_unref(stream.call);
+        }
+        free(stream.tool_result);
+
+        // Summarize older steps in the background while the next one runs
+        agent_compaction_start(agent, system_prompt);
 
         // Mock: Complete after a few steps for demonstration
         if (agent->state.total_steps >= 3 && !agent->state.is_complete) {
             agent->state.is_complete = true;
-            agent->state.final_result = strdup("Task completed after gathering information.");
+            agent->state.final_result = arena_strdup(&agent->state.arena,
+                "Task completed after gathering information.");
         }
+        metrics_span_end(&step_span);
     }
 
+    agent_compaction_abandon(agent);
+    transport_set_thread_budget(previous_budget);
     free(system_prompt);
 
-    // Build result
-    AgentResult* result = (AgentResult*)calloc(1, sizeof(AgentResult));
-    result->success = agent->state.is_complete;
-    result->final_result = agent->state.final_result
-        ? strdup(agent->state.final_result)
-        : strdup("Task not completed within step limit");
-    result->total_steps = agent->state.total_steps;
-    result->tool_calls = agent->state.tool_calls;
-
-    // Copy history
-    result->history_count = agent->state.history_count;
-    result->history = (ActionRecord*)calloc(result->history_count, sizeof(ActionRecord));
-    for (int i = 0; i < result->history_count; i++) {
-        result->history[i] = agent->state.history[i];
-        // Note: shallow copy - strings point to agent's data
-    }
-
-    return result;
+    metrics_span_set_int(&run_span, "agent.steps", agent->state.total_steps);
+    metrics_span_set_int(&run_span, "agent.completed", agent->state.is_complete);
+    metrics_span_end(&run_span);
+    return agent_result_create(&agent->state);
 }
 
 /**
  * Free agent result
  */
 void agent_result_free(AgentResult* result) {
-    free(result->final_result);
-    // Note: history strings are owned by agent, don't free them here
-    free(result->history);
     free(result);
 }
 
@@ -536,24 +1390,26 @@ void agent_result_free(AgentResult* result) {
  * Free agent
  */
 void agent_free(AutonomousAgent* agent) {
+    // Timed-out tool calls may still be running against the tools
+    task_group_wait(thread_pool_default(), &agent->tool_jobs);
+    task_group_destroy(&agent->tool_jobs);
+    for (int i = 0; i < agent->tool_count; i++) {
+        ToolMemo* memo = agent->tools[i].memo;
+        if (!memo) continue;
+        response_cache_destroy(memo->cache);
+        pthread_mutex_destroy(&memo->lock);
+        free(memo);
+    }
+
     free(agent->api_key);
     free(agent->model);
+    free(agent->compaction_model);
 
     // Free conversation
-    for (int i = 0; i < agent->conversation_count; i++) {
-        free(agent->conversation[i].content);
-    }
-
-    // Free history
-    for (int i = 0; i < agent->state.history_count; i++) {
-        free(agent->state.history[i].tool_args);
-        free(agent->state.history[i].tool_result);
-        free(agent->state.history[i].thought);
-    }
+    agent_conversation_free(&agent->conversation);
 
-    if (agent->state.final_result) {
-        free(agent->state.final_result);
-    }
+    // History and the final result live in the run arena
+    arena_destroy(&agent->state.arena);
 
     free(agent);
 }
@@ -561,41 +1417,43 @@ void agent_free(AutonomousAgent* agent) {
 // Example tool handlers
 
 char* search_handler(const char* args_json, void* user_data) {
-    char* query = json_get_string(args_json, "query");
-    char* result = (char*)malloc(512);
-
-    snprintf(result, 512,
+    JsonToken tokens[16];
+    JsonDoc doc;
+    char query[256] = "unknown";
+    json_parse(&doc, args_json, strlen(args_json), tokens, 16);
+    json_get_string(&doc, 0, "query", query, sizeof(query));
+
+    char* result = (char*)malloc(1280);
+    snprintf(result, 1280,
         "Search results for '%s':\n"
         "1. Information about %s\n"
         "2. Related topic to %s\n"
         "3. More details on %s",
-        query ? query : "unknown",
-        query ? query : "unknown",
-        query ? query : "unknown",
-        query ? query : "unknown");
-
-    if (query) free(query);
+        query, query, query, query);
     return result;
 }
 
 char* read_url_handler(const char* args_json, void* user_data) {
-    char* url = json_get_string(args_json, "url");
-    char* result = (char*)malloc(256);
-
-    snprintf(result, 256, "Content from %s: [Mock content about the topic]",
-             url ? url : "unknown");
-
-    if (url) free(url);
+    JsonToken tokens[16];
+    JsonDoc doc;
+    char url[512] = "unknown";
+    json_parse(&doc, args_json, strlen(args_json), tokens, 16);
+    json_get_string(&doc, 0, "url", url, sizeof(url));
+
+    char* result = (char*)malloc(640);
+    snprintf(result, 640, "Content from %s: [Mock content about the topic]", url);
     return result;
 }
 
 char* save_note_handler(const char* args_json, void* user_data) {
-    char* title = json_get_string(args_json, "title");
-    char* result = (char*)malloc(128);
-
-    snprintf(result, 128, "Note saved: %s", title ? title : "Untitled");
-
-    if (title) free(title);
+    JsonToken tokens[16];
+    JsonDoc doc;
+    char title[128] = "Untitled";
+    json_parse(&doc, args_json, strlen(args_json), tokens, 16);
+    json_get_string(&doc, 0, "title", title, sizeof(title));
+
+    char* result = (char*)malloc(160);
+    snprintf(result, 160, "Note saved: %s", title);
     return result;
 }
 
@@ -606,10 +1464,22 @@ int main() {
         return 1;
     }
 
+    transport_set_mock_responder(mock_anthropic_api);
+
+    // AGENT_METRICS_PORT serves Prometheus metrics on loopback;
+    // AGENT_TRACE_FILE appends one OTLP/JSON line per finished span
+    metrics_init_from_env();
+
+    // Repeated prompts are served from cache; set AGENT_CACHE_FILE to keep
+    // answers across runs
+    ResponseCache* cache = transport_enable_cache(transport_default(), 256, 3600,
+                                                  getenv("AGENT_CACHE_FILE"));
+
     printf("=== Autonomous Agent ===\n\n");
 
     // Create agent
     AutonomousAgent* agent = agent_create(api_key, NULL);
+    agent_set_streaming(agent, NULL, NULL);
 
     // Register tools
     agent_register_tool(agent, "search",
@@ -625,6 +1495,9 @@ int main() {
     agent_add_tool_param(agent, "title", "string", "Note title", true);
     agent_add_tool_param(agent, "content", "string", "Note content", true);
 
+    // Searches are deterministic here; repeats within an hour are free
+    agent_enable_tool_memo(agent, "search", 128, 3600, NULL);
+
     // Run agent
     AgentResult* result = agent_run(agent,
         "Research the current state of quantum computing", 10);
@@ -633,6 +1506,13 @@ int main() {
     printf("\nSuccess: %s\n", result->success ? "yes" : "no");
     printf("Steps: %d\n", result->total_steps);
     printf("Tool Calls: %d\n", result->tool_calls);
+    printf("Tokens: %d input, %d output, %d cache write, %d cache read\n",
+           result->usage.input_tokens, result->usage.output_tokens,
+           result->usage.cache_creation_input_tokens, result->usage.cache_read_input_tokens);
+
+    printf("Tool memo: %d hits, %d misses, %d joined\n",
+           result->memo.hits, result->memo.misses, result->memo.joined);
+    printf("Context compactions: %d\n", result->compactions);
 
     printf("\nAction History:\n");
     for (int i = 0; i < result->history_count; i++) {
@@ -657,5 +1537,11 @@ int main() {
     agent_result_free(result);
     agent_free(agent);
 
+    metrics_print_summary(stdout);
+    response_cache_print_stats(cache, stdout);
+    transport_set_cache(transport_default(), NULL);
+    response_cache_destroy(cache);
+    metrics_shutdown();
+
     return 0;
 }
@@ -2,11 +2,13 @@
  * Evaluator-Optimizer Pattern Implementation for C
  * Iterative refinement through evaluation and feedback loops
  *
- * Note: This is a simplified example. In production, use libcurl
- * for HTTP and cJSON for JSON parsing.
+ * Note: This is a simplified example. API calls go through the shared
+ * transport in anthropic_transport.h. In production, use cJSON for JSON
+ * parsing.
  *
  * Compile with:
- * gcc -o evaluator_optimizer evaluator_optimizer.c -lcurl -ljson-c -lm
+ * gcc -o evaluator_optimizer evaluator_optimizer.c -pthread -DAGENT_TRANSPORT_CURL -lcurl -ljson-c -lm
+ * (drop -DAGENT_TRANSPORT_CURL -lcurl to run against the mock responder)
  */
 
 #include <stdio.h>
@@ -14,13 +16,18 @@
 #include <string.h>
 #include <stdbool.h>
 #include <math.h>
+#include <pthread.h>
+
+#include "anthropic_transport.h"
+#include "message_batches.h"
+#include "string_builder.h"
 
 // Maximum sizes
 #define MAX_CRITERIA 20
 #define MAX_SUGGESTIONS 10
 #define MAX_ITERATIONS 10
 #define MAX_NAME_SIZE 64
-#define MAX_INPUT_SIZE 4096
+#define EVALUATE_PROMPT_PARTS 4
 #define MAX_OUTPUT_SIZE 16384
 
 /**
@@ -39,6 +46,8 @@ typedef struct CriterionScore {
     char criterion[MAX_NAME_SIZE];
     double score;
     char feedback[512];
+    char evidence[256];  // Passage the score rests on (per-criterion mode)
+    bool reused;         // Carried over from the previous revision
 } CriterionScore;
 
 /**
@@ -51,6 +60,7 @@ typedef struct EvaluationResult {
     char overall_feedback[1024];
     char* suggestions[MAX_SUGGESTIONS];
     int suggestion_count;
+    int reused_count;  // Criteria not re-scored
 } EvaluationResult;
 
 /**
@@ -60,6 +70,7 @@ typedef struct OptimizationIteration {
     int iteration;
     char* content;
     EvaluationResult* evaluation;
+    AnthropicUsage usage;  // Evaluation plus the generation that follows it
 } OptimizationIteration;
 
 /**
@@ -72,8 +83,17 @@ typedef struct OptimizationResult {
     int history_count;
     bool converged;
     double final_score;
+    AnthropicUsage usage;
 } OptimizationResult;
 
+/**
+ * How evaluator_evaluate_all sends its requests
+ */
+typedef enum {
+    EVALUATOR_BACKEND_MESSAGES,      // Concurrent Messages API calls
+    EVALUATOR_BACKEND_MESSAGE_BATCH  // One offline Message Batches job
+} EvaluatorBackend;
+
 /**
  * Evaluator-Optimizer configuration
  */
@@ -84,27 +104,83 @@ typedef struct EvaluatorOptimizer {
     int criteria_count;
     double target_score;
     int max_iterations;
+    // Rubric prefixes, built once and sent as prompt-cached blocks
+    char* generate_rubric;
+    char* evaluate_rubric;
+    AnthropicUsage usage;  // Summed over every call
+    EvaluatorBackend backend;
+    // Beam mode: candidates generated per round and survivors kept
+    // between rounds; 1 and 1 runs the serial loop
+    int beam_candidates;
+    int beam_width;
+    // Per-criterion mode: one concurrent request per criterion on
+    // criterion_model, each with its own cached rubric
+    bool per_criterion;
+    char* criterion_model;
+    char* criterion_rubrics[MAX_CRITERIA];
+    TokenBudget* budget;  // Not owned; NULL leaves generation and scoring unlimited
 } EvaluatorOptimizer;
 
 /**
- * Simplified API call
+ * Mock responder used when the transport is built without libcurl
  */
-char* call_anthropic_api(const char* api_key, const char* model,
-                         const char* prompt, int max_tokens) {
-    printf("API Call (mock) - Model: %s\n", model);
+char* mock_anthropic_api(const AnthropicRequest* request) {
+    printf("API Call (mock) - Model: %s\n", request->model);
     char* response = (char*)malloc(MAX_OUTPUT_SIZE);
-    snprintf(response, MAX_OUTPUT_SIZE,
-        "{\n"
-        "  \"criteria_scores\": [\n"
-        "    {\"criterion\": \"accuracy\", \"score\": 0.85, \"feedback\": \"Good accuracy\"},\n"
-        "    {\"criterion\": \"clarity\", \"score\": 0.80, \"feedback\": \"Could be clearer\"}\n"
-        "  ],\n"
-        "  \"overall_feedback\": \"Good overall with room for improvement\",\n"
-        "  \"suggestions\": [\"Add more examples\", \"Improve structure\"]\n"
-        "}");
+
+    if (request->cached_prefix && strstr(request->cached_prefix, "single criterion")) {
+        // Clarity quotes the opening, which every revision rewrites;
+        // accuracy quotes a sentence revisions keep
+        const char* content = strstr(request->prompt, "Content to evaluate:\n");
+        content = content ? content + strlen("Content to evaluate:\n") : "";
+        char evidence[64] = "";
+        if (strstr(request->cached_prefix, "Criterion: clarity")) {
+            snprintf(evidence, sizeof(evidence), "%.9s", content);
+        } else if (strstr(request->cached_prefix, "Criterion: accuracy")) {
+            snprintf(evidence, sizeof(evidence), "maps keys to buckets");
+        }
+        snprintf(response, MAX_OUTPUT_SIZE,
+            "{\"score\": %.2f, \"feedback\": \"Scored on its own\", "
+            "\"evidence\": \"%s\", \"suggestions\": [\"Tighten the wording\"]}",
+            0.75 + (double)(rand() % 20) / 100.0, evidence);
+    } else if (request->cached_prefix && strstr(request->cached_prefix, "Evaluate")) {
+        snprintf(response, MAX_OUTPUT_SIZE,
+            "{\n"
+            "  \"criteria_scores\": [\n"
+            "    {\"criterion\": \"accuracy\", \"score\": %.2f, \"feedback\": \"Good accuracy\"},\n"
+            "    {\"criterion\": \"clarity\", \"score\": %.2f, \"feedback\": \"Could be clearer\"},\n"
+            "    {\"criterion\": \"completeness\", \"score\": %.2f, \"feedback\": \"Covers the \\\"big picture\\\"\"}\n"
+            "  ],\n"
+            "  \"overall_feedback\": \"Good overall with room for improvement\",\n"
+            "  \"suggestions\": [\"Add more examples\", \"Improve structure\"]\n"
+            "}",
+            0.75 + (double)(rand() % 20) / 100.0,
+            0.75 + (double)(rand() % 20) / 100.0,
+            0.75 + (double)(rand() % 20) / 100.0);
+    } else if (strstr(request->prompt, "confidence")) {
+        snprintf(response, MAX_OUTPUT_SIZE,
+            "{\"answer\": \"This is the answer based on the analysis.\", "
+            "\"confidence\": %.2f, "
+            "\"reasoning\": \"Based on careful analysis of the problem.\"}",
+            0.85 + (double)(rand() % 15) / 100.0);
+    } else {
+        snprintf(response, MAX_OUTPUT_SIZE,
+            "Draft %d: A hash table maps keys to buckets with a hash function and "
+            "resolves collisions by chaining or open addressing.", rand() % 1000);
+    }
     return response;
 }
 
+/**
+ * Blocking API call through the shared transport
+ */
+char* call_anthropic_api(const char* api_key, const char* model,
+                         const char* prompt, int max_tokens) {
+    AnthropicRequest request = {.api_key = api_key, .model = model, .prompt = prompt,
+                                .max_tokens = max_tokens};
+    return transport_call(transport_default(), &request, NULL);
+}
+
 /**
  * Create evaluator-optimizer
  */
@@ -116,6 +192,10 @@ EvaluatorOptimizer* evaluator_create(const char* api_key) {
     e->criteria_count = 0;
     e->target_score = 0.8;
     e->max_iterations = 5;
+    e->backend = EVALUATOR_BACKEND_MESSAGES;
+    e->beam_candidates = 1;
+    e->beam_width = 1;
+    e->criterion_model = strdup("claude-3-haiku-20240307");
     return e;
 }
 
@@ -132,9 +212,85 @@ bool evaluator_add_criterion(EvaluatorOptimizer* e, const char* name,
     c->weight = weight;
     e->criteria_count++;
 
+    // Rebuilt with the new criterion on the next call
+    free(e->generate_rubric);
+    free(e->evaluate_rubric);
+    e->generate_rubric = NULL;
+    e->evaluate_rubric = NULL;
+
     return true;
 }
 
+/**
+ * Criteria block shared by every generation prompt
+ */
+const char* evaluator_generate_rubric(EvaluatorOptimizer* e) {
+    if (e->generate_rubric) return e->generate_rubric;
+
+    StringBuilder rubric = {0};
+    string_builder_append_str(&rubric, "Criteria to consider:\n");
+    for (int i = 0; i < e->criteria_count; i++) {
+        string_builder_appendf(&rubric, "- %s: %s\n", e->criteria[i].name,
+                               e->criteria[i].description);
+    }
+    e->generate_rubric = string_builder_take(&rubric);
+    return e->generate_rubric;
+}
+
+/**
+ * Criteria and response format shared by every evaluation prompt
+ */
+const char* evaluator_evaluate_rubric(EvaluatorOptimizer* e) {
+    if (e->evaluate_rubric) return e->evaluate_rubric;
+
+    StringBuilder rubric = {0};
+    string_builder_append_str(&rubric,
+        "Evaluate content against the criteria below.\n\nCriteria:\n");
+    for (int i = 0; i < e->criteria_count; i++) {
+        string_builder_appendf(&rubric, "%s (weight: %.1f): %s\n", e->criteria[i].name,
+                               e->criteria[i].weight, e->criteria[i].description);
+    }
+    string_builder_append_str(&rubric,
+        "\nRespond in JSON format:\n"
+        "{\n"
+        "  \"criteria_scores\": [{\"criterion\": \"name\", \"score\": 0.0-1.0, \"feedback\": \"...\"}],\n"
+        "  \"overall_feedback\": \"...\",\n"
+        "  \"suggestions\": [\"...\"]\n"
+        "}");
+    e->evaluate_rubric = string_builder_take(&rubric);
+    return e->evaluate_rubric;
+}
+
+/**
+ * Rubric for scoring one criterion on its own
+ */
+const char* evaluator_criterion_rubric(EvaluatorOptimizer* e, int index) {
+    if (e->criterion_rubrics[index]) return e->criterion_rubrics[index];
+
+    StringBuilder rubric = {0};
+    string_builder_appendf(&rubric,
+        "Score the content on a single criterion.\n\n"
+        "Criterion: %s: %s\n\n"
+        "Respond in JSON format:\n"
+        "{\"score\": 0.0-1.0, \"feedback\": \"...\", "
+        "\"evidence\": \"short verbatim quote the score rests on\", \"suggestions\": [\"...\"]}",
+        e->criteria[index].name, e->criteria[index].description);
+    e->criterion_rubrics[index] = string_builder_take(&rubric);
+    return e->criterion_rubrics[index];
+}
+
+/**
+ * Build every rubric up front so requests submitted from transport
+ * callbacks only read them
+ */
+void evaluator_prepare_rubrics(EvaluatorOptimizer* e) {
+    evaluator_generate_rubric(e);
+    evaluator_evaluate_rubric(e);
+    for (int i = 0; i < e->criteria_count; i++) {
+        evaluator_criterion_rubric(e, i);
+    }
+}
+
 /**
  * Set target score
  */
@@ -150,101 +306,436 @@ void evaluator_set_max_iterations(EvaluatorOptimizer* e, int max) {
 }
 
 /**
- * Parse evaluation JSON (simplified)
+ * Generate `candidates` drafts per round in parallel and keep the best
+ * `width` between rounds. candidates <= 1 restores the serial loop.
  */
-EvaluationResult* parse_evaluation(const char* json, EvaluatorOptimizer* e) {
+void evaluator_set_beam(EvaluatorOptimizer* e, int candidates, int width) {
+    e->beam_candidates = candidates > 1 ? candidates : 1;
+    e->beam_width = width < 1 ? 1 : width > e->beam_candidates ? e->beam_candidates : width;
+}
+
+/**
+ * Charge every generation and evaluation to a token budget (NULL removes
+ * it). Beam rounds generate only as many candidates as it can still pay
+ * for, and the loop stops once not even one fits. The serial loop stops
+ * at the first generation the budget refuses and keeps the last draft.
+ */
+void evaluator_set_budget(EvaluatorOptimizer* e, TokenBudget* budget) {
+    e->budget = budget;
+}
+
+/**
+ * Score each criterion with its own request on model (NULL keeps the
+ * current criterion model). A revision re-scores only the criteria below
+ * target_score and those whose quoted evidence the revision changed.
+ */
+void evaluator_set_per_criterion(EvaluatorOptimizer* e, bool enabled, const char* model) {
+    e->per_criterion = enabled;
+    if (model) {
+        free(e->criterion_model);
+        e->criterion_model = strdup(model);
+    }
+}
+
+/**
+ * Empty result with every configured criterion unscored
+ */
+EvaluationResult* evaluation_result_create(const EvaluatorOptimizer* e) {
     EvaluationResult* result = (EvaluationResult*)calloc(1, sizeof(EvaluationResult));
     result->criteria_scores = (CriterionScore*)calloc(MAX_CRITERIA, sizeof(CriterionScore));
-
-    // Simplified parsing - use cJSON in production
-    // This mock implementation creates scores based on criteria
     result->criteria_count = e->criteria_count;
 
-    double total_weight = 0;
-    double weighted_sum = 0;
-
     for (int i = 0; i < e->criteria_count; i++) {
         strncpy(result->criteria_scores[i].criterion, e->criteria[i].name, MAX_NAME_SIZE - 1);
-        result->criteria_scores[i].score = 0.75 + ((double)(rand() % 20) / 100.0);  // 0.75-0.95
-        snprintf(result->criteria_scores[i].feedback, 512, "Feedback for %s", e->criteria[i].name);
+        snprintf(result->criteria_scores[i].feedback, 512, "Not scored by the evaluator");
+    }
+    return result;
+}
 
+/**
+ * Weighted mean of the criterion scores
+ */
+void evaluation_result_score(EvaluationResult* result, const EvaluatorOptimizer* e) {
+    double total_weight = 0;
+    double weighted_sum = 0;
+    for (int i = 0; i < e->criteria_count; i++) {
         total_weight += e->criteria[i].weight;
         weighted_sum += result->criteria_scores[i].score * e->criteria[i].weight;
     }
-
     result->overall_score = total_weight > 0 ? weighted_sum / total_weight : 0;
-    strcpy(result->overall_feedback, "Overall good with areas for improvement");
+}
+
+/**
+ * Parse evaluation JSON. Scores come back in any order and are matched to
+ * the configured criteria by name; a criterion the reply skipped scores 0.
+ */
+EvaluationResult* parse_evaluation(const char* json, EvaluatorOptimizer* e) {
+    EvaluationResult* result = evaluation_result_create(e);
+
+    JsonToken tokens[JSON_DEFAULT_TOKENS];
+    JsonDoc doc;
+    uint64_t parse_started = metrics_now_ns();
+    JsonStatus status = json_parse_embedded(&doc, json, tokens, JSON_DEFAULT_TOKENS);
+    metrics_observe_since(METRIC_PARSE_TIME, parse_started);
+    if (status != JSON_OK) {
+        fprintf(stderr, "Evaluation response is not valid JSON\n");
+        strcpy(result->overall_feedback, "Evaluation response could not be parsed");
+        return result;
+    }
+
+    int scores = json_object_get(&doc, 0, "criteria_scores");
+    for (int item = json_first_child(&doc, scores); item >= 0;
+         item = json_next_child(&doc, scores, item)) {
+        int name = json_object_get(&doc, item, "criterion");
+        for (int i = 0; i < e->criteria_count; i++) {
+            if (!json_string_equals(&doc, name, e->criteria[i].name)) continue;
+            CriterionScore* score = &result->criteria_scores[i];
+            score->score = json_number(&doc, json_object_get(&doc, item, "score"), 0);
+            if (score->score < 0) score->score = 0;
+            if (score->score > 1) score->score = 1;
+            json_get_string(&doc, item, "feedback", score->feedback, sizeof(score->feedback));
+            break;
+        }
+    }
 
-    result->suggestions[0] = strdup("Add more detail");
-    result->suggestions[1] = strdup("Improve examples");
-    result->suggestion_count = 2;
+    evaluation_result_score(result, e);
+
+    json_get_string(&doc, 0, "overall_feedback", result->overall_feedback,
+                    sizeof(result->overall_feedback));
+
+    int suggestions = json_object_get(&doc, 0, "suggestions");
+    for (int item = json_first_child(&doc, suggestions);
+         item >= 0 && result->suggestion_count < MAX_SUGGESTIONS;
+         item = json_next_child(&doc, suggestions, item)) {
+        char* suggestion = json_string_dup(&doc, item);
+        if (suggestion) result->suggestions[result->suggestion_count++] = suggestion;
+    }
 
     return result;
 }
 
+/**
+ * Free evaluation result
+ */
+void evaluation_result_free(EvaluationResult* result) {
+    free(result->criteria_scores);
+    for (int i = 0; i < result->suggestion_count; i++) {
+        free(result->suggestions[i]);
+    }
+    free(result);
+}
+
+/**
+ * Build the request that generates initial or improved content into
+ * prompt, which must outlive the submit. Beam mode passes previous_content
+ * so each candidate improves its own parent.
+ */
+void evaluator_generate_request(EvaluatorOptimizer* e, const char* task,
+                                const EvaluationResult* previous_eval,
+                                const char* previous_content, StringBuilder* prompt,
+                                AnthropicRequest* request) {
+    // The criteria go first, in a cached block, so every generation call
+    // after the first reads them from the prompt cache
+    if (previous_eval == NULL) {
+        string_builder_appendf(prompt, "Complete this task:\n%s", task);
+    } else {
+        string_builder_appendf(prompt,
+            "Improve your previous response based on this feedback:\n\n"
+            "Original task: %s\n\n", task);
+        if (previous_content) {
+            string_builder_appendf(prompt, "Previous response:\n%s\n\n", previous_content);
+        }
+        string_builder_appendf(prompt,
+            "Previous evaluation:\n"
+            "- Overall score: %.0f%%\n"
+            "- Feedback: %s\n\n"
+            "Specific improvements needed:\n",
+            previous_eval->overall_score * 100, previous_eval->overall_feedback);
+        for (int i = 0; i < previous_eval->suggestion_count; i++) {
+            string_builder_appendf(prompt, "- %s\n", previous_eval->suggestions[i]);
+        }
+        string_builder_append_str(prompt, "\nCriteria scores:\n");
+        for (int i = 0; i < previous_eval->criteria_count; i++) {
+            string_builder_appendf(prompt, "- %s: %.0f%% - %s\n",
+                                   previous_eval->criteria_scores[i].criterion,
+                                   previous_eval->criteria_scores[i].score * 100,
+                                   previous_eval->criteria_scores[i].feedback);
+        }
+        string_builder_append_str(prompt,
+            "\nGenerate an improved version addressing all feedback:");
+    }
+
+    *request = (AnthropicRequest){.api_key = e->api_key, .model = e->model,
+                                  .prompt = string_builder_cstr(prompt), .max_tokens = 4096,
+                                  .cached_prefix = evaluator_generate_rubric(e),
+                                  .budget = e->budget};
+}
+
 /**
  * Generate initial or improved content
  */
 char* evaluator_generate(EvaluatorOptimizer* e, const char* task,
                           EvaluationResult* previous_eval) {
-    char prompt[MAX_INPUT_SIZE];
+    StringBuilder prompt = {0};
+    AnthropicRequest request;
+    evaluator_generate_request(e, task, previous_eval, NULL, &prompt, &request);
+
+    TransportFuture* future = transport_submit(transport_default(), &request, NULL, NULL);
+    AnthropicResponse* response = transport_future_wait(future);
+    string_builder_free(&prompt);
+    anthropic_usage_add(&e->usage, &response->usage);
+    char* content = response->text;
+    response->text = NULL;
+    if (!content) {
+        fprintf(stderr, "Generation failed: %s\n", response->error ? response->error : "no text");
+    }
+    transport_future_release(future);
+    return content;
+}
 
-    if (previous_eval == NULL) {
-        // Build criteria list
-        char criteria_list[2048];
-        criteria_list[0] = '\0';
+/**
+ * Build the evaluation request for one piece of content; the rubric goes
+ * in the cached prefix. The prompt is scattered over parts, which point at
+ * task and content rather than copying them, until the submit.
+ */
+void evaluator_evaluate_request(EvaluatorOptimizer* e, const char* task, const char* content,
+                                struct iovec parts[EVALUATE_PROMPT_PARTS],
+                                AnthropicRequest* request) {
+    static const char task_label[] = "Task: ";
+    static const char content_label[] = "\n\nContent to evaluate:\n";
+    parts[0] = (struct iovec){(void*)task_label, sizeof(task_label) - 1};
+    parts[1] = (struct iovec){(void*)task, strlen(task)};
+    parts[2] = (struct iovec){(void*)content_label, sizeof(content_label) - 1};
+    parts[3] = (struct iovec){(void*)content, content ? strlen(content) : 0};
+    *request = (AnthropicRequest){.api_key = e->api_key, .model = e->model,
+                                  .prompt_iov = parts, .prompt_iovcnt = EVALUATE_PROMPT_PARTS,
+                                  .max_tokens = 2048,
+                                  .cached_prefix = evaluator_evaluate_rubric(e),
+                                  .budget = e->budget};
+}
 
-        for (int i = 0; i < e->criteria_count; i++) {
-            char line[256];
-            snprintf(line, sizeof(line), "- %s: %s\n",
-                     e->criteria[i].name, e->criteria[i].description);
-            strcat(criteria_list, line);
+/**
+ * Evaluation completion callback; takes ownership of result. Runs on the
+ * transport thread, or inline when nothing had to be sent.
+ */
+typedef void (*EvaluationCallback)(EvaluationResult* result, const AnthropicUsage* usage,
+                                   void* user_data);
+
+struct PendingEvaluation;
+
+/**
+ * One criterion request of a per-criterion evaluation
+ */
+typedef struct CriterionRequest {
+    struct PendingEvaluation* evaluation;
+    int index;
+} CriterionRequest;
+
+/**
+ * Evaluation whose requests are in flight
+ */
+typedef struct PendingEvaluation {
+    EvaluatorOptimizer* e;
+    EvaluationResult* result;
+    int pending;  // Requests in flight plus one held by the submitter
+    AnthropicUsage usage;
+    pthread_mutex_t lock;
+    CriterionRequest criteria[MAX_CRITERIA];
+    EvaluationCallback callback;
+    void* user_data;
+} PendingEvaluation;
+
+/**
+ * Drop one outstanding request; the last one hands over the result
+ */
+void pending_evaluation_settle(PendingEvaluation* p, const AnthropicUsage* usage) {
+    pthread_mutex_lock(&p->lock);
+    if (usage) anthropic_usage_add(&p->usage, usage);
+    bool last = --p->pending == 0;
+    pthread_mutex_unlock(&p->lock);
+    if (!last) return;
+
+    if (p->e->per_criterion) {
+        EvaluationResult* result = p->result;
+        evaluation_result_score(result, p->e);
+        int below = 0;
+        for (int i = 0; i < result->criteria_count; i++) {
+            if (result->criteria_scores[i].score < p->e->target_score) below++;
         }
+        snprintf(result->overall_feedback, sizeof(result->overall_feedback),
+                 "%d of %d criteria below target (%d carried over unchanged)",
+                 below, result->criteria_count, result->reused_count);
+    }
+    p->callback(p->result, &p->usage, p->user_data);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
 
-        snprintf(prompt, sizeof(prompt),
-            "Complete this task:\n%s\n\n"
-            "Criteria to consider:\n%s",
-            task, criteria_list);
-    } else {
-        // Build feedback from previous evaluation
-        char scores_text[2048];
-        scores_text[0] = '\0';
+/**
+ * Whole-rubric evaluation finished
+ */
+void pending_evaluation_done(AnthropicResponse* response, void* user_data) {
+    PendingEvaluation* p = (PendingEvaluation*)user_data;
+    p->result = parse_evaluation(response->text, p->e);
+    pending_evaluation_settle(p, &response->usage);
+}
 
-        for (int i = 0; i < previous_eval->criteria_count; i++) {
-            char line[256];
-            snprintf(line, sizeof(line), "- %s: %.0f%% - %s\n",
-                     previous_eval->criteria_scores[i].criterion,
-                     previous_eval->criteria_scores[i].score * 100,
-                     previous_eval->criteria_scores[i].feedback);
-            strcat(scores_text, line);
+/**
+ * One criterion scored; criteria finish in any order
+ */
+void pending_criterion_done(AnthropicResponse* response, void* user_data) {
+    CriterionRequest* request = (CriterionRequest*)user_data;
+    PendingEvaluation* p = request->evaluation;
+    CriterionScore* score = &p->result->criteria_scores[request->index];
+
+    JsonToken tokens[32];
+    JsonDoc doc;
+    if (json_parse_embedded(&doc, response->text, tokens, 32) == JSON_OK) {
+        score->score = json_number(&doc, json_object_get(&doc, 0, "score"), 0);
+        if (score->score < 0) score->score = 0;
+        if (score->score > 1) score->score = 1;
+        json_get_string(&doc, 0, "feedback", score->feedback, sizeof(score->feedback));
+        json_get_string(&doc, 0, "evidence", score->evidence, sizeof(score->evidence));
+
+        int suggestions = json_object_get(&doc, 0, "suggestions");
+        pthread_mutex_lock(&p->lock);
+        for (int item = json_first_child(&doc, suggestions);
+             item >= 0 && p->result->suggestion_count < MAX_SUGGESTIONS;
+             item = json_next_child(&doc, suggestions, item)) {
+            char* suggestion = json_string_dup(&doc, item);
+            if (suggestion) p->result->suggestions[p->result->suggestion_count++] = suggestion;
         }
+        pthread_mutex_unlock(&p->lock);
+    } else {
+        fprintf(stderr, "Score for %s is not valid JSON\n", score->criterion);
+    }
+    pending_evaluation_settle(p, &response->usage);
+}
 
-        char suggestions_text[1024];
-        suggestions_text[0] = '\0';
+/**
+ * Whether a revision must re-score a criterion. A passing score survives
+ * as long as the passage it quoted is still in the content verbatim; with
+ * no quote, any change counts.
+ */
+bool criterion_needs_rescore(const EvaluatorOptimizer* e, const CriterionScore* previous,
+                             const char* content, const char* previous_content) {
+    if (!previous || !previous_content || !content) return true;
+    if (previous->score < e->target_score) return true;
+    if (strcmp(content, previous_content) == 0) return false;
+    if (!previous->evidence[0]) return true;
+    return strstr(content, previous->evidence) == NULL;
+}
 
-        for (int i = 0; i < previous_eval->suggestion_count; i++) {
-            char line[256];
-            snprintf(line, sizeof(line), "- %s\n", previous_eval->suggestions[i]);
-            strcat(suggestions_text, line);
+/**
+ * Start evaluating content; callback receives the result. previous_content
+ * and previous_eval (both optional) describe the revision the content came
+ * from, for incremental per-criterion scoring. Rubrics are built on first
+ * use, so call evaluator_prepare_rubrics before submitting from a callback.
+ */
+void evaluator_submit_evaluation(EvaluatorOptimizer* e, const char* task, const char* content,
+                                 const char* previous_content,
+                                 const EvaluationResult* previous_eval,
+                                 EvaluationCallback callback, void* user_data) {
+    PendingEvaluation* p = (PendingEvaluation*)calloc(1, sizeof(PendingEvaluation));
+    p->e = e;
+    p->pending = 1;
+    p->callback = callback;
+    p->user_data = user_data;
+    pthread_mutex_init(&p->lock, NULL);
+
+    // The transport copies each request on submit, so one set of prompt
+    // parts serves them all
+    struct iovec parts[EVALUATE_PROMPT_PARTS];
+    AnthropicRequest request;
+    evaluator_evaluate_request(e, task, content, parts, &request);
+
+    if (!e->per_criterion) {
+        p->pending++;
+        transport_future_release(transport_submit(transport_default(), &request,
+                                                  pending_evaluation_done, p));
+        pending_evaluation_settle(p, NULL);
+        return;
+    }
+
+    p->result = evaluation_result_create(e);
+    request.model = e->criterion_model;
+    request.max_tokens = 512;
+    for (int i = 0; i < e->criteria_count; i++) {
+        const CriterionScore* previous =
+            previous_eval && i < previous_eval->criteria_count ? &previous_eval->criteria_scores[i]
+                                                               : NULL;
+        if (!criterion_needs_rescore(e, previous, content, previous_content)) {
+            p->result->criteria_scores[i] = *previous;
+            p->result->criteria_scores[i].reused = true;
+            p->result->reused_count++;
+            continue;
         }
+        p->criteria[i] = (CriterionRequest){.evaluation = p, .index = i};
+        request.cached_prefix = evaluator_criterion_rubric(e, i);
+        pthread_mutex_lock(&p->lock);
+        p->pending++;
+        pthread_mutex_unlock(&p->lock);
+        transport_future_release(transport_submit(transport_default(), &request,
+                                                  pending_criterion_done, &p->criteria[i]));
+    }
+    pending_evaluation_settle(p, NULL);
+}
 
-        snprintf(prompt, sizeof(prompt),
-            "Improve your previous response based on this feedback:\n\n"
-            "Original task: %s\n\n"
-            "Previous evaluation:\n"
-            "- Overall score: %.0f%%\n"
-            "- Feedback: %s\n\n"
-            "Specific improvements needed:\n%s\n"
-            "Criteria scores:\n%s\n"
-            "Generate an improved version addressing all feedback:",
-            task,
-            previous_eval->overall_score * 100,
-            previous_eval->overall_feedback,
-            suggestions_text,
-            scores_text);
+/**
+ * Blocking wait for one submitted evaluation
+ */
+typedef struct EvaluationWait {
+    EvaluationResult* result;
+    AnthropicUsage usage;
+    bool done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} EvaluationWait;
+
+void evaluation_wait_done(EvaluationResult* result, const AnthropicUsage* usage,
+                          void* user_data) {
+    EvaluationWait* wait = (EvaluationWait*)user_data;
+    pthread_mutex_lock(&wait->lock);
+    wait->result = result;
+    wait->usage = *usage;
+    wait->done = true;
+    pthread_cond_signal(&wait->cond);
+    pthread_mutex_unlock(&wait->lock);
+}
+
+void evaluation_wait_init(EvaluationWait* wait) {
+    *wait = (EvaluationWait){0};
+    pthread_mutex_init(&wait->lock, NULL);
+    pthread_cond_init(&wait->cond, NULL);
+}
+
+/**
+ * Wait for the result and add its usage to the evaluator's total
+ */
+EvaluationResult* evaluation_wait_take(EvaluatorOptimizer* e, EvaluationWait* wait) {
+    pthread_mutex_lock(&wait->lock);
+    while (!wait->done) {
+        pthread_cond_wait(&wait->cond, &wait->lock);
     }
+    pthread_mutex_unlock(&wait->lock);
+    pthread_mutex_destroy(&wait->lock);
+    pthread_cond_destroy(&wait->cond);
+    anthropic_usage_add(&e->usage, &wait->usage);
+    return wait->result;
+}
 
-    return call_anthropic_api(e->api_key, e->model, prompt, 4096);
+/**
+ * Evaluate a revision of previous_content, re-scoring only what changed
+ * in per-criterion mode
+ */
+EvaluationResult* evaluator_evaluate_revision(EvaluatorOptimizer* e, const char* task,
+                                              const char* content, const char* previous_content,
+                                              const EvaluationResult* previous_eval) {
+    EvaluationWait wait;
+    evaluation_wait_init(&wait);
+    evaluator_submit_evaluation(e, task, content, previous_content, previous_eval,
+                                evaluation_wait_done, &wait);
+    return evaluation_wait_take(e, &wait);
 }
 
 /**
@@ -252,36 +743,293 @@ char* evaluator_generate(EvaluatorOptimizer* e, const char* task,
  */
 EvaluationResult* evaluator_evaluate(EvaluatorOptimizer* e, const char* task,
                                       const char* content) {
-    // Build criteria list
-    char criteria_list[2048];
-    criteria_list[0] = '\0';
+    return evaluator_evaluate_revision(e, task, content, NULL, NULL);
+}
 
-    for (int i = 0; i < e->criteria_count; i++) {
-        char line[256];
-        snprintf(line, sizeof(line), "%s (weight: %.1f): %s\n",
-                 e->criteria[i].name, e->criteria[i].weight,
-                 e->criteria[i].description);
-        strcat(criteria_list, line);
-    }
-
-    char prompt[MAX_INPUT_SIZE];
-    snprintf(prompt, sizeof(prompt),
-        "Evaluate this content against the criteria below.\n\n"
-        "Task: %s\n\n"
-        "Content to evaluate:\n%s\n\n"
-        "Criteria:\n%s\n\n"
-        "Respond in JSON format:\n"
-        "{\n"
-        "  \"criteria_scores\": [{\"criterion\": \"name\", \"score\": 0.0-1.0, \"feedback\": \"...\"}],\n"
-        "  \"overall_feedback\": \"...\",\n"
-        "  \"suggestions\": [\"...\"]\n"
-        "}",
-        task, content, criteria_list);
+/**
+ * Set the backend used by evaluator_evaluate_all
+ */
+void evaluator_set_backend(EvaluatorOptimizer* e, EvaluatorBackend backend) {
+    e->backend = backend;
+}
 
-    char* response = call_anthropic_api(e->api_key, e->model, prompt, 2048);
-    EvaluationResult* result = parse_evaluation(response, e);
-    free(response);
+/**
+ * Evaluate many pieces of content for the same task. Results are in input
+ * order and have the same form whichever backend ran them.
+ */
+EvaluationResult** evaluator_evaluate_all(EvaluatorOptimizer* e, const char* task,
+                                          const char** contents, int count) {
+    EvaluationResult** results = (EvaluationResult**)calloc(count > 0 ? count : 1,
+                                                            sizeof(EvaluationResult*));
+
+    // The batch job always sends the whole rubric in one request per item
+    if (e->backend == EVALUATOR_BACKEND_MESSAGE_BATCH) {
+        struct iovec parts[EVALUATE_PROMPT_PARTS];
+        AnthropicRequest request;
+        MessageBatch* batch = message_batch_create();
+        for (int i = 0; i < count; i++) {
+            evaluator_evaluate_request(e, task, contents[i], parts, &request);
+            message_batch_add(batch, &request);
+        }
+        message_batch_run(batch, transport_default());
+        for (int i = 0; i < count; i++) {
+            anthropic_usage_add(&e->usage, &message_batch_response(batch, i)->usage);
+            results[i] = parse_evaluation(message_batch_response(batch, i)->text, e);
+        }
+        message_batch_free(batch);
+        return results;
+    }
+
+    // All evaluations go out before any is awaited
+    EvaluationWait* waits = (EvaluationWait*)malloc((count > 0 ? count : 1) *
+                                                    sizeof(EvaluationWait));
+    for (int i = 0; i < count; i++) {
+        evaluation_wait_init(&waits[i]);
+        evaluator_submit_evaluation(e, task, contents[i], NULL, NULL, evaluation_wait_done,
+                                    &waits[i]);
+    }
+    for (int i = 0; i < count; i++) {
+        results[i] = evaluation_wait_take(e, &waits[i]);
+    }
+    free(waits);
+    return results;
+}
+
+/**
+ * Usage added to the evaluator's total since a snapshot
+ */
+void evaluator_usage_since(const EvaluatorOptimizer* e, const AnthropicUsage* before,
+                           AnthropicUsage* out) {
+    out->input_tokens = e->usage.input_tokens - before->input_tokens;
+    out->output_tokens = e->usage.output_tokens - before->output_tokens;
+    out->cache_creation_input_tokens =
+        e->usage.cache_creation_input_tokens - before->cache_creation_input_tokens;
+    out->cache_read_input_tokens =
+        e->usage.cache_read_input_tokens - before->cache_read_input_tokens;
+}
 
+/**
+ * One beam candidate: a draft and its evaluation
+ */
+typedef struct BeamCandidate {
+    struct BeamRound* round;
+    const struct BeamCandidate* parent;  // NULL in the first round
+    char* content;                       // NULL if generation failed
+    EvaluationResult* evaluation;        // NULL until evaluated
+    bool recorded;                       // Owned by the result history
+} BeamCandidate;
+
+/**
+ * Candidates in flight for one beam round
+ */
+typedef struct BeamRound {
+    EvaluatorOptimizer* e;
+    const char* task;
+    int pending;
+    AnthropicUsage usage;
+    MetricsSpan span;  // Parent of the round's generations and evaluations
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} BeamRound;
+
+/**
+ * Account one candidate's last call and wake the round when all are in
+ */
+void beam_candidate_finish(BeamRound* round, const AnthropicUsage* usage) {
+    pthread_mutex_lock(&round->lock);
+    anthropic_usage_add(&round->usage, usage);
+    if (--round->pending == 0) pthread_cond_broadcast(&round->done);
+    pthread_mutex_unlock(&round->lock);
+}
+
+/**
+ * Evaluation finished; runs on the transport thread
+ */
+void beam_evaluated(EvaluationResult* result, const AnthropicUsage* usage, void* user_data) {
+    BeamCandidate* candidate = (BeamCandidate*)user_data;
+    candidate->evaluation = result;
+    beam_candidate_finish(candidate->round, usage);
+}
+
+/**
+ * Generation finished; the evaluation goes out from here without waiting
+ * for the rest of the round
+ */
+void beam_generated(AnthropicResponse* response, void* user_data) {
+    BeamCandidate* candidate = (BeamCandidate*)user_data;
+    BeamRound* round = candidate->round;
+
+    if (!response->text) {
+        fprintf(stderr, "Beam candidate generation failed: %s\n",
+                response->error ? response->error : "no text");
+        beam_candidate_finish(round, &response->usage);
+        return;
+    }
+    candidate->content = response->text;
+    response->text = NULL;
+
+    pthread_mutex_lock(&round->lock);
+    anthropic_usage_add(&round->usage, &response->usage);
+    pthread_mutex_unlock(&round->lock);
+
+    // Runs on the transport's thread; the evaluation still belongs to the round
+    const BeamCandidate* parent = candidate->parent;
+    MetricsSpan* previous_span = metrics_span_attach(&round->span);
+    evaluator_submit_evaluation(round->e, round->task, candidate->content,
+                                parent ? parent->content : NULL,
+                                parent ? parent->evaluation : NULL, beam_evaluated, candidate);
+    metrics_span_restore(previous_span);
+}
+
+/**
+ * Higher score first; failed candidates sort last
+ */
+int beam_candidate_compare(const void* a, const void* b) {
+    const BeamCandidate* x = *(const BeamCandidate* const*)a;
+    const BeamCandidate* y = *(const BeamCandidate* const*)b;
+    double sx = x->evaluation ? x->evaluation->overall_score : -1;
+    double sy = y->evaluation ? y->evaluation->overall_score : -1;
+    return (sx < sy) - (sx > sy);
+}
+
+/**
+ * Beam optimization loop. Each round generates beam_candidates drafts from
+ * the surviving beam (round robin over its members), evaluates each as soon
+ * as it is written, and keeps the best beam_width of survivors and new
+ * drafts. A round costs about one generation plus one evaluation of wall
+ * clock however many candidates it runs.
+ */
+OptimizationResult* evaluator_optimize_beam(EvaluatorOptimizer* e, const char* task) {
+    OptimizationResult* result = (OptimizationResult*)calloc(1, sizeof(OptimizationResult));
+    result->history = (OptimizationIteration*)calloc(e->max_iterations, sizeof(OptimizationIteration));
+
+    int k = e->beam_candidates;
+    BeamCandidate* pool = (BeamCandidate*)calloc((size_t)e->max_iterations * k,
+                                                 sizeof(BeamCandidate));
+    // Survivors followed by the current round's candidates
+    BeamCandidate** ranked = (BeamCandidate**)malloc((e->beam_width + k) * sizeof(BeamCandidate*));
+    int beam_count = 0;
+    AnthropicUsage start_usage = e->usage;
+
+    // Built here so callbacks only ever read them
+    evaluator_prepare_rubrics(e);
+
+    MetricsSpan run_span;
+    metrics_span_begin(&run_span, "evaluator.beam_search", NULL);
+    BeamRound round = {.e = e, .task = task};
+    pthread_mutex_init(&round.lock, NULL);
+    pthread_cond_init(&round.done, NULL);
+
+    for (int i = 0; i < e->max_iterations; i++) {
+        BeamCandidate* candidates = pool + (size_t)i * k;
+        int round_k = k;
+        round.usage = (AnthropicUsage){0};
+        metrics_span_begin(&round.span, "evaluator.beam_round", NULL);
+        metrics_span_set_int(&round.span, "evaluator.iteration", i + 1);
+
+        for (int j = 0; j < round_k; j++) {
+            candidates[j].round = &round;
+            candidates[j].parent = beam_count > 0 ? ranked[j % beam_count] : NULL;
+
+            StringBuilder prompt = {0};
+            AnthropicRequest request;
+            const BeamCandidate* parent = candidates[j].parent;
+            evaluator_generate_request(e, task, parent ? parent->evaluation : NULL,
+                                       parent ? parent->content : NULL, &prompt, &request);
+
+            // Size the round to the budget: a candidate costs its draft
+            // plus an evaluation that reads the draft back
+            if (j == 0 && e->budget) {
+                struct iovec parts[EVALUATE_PROMPT_PARTS];
+                AnthropicRequest evaluation;
+                evaluator_evaluate_request(e, task, NULL, parts, &evaluation);
+                long per_candidate = anthropic_request_estimate_tokens(&request) +
+                                     anthropic_request_estimate_tokens(&evaluation) +
+                                     request.max_tokens;
+                round_k = token_budget_fan_out(e->budget, per_candidate, k, 0);
+                if (round_k == 0) {
+                    string_builder_free(&prompt);
+                    break;
+                }
+                if (round_k < k) {
+                    printf("Round %d: budget allows %d of %d candidates\n", i + 1, round_k, k);
+                }
+            }
+            if (j == 0) round.pending = round_k;
+
+            // Siblings share a prompt; each must be sampled, not cached
+            request.no_cache = true;
+            transport_future_release(transport_submit(transport_default(), &request,
+                                                      beam_generated, &candidates[j]));
+            string_builder_free(&prompt);
+        }
+        if (round_k == 0) {
+            printf("Round %d: token budget exhausted\n", i + 1);
+            round.span.error = true;
+            metrics_span_end(&round.span);
+            break;
+        }
+
+        pthread_mutex_lock(&round.lock);
+        while (round.pending > 0) {
+            pthread_cond_wait(&round.done, &round.lock);
+        }
+        pthread_mutex_unlock(&round.lock);
+        anthropic_usage_add(&e->usage, &round.usage);
+        metrics_span_set_int(&round.span, "evaluator.candidates", round_k);
+        metrics_span_end(&round.span);
+
+        // The round's best draft goes in the history
+        BeamCandidate* best = NULL;
+        for (int j = 0; j < round_k; j++) {
+            if (!candidates[j].evaluation) continue;
+            if (!best || candidates[j].evaluation->overall_score > best->evaluation->overall_score) {
+                best = &candidates[j];
+            }
+        }
+        if (!best) {
+            fprintf(stderr, "Beam round %d produced no evaluated candidates\n", i + 1);
+            break;
+        }
+        OptimizationIteration* iteration = &result->history[result->history_count++];
+        iteration->iteration = i + 1;
+        iteration->content = best->content;
+        iteration->evaluation = best->evaluation;
+        iteration->usage = round.usage;
+        best->recorded = true;
+
+        for (int j = 0; j < round_k; j++) ranked[beam_count + j] = &candidates[j];
+        qsort(ranked, beam_count + round_k, sizeof(BeamCandidate*), beam_candidate_compare);
+        beam_count = beam_count + round_k < e->beam_width ? beam_count + round_k : e->beam_width;
+        while (beam_count > 0 && !ranked[beam_count - 1]->evaluation) beam_count--;
+
+        printf("Round %d: best %.0f%% of %d candidates, beam %.0f%%\n", i + 1,
+               best->evaluation->overall_score * 100, round_k,
+               ranked[0]->evaluation->overall_score * 100);
+
+        if (ranked[0]->evaluation->overall_score >= e->target_score) {
+            result->converged = true;
+            break;
+        }
+    }
+
+    result->total_iterations = result->history_count;
+    result->final_content = strdup(beam_count > 0 ? ranked[0]->content : "");
+    result->final_score = beam_count > 0 ? ranked[0]->evaluation->overall_score : 0;
+    evaluator_usage_since(e, &start_usage, &result->usage);
+
+    for (int i = 0; i < e->max_iterations * k; i++) {
+        if (pool[i].recorded) continue;
+        free(pool[i].content);
+        if (pool[i].evaluation) evaluation_result_free(pool[i].evaluation);
+    }
+    pthread_mutex_destroy(&round.lock);
+    pthread_cond_destroy(&round.done);
+    free(ranked);
+    free(pool);
+
+    metrics_span_set_int(&run_span, "evaluator.converged", result->converged);
+    metrics_span_end(&run_span);
     return result;
 }
 
@@ -289,19 +1037,36 @@ EvaluationResult* evaluator_evaluate(EvaluatorOptimizer* e, const char* task,
  * Run optimization loop
  */
 OptimizationResult* evaluator_optimize(EvaluatorOptimizer* e, const char* task) {
+    if (e->beam_candidates > 1) return evaluator_optimize_beam(e, task);
+
     OptimizationResult* result = (OptimizationResult*)calloc(1, sizeof(OptimizationResult));
     result->history = (OptimizationIteration*)calloc(e->max_iterations, sizeof(OptimizationIteration));
     result->history_count = 0;
 
     char* current_content = NULL;
     EvaluationResult* current_eval = NULL;
+    AnthropicUsage start_usage = e->usage;
+    MetricsSpan run_span;
+    metrics_span_begin(&run_span, "evaluator.optimize", NULL);
 
-    // Initial generation
+    // Initial generation; without a draft there is nothing to evaluate
     current_content = evaluator_generate(e, task, NULL);
+    if (!current_content) {
+        printf("Iteration 1: no draft generated\n");
+        run_span.error = true;
+    }
 
-    for (int i = 0; i < e->max_iterations; i++) {
-        // Evaluate
-        current_eval = evaluator_evaluate(e, task, current_content);
+    for (int i = 0; current_content && i < e->max_iterations; i++) {
+        AnthropicUsage before = e->usage;
+        MetricsSpan span;
+        metrics_span_begin(&span, "evaluator.iteration", NULL);
+        metrics_span_set_int(&span, "evaluator.iteration", i + 1);
+
+        // Evaluate; per-criterion mode re-scores only what the revision changed
+        const OptimizationIteration* previous = i > 0 ? &result->history[i - 1] : NULL;
+        current_eval = evaluator_evaluate_revision(e, task, current_content,
+                                                   previous ? previous->content : NULL,
+                                                   previous ? previous->evaluation : NULL);
 
         // Record iteration
         result->history[i].iteration = i + 1;
@@ -310,6 +1075,8 @@ OptimizationResult* evaluator_optimize(EvaluatorOptimizer* e, const char* task)
         result->history_count++;
 
         printf("Iteration %d: %.0f%%\n", i + 1, current_eval->overall_score * 100);
+        metrics_span_set_int(&span, "evaluator.score_percent",
+                             (int64_t)(current_eval->overall_score * 100));
 
         // Check if target reached
         if (current_eval->overall_score >= e->target_score) {
@@ -317,37 +1084,45 @@ OptimizationResult* evaluator_optimize(EvaluatorOptimizer* e, const char* task)
             result->total_iterations = i + 1;
             result->converged = true;
             result->final_score = current_eval->overall_score;
+            evaluator_usage_since(e, &before, &result->history[i].usage);
+            evaluator_usage_since(e, &start_usage, &result->usage);
 
             free(current_content);
+            metrics_span_end(&span);
+            metrics_span_set_int(&run_span, "evaluator.converged", 1);
+            metrics_span_end(&run_span);
             return result;
         }
 
-        // Generate improved version
+        // Generate improved version; if that fails (a spent budget, say)
+        // the last draft stands
         char* improved = evaluator_generate(e, task, current_eval);
+        evaluator_usage_since(e, &before, &result->history[i].usage);
+        if (!improved) {
+            printf("Iteration %d: no improved draft, stopping\n", i + 1);
+            span.error = true;
+            metrics_span_end(&span);
+            break;
+        }
         free(current_content);
         current_content = improved;
+        metrics_span_end(&span);
     }
+    evaluator_usage_since(e, &start_usage, &result->usage);
 
-    // Max iterations reached
-    result->final_content = current_content;
-    result->total_iterations = e->max_iterations;
+    // Max iterations reached, or generation stopped early
+    result->final_content = current_content ? current_content : strdup("");
+    result->total_iterations = result->history_count;
     result->converged = false;
-    result->final_score = result->history[result->history_count - 1].evaluation->overall_score;
+    result->final_score = result->history_count > 0
+                              ? result->history[result->history_count - 1].evaluation->overall_score
+                              : 0;
 
+    metrics_span_set_int(&run_span, "evaluator.converged", 0);
+    metrics_span_end(&run_span);
     return result;
 }
 
-/**
- * Free evaluation result
- */
-void evaluation_result_free(EvaluationResult* result) {
-    free(result->criteria_scores);
-    for (int i = 0; i < result->suggestion_count; i++) {
-        free(result->suggestions[i]);
-    }
-    free(result);
-}
-
 /**
  * Free optimization result
  */
@@ -368,6 +1143,12 @@ void evaluator_free(EvaluatorOptimizer* e) {
     free(e->api_key);
     free(e->model);
     free(e->criteria);
+    free(e->generate_rubric);
+    free(e->evaluate_rubric);
+    free(e->criterion_model);
+    for (int i = 0; i < MAX_CRITERIA; i++) {
+        free(e->criterion_rubrics[i]);
+    }
     free(e);
 }
 
@@ -424,14 +1205,23 @@ void confidence_set_threshold(ConfidenceOptimizer* c, double threshold) {
 }
 
 /**
- * Parse confidence response (simplified)
+ * Parse confidence response; an unparseable reply counts as zero confidence
  */
 void parse_confidence_response(const char* response, char** answer, double* confidence,
                                 char* reasoning, size_t reasoning_size) {
-    // Simplified - in production use proper JSON parsing
-    *answer = strdup("This is the answer based on the analysis.");
-    *confidence = 0.85 + ((double)(rand() % 15) / 100.0);  // 0.85-1.0
-    snprintf(reasoning, reasoning_size, "Based on careful analysis of the problem.");
+    JsonToken tokens[32];
+    JsonDoc doc;
+    *answer = NULL;
+    *confidence = 0;
+    reasoning[0] = '\0';
+
+    if (json_parse_embedded(&doc, response, tokens, 32) == JSON_OK) {
+        *answer = json_string_dup(&doc, json_object_get(&doc, 0, "answer"));
+        *confidence = json_number(&doc, json_object_get(&doc, 0, "confidence"), 0);
+        json_get_string(&doc, 0, "reasoning", reasoning, reasoning_size);
+    }
+    // Without a JSON answer field, the whole reply is the answer
+    if (!*answer) *answer = strdup(response ? response : "");
 }
 
 /**
@@ -439,17 +1229,17 @@ void parse_confidence_response(const char* response, char** answer, double* conf
  */
 void confidence_attempt(ConfidenceOptimizer* c, const char* task,
                          const char* previous_attempts, ConfidenceAttempt* result) {
-    char prompt[MAX_INPUT_SIZE];
+    StringBuilder prompt = {0};
 
     if (previous_attempts == NULL || strlen(previous_attempts) == 0) {
-        snprintf(prompt, sizeof(prompt),
+        string_builder_appendf(&prompt,
             "Complete this task and assess your confidence:\n\n"
             "%s\n\n"
             "Respond in JSON format:\n"
             "{\"answer\": \"...\", \"confidence\": 0.0-1.0, \"reasoning\": \"...\"}",
             task);
     } else {
-        snprintf(prompt, sizeof(prompt),
+        string_builder_appendf(&prompt,
             "Improve upon your previous attempts:\n\n"
             "Task: %s\n\n"
             "Previous attempts:\n%s\n\n"
@@ -459,7 +1249,8 @@ void confidence_attempt(ConfidenceOptimizer* c, const char* task,
             task, previous_attempts);
     }
 
-    char* response = call_anthropic_api(c->api_key, c->model, prompt, 2048);
+    char* response = call_anthropic_api(c->api_key, c->model, string_builder_cstr(&prompt), 2048);
+    string_builder_free(&prompt);
 
     char* answer;
     double confidence;
@@ -478,17 +1269,16 @@ ConfidenceResult* confidence_optimize(ConfidenceOptimizer* c, const char* task)
     ConfidenceResult* result = (ConfidenceResult*)calloc(1, sizeof(ConfidenceResult));
     result->attempts = (ConfidenceAttempt*)calloc(c->max_attempts, sizeof(ConfidenceAttempt));
     result->attempt_count = 0;
+    MetricsSpan span;
+    metrics_span_begin(&span, "evaluator.confidence", NULL);
 
-    char previous_attempts[MAX_INPUT_SIZE];
-    previous_attempts[0] = '\0';
+    StringBuilder previous_attempts = {0};
 
     for (int i = 0; i < c->max_attempts; i++) {
         ConfidenceAttempt* attempt = &result->attempts[i];
         attempt->attempt = i + 1;
 
-        confidence_attempt(c, task,
-                           strlen(previous_attempts) > 0 ? previous_attempts : NULL,
-                           attempt);
+        confidence_attempt(c, task, previous_attempts.data, attempt);
         result->attempt_count++;
 
         printf("Attempt %d: %.0f%% confidence\n", i + 1, attempt->confidence * 100);
@@ -498,16 +1288,19 @@ ConfidenceResult* confidence_optimize(ConfidenceOptimizer* c, const char* task)
             result->final_answer = strdup(attempt->answer);
             result->final_confidence = attempt->confidence;
             result->converged = true;
+            string_builder_free(&previous_attempts);
+            metrics_span_set_int(&span, "evaluator.attempts", result->attempt_count);
+            metrics_span_set_int(&span, "evaluator.converged", 1);
+            metrics_span_end(&span);
             return result;
         }
 
         // Build previous attempts string for next iteration
-        char attempt_str[1024];
-        snprintf(attempt_str, sizeof(attempt_str),
+        string_builder_appendf(&previous_attempts,
             "Attempt %d: %s\nConfidence: %.0f%%\nReasoning: %s\n\n",
             i + 1, attempt->answer, attempt->confidence * 100, attempt->reasoning);
-        strcat(previous_attempts, attempt_str);
     }
+    string_builder_free(&previous_attempts);
 
     // Find best attempt
     double best_confidence = 0;
@@ -522,6 +1315,9 @@ ConfidenceResult* confidence_optimize(ConfidenceOptimizer* c, const char* task)
     result->final_answer = strdup(result->attempts[best_idx].answer);
     result->final_confidence = best_confidence;
     result->converged = false;
+    metrics_span_set_int(&span, "evaluator.attempts", result->attempt_count);
+    metrics_span_set_int(&span, "evaluator.converged", 0);
+    metrics_span_end(&span);
 
     return result;
 }
@@ -556,6 +1352,16 @@ int main() {
 
     // Seed random for mock responses
     srand(42);
+    transport_set_mock_responder(mock_anthropic_api);
+
+    // AGENT_METRICS_PORT serves Prometheus metrics on loopback;
+    // AGENT_TRACE_FILE appends one OTLP/JSON line per finished span
+    metrics_init_from_env();
+
+    // Repeated prompts are served from cache; set AGENT_CACHE_FILE to keep
+    // answers across runs
+    ResponseCache* cache = transport_enable_cache(transport_default(), 256, 3600,
+                                                  getenv("AGENT_CACHE_FILE"));
 
     // Evaluator-Optimizer
     printf("=== Evaluator-Optimizer ===\n\n");
@@ -579,13 +1385,78 @@ int main() {
     printf("Final Score: %.0f%%\n", opt_result->final_score * 100);
     printf("\nIteration History:\n");
     for (int i = 0; i < opt_result->history_count; i++) {
-        printf("  Iteration %d: %.0f%%\n",
+        printf("  Iteration %d: %.0f%% (cache write %d, cache read %d tokens)\n",
                opt_result->history[i].iteration,
-               opt_result->history[i].evaluation->overall_score * 100);
+               opt_result->history[i].evaluation->overall_score * 100,
+               opt_result->history[i].usage.cache_creation_input_tokens,
+               opt_result->history[i].usage.cache_read_input_tokens);
     }
+    printf("Tokens: %d input, %d output, %d cache write, %d cache read\n",
+           opt_result->usage.input_tokens, opt_result->usage.output_tokens,
+           opt_result->usage.cache_creation_input_tokens,
+           opt_result->usage.cache_read_input_tokens);
     printf("\nFinal Content (first 100 chars):\n%.100s...\n", opt_result->final_content);
 
     optimization_result_free(opt_result);
+
+    // Beam mode: four candidates per round, the best two carried forward
+    printf("\n=== Beam Search (4 candidates, beam 2) ===\n\n");
+    evaluator_set_beam(evaluator, 4, 2);
+    evaluator_set_target(evaluator, 0.9);
+    opt_result = evaluator_optimize(evaluator, "Explain how hash tables work");
+    printf("\nConverged: %s after %d rounds\n", opt_result->converged ? "yes" : "no",
+           opt_result->total_iterations);
+    printf("Final Score: %.0f%%\n", opt_result->final_score * 100);
+    printf("Tokens: %d input, %d output\n", opt_result->usage.input_tokens,
+           opt_result->usage.output_tokens);
+    optimization_result_free(opt_result);
+
+    // The same search under a token ceiling; rounds shrink as it runs out
+    printf("\n=== Budgeted Beam Search ===\n\n");
+    TokenBudget beam_budget;
+    token_budget_init(&beam_budget, 40000);
+    evaluator_set_budget(evaluator, &beam_budget);
+    evaluator_set_target(evaluator, 0.99);
+    opt_result = evaluator_optimize(evaluator, "Explain how hash tables work in one paragraph");
+    printf("Final Score: %.0f%% after %d rounds\n", opt_result->final_score * 100,
+           opt_result->total_iterations);
+    optimization_result_free(opt_result);
+    token_budget_print(&beam_budget, "Beam", stdout);
+    evaluator_set_budget(evaluator, NULL);
+    token_budget_destroy(&beam_budget);
+    evaluator_set_beam(evaluator, 1, 1);
+
+    // Per-criterion scoring on the cheaper model; passing criteria whose
+    // quoted evidence survives a revision are not sent again
+    printf("\n=== Per-Criterion Evaluation ===\n\n");
+    evaluator_set_per_criterion(evaluator, true, NULL);
+    evaluator_set_target(evaluator, 0.85);
+    opt_result = evaluator_optimize(evaluator, "Explain how hash tables work");
+    for (int i = 0; i < opt_result->history_count; i++) {
+        const EvaluationResult* evaluation = opt_result->history[i].evaluation;
+        printf("  Iteration %d: %.0f%%, %d of %d criteria carried over\n",
+               opt_result->history[i].iteration, evaluation->overall_score * 100,
+               evaluation->reused_count, evaluation->criteria_count);
+    }
+    optimization_result_free(opt_result);
+    evaluator_set_per_criterion(evaluator, false, NULL);
+
+    // Offline scoring of several drafts through one Message Batches job
+    printf("\n=== Batch Evaluation ===\n\n");
+    const char* drafts[] = {
+        "Hash tables map keys to buckets.",
+        "A hash table hashes each key to an index and chains colliding entries.",
+        "Hash tables trade memory for O(1) average lookups."
+    };
+    evaluator_set_backend(evaluator, EVALUATOR_BACKEND_MESSAGE_BATCH);
+    EvaluationResult** scored = evaluator_evaluate_all(evaluator, "Explain how hash tables work",
+                                                       drafts, 3);
+    for (int i = 0; i < 3; i++) {
+        printf("Draft %d: %.0f%% - %s\n", i + 1, scored[i]->overall_score * 100,
+               scored[i]->overall_feedback);
+        evaluation_result_free(scored[i]);
+    }
+    free(scored);
     evaluator_free(evaluator);
 
     // Confidence-based optimizer
@@ -605,5 +1476,11 @@ int main() {
     confidence_result_free(conf_result);
     confidence_free(conf_opt);
 
+    metrics_print_summary(stdout);
+    response_cache_print_stats(cache, stdout);
+    transport_set_cache(transport_default(), NULL);
+    response_cache_destroy(cache);
+    metrics_shutdown();
+
     return 0;
 }
@@ -0,0 +1,548 @@
+/**
+ * Shared JSON Tokenizer for the C Agent Pattern Templates
+ * Single-pass, zero-copy tokenizer for model responses and API bodies
+ *
+ * json_parse() splits a buffer into a flat array of tokens in one pass.
+ * Tokens are byte ranges into the original buffer, so lookups return
+ * views and nothing is copied unless the caller asks for a decoded string
+ * (json_string_copy into a caller buffer, or json_string_dup). Each token
+ * records the index just past its subtree, so skipping a value is O(1).
+ *
+ * String bodies are scanned for the next quote or backslash 16 bytes at a
+ * time with SSE2 or NEON when available. Escapes, including \u surrogate
+ * pairs, are decoded correctly.
+ *
+ * Truncated input (a response that is still streaming) returns
+ * JSON_PARTIAL. Tokens that were closed before the cut are valid and
+ * json_object_get() finds members whose values are complete, so callers
+ * can act on fields as soon as they arrive.
+ *
+ * Header-only: include it from a template.
+ */
+
+#ifndef JSON_TOKENIZER_H
+#define JSON_TOKENIZER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#define JSON_MAX_DEPTH 64
+#define JSON_DEFAULT_TOKENS 256
+
+typedef enum {
+    JSON_OBJECT,
+    JSON_ARRAY,
+    JSON_STRING,
+    JSON_NUMBER,
+    JSON_TRUE,
+    JSON_FALSE,
+    JSON_NULL
+} JsonType;
+
+typedef enum {
+    JSON_OK = 0,
+    JSON_PARTIAL = -1,  // Input ended inside the root value
+    JSON_INVALID = -2,
+    JSON_NOMEM = -3     // More tokens than capacity
+} JsonStatus;
+
+/**
+ * One value. Strings exclude their quotes; end is -1 while a container
+ * or string is still open in partial input.
+ */
+typedef struct JsonToken {
+    JsonType type;
+    int start;
+    int end;
+    int size;    // Members of an object, elements of an array
+    int skip;    // Index of the first token after this subtree
+    int parent;  // -1 for the root; a member value's parent is its object
+    bool escaped;  // String contains backslash escapes
+} JsonToken;
+
+/**
+ * Parsed document: the source buffer plus its tokens
+ */
+typedef struct JsonDoc {
+    const char* json;
+    size_t length;
+    JsonToken* tokens;
+    int count;
+    int capacity;
+    JsonStatus status;
+} JsonDoc;
+
+/**
+ * Borrowed byte range in the source buffer
+ */
+typedef struct JsonView {
+    const char* data;
+    size_t length;
+} JsonView;
+
+/**
+ * Find the next quote or backslash in [p, end); returns end if none
+ */
+static inline const char* json_scan_string(const char* p, const char* end) {
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                                                  _mm_cmpeq_epi8(chunk, backslash)));
+        if (mask) return p + __builtin_ctz((unsigned int)mask);
+        p += 16;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    while (end - p >= 16) {
+        uint8x16_t chunk = vld1q_u8((const uint8_t*)p);
+        uint8x16_t hits = vorrq_u8(vceqq_u8(chunk, quote), vceqq_u8(chunk, backslash));
+        if (vmaxvq_u8(hits)) break;  // The scalar loop pinpoints the hit
+        p += 16;
+    }
+#endif
+    while (p < end && *p != '"' && *p != '\\') p++;
+    return p;
+}
+
+/**
+ * Add a token (its end and skip are filled in when it closes)
+ */
+static inline int json_push_token(JsonDoc* doc, JsonType type, int start, int parent) {
+    if (doc->count >= doc->capacity) return -1;
+    JsonToken* token = &doc->tokens[doc->count];
+    token->type = type;
+    token->start = start;
+    token->end = -1;
+    token->size = 0;
+    token->skip = -1;
+    token->parent = parent;
+    token->escaped = false;
+    return doc->count++;
+}
+
+/**
+ * Tokenize exactly one JSON value at the start of json (after whitespace).
+ * Text after the root value is ignored.
+ */
+static inline JsonStatus json_parse(JsonDoc* doc, const char* json, size_t length,
+                                    JsonToken* tokens, int capacity) {
+    // What the innermost open container accepts next
+    enum { EXPECT_VALUE, EXPECT_KEY, EXPECT_COLON, EXPECT_COMMA_OR_END } expect = EXPECT_VALUE;
+    int stack[JSON_MAX_DEPTH];
+    int depth = 0;
+
+    doc->json = json;
+    doc->length = length;
+    doc->tokens = tokens;
+    doc->count = 0;
+    doc->capacity = capacity;
+
+    const char* p = json;
+    const char* end = json + length;
+    int parent = -1;
+    bool first = true;  // First member or element, where a bare close is allowed
+
+    while (p < end) {
+        char c = *p;
+        if (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+            p++;
+            continue;
+        }
+        int pos = (int)(p - json);
+        bool completed = false;  // A value just finished
+
+        if (expect == EXPECT_COLON) {
+            if (c != ':') return doc->status = JSON_INVALID;
+            expect = EXPECT_VALUE;
+            p++;
+            continue;
+        }
+
+        if (expect == EXPECT_COMMA_OR_END || ((expect == EXPECT_KEY || expect == EXPECT_VALUE) &&
+                                              first && (c == '}' || c == ']'))) {
+            if (c == ',' && expect == EXPECT_COMMA_OR_END) {
+                expect = doc->tokens[parent].type == JSON_OBJECT ? EXPECT_KEY : EXPECT_VALUE;
+                first = false;
+                p++;
+                continue;
+            }
+            JsonType closing = c == '}' ? JSON_OBJECT : JSON_ARRAY;
+            if ((c != '}' && c != ']') || parent < 0 || doc->tokens[parent].type != closing) {
+                return doc->status = JSON_INVALID;
+            }
+            JsonToken* container = &doc->tokens[parent];
+            container->end = pos + 1;
+            container->skip = doc->count;
+            depth--;
+            parent = depth > 0 ? stack[depth - 1] : -1;
+            p++;
+            completed = true;
+        } else if (c == '"') {
+            bool is_key = expect == EXPECT_KEY;
+            int index = json_push_token(doc, JSON_STRING, pos + 1, parent);
+            if (index < 0) return doc->status = JSON_NOMEM;
+            JsonToken* token = &doc->tokens[index];
+            token->skip = index + 1;
+
+            const char* s = p + 1;
+            for (;;) {
+                s = json_scan_string(s, end);
+                if (s >= end) return doc->status = JSON_PARTIAL;
+                if (*s == '"') break;
+                token->escaped = true;
+                s += 2;  // Backslash and the escaped character
+                if (s > end) return doc->status = JSON_PARTIAL;
+            }
+            token->end = (int)(s - json);
+            p = s + 1;
+
+            if (is_key) {
+                doc->tokens[parent].size++;
+                expect = EXPECT_COLON;
+                first = false;
+                continue;
+            }
+            completed = true;
+        } else if (expect == EXPECT_KEY) {
+            return doc->status = JSON_INVALID;
+        } else if (c == '{' || c == '[') {
+            if (depth >= JSON_MAX_DEPTH) return doc->status = JSON_INVALID;
+            int index = json_push_token(doc, c == '{' ? JSON_OBJECT : JSON_ARRAY, pos, parent);
+            if (index < 0) return doc->status = JSON_NOMEM;
+            if (parent >= 0 && doc->tokens[parent].type == JSON_ARRAY) doc->tokens[parent].size++;
+            stack[depth++] = index;
+            parent = index;
+            expect = c == '{' ? EXPECT_KEY : EXPECT_VALUE;
+            first = true;
+            p++;
+            continue;
+        } else {
+            JsonType type;
+            if (c == '-' || (c >= '0' && c <= '9')) type = JSON_NUMBER;
+            else if (c == 't') type = JSON_TRUE;
+            else if (c == 'f') type = JSON_FALSE;
+            else if (c == 'n') type = JSON_NULL;
+            else return doc->status = JSON_INVALID;
+
+            const char* s = p;
+            while (s < end && *s != ',' && *s != '}' && *s != ']' && *s != ' ' &&
+                   *s != '\n' && *s != '\r' && *s != '\t') {
+                s++;
+            }
+            // A number at the end of a truncated buffer may still grow
+            if (s == end && depth > 0) return doc->status = JSON_PARTIAL;
+
+            int index = json_push_token(doc, type, pos, parent);
+            if (index < 0) return doc->status = JSON_NOMEM;
+            doc->tokens[index].end = (int)(s - json);
+            doc->tokens[index].skip = index + 1;
+            p = s;
+            completed = true;
+        }
+
+        if (completed) {
+            int index = doc->count - 1;
+            // The value that just finished starts at the innermost open token
+            // if it was a container; otherwise it is the last token pushed
+            if (parent >= 0 && doc->tokens[parent].type == JSON_ARRAY &&
+                doc->tokens[index].type != JSON_OBJECT && doc->tokens[index].type != JSON_ARRAY &&
+                doc->tokens[index].parent == parent && c != '}' && c != ']') {
+                doc->tokens[parent].size++;
+            }
+            if (depth == 0) return doc->status = JSON_OK;
+            expect = EXPECT_COMMA_OR_END;
+        }
+    }
+
+    return doc->status = doc->count > 0 || depth > 0 ? JSON_PARTIAL : JSON_INVALID;
+}
+
+/**
+ * Tokenize the first JSON object embedded in text, such as a reply that
+ * wraps its JSON in prose or a markdown code block
+ */
+static inline JsonStatus json_parse_embedded(JsonDoc* doc, const char* text,
+                                             JsonToken* tokens, int capacity) {
+    if (!text) text = "";
+    size_t length = strlen(text);
+    const char* start = (const char*)memchr(text, '{', length);
+    if (!start) {
+        doc->json = text;
+        doc->length = length;
+        doc->tokens = tokens;
+        doc->count = 0;
+        doc->capacity = capacity;
+        return doc->status = JSON_INVALID;
+    }
+    return json_parse(doc, start, length - (size_t)(start - text), tokens, capacity);
+}
+
+/**
+ * Tokenize into a heap array that grows until the document fits; release
+ * it with json_doc_free()
+ */
+static inline JsonStatus json_parse_alloc(JsonDoc* doc, const char* json, size_t length) {
+    int capacity = JSON_DEFAULT_TOKENS;
+    for (;;) {
+        JsonToken* tokens = (JsonToken*)malloc((size_t)capacity * sizeof(JsonToken));
+        JsonStatus status = json_parse(doc, json, length, tokens, capacity);
+        if (status != JSON_NOMEM) return status;
+        free(tokens);
+        capacity *= 2;
+    }
+}
+
+static inline void json_doc_free(JsonDoc* doc) {
+    free(doc->tokens);
+    doc->tokens = NULL;
+    doc->count = 0;
+}
+
+/**
+ * True if the token is present and fully parsed
+ */
+static inline bool json_complete(const JsonDoc* doc, int index) {
+    return index >= 0 && index < doc->count && doc->tokens[index].end >= 0;
+}
+
+/**
+ * Raw bytes of a token (strings without quotes, escapes undecoded)
+ */
+static inline JsonView json_view(const JsonDoc* doc, int index) {
+    JsonView view = {"", 0};
+    if (!json_complete(doc, index)) return view;
+    view.data = doc->json + doc->tokens[index].start;
+    view.length = (size_t)(doc->tokens[index].end - doc->tokens[index].start);
+    return view;
+}
+
+/**
+ * Append the UTF-8 encoding of a code point; returns bytes written
+ */
+static inline size_t json_utf8_encode(unsigned int cp, char* out) {
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    } else if (cp < 0x800) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    } else if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+static inline int json_hex4(const char* p, const char* end) {
+    if (end - p < 4) return -1;
+    int value = 0;
+    for (int i = 0; i < 4; i++) {
+        char h = p[i];
+        int digit = h >= '0' && h <= '9' ? h - '0'
+                  : h >= 'a' && h <= 'f' ? h - 'a' + 10
+                  : h >= 'A' && h <= 'F' ? h - 'A' + 10 : -1;
+        if (digit < 0) return -1;
+        value = value * 16 + digit;
+    }
+    return value;
+}
+
+/**
+ * Decode a string token into out (always NUL-terminated, truncated to
+ * out_size - 1 bytes). Returns the full decoded length, so a result of
+ * out_size or more means the copy was truncated.
+ */
+static inline size_t json_string_copy(const JsonDoc* doc, int index, char* out, size_t out_size) {
+    JsonView view = json_view(doc, index);
+    const char* p = view.data;
+    const char* end = p + view.length;
+    size_t length = 0;
+    size_t written = 0;
+    bool truncated = out_size == 0;
+
+    while (p < end) {
+        char utf8[4];
+        size_t n;
+        if (*p != '\\') {
+            const char* run = json_scan_string(p, end);
+            n = (size_t)(run - p);
+            if (out && !truncated) {
+                size_t room = out_size - 1 - written;
+                if (n > room) truncated = true;
+                memcpy(out + written, p, n < room ? n : room);
+                written += n < room ? n : room;
+            }
+            length += n;
+            p = run;
+            continue;
+        }
+
+        char c = p + 1 < end ? p[1] : '\0';
+        p += p + 1 < end ? 2 : 1;
+        switch (c) {
+            case 'n': utf8[0] = '\n'; n = 1; break;
+            case 't': utf8[0] = '\t'; n = 1; break;
+            case 'r': utf8[0] = '\r'; n = 1; break;
+            case 'b': utf8[0] = '\b'; n = 1; break;
+            case 'f': utf8[0] = '\f'; n = 1; break;
+            case 'u': {
+                int cp = json_hex4(p, end);
+                if (cp < 0) {
+                    n = 0;
+                    break;
+                }
+                p += 4;
+                // Combine a surrogate pair into one code point
+                if (cp >= 0xD800 && cp < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                    int low = json_hex4(p + 2, end);
+                    if (low >= 0xDC00 && low < 0xE000) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        p += 6;
+                    }
+                }
+                n = json_utf8_encode((unsigned int)cp, utf8);
+                break;
+            }
+            default: utf8[0] = c; n = c ? 1 : 0; break;
+        }
+        // A decoded character is copied whole or not at all
+        if (out && !truncated) {
+            if (n > out_size - 1 - written) {
+                truncated = true;
+            } else {
+                memcpy(out + written, utf8, n);
+                written += n;
+            }
+        }
+        length += n;
+    }
+
+    if (out && out_size > 0) out[written] = '\0';
+    return length;
+}
+
+/**
+ * Decode a string token into a new allocation; NULL if not a complete string
+ */
+static inline char* json_string_dup(const JsonDoc* doc, int index) {
+    if (!json_complete(doc, index) || doc->tokens[index].type != JSON_STRING) return NULL;
+    size_t length = json_string_copy(doc, index, NULL, 0);
+    char* out = (char*)malloc(length + 1);
+    json_string_copy(doc, index, out, length + 1);
+    return out;
+}
+
+/**
+ * Compare a string token with a C string, decoding escapes if needed
+ */
+static inline bool json_string_equals(const JsonDoc* doc, int index, const char* s) {
+    if (!json_complete(doc, index) || doc->tokens[index].type != JSON_STRING) return false;
+    JsonView view = json_view(doc, index);
+    size_t length = strlen(s);
+    if (!doc->tokens[index].escaped) {
+        return view.length == length && memcmp(view.data, s, length) == 0;
+    }
+
+    char buffer[256];
+    if (length >= sizeof(buffer)) {
+        char* decoded = json_string_dup(doc, index);
+        bool equal = strcmp(decoded, s) == 0;
+        free(decoded);
+        return equal;
+    }
+    return json_string_copy(doc, index, buffer, sizeof(buffer)) == length &&
+           memcmp(buffer, s, length) == 0;
+}
+
+/**
+ * Value of key in an object, or -1. In partial input, members whose value
+ * has not finished arriving are not found.
+ */
+static inline int json_object_get(const JsonDoc* doc, int object, const char* key) {
+    if (object < 0 || object >= doc->count || doc->tokens[object].type != JSON_OBJECT) return -1;
+
+    int member = object + 1;
+    for (int i = 0; i < doc->tokens[object].size && member + 1 < doc->count; i++) {
+        int value = member + 1;
+        if (!json_complete(doc, value)) return -1;
+        if (json_string_equals(doc, member, key)) return value;
+        member = doc->tokens[value].skip;
+    }
+    return -1;
+}
+
+/**
+ * First element of an array (or first member value of an object), or -1
+ */
+static inline int json_first_child(const JsonDoc* doc, int container) {
+    if (container < 0 || container >= doc->count || doc->tokens[container].size == 0) return -1;
+    int child = container + 1;
+    if (doc->tokens[container].type == JSON_OBJECT) child++;
+    return json_complete(doc, child) ? child : -1;
+}
+
+/**
+ * Next element after child in the same container, or -1
+ */
+static inline int json_next_child(const JsonDoc* doc, int container, int child) {
+    int next = doc->tokens[child].skip;
+    if (doc->tokens[container].type == JSON_OBJECT) next++;
+    if (next >= doc->count || doc->tokens[next].parent != container) return -1;
+    return json_complete(doc, next) ? next : -1;
+}
+
+/**
+ * Numeric value of a token, or fallback
+ */
+static inline double json_number(const JsonDoc* doc, int index, double fallback) {
+    if (!json_complete(doc, index) || doc->tokens[index].type != JSON_NUMBER) return fallback;
+    JsonView view = json_view(doc, index);
+    char buffer[64];
+    if (view.length >= sizeof(buffer)) return fallback;
+    memcpy(buffer, view.data, view.length);
+    buffer[view.length] = '\0';
+    return strtod(buffer, NULL);
+}
+
+/**
+ * Boolean value of a token, or fallback
+ */
+static inline bool json_bool(const JsonDoc* doc, int index, bool fallback) {
+    if (!json_complete(doc, index)) return fallback;
+    if (doc->tokens[index].type == JSON_TRUE) return true;
+    if (doc->tokens[index].type == JSON_FALSE) return false;
+    return fallback;
+}
+
+/**
+ * Decode a string member of an object into out; false if absent
+ */
+static inline bool json_get_string(const JsonDoc* doc, int object, const char* key,
+                                   char* out, size_t out_size) {
+    int value = json_object_get(doc, object, key);
+    if (value < 0 || doc->tokens[value].type != JSON_STRING) return false;
+    json_string_copy(doc, value, out, out_size);
+    return true;
+}
+
+#endif // JSON_TOKENIZER_H
@@ -0,0 +1,402 @@
+/**
+ * Shared Message Batches Backend for the C Agent Pattern Templates
+ * Offline execution of many Messages API requests through the batch endpoint
+ *
+ * Work that is not latency sensitive (overnight sectioning or evaluation
+ * runs) can go through the asynchronous Message Batches API, which costs
+ * less and is not bound by per-minute rate limits. A MessageBatch collects
+ * ordinary AnthropicRequests; message_batch_run() submits them as one
+ * batch, polls until the batch has ended, then downloads the results and
+ * maps each one back to its request as an AnthropicResponse, the same
+ * struct the synchronous transport produces.
+ *
+ * Requests already in the transport's response cache are answered without
+ * being sent, and successful results are stored in it. Without
+ * AGENT_TRANSPORT_CURL the batch is answered immediately from the mock
+ * responder registered with the transport. A run is one "message_batch"
+ * span and adds to the same counters as synchronous requests.
+ *
+ * Header-only: include it from a template, after anthropic_transport.h.
+ */
+
+#ifndef MESSAGE_BATCHES_H
+#define MESSAGE_BATCHES_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "arena.h"
+#include "anthropic_transport.h"
+
+#define MESSAGE_BATCHES_URL "https://api.anthropic.com/v1/messages/batches"
+#define MESSAGE_BATCH_POLL_INTERVAL_MS 30000
+#define MESSAGE_BATCH_TIMEOUT_SECONDS (24 * 60 * 60)  // Batches expire after a day
+
+/**
+ * Requests collected for one batch, and their responses after a run
+ */
+typedef struct MessageBatch {
+    AnthropicRequest* requests;  // Strings copied into the arena
+    AnthropicResponse* responses;
+    int count;
+    int capacity;
+    Arena arena;
+    char id[128];  // Provider batch id once submitted
+    int poll_interval_ms;
+    int timeout_seconds;
+    int cache_hits;  // Requests answered without being sent
+} MessageBatch;
+
+/**
+ * Create an empty batch
+ */
+static inline MessageBatch* message_batch_create(void) {
+    MessageBatch* batch = (MessageBatch*)calloc(1, sizeof(MessageBatch));
+    arena_init(&batch->arena, 0);
+    batch->poll_interval_ms = MESSAGE_BATCH_POLL_INTERVAL_MS;
+    batch->timeout_seconds = MESSAGE_BATCH_TIMEOUT_SECONDS;
+    return batch;
+}
+
+/**
+ * Set how often the batch status is polled
+ */
+static inline void message_batch_set_poll_interval(MessageBatch* batch, int interval_ms) {
+    batch->poll_interval_ms = interval_ms > 0 ? interval_ms : MESSAGE_BATCH_POLL_INTERVAL_MS;
+}
+
+static inline const char* message_batch_copy(MessageBatch* batch, const char* s) {
+    return s ? arena_strdup(&batch->arena, s) : NULL;
+}
+
+/**
+ * Copy a request's prompt, joining prompt_iov pieces
+ */
+static inline const char* message_batch_copy_prompt(MessageBatch* batch,
+                                                    const AnthropicRequest* request) {
+    if (!request->prompt_iov) return message_batch_copy(batch, request->prompt);
+
+    size_t length = 0;
+    for (int i = 0; i < request->prompt_iovcnt; i++) length += request->prompt_iov[i].iov_len;
+    char* prompt = (char*)arena_alloc(&batch->arena, length + 1);
+    length = 0;
+    for (int i = 0; i < request->prompt_iovcnt; i++) {
+        memcpy(prompt + length, request->prompt_iov[i].iov_base, request->prompt_iov[i].iov_len);
+        length += request->prompt_iov[i].iov_len;
+    }
+    prompt[length] = '\0';
+    return prompt;
+}
+
+/**
+ * Queue a request; returns its index in the batch
+ */
+static inline int message_batch_add(MessageBatch* batch, const AnthropicRequest* request) {
+    if (batch->count == batch->capacity) {
+        batch->capacity = batch->capacity ? batch->capacity * 2 : 16;
+        batch->requests = (AnthropicRequest*)realloc(batch->requests,
+                                                     batch->capacity * sizeof(AnthropicRequest));
+        batch->responses = (AnthropicResponse*)realloc(batch->responses,
+                                                       batch->capacity * sizeof(AnthropicResponse));
+    }
+
+    AnthropicRequest* copy = &batch->requests[batch->count];
+    *copy = *request;
+    copy->api_key = message_batch_copy(batch, request->api_key);
+    copy->model = message_batch_copy(batch, request->model);
+    copy->system_prompt = message_batch_copy(batch, request->system_prompt);
+    copy->prompt = message_batch_copy_prompt(batch, request);
+    copy->prompt_iov = NULL;
+    copy->cached_prefix = message_batch_copy(batch, request->cached_prefix);
+    memset(&batch->responses[batch->count], 0, sizeof(AnthropicResponse));
+    return batch->count++;
+}
+
+/**
+ * Response for a request after message_batch_run()
+ */
+static inline AnthropicResponse* message_batch_response(MessageBatch* batch, int index) {
+    return index >= 0 && index < batch->count ? &batch->responses[index] : NULL;
+}
+
+/**
+ * Take ownership of a request's response text (NULL if it failed)
+ */
+static inline char* message_batch_take_text(MessageBatch* batch, int index) {
+    AnthropicResponse* response = message_batch_response(batch, index);
+    if (!response) return NULL;
+    char* text = response->text;
+    response->text = NULL;
+    return text;
+}
+
+/**
+ * Record a successful result and store it in the response cache
+ */
+static inline void message_batch_succeed(MessageBatch* batch, int index, ResponseCache* cache,
+                                         char* text) {
+    AnthropicResponse* response = &batch->responses[index];
+    const AnthropicRequest* request = &batch->requests[index];
+    response->text = text;
+    response->status = 200;
+    if (cache && !request->no_cache) {
+        response_cache_put(cache, transport_cache_key(request), text);
+    }
+}
+
+#ifdef AGENT_TRANSPORT_CURL
+
+static size_t message_batch_write_callback(char* data, size_t size, size_t nmemb, void* user_data) {
+    string_builder_append((StringBuilder*)user_data, data, size * nmemb);
+    return size * nmemb;
+}
+
+/**
+ * Blocking request to the batches endpoint; body NULL sends a GET
+ */
+static inline long message_batch_http(const char* url, const char* api_key, const char* body,
+                                      StringBuilder* out) {
+    char key_header[256];
+    snprintf(key_header, sizeof(key_header), "x-api-key: %s", api_key);
+    struct curl_slist* headers = curl_slist_append(NULL, "content-type: application/json");
+    headers = curl_slist_append(headers, "anthropic-version: " TRANSPORT_API_VERSION);
+    headers = curl_slist_append(headers, key_header);
+
+    CURL* easy = curl_easy_init();
+    curl_easy_setopt(easy, CURLOPT_URL, url);
+    curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers);
+    if (body) {
+        curl_easy_setopt(easy, CURLOPT_POSTFIELDS, body);
+        curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, (long)strlen(body));
+    } else {
+        curl_easy_setopt(easy, CURLOPT_HTTPGET, 1L);
+    }
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, message_batch_write_callback);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, out);
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+
+    long status = 0;
+    CURLcode code = curl_easy_perform(easy);
+    if (code == CURLE_OK) {
+        curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+    } else {
+        fprintf(stderr, "Message batch request failed: %s\n", curl_easy_strerror(code));
+    }
+    curl_easy_cleanup(easy);
+    curl_slist_free_all(headers);
+    return status;
+}
+
+/**
+ * Map one line of the results file back to its request
+ */
+static inline void message_batch_apply_result(MessageBatch* batch, ResponseCache* cache,
+                                              const char* line, size_t length) {
+    JsonDoc doc = {0};
+    if (json_parse_alloc(&doc, line, length) != JSON_OK) {
+        json_doc_free(&doc);
+        return;
+    }
+
+    // custom_id is "r<index>"
+    char custom_id[32];
+    int index = -1;
+    if (json_get_string(&doc, 0, "custom_id", custom_id, sizeof(custom_id)) && custom_id[0] == 'r') {
+        index = atoi(custom_id + 1);
+    }
+    int result = json_object_get(&doc, 0, "result");
+    if (index < 0 || index >= batch->count || result < 0) {
+        json_doc_free(&doc);
+        return;
+    }
+
+    AnthropicResponse* response = &batch->responses[index];
+    if (json_string_equals(&doc, json_object_get(&doc, result, "type"), "succeeded")) {
+        int message = json_object_get(&doc, result, "message");
+        char* text = transport_extract_text(&doc, message);
+        transport_parse_usage(&doc, message, &response->usage);
+        if (text) {
+            message_batch_succeed(batch, index, cache, text);
+        } else {
+            response->error = strdup("Response had no text content");
+        }
+    } else {
+        // errored, canceled or expired
+        int error = json_object_get(&doc, json_object_get(&doc, result, "error"), "error");
+        response->error = json_string_dup(&doc, json_object_get(&doc, error, "message"));
+        if (!response->error) {
+            response->error = json_string_dup(&doc, json_object_get(&doc, result, "type"));
+        }
+    }
+    json_doc_free(&doc);
+}
+
+/**
+ * Submit every unanswered request, wait for the batch to end and collect
+ * the results
+ */
+static inline bool message_batch_send(MessageBatch* batch, ResponseCache* cache) {
+    const char* api_key = NULL;
+    StringBuilder body = {0};
+    string_builder_append_str(&body, "{\"requests\":[");
+    int sent = 0;
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->responses[i].text) continue;
+        string_builder_appendf(&body, "%s{\"custom_id\":\"r%d\",\"params\":",
+                               sent++ ? "," : "", i);
+        transport_build_body(&batch->requests[i], false, &body);
+        string_builder_append_str(&body, "}");
+        api_key = batch->requests[i].api_key;
+    }
+    string_builder_append_str(&body, "]}");
+    if (sent == 0) {
+        free(body.data);
+        return true;
+    }
+
+    StringBuilder reply = {0};
+    long status = message_batch_http(MESSAGE_BATCHES_URL, api_key, body.data, &reply);
+    free(body.data);
+
+    JsonToken tokens[JSON_DEFAULT_TOKENS];
+    JsonDoc doc;
+    if (status != 200 || !reply.data ||
+        json_parse(&doc, reply.data, reply.length, tokens, JSON_DEFAULT_TOKENS) != JSON_OK ||
+        !json_get_string(&doc, 0, "id", batch->id, sizeof(batch->id))) {
+        fprintf(stderr, "Message batch was not created (HTTP %ld): %s\n", status,
+                reply.data ? reply.data : "");
+        free(reply.data);
+        return false;
+    }
+
+    // Poll until processing has ended; results_url appears then
+    char url[512];
+    char results_url[1024] = "";
+    snprintf(url, sizeof(url), "%s/%s", MESSAGE_BATCHES_URL, batch->id);
+    time_t deadline = time(NULL) + batch->timeout_seconds;
+    while (!results_url[0] && time(NULL) < deadline) {
+        struct timespec pause = {batch->poll_interval_ms / 1000,
+                                 (long)(batch->poll_interval_ms % 1000) * 1000000L};
+        nanosleep(&pause, NULL);
+
+        reply.length = 0;
+        status = message_batch_http(url, api_key, NULL, &reply);
+        if (status != 200 || !reply.data ||
+            json_parse(&doc, reply.data, reply.length, tokens, JSON_DEFAULT_TOKENS) != JSON_OK) {
+            continue;  // Transient; keep polling until the deadline
+        }
+        if (json_string_equals(&doc, json_object_get(&doc, 0, "processing_status"), "ended")) {
+            json_get_string(&doc, 0, "results_url", results_url, sizeof(results_url));
+        }
+    }
+    if (!results_url[0]) {
+        fprintf(stderr, "Message batch %s did not end in time\n", batch->id);
+        free(reply.data);
+        return false;
+    }
+
+    // Results are JSON Lines in arbitrary order, matched by custom_id
+    reply.length = 0;
+    status = message_batch_http(results_url, api_key, NULL, &reply);
+    if (status == 200 && reply.data) {
+        const char* line = reply.data;
+        const char* end = reply.data + reply.length;
+        while (line < end) {
+            const char* newline = (const char*)memchr(line, '\n', end - line);
+            const char* line_end = newline ? newline : end;
+            if (line_end > line) message_batch_apply_result(batch, cache, line, line_end - line);
+            line = line_end + 1;
+        }
+    }
+    free(reply.data);
+    return status == 200;
+}
+
+#else
+
+/**
+ * Mock build: answer every unanswered request from the mock responder
+ */
+static inline bool message_batch_send(MessageBatch* batch, ResponseCache* cache) {
+    snprintf(batch->id, sizeof(batch->id), "msgbatch_mock");
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->responses[i].text) continue;
+        const AnthropicRequest* request = &batch->requests[i];
+        char* text = transport_mock_responder ? transport_mock_responder(request) : NULL;
+        if (text) {
+            transport_mock_usage(request, text, &batch->responses[i].usage);
+            message_batch_succeed(batch, i, cache, text);
+        }
+    }
+    return true;
+}
+
+#endif
+
+/**
+ * Run the batch to completion through the transport's cache and API key.
+ * Returns false if the batch could not be submitted or did not end; any
+ * request without a response then has an error set.
+ */
+static inline bool message_batch_run(MessageBatch* batch, Transport* transport) {
+    ResponseCache* cache = transport->cache;
+    MetricsSpan span;
+    metrics_span_begin(&span, "message_batch", NULL);
+
+    // Answer what the cache already holds; only the rest is sent
+    for (int i = 0; i < batch->count; i++) {
+        const AnthropicRequest* request = &batch->requests[i];
+        if (!cache || request->no_cache || batch->responses[i].text) continue;
+        char* cached = response_cache_get(cache, transport_cache_key(request));
+        metrics_count(cached ? METRIC_CACHE_HITS : METRIC_CACHE_MISSES, 1);
+        if (cached) {
+            batch->responses[i].text = cached;
+            batch->responses[i].status = 200;
+            batch->cache_hits++;
+        }
+    }
+
+    bool ok = message_batch_send(batch, cache);
+
+    int errors = 0;
+    for (int i = 0; i < batch->count; i++) {
+        AnthropicResponse* response = &batch->responses[i];
+        if (!response->text && !response->error) {
+            response->error = strdup(ok ? "No result for request" : "Batch did not complete");
+        }
+        if (response->error) errors++;
+        metrics_count(METRIC_INPUT_TOKENS, (uint64_t)response->usage.input_tokens);
+        metrics_count(METRIC_OUTPUT_TOKENS, (uint64_t)response->usage.output_tokens);
+        metrics_count(METRIC_CACHE_READ_TOKENS, (uint64_t)response->usage.cache_read_input_tokens);
+        metrics_count(METRIC_CACHE_WRITE_TOKENS,
+                      (uint64_t)response->usage.cache_creation_input_tokens);
+    }
+    metrics_count(METRIC_API_REQUESTS, (uint64_t)(batch->count - batch->cache_hits));
+    metrics_count(METRIC_API_ERRORS, (uint64_t)errors);
+
+    metrics_span_set_int(&span, "anthropic.batch.requests", batch->count);
+    metrics_span_set_int(&span, "anthropic.batch.cache_hits", batch->cache_hits);
+    metrics_span_set_int(&span, "anthropic.batch.errors", errors);
+    span.error = !ok;
+    metrics_span_end(&span);
+    return ok;
+}
+
+/**
+ * Free a batch and any response text not taken
+ */
+static inline void message_batch_free(MessageBatch* batch) {
+    for (int i = 0; i < batch->count; i++) {
+        free(batch->responses[i].text);
+        free(batch->responses[i].error);
+    }
+    free(batch->requests);
+    free(batch->responses);
+    arena_destroy(&batch->arena);
+    free(batch);
+}
+
+#endif // MESSAGE_BATCHES_H
@@ -0,0 +1,592 @@
+/**
+ * Shared Instrumentation for the C Agent Pattern Templates
+ * Counters, latency histograms, trace spans and a pull exporter
+ *
+ * Counters and histograms live in per-thread shards. A thread only ever
+ * writes its own shard, with relaxed atomic loads and stores, so the hot
+ * path takes no lock and issues no read-modify-write instruction. Readers
+ * sum every shard; a snapshot can be taken at any time while other threads
+ * keep counting. Shards are never freed, so counts survive their thread.
+ *
+ * Histograms bucket durations by powers of two of a microsecond, from
+ * under 1 us to about 2 minutes, and keep a count and a sum.
+ *
+ * Spans follow the OpenTelemetry data model: 16-byte trace IDs, 8-byte
+ * span IDs, a parent, start and end times in Unix nanoseconds, an error
+ * status and a few attributes. They cost nothing until a hook is set with
+ * metrics_set_span_hooks(). metrics_enable_trace_file() writes finished
+ * spans as OTLP/JSON lines for a collector to pick up.
+ *
+ * metrics_start_exporter() serves the counters and histograms in the
+ * Prometheus text format over HTTP on a loopback port, so a running
+ * process can be scraped without stopping it. metrics_init_from_env()
+ * enables the exporter from AGENT_METRICS_PORT and the trace file from
+ * AGENT_TRACE_FILE.
+ *
+ * Header-only: include it from a template and compile with -pthread.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define METRICS_HISTOGRAM_BUCKETS 28      // Bucket b counts values under 2^b us; the last is +Inf
+#define METRICS_SPAN_MAX_ATTRIBUTES 8
+#define METRICS_ATTRIBUTE_STRING_SIZE 64
+
+/**
+ * Counters
+ */
+typedef enum {
+    METRIC_API_REQUESTS,       // Requests that reached the API (cache hits excluded)
+    METRIC_API_ERRORS,         // Requests that failed after their retries
+    METRIC_CACHE_HITS,
+    METRIC_CACHE_MISSES,
+    METRIC_RETRIES,
+    METRIC_HEDGES,
+    METRIC_INPUT_TOKENS,
+    METRIC_OUTPUT_TOKENS,
+    METRIC_CACHE_READ_TOKENS,
+    METRIC_CACHE_WRITE_TOKENS,
+    METRIC_POOL_JOBS,
+    METRIC_COUNTER_COUNT
+} MetricsCounter;
+
+/**
+ * Duration histograms
+ */
+typedef enum {
+    METRIC_CALL_LATENCY,     // Submit to completion of an API request
+    METRIC_ADMISSION_WAIT,   // Time spent queued in the rate governor
+    METRIC_QUEUE_WAIT,       // Thread pool job submit to start
+    METRIC_PARSE_TIME,       // JSON parsing of responses, plans and actions
+    METRIC_HISTOGRAM_COUNT
+} MetricsHistogram;
+
+static const char* const metrics_counter_names[METRIC_COUNTER_COUNT] = {
+    "agent_api_requests_total", "agent_api_errors_total", "agent_cache_hits_total",
+    "agent_cache_misses_total", "agent_api_retries_total", "agent_api_hedges_total",
+    "agent_input_tokens_total", "agent_output_tokens_total", "agent_cache_read_tokens_total",
+    "agent_cache_write_tokens_total", "agent_pool_jobs_total"};
+
+static const char* const metrics_histogram_names[METRIC_HISTOGRAM_COUNT] = {
+    "agent_api_call_duration_seconds", "agent_rate_admission_wait_seconds",
+    "agent_pool_queue_wait_seconds", "agent_parse_duration_seconds"};
+
+/**
+ * One thread's counts
+ */
+typedef struct MetricsShard {
+    _Atomic uint64_t counters[METRIC_COUNTER_COUNT];
+    _Atomic uint64_t buckets[METRIC_HISTOGRAM_COUNT][METRICS_HISTOGRAM_BUCKETS];
+    _Atomic uint64_t observed[METRIC_HISTOGRAM_COUNT];
+    _Atomic uint64_t sum_ns[METRIC_HISTOGRAM_COUNT];
+    struct MetricsShard* next;
+} MetricsShard;
+
+/**
+ * Totals over every shard at one point in time
+ */
+typedef struct MetricsSnapshot {
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    uint64_t buckets[METRIC_HISTOGRAM_COUNT][METRICS_HISTOGRAM_BUCKETS];
+    uint64_t observed[METRIC_HISTOGRAM_COUNT];
+    uint64_t sum_ns[METRIC_HISTOGRAM_COUNT];
+} MetricsSnapshot;
+
+/**
+ * Identity of a span, enough to parent a span on another thread
+ */
+typedef struct MetricsSpanContext {
+    uint8_t trace_id[16];
+    uint8_t span_id[8];
+} MetricsSpanContext;
+
+typedef struct MetricsAttribute {
+    const char* key;  // Must be a string literal or outlive the span
+    bool is_string;
+    int64_t int_value;
+    char string_value[METRICS_ATTRIBUTE_STRING_SIZE];  // Copied, truncated
+} MetricsAttribute;
+
+/**
+ * A timed operation; usually lives on the stack of the code it measures
+ */
+typedef struct MetricsSpan {
+    const char* name;  // Must be a string literal or outlive the span
+    MetricsSpanContext context;
+    uint8_t parent_span_id[8];
+    bool has_parent;
+    bool active;       // False when no hook is set; the span records nothing
+    bool current;      // Made the thread's current span by metrics_span_begin
+    bool error;
+    uint64_t start_unix_ns;
+    uint64_t end_unix_ns;
+    MetricsAttribute attributes[METRICS_SPAN_MAX_ATTRIBUTES];
+    int attribute_count;
+    struct MetricsSpan* previous;  // The thread's current span before this one
+} MetricsSpan;
+
+/**
+ * Span hook; set hooks before any span starts
+ */
+typedef void (*MetricsSpanHook)(const MetricsSpan* span, void* user_data);
+
+static _Atomic(MetricsShard*) metrics_shards = NULL;
+static _Thread_local MetricsShard* metrics_thread_shard = NULL;
+static _Thread_local MetricsSpan* metrics_thread_span = NULL;
+static _Thread_local uint64_t metrics_thread_rng = 0;
+
+static MetricsSpanHook metrics_span_on_start = NULL;
+static MetricsSpanHook metrics_span_on_end = NULL;
+static void* metrics_span_user_data = NULL;
+
+static inline uint64_t metrics_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static inline uint64_t metrics_unix_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * This thread's shard, registered on first use
+ */
+static inline MetricsShard* metrics_shard(void) {
+    MetricsShard* shard = metrics_thread_shard;
+    if (shard) return shard;
+
+    shard = (MetricsShard*)calloc(1, sizeof(MetricsShard));
+    shard->next = atomic_load(&metrics_shards);
+    while (!atomic_compare_exchange_weak(&metrics_shards, &shard->next, shard)) {
+    }
+    metrics_thread_shard = shard;
+    return shard;
+}
+
+// Only the owning thread writes a shard, so a load and a store suffice
+static inline void metrics_shard_add(_Atomic uint64_t* slot, uint64_t amount) {
+    atomic_store_explicit(slot, atomic_load_explicit(slot, memory_order_relaxed) + amount,
+                          memory_order_relaxed);
+}
+
+static inline void metrics_count(MetricsCounter counter, uint64_t amount) {
+    if (amount == 0) return;
+    metrics_shard_add(&metrics_shard()->counters[counter], amount);
+}
+
+/**
+ * Record a duration in nanoseconds
+ */
+static inline void metrics_observe_ns(MetricsHistogram histogram, uint64_t ns) {
+    MetricsShard* shard = metrics_shard();
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+    while (bucket < METRICS_HISTOGRAM_BUCKETS - 1 && us >= (1ull << bucket)) bucket++;
+    metrics_shard_add(&shard->buckets[histogram][bucket], 1);
+    metrics_shard_add(&shard->observed[histogram], 1);
+    metrics_shard_add(&shard->sum_ns[histogram], ns);
+}
+
+/**
+ * Record the time since started_ns (from metrics_now_ns)
+ */
+static inline void metrics_observe_since(MetricsHistogram histogram, uint64_t started_ns) {
+    metrics_observe_ns(histogram, metrics_now_ns() - started_ns);
+}
+
+/**
+ * Sum every thread's shard
+ */
+static inline void metrics_snapshot(MetricsSnapshot* snapshot) {
+    memset(snapshot, 0, sizeof(*snapshot));
+    for (MetricsShard* shard = atomic_load(&metrics_shards); shard; shard = shard->next) {
+        for (int c = 0; c < METRIC_COUNTER_COUNT; c++) {
+            snapshot->counters[c] += atomic_load_explicit(&shard->counters[c], memory_order_relaxed);
+        }
+        for (int h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+            for (int b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++) {
+                snapshot->buckets[h][b] +=
+                    atomic_load_explicit(&shard->buckets[h][b], memory_order_relaxed);
+            }
+            snapshot->observed[h] += atomic_load_explicit(&shard->observed[h], memory_order_relaxed);
+            snapshot->sum_ns[h] += atomic_load_explicit(&shard->sum_ns[h], memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Upper bound, in milliseconds, of the bucket holding quantile q; 0 when
+ * nothing was observed
+ */
+static inline double metrics_quantile_ms(const MetricsSnapshot* snapshot,
+                                         MetricsHistogram histogram, double q) {
+    uint64_t total = snapshot->observed[histogram];
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t)(q * (double)total);
+    if (rank >= total) rank = total - 1;
+    uint64_t seen = 0;
+    int b = 0;
+    for (; b < METRICS_HISTOGRAM_BUCKETS - 1; b++) {
+        seen += snapshot->buckets[histogram][b];
+        if (seen > rank) break;
+    }
+    return (double)(1ull << b) / 1000.0;
+}
+
+/**
+ * Write every counter and histogram in the Prometheus text format
+ */
+static inline void metrics_write_prometheus(FILE* out) {
+    MetricsSnapshot snapshot;
+    metrics_snapshot(&snapshot);
+
+    for (int c = 0; c < METRIC_COUNTER_COUNT; c++) {
+        fprintf(out, "# TYPE %s counter\n%s %llu\n", metrics_counter_names[c],
+                metrics_counter_names[c], (unsigned long long)snapshot.counters[c]);
+    }
+    for (int h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+        const char* name = metrics_histogram_names[h];
+        fprintf(out, "# TYPE %s histogram\n", name);
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRICS_HISTOGRAM_BUCKETS - 1; b++) {
+            cumulative += snapshot.buckets[h][b];
+            fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", name, (double)(1ull << b) / 1e6,
+                    (unsigned long long)cumulative);
+        }
+        fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+                (unsigned long long)snapshot.observed[h]);
+        fprintf(out, "%s_sum %.9f\n%s_count %llu\n", name, (double)snapshot.sum_ns[h] / 1e9,
+                name, (unsigned long long)snapshot.observed[h]);
+    }
+}
+
+/**
+ * Short human-readable summary of what was recorded
+ */
+static inline void metrics_print_summary(FILE* out) {
+    MetricsSnapshot s;
+    metrics_snapshot(&s);
+    fprintf(out, "Metrics: %llu API requests (%llu errors, %llu retries, %llu hedges), "
+                 "cache %llu hits / %llu misses, %llu in / %llu out tokens\n",
+            (unsigned long long)s.counters[METRIC_API_REQUESTS],
+            (unsigned long long)s.counters[METRIC_API_ERRORS],
+            (unsigned long long)s.counters[METRIC_RETRIES],
+            (unsigned long long)s.counters[METRIC_HEDGES],
+            (unsigned long long)s.counters[METRIC_CACHE_HITS],
+            (unsigned long long)s.counters[METRIC_CACHE_MISSES],
+            (unsigned long long)s.counters[METRIC_INPUT_TOKENS],
+            (unsigned long long)s.counters[METRIC_OUTPUT_TOKENS]);
+    for (int h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+        if (s.observed[h] == 0) continue;
+        fprintf(out, "  %s: %llu, p50 <= %.3f ms, p95 <= %.3f ms\n", metrics_histogram_names[h],
+                (unsigned long long)s.observed[h], metrics_quantile_ms(&s, h, 0.5),
+                metrics_quantile_ms(&s, h, 0.95));
+    }
+}
+
+/**
+ * Install span hooks (NULL for none); set them before any span starts
+ */
+static inline void metrics_set_span_hooks(MetricsSpanHook on_start, MetricsSpanHook on_end,
+                                          void* user_data) {
+    metrics_span_on_start = on_start;
+    metrics_span_on_end = on_end;
+    metrics_span_user_data = user_data;
+}
+
+static inline uint64_t metrics_random(void) {
+    if (metrics_thread_rng == 0) {
+        metrics_thread_rng = metrics_unix_ns() ^ (uint64_t)(uintptr_t)&metrics_thread_rng;
+        if (metrics_thread_rng == 0) metrics_thread_rng = 1;
+    }
+    // xorshift64*
+    metrics_thread_rng ^= metrics_thread_rng >> 12;
+    metrics_thread_rng ^= metrics_thread_rng << 25;
+    metrics_thread_rng ^= metrics_thread_rng >> 27;
+    return metrics_thread_rng * 0x2545F4914F6CDD1Dull;
+}
+
+/**
+ * Start a span under parent (NULL for a new trace) without making it the
+ * thread's current span; it may end on any thread
+ */
+static inline void metrics_span_start(MetricsSpan* span, const char* name,
+                                      const MetricsSpanContext* parent) {
+    memset(span, 0, sizeof(*span));
+    span->name = name;
+    if (!metrics_span_on_start && !metrics_span_on_end) return;
+
+    span->active = true;
+    uint64_t id = metrics_random();
+    memcpy(span->context.span_id, &id, sizeof(id));
+    if (parent) {
+        memcpy(span->context.trace_id, parent->trace_id, sizeof(span->context.trace_id));
+        memcpy(span->parent_span_id, parent->span_id, sizeof(span->parent_span_id));
+        span->has_parent = true;
+    } else {
+        uint64_t trace[2] = {metrics_random(), metrics_random()};
+        memcpy(span->context.trace_id, trace, sizeof(trace));
+    }
+    span->start_unix_ns = metrics_unix_ns();
+    if (metrics_span_on_start) metrics_span_on_start(span, metrics_span_user_data);
+}
+
+/**
+ * Start a span and make it this thread's current span until it ends. The
+ * parent is parent if given, else the thread's current span (a new trace
+ * if there is none). End it on the same thread.
+ */
+static inline void metrics_span_begin(MetricsSpan* span, const char* name,
+                                      const MetricsSpanContext* parent) {
+    MetricsSpan* enclosing = metrics_thread_span;
+    if (!parent && enclosing && enclosing->active) parent = &enclosing->context;
+    metrics_span_start(span, name, parent);
+    if (!span->active) return;
+    span->current = true;
+    span->previous = enclosing;
+    metrics_thread_span = span;
+}
+
+/**
+ * Start a child of this thread's current span without making it current,
+ * for work that finishes on another thread
+ */
+static inline void metrics_span_begin_async(MetricsSpan* span, const char* name) {
+    MetricsSpan* enclosing = metrics_thread_span;
+    metrics_span_start(span, name, enclosing && enclosing->active ? &enclosing->context : NULL);
+}
+
+/**
+ * A span's context for parenting others; NULL when it records nothing
+ */
+static inline const MetricsSpanContext* metrics_span_context(const MetricsSpan* span) {
+    return span->active ? &span->context : NULL;
+}
+
+/**
+ * This thread's current span, for parenting work handed to other threads;
+ * NULL when there is none
+ */
+static inline const MetricsSpanContext* metrics_current_span_context(void) {
+    MetricsSpan* span = metrics_thread_span;
+    return span && span->active ? &span->context : NULL;
+}
+
+/**
+ * Make a started span this thread's current span, so spans started here
+ * become its children, e.g. while submitting work on its behalf. Returns
+ * the span to put back with metrics_span_restore().
+ */
+static inline MetricsSpan* metrics_span_attach(MetricsSpan* span) {
+    MetricsSpan* previous = metrics_thread_span;
+    metrics_thread_span = span;
+    return previous;
+}
+
+static inline void metrics_span_restore(MetricsSpan* previous) {
+    metrics_thread_span = previous;
+}
+
+static inline MetricsAttribute* metrics_span_attribute(MetricsSpan* span, const char* key) {
+    if (!span->active || span->attribute_count >= METRICS_SPAN_MAX_ATTRIBUTES) return NULL;
+    MetricsAttribute* attribute = &span->attributes[span->attribute_count++];
+    attribute->key = key;
+    return attribute;
+}
+
+static inline void metrics_span_set_int(MetricsSpan* span, const char* key, int64_t value) {
+    MetricsAttribute* attribute = metrics_span_attribute(span, key);
+    if (attribute) attribute->int_value = value;
+}
+
+static inline void metrics_span_set_string(MetricsSpan* span, const char* key, const char* value) {
+    MetricsAttribute* attribute = metrics_span_attribute(span, key);
+    if (!attribute) return;
+    attribute->is_string = true;
+    snprintf(attribute->string_value, sizeof(attribute->string_value), "%s", value ? value : "");
+}
+
+static inline void metrics_span_end(MetricsSpan* span) {
+    if (!span->active) return;
+    span->end_unix_ns = metrics_unix_ns();
+    if (span->current) metrics_thread_span = span->previous;
+    if (metrics_span_on_end) metrics_span_on_end(span, metrics_span_user_data);
+    span->active = false;
+}
+
+static inline void metrics_write_hex(FILE* out, const uint8_t* bytes, size_t length) {
+    for (size_t i = 0; i < length; i++) fprintf(out, "%02x", bytes[i]);
+}
+
+/**
+ * Write a span as one line of OTLP/JSON
+ */
+static inline void metrics_write_span_json(const MetricsSpan* span, FILE* out) {
+    fputs("{\"traceId\":\"", out);
+    metrics_write_hex(out, span->context.trace_id, sizeof(span->context.trace_id));
+    fputs("\",\"spanId\":\"", out);
+    metrics_write_hex(out, span->context.span_id, sizeof(span->context.span_id));
+    fputs("\"", out);
+    if (span->has_parent) {
+        fputs(",\"parentSpanId\":\"", out);
+        metrics_write_hex(out, span->parent_span_id, sizeof(span->parent_span_id));
+        fputs("\"", out);
+    }
+    // Names and keys are code-supplied identifiers; string values are escaped
+    fprintf(out, ",\"name\":\"%s\",\"startTimeUnixNano\":\"%llu\",\"endTimeUnixNano\":\"%llu\","
+                 "\"status\":{\"code\":%d},\"attributes\":[",
+            span->name, (unsigned long long)span->start_unix_ns,
+            (unsigned long long)span->end_unix_ns, span->error ? 2 : 1);
+    for (int i = 0; i < span->attribute_count; i++) {
+        const MetricsAttribute* attribute = &span->attributes[i];
+        fprintf(out, "%s{\"key\":\"%s\",\"value\":{", i > 0 ? "," : "", attribute->key);
+        if (attribute->is_string) {
+            fputs("\"stringValue\":\"", out);
+            for (const char* c = attribute->string_value; *c; c++) {
+                if (*c == '"' || *c == '\\') {
+                    fprintf(out, "\\%c", *c);
+                } else if ((unsigned char)*c < 0x20) {
+                    fprintf(out, "\\u%04x", (unsigned char)*c);
+                } else {
+                    fputc(*c, out);
+                }
+            }
+            fputs("\"}}", out);
+        } else {
+            fprintf(out, "\"intValue\":\"%lld\"}}", (long long)attribute->int_value);
+        }
+    }
+    fputs("]}\n", out);
+}
+
+static pthread_mutex_t metrics_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE* metrics_trace_file = NULL;
+
+static void metrics_trace_file_hook(const MetricsSpan* span, void* user_data) {
+    pthread_mutex_lock(&metrics_trace_lock);
+    metrics_write_span_json(span, (FILE*)user_data);
+    pthread_mutex_unlock(&metrics_trace_lock);
+}
+
+/**
+ * Append finished spans to path as OTLP/JSON lines; false if it cannot be
+ * opened. Replaces any span hooks.
+ */
+static inline bool metrics_enable_trace_file(const char* path) {
+    FILE* file = fopen(path, "a");
+    if (!file) {
+        fprintf(stderr, "Cannot open trace file %s\n", path);
+        return false;
+    }
+    setvbuf(file, NULL, _IOLBF, 0);
+    metrics_trace_file = file;
+    metrics_set_span_hooks(NULL, metrics_trace_file_hook, file);
+    return true;
+}
+
+// Pull exporter state
+static int metrics_exporter_fd = -1;
+static pthread_t metrics_exporter_thread;
+
+static void* metrics_exporter_main(void* arg) {
+    (void)arg;
+    for (;;) {
+        int client = accept(metrics_exporter_fd, NULL, NULL);
+        if (client < 0) break;  // The listening socket was shut down
+
+        // Every request gets the full exposition; the request itself is ignored
+        char request[1024];
+        ssize_t ignored = recv(client, request, sizeof(request), 0);
+        (void)ignored;
+
+        char* body = NULL;
+        size_t body_length = 0;
+        FILE* out = open_memstream(&body, &body_length);
+        metrics_write_prometheus(out);
+        fclose(out);
+
+        char header[128];
+        int header_length = snprintf(header, sizeof(header),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %zu\r\n\r\n", body_length);
+        send(client, header, (size_t)header_length, MSG_NOSIGNAL);
+        send(client, body, body_length, MSG_NOSIGNAL);
+        free(body);
+        close(client);
+    }
+    return NULL;
+}
+
+/**
+ * Serve metrics over HTTP on 127.0.0.1:port from a background thread;
+ * false if the port cannot be bound
+ */
+static inline bool metrics_start_exporter(int port) {
+    if (metrics_exporter_fd >= 0) return true;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 8) != 0) {
+        fprintf(stderr, "Cannot serve metrics on port %d\n", port);
+        close(fd);
+        return false;
+    }
+
+    metrics_exporter_fd = fd;
+    pthread_create(&metrics_exporter_thread, NULL, metrics_exporter_main, NULL);
+    return true;
+}
+
+/**
+ * Start the exporter from AGENT_METRICS_PORT and the trace file from
+ * AGENT_TRACE_FILE, when set
+ */
+static inline void metrics_init_from_env(void) {
+    const char* port = getenv("AGENT_METRICS_PORT");
+    if (port && *port) metrics_start_exporter(atoi(port));
+    const char* trace = getenv("AGENT_TRACE_FILE");
+    if (trace && *trace) metrics_enable_trace_file(trace);
+}
+
+/**
+ * Stop the exporter and close the trace file; spans must have ended
+ */
+static inline void metrics_shutdown(void) {
+    if (metrics_exporter_fd >= 0) {
+        shutdown(metrics_exporter_fd, SHUT_RDWR);
+        pthread_join(metrics_exporter_thread, NULL);
+        close(metrics_exporter_fd);
+        metrics_exporter_fd = -1;
+    }
+    if (metrics_trace_file) {
+        metrics_set_span_hooks(NULL, NULL, NULL);
+        fclose(metrics_trace_file);
+        metrics_trace_file = NULL;
+    }
+}
+
+#endif // METRICS_H
@@ -2,25 +2,31 @@
  * Orchestrator-Workers Pattern Implementation for C
  * Central orchestrator delegates to specialized workers
  *
- * Note: This is a simplified example. In production, use libcurl
- * for HTTP and cJSON for JSON parsing.
+ * Note: This is a simplified example. API calls go through the shared
+ * transport in anthropic_transport.h. In production, use cJSON for JSON
+ * parsing.
  *
  * Compile with:
- * gcc -o orchestrator_workers orchestrator_workers.c -pthread -lcurl -ljson-c
+ * gcc -o orchestrator_workers orchestrator_workers.c -pthread -DAGENT_TRANSPORT_CURL -lcurl -ljson-c
+ * (drop -DAGENT_TRANSPORT_CURL -lcurl to run against the mock responder)
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <pthread.h>
+#include <stdatomic.h>
+
+#include "arena.h"
+#include "thread_pool.h"
+#include "anthropic_transport.h"
+#include "string_builder.h"
 
 // Maximum sizes
 #define MAX_WORKERS 20
-#define MAX_TASKS 50
-#define MAX_DEPENDENCIES 10
 #define MAX_NAME_SIZE 64
-#define MAX_INPUT_SIZE 4096
 #define MAX_OUTPUT_SIZE 16384
 
 /**
@@ -35,14 +41,16 @@ typedef struct WorkerResult {
 } WorkerResult;
 
 /**
- * Subtask definition
+ * Subtask definition. Strings and the dependency list live in the plan's
+ * arena; dependencies are indices of prerequisite tasks in the plan.
  */
 typedef struct SubTask {
-    char id[MAX_NAME_SIZE];
-    char type[MAX_NAME_SIZE];
-    char* description;
-    char* context;  // JSON string
-    char* dependencies[MAX_DEPENDENCIES];
+    int index;
+    const char* id;  // Planner's id, kept for reporting
+    const char* type;
+    const char* description;
+    const char* context;  // JSON string
+    const int* dependencies;
     int dependency_count;
 } SubTask;
 
@@ -62,16 +70,60 @@ typedef struct Worker {
 } Worker;
 
 /**
- * Simplified API call
+ * Mock responder used when the transport is built without libcurl
  */
-char* call_anthropic_api(const char* api_key, const char* model,
-                         const char* prompt, int max_tokens) {
-    printf("API Call (mock) - Model: %s\n", model);
+char* mock_anthropic_api(const AnthropicRequest* request) {
+    printf("API Call (mock) - Model: %s\n", request->model);
     char* response = (char*)malloc(MAX_OUTPUT_SIZE);
-    snprintf(response, MAX_OUTPUT_SIZE, "Mock response for: %.50s...", prompt);
+    if (request->cached_prefix && strstr(request->cached_prefix, "Break down")) {
+        snprintf(response, MAX_OUTPUT_SIZE,
+            "{\n"
+            "  \"tasks\": [\n"
+            "    {\"id\": \"task_1\", \"type\": \"researcher\", \"description\": \"Research the topic\", \"dependencies\": []},\n"
+            "    {\"id\": \"task_2\", \"type\": \"writer\", \"description\": \"Write based on research\", \"dependencies\": [\"task_1\"]}\n"
+            "  ],\n"
+            "  \"synthesis\": \"Combine research and writing into final document\"\n"
+            "}");
+    } else {
+        snprintf(response, MAX_OUTPUT_SIZE, "Mock response for: %.50s...", request->prompt);
+    }
     return response;
 }
 
+/**
+ * Blocking API call through the shared transport; a NULL budget or policy
+ * falls back to the calling thread's
+ */
+char* call_anthropic_api(const char* api_key, const char* model, const char* prompt,
+                         int max_tokens, TokenBudget* budget, const TransportPolicy* policy) {
+    AnthropicRequest request = {.api_key = api_key, .model = model, .prompt = prompt,
+                                .max_tokens = max_tokens, .budget = budget, .policy = policy};
+    return transport_call(transport_default(), &request, NULL);
+}
+
+/**
+ * API call that sends a stable prefix as a prompt-cached block and the
+ * prompt scattered over parts, so task text and results go straight into
+ * the request body without being joined first. A NULL budget or policy
+ * falls back to the calling thread's.
+ */
+char* call_anthropic_api_iov(const char* api_key, const char* model, const char* prefix,
+                             const struct iovec* parts, int part_count, int max_tokens,
+                             TokenBudget* budget, const TransportPolicy* policy,
+                             AnthropicUsage* usage) {
+    AnthropicRequest request = {.api_key = api_key, .model = model, .prompt_iov = parts,
+                                .prompt_iovcnt = part_count, .max_tokens = max_tokens,
+                                .cached_prefix = prefix, .budget = budget, .policy = policy};
+    return transport_call(transport_default(), &request, usage);
+}
+
+/**
+ * iovec over a NUL-terminated string
+ */
+static inline struct iovec iov_str(const char* s) {
+    return (struct iovec){(void*)s, strlen(s)};
+}
+
 /**
  * LLM worker context
  */
@@ -87,19 +139,19 @@ typedef struct LLMWorkerContext {
 WorkerResult* llm_worker_execute(const SubTask* task, void* user_data) {
     LLMWorkerContext* ctx = (LLMWorkerContext*)user_data;
 
-    // Build prompt
-    char prompt[MAX_INPUT_SIZE];
-    snprintf(prompt, sizeof(prompt),
-        "%s\n\nTask: %s\n\nContext:\n%s\n\nProvide your result:",
-        ctx->system_prompt, task->description,
-        task->context ? task->context : "{}");
+    // Build prompt; the worker's role prompt is a cached prefix shared by
+    // every task of this worker type
+    struct iovec parts[] = {iov_str("Task: "), iov_str(task->description),
+                            iov_str("\n\nContext:\n"), iov_str(task->context ? task->context : "{}"),
+                            iov_str("\n\nProvide your result:")};
 
     // Call API
-    char* response = call_anthropic_api(ctx->api_key, ctx->model, prompt, 4096);
+    char* response = call_anthropic_api_iov(ctx->api_key, ctx->model, ctx->system_prompt,
+                                            parts, 5, 4096, NULL, NULL, NULL);
 
     WorkerResult* result = (WorkerResult*)calloc(1, sizeof(WorkerResult));
-    strcpy(result->task_id, task->id);
-    strcpy(result->worker_type, task->type);
+    strncpy(result->task_id, task->id, MAX_NAME_SIZE - 1);
+    strncpy(result->worker_type, task->type, MAX_NAME_SIZE - 1);
 
     if (response) {
         result->result = response;
@@ -138,11 +190,21 @@ void llm_worker_context_free(LLMWorkerContext* ctx) {
 
 /**
  * Orchestration plan
+ *
+ * Dependencies are resolved to task indices while parsing and stored in
+ * CSR form: the prerequisites of task i are
+ * dependencies[dependency_offsets[i] .. dependency_offsets[i + 1]).
+ * Tasks, their strings and both arrays are carved from one arena.
  */
 typedef struct OrchestrationPlan {
     SubTask* tasks;
     int task_count;
+    int* dependency_offsets;
+    int* dependencies;
     char* synthesis;
+    char error[256];  // Why the plan cannot run; empty if it can
+    Arena arena;
+    AnthropicUsage usage;  // Of the planning call
 } OrchestrationPlan;
 
 /**
@@ -154,6 +216,8 @@ typedef struct OrchestrationResult {
     int worker_count;
     char* final_result;
     bool success;
+    AnthropicUsage plan_usage;
+    int synthesis_calls;  // Summaries plus the final call
 } OrchestrationResult;
 
 /**
@@ -164,6 +228,11 @@ typedef struct Orchestrator {
     char* model;
     Worker workers[MAX_WORKERS];
     int worker_count;
+    char* plan_prefix;  // Worker list and plan format, rebuilt when workers change
+    ThreadPool* pool;  // Not owned; NULL uses the shared default pool
+    int reduce_fan_in;  // 0 synthesizes in one call; otherwise nodes per reduce step
+    TokenBudget* budget;  // Not owned; NULL leaves the run unlimited
+    const TransportPolicy* policy;  // Not owned; NULL uses the transport's
 } Orchestrator;
 
 /**
@@ -174,9 +243,46 @@ Orchestrator* orchestrator_create(const char* api_key, const char* model) {
     o->api_key = strdup(api_key);
     o->model = model ? strdup(model) : strdup("claude-sonnet-4-20250514");
     o->worker_count = 0;
+    o->pool = NULL;
+    o->reduce_fan_in = 0;
     return o;
 }
 
+/**
+ * Run workers on a specific pool (shared with other patterns)
+ */
+void orchestrator_set_pool(Orchestrator* o, ThreadPool* pool) {
+    o->pool = pool;
+}
+
+/**
+ * Synthesize hierarchically: every fan_in results are summarized together
+ * as soon as they finish, and the summaries are merged the same way until
+ * the final call sees at most fan_in of them. 0 keeps the single call.
+ */
+void orchestrator_set_reduce_fan_in(Orchestrator* o, int fan_in) {
+    o->reduce_fan_in = fan_in <= 0 ? 0 : (fan_in < 2 ? 2 : fan_in);
+}
+
+/**
+ * Charge planning, every worker and synthesis to a token budget (NULL
+ * removes it). Workers are charged through the thread budget, so custom
+ * workers that make their own calls are covered too; a call that does not
+ * fit fails like any other API error.
+ */
+void orchestrator_set_budget(Orchestrator* o, TokenBudget* budget) {
+    o->budget = budget;
+}
+
+/**
+ * Run planning, every worker and synthesis under a deadline, retry and
+ * hedging policy (NULL reverts to the transport's). Like the budget,
+ * workers get it through the thread policy.
+ */
+void orchestrator_set_policy(Orchestrator* o, const TransportPolicy* policy) {
+    o->policy = policy;
+}
+
 /**
  * Register a worker
  */
@@ -193,6 +299,9 @@ bool orchestrator_register_worker(Orchestrator* o, const char* type,
     worker->user_data = user_data;
     o->worker_count++;
 
+    free(o->plan_prefix);
+    o->plan_prefix = NULL;
+
     return true;
 }
 
@@ -206,31 +315,177 @@ bool orchestrator_register_llm_worker(Orchestrator* o, const char* type,
 }
 
 /**
- * Parse planning response to create subtasks (simplified)
+ * FNV-1a hash for task ids
+ */
+unsigned int task_id_hash(const char* id, size_t length) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)id[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Resolve a task id through the open-addressing id index
+ */
+int task_index_lookup(const OrchestrationPlan* plan, const int* slots,
+                      unsigned int mask, const char* id, size_t length) {
+    for (unsigned int h = task_id_hash(id, length) & mask; slots[h] >= 0; h = (h + 1) & mask) {
+        const char* candidate = plan->tasks[slots[h]].id;
+        if (strncmp(candidate, id, length) == 0 && candidate[length] == '\0') return slots[h];
+    }
+    return -1;
+}
+
+/**
+ * Copy a string or number token into the plan's arena. Planners use
+ * either for ids, so both are accepted.
+ */
+const char* plan_token_text(OrchestrationPlan* plan, const JsonDoc* doc, int index,
+                            const char* fallback) {
+    if (!json_complete(doc, index)) return arena_strdup(&plan->arena, fallback);
+    if (doc->tokens[index].type == JSON_NUMBER) {
+        JsonView view = json_view(doc, index);
+        return arena_strndup(&plan->arena, view.data, view.length);
+    }
+    if (doc->tokens[index].type != JSON_STRING) return arena_strdup(&plan->arena, fallback);
+
+    size_t length = json_string_copy(doc, index, NULL, 0);
+    char* text = (char*)arena_alloc(&plan->arena, length + 1);
+    json_string_copy(doc, index, text, length + 1);
+    return text;
+}
+
+/**
+ * Mark a plan unrunnable; the first error wins
+ */
+void plan_set_error(OrchestrationPlan* plan, const char* format, ...) {
+    if (plan->error[0]) return;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(plan->error, sizeof(plan->error), format, args);
+    va_end(args);
+}
+
+/**
+ * Free a plan and everything in its arena
+ */
+void orchestration_plan_free(OrchestrationPlan* plan) {
+    free(plan->synthesis);
+    arena_destroy(&plan->arena);
+    free(plan);
+}
+
+/**
+ * Parse the planner's JSON into tasks with dependencies resolved to
+ * indices. Problems (malformed JSON, duplicate or unknown ids) are
+ * recorded in plan->error so the plan is rejected before anything runs.
  */
 OrchestrationPlan* parse_plan(const char* response) {
-    // Simplified - in production use proper JSON parsing
     OrchestrationPlan* plan = (OrchestrationPlan*)calloc(1, sizeof(OrchestrationPlan));
+    arena_init(&plan->arena, 0);
+
+    // Plans grow with the task count, so tokens live on the heap
+    JsonDoc doc = {0};
+    const char* start = response ? strchr(response, '{') : NULL;
+    if (!start || json_parse_alloc(&doc, start, strlen(start)) != JSON_OK) {
+        json_doc_free(&doc);
+        plan_set_error(plan, "Plan response is not valid JSON");
+        plan->synthesis = strdup("");
+        plan->dependency_offsets = (int*)arena_alloc(&plan->arena, sizeof(int));
+        plan->dependency_offsets[0] = 0;
+        return plan;
+    }
 
-    // Create mock tasks for demonstration
-    plan->task_count = 2;
-    plan->tasks = (SubTask*)calloc(plan->task_count, sizeof(SubTask));
+    int tasks = json_object_get(&doc, 0, "tasks");
+    int n = tasks >= 0 && doc.tokens[tasks].type == JSON_ARRAY ? doc.tokens[tasks].size : 0;
+    plan->tasks = (SubTask*)arena_alloc(&plan->arena, (n > 0 ? n : 1) * sizeof(SubTask));
+    plan->dependency_offsets = (int*)arena_alloc(&plan->arena, (n + 1) * sizeof(int));
+    plan->dependency_offsets[0] = 0;
+
+    // First pass: task fields, plus dependency counts for the CSR offsets
+    int* dep_arrays = (int*)malloc((n > 0 ? n : 1) * sizeof(int));
+    int item = json_first_child(&doc, tasks);
+    for (int i = 0; i < n && item >= 0; i++, item = json_next_child(&doc, tasks, item)) {
+        SubTask* task = &plan->tasks[plan->task_count++];
+        char fallback_id[32];
+        snprintf(fallback_id, sizeof(fallback_id), "task_%d", i + 1);
+
+        task->index = i;
+        task->id = plan_token_text(plan, &doc, json_object_get(&doc, item, "id"), fallback_id);
+        task->type = plan_token_text(plan, &doc, json_object_get(&doc, item, "type"), "");
+        task->description = plan_token_text(plan, &doc, json_object_get(&doc, item, "description"), "");
+
+        // Context stays raw JSON for the worker prompt
+        int context = json_object_get(&doc, item, "context");
+        JsonView view = context >= 0 ? json_view(&doc, context) : (JsonView){"{}", 2};
+        task->context = arena_strndup(&plan->arena, view.data, view.length);
+
+        int deps = json_object_get(&doc, item, "dependencies");
+        dep_arrays[i] = deps >= 0 && doc.tokens[deps].type == JSON_ARRAY ? deps : -1;
+        task->dependency_count = dep_arrays[i] >= 0 ? doc.tokens[deps].size : 0;
+        plan->dependency_offsets[i + 1] = plan->dependency_offsets[i] + task->dependency_count;
+    }
+    n = plan->task_count;
+
+    // Id index sized to a power of two at least twice the task count
+    unsigned int capacity = 16;
+    while (capacity < (unsigned int)n * 2) capacity <<= 1;
+    unsigned int mask = capacity - 1;
+    int* slots = (int*)malloc(capacity * sizeof(int));
+    for (unsigned int i = 0; i < capacity; i++) slots[i] = -1;
+
+    for (int i = 0; i < n; i++) {
+        const char* id = plan->tasks[i].id;
+        size_t length = strlen(id);
+        if (task_index_lookup(plan, slots, mask, id, length) >= 0) {
+            plan_set_error(plan, "Duplicate task id '%s'", id);
+            continue;
+        }
+        unsigned int h = task_id_hash(id, length) & mask;
+        while (slots[h] >= 0) h = (h + 1) & mask;
+        slots[h] = i;
+    }
 
-    strcpy(plan->tasks[0].id, "task_1");
-    strcpy(plan->tasks[0].type, "researcher");
-    plan->tasks[0].description = strdup("Research the topic");
-    plan->tasks[0].context = strdup("{}");
-    plan->tasks[0].dependency_count = 0;
+    // Second pass: resolve every dependency id to an index exactly once
+    int edge_count = plan->dependency_offsets[n];
+    plan->dependencies = (int*)arena_alloc(&plan->arena, (edge_count > 0 ? edge_count : 1) * sizeof(int));
+    for (int i = 0; i < n; i++) {
+        SubTask* task = &plan->tasks[i];
+        int* out = plan->dependencies + plan->dependency_offsets[i];
+        task->dependencies = out;
+
+        int count = 0;
+        for (int dep = json_first_child(&doc, dep_arrays[i]); dep >= 0 && count < task->dependency_count;
+             dep = json_next_child(&doc, dep_arrays[i], dep)) {
+            char id[256];
+            size_t length;
+            if (doc.tokens[dep].type == JSON_NUMBER) {
+                JsonView view = json_view(&doc, dep);
+                length = view.length < sizeof(id) ? view.length : sizeof(id) - 1;
+                memcpy(id, view.data, length);
+                id[length] = '\0';
+            } else {
+                length = json_string_copy(&doc, dep, id, sizeof(id));
+            }
 
-    strcpy(plan->tasks[1].id, "task_2");
-    strcpy(plan->tasks[1].type, "writer");
-    plan->tasks[1].description = strdup("Write based on research");
-    plan->tasks[1].context = strdup("{}");
-    plan->tasks[1].dependencies[0] = strdup("task_1");
-    plan->tasks[1].dependency_count = 1;
+            int index = length < sizeof(id) ? task_index_lookup(plan, slots, mask, id, length) : -1;
+            if (index < 0) {
+                plan_set_error(plan, "Task '%s' depends on unknown task '%s'", task->id, id);
+                continue;
+            }
+            out[count++] = index;
+        }
+        task->dependency_count = count;
+    }
+    free(slots);
+    free(dep_arrays);
 
-    plan->synthesis = strdup("Combine research and writing into final document");
+    plan->synthesis = json_string_dup(&doc, json_object_get(&doc, 0, "synthesis"));
+    if (!plan->synthesis) plan->synthesis = strdup("Combine the results");
 
+    json_doc_free(&doc);
     return plan;
 }
 
@@ -238,32 +493,37 @@ OrchestrationPlan* parse_plan(const char* response) {
  * Create execution plan
  */
 OrchestrationPlan* orchestrator_create_plan(Orchestrator* o, const char* task) {
-    // Build list of available workers
-    char workers_desc[MAX_INPUT_SIZE];
-    workers_desc[0] = '\0';
+    // The worker list and format only change when workers are registered,
+    // so they form a cached prefix ahead of the task
+    if (!o->plan_prefix) {
+        StringBuilder prefix = {0};
+        string_builder_append_str(&prefix,
+            "Break down the task below into subtasks for specialized workers.\n\n"
+            "Available workers:\n");
+        for (int i = 0; i < o->worker_count; i++) {
+            string_builder_appendf(&prefix, "- %s\n", o->workers[i].type);
+        }
+        string_builder_append_str(&prefix,
+            "\n"
+            "Respond in JSON format:\n"
+            "{\n"
+            "  \"tasks\": [\n"
+            "    {\"id\": \"task_1\", \"type\": \"worker_type\", \"description\": \"...\", \"dependencies\": []}\n"
+            "  ],\n"
+            "  \"synthesis\": \"How to combine results\"\n"
+            "}");
+        o->plan_prefix = string_builder_take(&prefix);
+    }
 
-    for (int i = 0; i < o->worker_count; i++) {
-        char line[256];
-        snprintf(line, sizeof(line), "- %s\n", o->workers[i].type);
-        strcat(workers_desc, line);
-    }
-
-    char prompt[MAX_INPUT_SIZE];
-    snprintf(prompt, sizeof(prompt),
-        "Break down this task into subtasks for specialized workers.\n\n"
-        "Available workers:\n%s\n"
-        "Task: %s\n\n"
-        "Respond in JSON format:\n"
-        "{\n"
-        "  \"tasks\": [\n"
-        "    {\"id\": \"task_1\", \"type\": \"worker_type\", \"description\": \"...\", \"dependencies\": []}\n"
-        "  ],\n"
-        "  \"synthesis\": \"How to combine results\"\n"
-        "}",
-        workers_desc, task);
-
-    char* response = call_anthropic_api(o->api_key, o->model, prompt, 2048);
+    struct iovec parts[] = {iov_str("Task: "), iov_str(task)};
+
+    AnthropicUsage usage = {0};
+    char* response = call_anthropic_api_iov(o->api_key, o->model, o->plan_prefix, parts, 2,
+                                            2048, o->budget, o->policy, &usage);
+    uint64_t parse_started = metrics_now_ns();
     OrchestrationPlan* plan = parse_plan(response);
+    metrics_observe_since(METRIC_PARSE_TIME, parse_started);
+    plan->usage = usage;
     free(response);
 
     return plan;
@@ -282,169 +542,587 @@ Worker* orchestrator_find_worker(Orchestrator* o, const char* type) {
 }
 
 /**
- * Check if all dependencies are completed
+ * Dependents graph, the inverse of the plan's prerequisite lists
+ *
+ * Dependents are stored in CSR form: the tasks that depend on task i are
+ * dependents[dependent_offsets[i] .. dependent_offsets[i + 1]).
+ */
+typedef struct TaskGraph {
+    int task_count;
+    int* dependent_offsets;
+    int* dependents;
+    int* in_degree;
+} TaskGraph;
+
+/**
+ * Free task graph arrays
+ */
+void task_graph_free(TaskGraph* graph) {
+    free(graph->dependent_offsets);
+    free(graph->dependents);
+    free(graph->in_degree);
+    memset(graph, 0, sizeof(TaskGraph));
+}
+
+/**
+ * Build the dependents graph; rejects plans with parse errors or cycles
  */
-bool dependencies_completed(const SubTask* task, const char** completed, int completed_count) {
-    for (int i = 0; i < task->dependency_count; i++) {
-        bool found = false;
-        for (int j = 0; j < completed_count; j++) {
-            if (strcmp(task->dependencies[i], completed[j]) == 0) {
-                found = true;
+bool task_graph_build(const OrchestrationPlan* plan, TaskGraph* graph,
+                      char* error, size_t error_size) {
+    memset(graph, 0, sizeof(TaskGraph));
+    if (plan->error[0]) {
+        snprintf(error, error_size, "%s", plan->error);
+        return false;
+    }
+
+    int n = plan->task_count;
+    graph->task_count = n;
+    graph->dependent_offsets = (int*)calloc(n + 1, sizeof(int));
+    graph->in_degree = (int*)calloc(n > 0 ? n : 1, sizeof(int));
+
+    // Invert the prerequisite CSR: count dependents per prerequisite
+    int edge_count = 0;
+    for (int i = 0; i < n; i++) {
+        const SubTask* task = &plan->tasks[i];
+        for (int j = 0; j < task->dependency_count; j++) {
+            graph->dependent_offsets[task->dependencies[j] + 1]++;
+        }
+        graph->in_degree[i] = task->dependency_count;
+        edge_count += task->dependency_count;
+    }
+
+    for (int i = 0; i < n; i++) {
+        graph->dependent_offsets[i + 1] += graph->dependent_offsets[i];
+    }
+
+    graph->dependents = (int*)malloc((edge_count > 0 ? edge_count : 1) * sizeof(int));
+    int* fill = (int*)malloc((n > 0 ? n : 1) * sizeof(int));
+    memcpy(fill, graph->dependent_offsets, n * sizeof(int));
+    for (int i = 0; i < n; i++) {
+        const SubTask* task = &plan->tasks[i];
+        for (int j = 0; j < task->dependency_count; j++) {
+            graph->dependents[fill[task->dependencies[j]]++] = i;
+        }
+    }
+
+    // Kahn's algorithm on a scratch copy of the in-degrees
+    int* degree = fill;
+    memcpy(degree, graph->in_degree, n * sizeof(int));
+    int* queue = (int*)malloc((n > 0 ? n : 1) * sizeof(int));
+    int head = 0, tail = 0;
+    for (int i = 0; i < n; i++) {
+        if (degree[i] == 0) queue[tail++] = i;
+    }
+    while (head < tail) {
+        int t = queue[head++];
+        for (int k = graph->dependent_offsets[t]; k < graph->dependent_offsets[t + 1]; k++) {
+            if (--degree[graph->dependents[k]] == 0) queue[tail++] = graph->dependents[k];
+        }
+    }
+
+    bool acyclic = tail == n;
+    if (!acyclic) {
+        for (int i = 0; i < n; i++) {
+            if (degree[i] > 0) {
+                snprintf(error, error_size, "Circular dependency involving task '%s'",
+                         plan->tasks[i].id);
                 break;
             }
         }
-        if (!found) return false;
+        task_graph_free(graph);
     }
+
+    free(queue);
+    free(degree);
+    return acyclic;
+}
+
+/**
+ * Check a plan's dependencies before execution
+ */
+bool orchestrator_validate_plan(const OrchestrationPlan* plan, char* error, size_t error_size) {
+    TaskGraph graph;
+    if (!task_graph_build(plan, &graph, error, error_size)) return false;
+    task_graph_free(&graph);
     return true;
 }
 
 /**
- * Worker thread arguments
+ * Nodes waiting at one level of a reduce tree
  */
-typedef struct WorkerThreadArgs {
-    Worker* worker;
-    SubTask* task;
-    WorkerResult** result;
-} WorkerThreadArgs;
+typedef struct ReduceLevel {
+    char** items;  // fan_in slots
+    int count;
+} ReduceLevel;
 
 /**
- * Worker thread function
+ * Hierarchical synthesis. Worker results enter level 0 as they finish;
+ * every fan_in nodes at a level are summarized on the pool into one node
+ * at the next level, while later workers are still running. The final
+ * synthesis call sees at most fan_in nodes however many tasks ran.
  */
-void* worker_thread(void* args) {
-    WorkerThreadArgs* wargs = (WorkerThreadArgs*)args;
-    *wargs->result = wargs->worker->execute(wargs->task, wargs->worker->user_data);
-    return NULL;
+typedef struct ReduceTree {
+    Orchestrator* orchestrator;
+    const char* task;
+    int fan_in;
+    ReduceLevel* levels;
+    int level_count;
+    int leaves_remaining;  // Results not yet added
+    int in_flight;         // Summaries being written
+    pthread_mutex_t lock;
+    ThreadPool* pool;
+    TaskGroup group;
+    atomic_int calls;
+    const MetricsSpanContext* parent_span;  // Parent of every summary span
+} ReduceTree;
+
+/**
+ * One group of nodes being summarized
+ */
+typedef struct ReduceJob {
+    ReduceTree* tree;
+    int level;
+    char** items;
+    int count;
+} ReduceJob;
+
+void reduce_tree_init(ReduceTree* tree, Orchestrator* o, const char* task, int leaf_count) {
+    memset(tree, 0, sizeof(ReduceTree));
+    tree->orchestrator = o;
+    tree->task = task;
+    tree->fan_in = o->reduce_fan_in;
+    tree->leaves_remaining = leaf_count;
+    pthread_mutex_init(&tree->lock, NULL);
+    tree->pool = o->pool ? o->pool : thread_pool_default();
+    task_group_init(&tree->group);
+    atomic_init(&tree->calls, 0);
+    tree->parent_span = metrics_current_span_context();
+}
+
+void reduce_tree_destroy(ReduceTree* tree) {
+    for (int l = 0; l < tree->level_count; l++) {
+        for (int i = 0; i < tree->levels[l].count; i++) {
+            free(tree->levels[l].items[i]);
+        }
+        free(tree->levels[l].items);
+    }
+    free(tree->levels);
+    pthread_mutex_destroy(&tree->lock);
+    task_group_destroy(&tree->group);
 }
 
+void reduce_tree_push(ReduceTree* tree, int level, char* item, bool from_job);
+
 /**
- * Execute tasks respecting dependencies
+ * Summarize one group into a node for the next level
  */
-WorkerResult** orchestrator_execute_tasks(Orchestrator* o, OrchestrationPlan* plan,
-                                           int* result_count) {
-    *result_count = plan->task_count;
-    WorkerResult** results = (WorkerResult**)calloc(plan->task_count, sizeof(WorkerResult*));
+void reduce_job_run(void* args) {
+    ReduceJob* job = (ReduceJob*)args;
+    ReduceTree* tree = job->tree;
+    Orchestrator* o = tree->orchestrator;
+
+    MetricsSpan span;
+    metrics_span_begin(&span, "orchestrator.reduce", tree->parent_span);
+    metrics_span_set_int(&span, "orchestrator.reduce.level", job->level);
+    metrics_span_set_int(&span, "orchestrator.reduce.inputs", job->count);
+
+    StringBuilder prompt = {0};
+    string_builder_appendf(&prompt,
+        "Condense these partial results into one summary that keeps every fact, "
+        "decision and open issue the final answer will need.\n\n"
+        "Original task: %s\n\n"
+        "Partial results:\n", tree->task);
+    for (int i = 0; i < job->count; i++) {
+        string_builder_appendf(&prompt, "%s%s", i > 0 ? "\n---\n" : "", job->items[i]);
+    }
+    string_builder_append_str(&prompt, "\n\nSummary:");
 
-    // Track completed tasks
-    const char** completed = (const char**)calloc(plan->task_count, sizeof(char*));
-    int completed_count = 0;
+    char* summary = call_anthropic_api(o->api_key, o->model, prompt.data, 2048, o->budget,
+                                       o->policy);
+    atomic_fetch_add(&tree->calls, 1);
+    span.error = summary == NULL;
+    metrics_span_end(&span);
 
-    // Track pending tasks
-    bool* pending = (bool*)calloc(plan->task_count, sizeof(bool));
-    for (int i = 0; i < plan->task_count; i++) pending[i] = true;
-    int pending_count = plan->task_count;
+    StringBuilder node = {0};
+    if (summary) {
+        string_builder_appendf(&node, "Summary of %d partial results:\n%s", job->count, summary);
+    } else {
+        // Keep the inputs rather than lose them
+        fprintf(stderr, "Reduce step at level %d failed; passing its inputs up\n", job->level);
+        string_builder_append(&node, prompt.data, prompt.length);
+    }
+    free(summary);
+    string_builder_free(&prompt);
+    for (int i = 0; i < job->count; i++) {
+        free(job->items[i]);
+    }
+    free(job->items);
 
-    while (pending_count > 0) {
-        // Find ready tasks
-        int ready_indices[MAX_TASKS];
-        int ready_count = 0;
+    reduce_tree_push(tree, job->level + 1, string_builder_take(&node), true);
+    free(job);
+}
 
-        for (int i = 0; i < plan->task_count; i++) {
-            if (pending[i] && dependencies_completed(&plan->tasks[i], completed, completed_count)) {
-                ready_indices[ready_count++] = i;
+/**
+ * Add a node (taking ownership); a full level starts a summary job unless
+ * nothing else is coming and the final call can take every node directly
+ */
+void reduce_tree_push(ReduceTree* tree, int level, char* item, bool from_job) {
+    ReduceJob* job = NULL;
+
+    pthread_mutex_lock(&tree->lock);
+    if (from_job) {
+        tree->in_flight--;
+    } else {
+        tree->leaves_remaining--;
+    }
+    if (level >= tree->level_count) {
+        tree->levels = (ReduceLevel*)realloc(tree->levels, (level + 1) * sizeof(ReduceLevel));
+        for (int l = tree->level_count; l <= level; l++) {
+            tree->levels[l].items = (char**)calloc(tree->fan_in, sizeof(char*));
+            tree->levels[l].count = 0;
+        }
+        tree->level_count = level + 1;
+    }
+    ReduceLevel* slot = &tree->levels[level];
+    slot->items[slot->count++] = item;
+
+    if (slot->count == tree->fan_in) {
+        int total = 0;
+        for (int l = 0; l < tree->level_count; l++) total += tree->levels[l].count;
+        bool last = tree->leaves_remaining == 0 && tree->in_flight == 0 && total <= tree->fan_in;
+        if (!last) {
+            job = (ReduceJob*)malloc(sizeof(ReduceJob));
+            *job = (ReduceJob){tree, level, slot->items, slot->count};
+            slot->items = (char**)calloc(tree->fan_in, sizeof(char*));
+            slot->count = 0;
+            tree->in_flight++;
+        }
+    }
+    pthread_mutex_unlock(&tree->lock);
+
+    if (job) thread_pool_submit(tree->pool, &tree->group, reduce_job_run, job);
+}
+
+/**
+ * Add a finished worker result as a level-0 node
+ */
+void reduce_tree_add_result(ReduceTree* tree, const WorkerResult* result) {
+    StringBuilder node = {0};
+    string_builder_appendf(&node, "Worker: %s\nTask: %s\n%s%s", result->worker_type,
+                           result->task_id, result->success ? "Result: " : "FAILED: ",
+                           result->success ? (result->result ? result->result : "")
+                                           : (result->error ? result->error : ""));
+    reduce_tree_push(tree, 0, string_builder_take(&node), false);
+}
+
+/**
+ * Wait for outstanding summaries, fold partial levels until at most
+ * fan_in nodes are left, and write the final response from them
+ */
+char* reduce_tree_finish(ReduceTree* tree, const char* synthesis_instructions) {
+    task_group_wait(tree->pool, &tree->group);
+
+    for (int level = 0; level < tree->level_count; level++) {
+        ReduceJob* job = NULL;
+        pthread_mutex_lock(&tree->lock);
+        int total = 0;
+        for (int l = 0; l < tree->level_count; l++) total += tree->levels[l].count;
+        ReduceLevel* slot = &tree->levels[level];
+        if (total > tree->fan_in && slot->count > 0) {
+            if (level + 1 == tree->level_count) {
+                tree->levels = (ReduceLevel*)realloc(tree->levels,
+                                                     (level + 2) * sizeof(ReduceLevel));
+                tree->levels[level + 1].items = (char**)calloc(tree->fan_in, sizeof(char*));
+                tree->levels[level + 1].count = 0;
+                tree->level_count++;
+                slot = &tree->levels[level];
+            }
+            if (slot->count == 1) {
+                // A lone node moves up as it is
+                ReduceLevel* next = &tree->levels[level + 1];
+                next->items[next->count++] = slot->items[0];
+                slot->count = 0;
+            } else {
+                job = (ReduceJob*)malloc(sizeof(ReduceJob));
+                *job = (ReduceJob){tree, level, slot->items, slot->count};
+                slot->items = (char**)calloc(tree->fan_in, sizeof(char*));
+                slot->count = 0;
+                tree->in_flight++;
             }
         }
+        pthread_mutex_unlock(&tree->lock);
 
-        if (ready_count == 0 && pending_count > 0) {
-            fprintf(stderr, "Circular dependency detected!\n");
-            break;
+        if (job) {
+            thread_pool_submit(tree->pool, &tree->group, reduce_job_run, job);
+            task_group_wait(tree->pool, &tree->group);
         }
+    }
 
-        // Execute ready tasks in parallel
-        pthread_t* threads = (pthread_t*)calloc(ready_count, sizeof(pthread_t));
-        WorkerThreadArgs* args = (WorkerThreadArgs*)calloc(ready_count, sizeof(WorkerThreadArgs));
-
-        for (int i = 0; i < ready_count; i++) {
-            int task_idx = ready_indices[i];
-            SubTask* task = &plan->tasks[task_idx];
-            Worker* worker = orchestrator_find_worker(o, task->type);
-
-            if (!worker) {
-                results[task_idx] = (WorkerResult*)calloc(1, sizeof(WorkerResult));
-                strcpy(results[task_idx]->task_id, task->id);
-                strcpy(results[task_idx]->worker_type, task->type);
-                results[task_idx]->success = false;
-                results[task_idx]->error = strdup("No worker found for type");
-                continue;
-            }
+    // Highest levels first: they summarize the results that finished first
+    Orchestrator* o = tree->orchestrator;
+    StringBuilder prompt = {0};
+    string_builder_appendf(&prompt,
+        "Synthesize these worker results into a final response.\n\n"
+        "Original task: %s\n\n"
+        "Worker results:\n", tree->task);
+    int written = 0;
+    for (int l = tree->level_count - 1; l >= 0; l--) {
+        for (int i = 0; i < tree->levels[l].count; i++) {
+            string_builder_appendf(&prompt, "%s%s", written++ > 0 ? "\n---\n" : "",
+                                   tree->levels[l].items[i]);
+        }
+    }
+    string_builder_appendf(&prompt,
+        "%s\n\n"
+        "Instructions: %s\n\n"
+        "Provide a comprehensive final result:",
+        written > 0 ? "\n---\n" : "", synthesis_instructions);
+
+    char* response = call_anthropic_api(o->api_key, o->model, prompt.data, 4096, o->budget,
+                                        o->policy);
+    atomic_fetch_add(&tree->calls, 1);
+    string_builder_free(&prompt);
+    return response;
+}
+
+/**
+ * Shared state for one scheduled plan execution
+ */
+typedef struct TaskScheduler {
+    Orchestrator* orchestrator;
+    OrchestrationPlan* plan;
+    TaskGraph graph;
+    atomic_int* remaining_deps;
+    WorkerResult** results;
+    ThreadPool* pool;
+    TaskGroup group;
+    struct TaskJob* jobs;
+    ReduceTree* reduce;  // NULL unless results are reduced as they finish
+    const MetricsSpanContext* parent_span;  // Parent of every worker span
+} TaskScheduler;
 
-            args[i].worker = worker;
-            args[i].task = task;
-            args[i].result = &results[task_idx];
+/**
+ * Worker job arguments
+ */
+typedef struct TaskJob {
+    TaskScheduler* scheduler;
+    int task_index;
+} TaskJob;
+
+/**
+ * Create a failed worker result
+ */
+WorkerResult* worker_result_failed(const SubTask* task, const char* error) {
+    WorkerResult* result = (WorkerResult*)calloc(1, sizeof(WorkerResult));
+    strncpy(result->task_id, task->id, MAX_NAME_SIZE - 1);
+    strncpy(result->worker_type, task->type, MAX_NAME_SIZE - 1);
+    result->success = false;
+    result->error = strdup(error);
+    return result;
+}
 
-            pthread_create(&threads[i], NULL, worker_thread, &args[i]);
+/**
+ * Worker job function - runs one task, then releases its dependents
+ */
+void worker_thread(void* args) {
+    TaskJob* job = (TaskJob*)args;
+    TaskScheduler* s = job->scheduler;
+    int t = job->task_index;
+    SubTask* task = &s->plan->tasks[t];
+    MetricsSpan span;
+    metrics_span_begin(&span, "orchestrator.worker", s->parent_span);
+    metrics_span_set_string(&span, "orchestrator.task.id", task->id);
+    metrics_span_set_string(&span, "orchestrator.worker.type", task->type);
+
+    Worker* worker = orchestrator_find_worker(s->orchestrator, task->type);
+    if (worker) {
+        TokenBudget* previous = transport_set_thread_budget(s->orchestrator->budget);
+        const TransportPolicy* previous_policy = transport_set_thread_policy(s->orchestrator->policy);
+        s->results[t] = worker->execute(task, worker->user_data);
+        transport_set_thread_policy(previous_policy);
+        transport_set_thread_budget(previous);
+    } else {
+        s->results[t] = worker_result_failed(task, "No worker found for type");
+    }
+    if (s->reduce) reduce_tree_add_result(s->reduce, s->results[t]);
+    span.error = !s->results[t]->success;
+    metrics_span_end(&span);
+
+    // A dependent starts the moment its last prerequisite finishes; it joins
+    // the same group before this job completes, so the group cannot drain early
+    for (int k = s->graph.dependent_offsets[t]; k < s->graph.dependent_offsets[t + 1]; k++) {
+        int d = s->graph.dependents[k];
+        if (atomic_fetch_sub(&s->remaining_deps[d], 1) == 1) {
+            thread_pool_submit(s->pool, &s->group, worker_thread, &s->jobs[d]);
         }
+    }
+}
 
-        // Wait for ready tasks
-        for (int i = 0; i < ready_count; i++) {
-            if (args[i].worker) {  // Skip tasks that failed to find worker
-                pthread_join(threads[i], NULL);
-            }
+/**
+ * Execute tasks respecting dependencies, feeding each result to reduce
+ * (if any) the moment it is ready
+ */
+WorkerResult** orchestrator_run_tasks(Orchestrator* o, OrchestrationPlan* plan,
+                                      ReduceTree* reduce, int* result_count) {
+    *result_count = plan->task_count;
+    WorkerResult** results = (WorkerResult**)calloc(plan->task_count, sizeof(WorkerResult*));
 
-            int task_idx = ready_indices[i];
-            completed[completed_count++] = plan->tasks[task_idx].id;
-            pending[task_idx] = false;
-            pending_count--;
+    TaskScheduler s;
+    char error[256];
+    if (!task_graph_build(plan, &s.graph, error, sizeof(error))) {
+        // Reject the whole plan up front rather than running part of it
+        fprintf(stderr, "Plan rejected: %s\n", error);
+        for (int i = 0; i < plan->task_count; i++) {
+            results[i] = worker_result_failed(&plan->tasks[i], error);
+            if (reduce) reduce_tree_add_result(reduce, results[i]);
         }
+        return results;
+    }
+
+    s.orchestrator = o;
+    s.plan = plan;
+    s.results = results;
+    s.pool = o->pool ? o->pool : thread_pool_default();
+    s.remaining_deps = (atomic_int*)calloc(plan->task_count, sizeof(atomic_int));
+    s.jobs = (TaskJob*)calloc(plan->task_count, sizeof(TaskJob));
+    s.reduce = reduce;
+    s.parent_span = metrics_current_span_context();
+    task_group_init(&s.group);
 
-        free(threads);
-        free(args);
+    for (int i = 0; i < plan->task_count; i++) {
+        atomic_init(&s.remaining_deps[i], s.graph.in_degree[i]);
+        s.jobs[i].scheduler = &s;
+        s.jobs[i].task_index = i;
     }
 
-    free(completed);
-    free(pending);
+    // Seed the ready queue with tasks that have no dependencies
+    for (int i = 0; i < plan->task_count; i++) {
+        if (s.graph.in_degree[i] == 0) {
+            thread_pool_submit(s.pool, &s.group, worker_thread, &s.jobs[i]);
+        }
+    }
+
+    task_group_wait(s.pool, &s.group);
+
+    task_group_destroy(&s.group);
+    task_graph_free(&s.graph);
+    free(s.remaining_deps);
+    free(s.jobs);
     return results;
 }
 
 /**
- * Synthesize results
+ * Execute tasks respecting dependencies
  */
-char* orchestrator_synthesize(Orchestrator* o, const char* task,
-                               WorkerResult** results, int result_count,
-                               const char* synthesis_instructions) {
-    // Build result summaries
-    char summaries[MAX_OUTPUT_SIZE];
-    summaries[0] = '\0';
+WorkerResult** orchestrator_execute_tasks(Orchestrator* o, OrchestrationPlan* plan,
+                                           int* result_count) {
+    return orchestrator_run_tasks(o, plan, NULL, result_count);
+}
 
-    for (int i = 0; i < result_count; i++) {
-        char summary[2048];
-        if (results[i]->success) {
-            snprintf(summary, sizeof(summary),
-                "Worker: %s\nTask: %s\nResult: %s\n---\n",
-                results[i]->worker_type, results[i]->task_id, results[i]->result);
-        } else {
-            snprintf(summary, sizeof(summary),
-                "Worker: %s\nTask: %s\nFAILED: %s\n---\n",
-                results[i]->worker_type, results[i]->task_id, results[i]->error);
+static char* orchestrator_synthesize_results(Orchestrator* o, const char* task,
+                                             WorkerResult** results, int result_count,
+                                             const char* synthesis_instructions) {
+    if (o->reduce_fan_in > 0) {
+        ReduceTree tree;
+        reduce_tree_init(&tree, o, task, result_count);
+        for (int i = 0; i < result_count; i++) {
+            reduce_tree_add_result(&tree, results[i]);
         }
-        strcat(summaries, summary);
+        char* response = reduce_tree_finish(&tree, synthesis_instructions);
+        reduce_tree_destroy(&tree);
+        return response;
     }
 
-    char prompt[MAX_OUTPUT_SIZE];
-    snprintf(prompt, sizeof(prompt),
+    // The labels around each result are built in one buffer; the results
+    // themselves are sent from the WorkerResults, never copied into it.
+    // ends[i] is where the labels before result i stop.
+    StringBuilder labels = {0};
+    size_t* ends = (size_t*)malloc((result_count + 1) * sizeof(size_t));
+    string_builder_appendf(&labels,
         "Synthesize these worker results into a final response.\n\n"
         "Original task: %s\n\n"
-        "Worker results:\n%s\n\n"
+        "Worker results:\n", task);
+    for (int i = 0; i < result_count; i++) {
+        string_builder_appendf(&labels, "%sWorker: %s\nTask: %s\n%s", i > 0 ? "\n---\n" : "",
+                               results[i]->worker_type, results[i]->task_id,
+                               results[i]->success ? "Result: " : "FAILED: ");
+        ends[i] = labels.length;
+    }
+    string_builder_appendf(&labels,
+        "%s\n\n"
         "Instructions: %s\n\n"
         "Provide a comprehensive final result:",
-        task, summaries, synthesis_instructions);
+        result_count > 0 ? "\n---\n" : "", synthesis_instructions);
 
-    return call_anthropic_api(o->api_key, o->model, prompt, 4096);
+    int part_count = 0;
+    struct iovec* parts = (struct iovec*)malloc((2 * result_count + 1) * sizeof(struct iovec));
+    size_t start = 0;
+    for (int i = 0; i < result_count; i++) {
+        parts[part_count++] = (struct iovec){labels.data + start, ends[i] - start};
+        const char* body = results[i]->success ? results[i]->result : results[i]->error;
+        parts[part_count++] = iov_str(body ? body : "");
+        start = ends[i];
+    }
+    parts[part_count++] = (struct iovec){labels.data + start, labels.length - start};
+
+    char* response = call_anthropic_api_iov(o->api_key, o->model, NULL, parts, part_count, 4096,
+                                            o->budget, o->policy, NULL);
+    free(parts);
+    free(ends);
+    string_builder_free(&labels);
+    return response;
+}
+
+/**
+ * Synthesize results
+ */
+char* orchestrator_synthesize(Orchestrator* o, const char* task,
+                               WorkerResult** results, int result_count,
+                               const char* synthesis_instructions) {
+    MetricsSpan span;
+    metrics_span_begin(&span, "orchestrator.synthesize", NULL);
+    metrics_span_set_int(&span, "orchestrator.results", result_count);
+    metrics_span_set_int(&span, "orchestrator.reduce_fan_in", o->reduce_fan_in);
+    char* response = orchestrator_synthesize_results(o, task, results, result_count,
+                                                     synthesis_instructions);
+    span.error = response == NULL;
+    metrics_span_end(&span);
+    return response;
 }
 
 /**
  * Execute orchestration
  */
 OrchestrationResult* orchestrator_execute(Orchestrator* o, const char* task) {
+    MetricsSpan span;
+    metrics_span_begin(&span, "orchestrator.run", NULL);
+
     // Step 1: Plan
     OrchestrationPlan* plan = orchestrator_create_plan(o, task);
+    metrics_span_set_int(&span, "orchestrator.tasks", plan->task_count);
 
-    // Step 2: Execute with dependencies
+    // Step 2: Execute with dependencies; in reduce mode finished results
+    // are summarized while the rest are still running
     int worker_count;
-    WorkerResult** worker_results = orchestrator_execute_tasks(o, plan, &worker_count);
+    WorkerResult** worker_results;
+    char* final_result;
+    int synthesis_calls = 1;
+    if (o->reduce_fan_in > 0) {
+        ReduceTree tree;
+        reduce_tree_init(&tree, o, task, plan->task_count);
+        worker_results = orchestrator_run_tasks(o, plan, &tree, &worker_count);
+
+        // Step 3: Merge what is left of the tree
+        final_result = reduce_tree_finish(&tree, plan->synthesis);
+        synthesis_calls = atomic_load(&tree.calls);
+        reduce_tree_destroy(&tree);
+    } else {
+        worker_results = orchestrator_execute_tasks(o, plan, &worker_count);
 
-    // Step 3: Synthesize
-    char* final_result = orchestrator_synthesize(o, task, worker_results, worker_count,
-                                                  plan->synthesis);
+        // Step 3: Synthesize
+        final_result = orchestrator_synthesize(o, task, worker_results, worker_count,
+                                               plan->synthesis);
+    }
 
     // Check success
     bool success = true;
@@ -462,19 +1140,13 @@ OrchestrationResult* orchestrator_execute(Orchestrator* o, const char* task) {
     result->worker_count = worker_count;
     result->final_result = final_result;
     result->success = success;
+    result->plan_usage = plan->usage;
+    result->synthesis_calls = synthesis_calls;
 
-    // Free plan
-    for (int i = 0; i < plan->task_count; i++) {
-        free(plan->tasks[i].description);
-        free(plan->tasks[i].context);
-        for (int j = 0; j < plan->tasks[i].dependency_count; j++) {
-            free(plan->tasks[i].dependencies[j]);
-        }
-    }
-    free(plan->tasks);
-    free(plan->synthesis);
-    free(plan);
+    orchestration_plan_free(plan);
 
+    span.error = !success;
+    metrics_span_end(&span);
     return result;
 }
 
@@ -506,6 +1178,7 @@ void orchestration_result_free(OrchestrationResult* result) {
 void orchestrator_free(Orchestrator* o) {
     free(o->api_key);
     free(o->model);
+    free(o->plan_prefix);
 
     for (int i = 0; i < o->worker_count; i++) {
         free(o->workers[i].system_prompt);
@@ -526,10 +1199,32 @@ int main() {
         return 1;
     }
 
+    transport_set_mock_responder(mock_anthropic_api);
+
+    // AGENT_METRICS_PORT serves Prometheus metrics on loopback;
+    // AGENT_TRACE_FILE appends one OTLP/JSON line per finished span
+    metrics_init_from_env();
+
+    // Repeated prompts are served from cache; set AGENT_CACHE_FILE to keep
+    // answers across runs
+    ResponseCache* cache = transport_enable_cache(transport_default(), 256, 3600,
+                                                  getenv("AGENT_CACHE_FILE"));
+
     printf("=== Orchestrator-Workers Pattern ===\n\n");
 
-    // Create orchestrator
+    // Create orchestrator; one token ceiling covers planning, workers and
+    // synthesis
     Orchestrator* orchestrator = orchestrator_create(api_key, NULL);
+    TokenBudget budget;
+    token_budget_init(&budget, 100000);
+    orchestrator_set_budget(orchestrator, &budget);
+
+    // Every call gets a minute, retries on 429/529 and a hedge once it runs
+    // past the p95 of recent calls
+    TransportPolicy policy = transport_default_policy;
+    policy.timeout_ms = 60000;
+    policy.hedge_after_ms = TRANSPORT_HEDGE_P95;
+    orchestrator_set_policy(orchestrator, &policy);
 
     // Register workers
     orchestrator_register_llm_worker(orchestrator, "researcher",
@@ -547,7 +1242,10 @@ int main() {
 
     // Print results
     printf("Task: %s\n", result->task);
-    printf("Success: %s\n\n", result->success ? "yes" : "no");
+    printf("Success: %s\n", result->success ? "yes" : "no");
+    printf("Planning tokens: %d input, %d cache write, %d cache read\n\n",
+           result->plan_usage.input_tokens, result->plan_usage.cache_creation_input_tokens,
+           result->plan_usage.cache_read_input_tokens);
 
     printf("Worker Results:\n");
     for (int i = 0; i < result->worker_count; i++) {
@@ -559,9 +1257,40 @@ int main() {
 
     printf("\nFinal Result:\n%s\n", result->final_result);
 
+    // Hierarchical synthesis: nine results reduced three at a time
+    printf("\n=== Hierarchical Synthesis (fan-in 3) ===\n\n");
+    orchestrator_set_reduce_fan_in(orchestrator, 3);
+    WorkerResult* sections[9];
+    for (int i = 0; i < 9; i++) {
+        sections[i] = (WorkerResult*)calloc(1, sizeof(WorkerResult));
+        snprintf(sections[i]->task_id, MAX_NAME_SIZE, "section_%d", i + 1);
+        strcpy(sections[i]->worker_type, "writer");
+        char text[128];
+        snprintf(text, sizeof(text), "Error handling advice, part %d of 9", i + 1);
+        sections[i]->result = strdup(text);
+        sections[i]->success = true;
+    }
+    char* merged = orchestrator_synthesize(orchestrator,
+        "Create a guide on best practices for error handling in C", sections, 9,
+        "Merge the sections into one guide");
+    printf("\nMerged Result:\n%s\n", merged ? merged : "(failed)");
+    free(merged);
+    for (int i = 0; i < 9; i++) {
+        worker_result_free(sections[i]);
+    }
+
+    token_budget_print(&budget, "Orchestrator", stdout);
+
     // Cleanup
     orchestration_result_free(result);
     orchestrator_free(orchestrator);
+    token_budget_destroy(&budget);
+
+    metrics_print_summary(stdout);
+    response_cache_print_stats(cache, stdout);
+    transport_set_cache(transport_default(), NULL);
+    response_cache_destroy(cache);
+    metrics_shutdown();
 
     return 0;
 }
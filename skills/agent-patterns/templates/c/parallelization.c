@@ -2,11 +2,13 @@
  * Parallelization Pattern Implementation for C
  * Concurrent LLM calls with sectioning, voting, and guardrails
  *
- * Note: This example uses POSIX threads. In production, use libcurl
- * for HTTP and cJSON for JSON parsing.
+ * Note: Work runs on the shared worker pool from thread_pool.h and API
+ * calls go through the shared transport in anthropic_transport.h. In
+ * production, use cJSON for JSON parsing.
  *
  * Compile with:
- * gcc -o parallelization parallelization.c -pthread -lcurl -ljson-c
+ * gcc -o parallelization parallelization.c -pthread -DAGENT_TRANSPORT_CURL -lcurl -ljson-c
+ * (drop -DAGENT_TRANSPORT_CURL -lcurl to run against the mock responder)
  */
 
 #include <stdio.h>
@@ -14,12 +16,19 @@
 #include <string.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "thread_pool.h"
+#include "anthropic_transport.h"
+#include "message_batches.h"
 
 // Maximum sizes
 #define MAX_SECTIONS 50
-#define MAX_VOTERS 10
+#define MAX_VOTERS 256
+#define DEFAULT_MAX_VOTERS 64
 #define MAX_GUARDRAILS 10
-#define MAX_INPUT_SIZE 4096
 #define MAX_OUTPUT_SIZE 16384
 #define MAX_NAME_SIZE 64
 
@@ -32,61 +41,150 @@ typedef struct SectionResult {
     char* result;
     bool success;
     char* error;
+    int attempts;      // Requests sent, retries and hedges included
+    double start_ms;   // Relative to the start of sectioning_process
+    double finish_ms;
 } SectionResult;
 
 /**
- * Arguments for section worker thread
+ * Arguments for section worker job
  */
 typedef struct SectionWorkerArgs {
     int index;
     const char* section;
     const char* api_key;
     const char* model;
-    const char* prompt_template;  // Format string with %s for section
+    const char* prompt_template;  // Prompt with %s where the section goes
+    const TransportPolicy* policy;
+    const MetricsSpanContext* parent_span;  // The sectioning run's span
+    double epoch_ms;
     SectionResult* result;
 } SectionWorkerArgs;
 
 /**
- * Simplified API call - in production, use libcurl
+ * Monotonic clock in milliseconds
  */
-char* call_anthropic_api(const char* api_key, const char* model,
-                         const char* prompt, int max_tokens) {
-    // NOTE: Placeholder - implement using libcurl in production
-    printf("API Call (mock) - Model: %s\n", model);
+double monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * Mock responder used when the transport is built without libcurl
+ */
+char* mock_anthropic_api(const AnthropicRequest* request) {
+    printf("API Call (mock) - Model: %s\n", request->model);
 
     // Mock response
     char* response = (char*)malloc(MAX_OUTPUT_SIZE);
-    snprintf(response, MAX_OUTPUT_SIZE, "Mock response for: %.50s...", prompt);
+    snprintf(response, MAX_OUTPUT_SIZE, "Mock response for: %.50s...", request->prompt);
     return response;
 }
 
 /**
- * Section worker thread function
+ * Blocking API call through the shared transport
  */
-void* section_worker(void* args) {
-    SectionWorkerArgs* worker = (SectionWorkerArgs*)args;
+char* call_anthropic_api(const char* api_key, const char* model,
+                         const char* prompt, int max_tokens) {
+    AnthropicRequest request = {.api_key = api_key, .model = model, .prompt = prompt,
+                                .max_tokens = max_tokens};
+    return transport_call(transport_default(), &request, NULL);
+}
 
-    // Format prompt
-    char prompt[MAX_INPUT_SIZE];
-    snprintf(prompt, sizeof(prompt), worker->prompt_template, worker->section);
+/**
+ * Resolve a parallelizer's pool (NULL means the shared default pool)
+ */
+ThreadPool* parallelizer_pool(ThreadPool* pool) {
+    return pool ? pool : thread_pool_default();
+}
+
+/**
+ * Scatter a section prompt over parts: the template around its first %s,
+ * with the section itself in between, so sections are never copied into
+ * a prompt buffer
+ */
+int section_prompt_parts(const char* prompt_template, const char* section,
+                         struct iovec parts[3]) {
+    const char* slot = strstr(prompt_template, "%s");
+    if (!slot) {
+        parts[0] = (struct iovec){(void*)prompt_template, strlen(prompt_template)};
+        return 1;
+    }
+    parts[0] = (struct iovec){(void*)prompt_template, (size_t)(slot - prompt_template)};
+    parts[1] = (struct iovec){(void*)section, strlen(section)};
+    parts[2] = (struct iovec){(void*)(slot + 2), strlen(slot + 2)};
+    return 3;
+}
+
+/**
+ * Section worker job
+ */
+void section_worker(void* args) {
+    SectionWorkerArgs* worker = (SectionWorkerArgs*)args;
+    worker->result->start_ms = monotonic_ms() - worker->epoch_ms;
+    MetricsSpan span;
+    metrics_span_begin(&span, "sectioning.section", worker->parent_span);
+    metrics_span_set_int(&span, "sectioning.section.index", worker->index);
 
     // Call API
-    char* response = call_anthropic_api(worker->api_key, worker->model, prompt, 4096);
+    struct iovec parts[3];
+    AnthropicRequest request = {.api_key = worker->api_key, .model = worker->model,
+                                .prompt_iov = parts, .max_tokens = 4096,
+                                .policy = worker->policy};
+    request.prompt_iovcnt = section_prompt_parts(worker->prompt_template, worker->section, parts);
+    TransportFuture* future = transport_submit(transport_default(), &request, NULL, NULL);
+    AnthropicResponse* response = transport_future_wait(future);
 
     // Store result
     worker->result->index = worker->index;
     worker->result->section = strdup(worker->section);
-    if (response) {
-        worker->result->result = response;
+    worker->result->attempts = response->attempts;
+    if (response->text) {
+        worker->result->result = response->text;
+        response->text = NULL;
         worker->result->success = true;
         worker->result->error = NULL;
     } else {
         worker->result->result = NULL;
         worker->result->success = false;
-        worker->result->error = strdup("API call failed");
+        worker->result->error = strdup(response->error ? response->error : "API call failed");
     }
+    transport_future_release(future);
+    span.error = !worker->result->success;
+    metrics_span_end(&span);
 
-    return NULL;
+    worker->result->finish_ms = monotonic_ms() - worker->epoch_ms;
+}
+
+/**
+ * How sections are scheduled when max_concurrency is set
+ */
+typedef enum {
+    SECTIONING_BATCHED,         // Fixed batches, each joined before the next
+    SECTIONING_SLIDING_WINDOW,  // Start the next section as soon as a slot frees
+    SECTIONING_MESSAGE_BATCH    // One offline Message Batches job; concurrency is ignored
+} SectioningMode;
+
+/**
+ * Shared state for the sliding-window lanes
+ */
+typedef struct SectioningWindow {
+    atomic_int next_index;
+    int section_count;
+    SectionWorkerArgs* args;
+} SectioningWindow;
+
+/**
+ * Sliding-window lane job - keeps claiming sections until none are left
+ */
+void sectioning_lane(void* arg) {
+    SectioningWindow* window = (SectioningWindow*)arg;
+    for (;;) {
+        int i = atomic_fetch_add(&window->next_index, 1);
+        if (i >= window->section_count) break;
+        section_worker(&window->args[i]);
+    }
 }
 
 /**
@@ -97,6 +195,9 @@ typedef struct SectioningParallelizer {
     char* model;
     char* prompt_template;
     int max_concurrency;
+    SectioningMode mode;
+    ThreadPool* pool;  // Not owned; NULL uses the shared default pool
+    const TransportPolicy* policy;  // Not owned; NULL uses the transport's
 } SectioningParallelizer;
 
 /**
@@ -108,6 +209,9 @@ SectioningParallelizer* sectioning_create(const char* api_key, const char* promp
     p->model = strdup("claude-sonnet-4-20250514");
     p->prompt_template = strdup(prompt_template);
     p->max_concurrency = 0;  // No limit by default
+    p->mode = SECTIONING_BATCHED;
+    p->pool = NULL;
+    p->policy = NULL;
     return p;
 }
 
@@ -118,6 +222,59 @@ void sectioning_set_concurrency(SectioningParallelizer* p, int max) {
     p->max_concurrency = max;
 }
 
+/**
+ * Set scheduling mode
+ */
+void sectioning_set_mode(SectioningParallelizer* p, SectioningMode mode) {
+    p->mode = mode;
+}
+
+/**
+ * Run sections on a specific pool (shared with other parallelizers)
+ */
+void sectioning_set_pool(SectioningParallelizer* p, ThreadPool* pool) {
+    p->pool = pool;
+}
+
+/**
+ * Give each section a deadline, retries and hedging (NULL reverts to the
+ * transport's policy); message batch mode ignores it
+ */
+void sectioning_set_policy(SectioningParallelizer* p, const TransportPolicy* policy) {
+    p->policy = policy;
+}
+
+/**
+ * Run every section as one Message Batches job; slower to finish but
+ * cheaper, for work that is not latency sensitive
+ */
+void sectioning_process_message_batch(SectioningParallelizer* p, SectionWorkerArgs* args,
+                                      int section_count) {
+    MessageBatch* batch = message_batch_create();
+    for (int i = 0; i < section_count; i++) {
+        struct iovec parts[3];
+        AnthropicRequest request = {.api_key = p->api_key, .model = p->model,
+                                    .prompt_iov = parts, .max_tokens = 4096};
+        request.prompt_iovcnt = section_prompt_parts(p->prompt_template, args[i].section, parts);
+        message_batch_add(batch, &request);
+        args[i].result->start_ms = 0;
+    }
+
+    message_batch_run(batch, transport_default());
+
+    for (int i = 0; i < section_count; i++) {
+        SectionResult* result = args[i].result;
+        AnthropicResponse* response = message_batch_response(batch, i);
+        result->index = i;
+        result->section = strdup(args[i].section);
+        result->result = message_batch_take_text(batch, i);
+        result->success = result->result != NULL;
+        result->error = result->success ? NULL : strdup(response->error);
+        result->finish_ms = monotonic_ms() - args[i].epoch_ms;
+    }
+    message_batch_free(batch);
+}
+
 /**
  * Process sections in parallel
  */
@@ -126,37 +283,63 @@ SectionResult* sectioning_process(SectioningParallelizer* p,
                                    int* result_count) {
     *result_count = section_count;
     SectionResult* results = (SectionResult*)calloc(section_count, sizeof(SectionResult));
-
-    pthread_t* threads = (pthread_t*)calloc(section_count, sizeof(pthread_t));
     SectionWorkerArgs* args = (SectionWorkerArgs*)calloc(section_count, sizeof(SectionWorkerArgs));
 
-    // Determine batch size
-    int batch_size = (p->max_concurrency > 0) ? p->max_concurrency : section_count;
+    ThreadPool* pool = parallelizer_pool(p->pool);
+    TaskGroup group;
+    task_group_init(&group);
+    MetricsSpan span;
+    metrics_span_begin(&span, "sectioning.run", NULL);
+    metrics_span_set_int(&span, "sectioning.sections", section_count);
 
-    for (int batch_start = 0; batch_start < section_count; batch_start += batch_size) {
-        int batch_end = batch_start + batch_size;
-        if (batch_end > section_count) batch_end = section_count;
+    double epoch_ms = monotonic_ms();
+    for (int i = 0; i < section_count; i++) {
+        args[i].index = i;
+        args[i].section = sections[i];
+        args[i].api_key = p->api_key;
+        args[i].model = p->model;
+        args[i].prompt_template = p->prompt_template;
+        args[i].policy = p->policy;
+        args[i].parent_span = metrics_span_context(&span);
+        args[i].epoch_ms = epoch_ms;
+        args[i].result = &results[i];
+    }
 
-        // Start threads for this batch
-        for (int i = batch_start; i < batch_end; i++) {
-            args[i].index = i;
-            args[i].section = sections[i];
-            args[i].api_key = p->api_key;
-            args[i].model = p->model;
-            args[i].prompt_template = p->prompt_template;
-            args[i].result = &results[i];
+    // Determine batch size
+    int batch_size = (p->max_concurrency > 0) ? p->max_concurrency : section_count;
 
-            pthread_create(&threads[i], NULL, section_worker, &args[i]);
+    if (p->mode == SECTIONING_MESSAGE_BATCH) {
+        sectioning_process_message_batch(p, args, section_count);
+    } else if (p->mode == SECTIONING_SLIDING_WINDOW && batch_size < section_count) {
+        // batch_size lanes, each pulling the next unstarted section; results
+        // still land at their own index
+        SectioningWindow window;
+        atomic_init(&window.next_index, 0);
+        window.section_count = section_count;
+        window.args = args;
+
+        for (int lane = 0; lane < batch_size; lane++) {
+            thread_pool_submit(pool, &group, sectioning_lane, &window);
         }
+        task_group_wait(pool, &group);
+    } else {
+        for (int batch_start = 0; batch_start < section_count; batch_start += batch_size) {
+            int batch_end = batch_start + batch_size;
+            if (batch_end > section_count) batch_end = section_count;
+
+            // Submit this batch
+            for (int i = batch_start; i < batch_end; i++) {
+                thread_pool_submit(pool, &group, section_worker, &args[i]);
+            }
 
-        // Wait for this batch to complete
-        for (int i = batch_start; i < batch_end; i++) {
-            pthread_join(threads[i], NULL);
+            // Wait for this batch to complete
+            task_group_wait(pool, &group);
         }
     }
 
-    free(threads);
+    task_group_destroy(&group);
     free(args);
+    metrics_span_end(&span);
     return results;
 }
 
@@ -194,61 +377,197 @@ typedef struct VoteResult {
 typedef struct VotingResult {
     char* winner;
     int winner_count;
+    double winner_weight;  // Equals winner_count unless votes are weighted
+    int unique_answers;
     int total_votes;
+    int votes_consumed;  // Responses tallied before the result was decided
+    bool early_exit;     // Quorum reached before every voter answered
+    int voters_dropped;  // Voters not asked because the budget could not pay for them
     VoteResult* all_responses;
     int response_count;
 } VotingResult;
 
+/**
+ * Interned answer in the tally table; each distinct answer is stored once
+ */
 typedef struct VoteCount {
-    char* answer;
+    char* answer;  // NULL marks an empty slot
+    uint64_t hash;
     int count;
+    double weight;
 } VoteCount;
 
+/**
+ * Extract answer callback type
+ */
+typedef char* (*ExtractAnswerFunc)(const char* response);
+
+/**
+ * Vote weight callback type; results are clamped to [0, 1]
+ */
+typedef double (*VoteWeightFunc)(const char* response, const char* answer, int voter_index,
+                                 void* user_data);
+
+/**
+ * Voting parallelizer
+ */
+typedef struct VotingParallelizer {
+    char* api_key;
+    char* model;
+    int num_voters;
+    int max_voters;
+    ExtractAnswerFunc extract_answer;
+    VoteWeightFunc weight;  // NULL counts every vote as 1
+    void* weight_user_data;
+    bool quorum;  // Return as soon as the winner cannot be overtaken
+    Transport* transport;  // Not owned; NULL uses the shared default transport
+    TokenBudget* budget;   // Not owned; NULL leaves voters unlimited
+    const TransportPolicy* policy;  // Not owned; NULL uses the transport's
+} VotingParallelizer;
+
+/**
+ * Tally shared between voting_vote and the voter callbacks. Stragglers
+ * can outlive the call, so the session is reference counted.
+ */
+typedef struct VoteSession {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    atomic_int refs;
+    ExtractAnswerFunc extract_answer;
+    VoteWeightFunc weight;
+    void* weight_user_data;
+    bool quorum;
+    int num_voters;
+    int reported;  // Voters that answered or failed before the decision
+    bool decided;
+    VoteResult* results;  // Handed to the caller once decided
+    struct VotingWorkerArgs* args;
+    VoteCount* votes;  // Open-addressed, capacity is a power of two
+    size_t capacity;
+    int unique_votes;
+    VoteCount* leader;
+    double runner_up;  // Highest weight among the other answers
+} VoteSession;
+
 typedef struct VotingWorkerArgs {
     int index;
-    const char* prompt;
-    const char* api_key;
-    const char* model;
-    VoteResult* result;
+    VoteSession* session;
 } VotingWorkerArgs;
 
 /**
- * Vote worker thread
+ * FNV-1a hash of an answer
  */
-void* vote_worker(void* args) {
-    VotingWorkerArgs* worker = (VotingWorkerArgs*)args;
+uint64_t vote_answer_hash(const char* answer) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (const unsigned char* p = (const unsigned char*)answer; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
 
-    char* response = call_anthropic_api(worker->api_key, worker->model,
-                                        worker->prompt, 1024);
+/**
+ * Drop one reference to a vote session
+ */
+void vote_session_release(VoteSession* session) {
+    if (atomic_fetch_sub(&session->refs, 1) != 1) return;
 
-    worker->result->index = worker->index;
-    if (response) {
-        worker->result->response = response;
-        worker->result->success = true;
-        worker->result->error = NULL;
-    } else {
-        worker->result->response = NULL;
-        worker->result->success = false;
-        worker->result->error = strdup("API call failed");
+    for (size_t i = 0; i < session->capacity; i++) {
+        free(session->votes[i].answer);
+    }
+    free(session->votes);
+    free(session->args);
+    pthread_mutex_destroy(&session->lock);
+    pthread_cond_destroy(&session->cond);
+    free(session);
+}
+
+/**
+ * Count one answer, taking ownership of it (session lock held). The table
+ * holds at least twice as many slots as voters, so probing always ends.
+ */
+void vote_session_tally(VoteSession* session, char* answer, double weight) {
+    uint64_t hash = vote_answer_hash(answer);
+    size_t mask = session->capacity - 1;
+    VoteCount* entry = &session->votes[hash & mask];
+    while (entry->answer && (entry->hash != hash || strcmp(entry->answer, answer) != 0)) {
+        entry = &session->votes[(entry - session->votes + 1) & mask];
     }
 
-    return NULL;
+    if (entry->answer) {
+        free(answer);
+    } else {
+        entry->answer = answer;
+        entry->hash = hash;
+        session->unique_votes++;
+    }
+    entry->count++;
+    entry->weight += weight;
+
+    // Weights only grow, so the leader and runner-up can be kept current
+    // without rescanning the table
+    if (entry == session->leader) return;
+    if (!session->leader || entry->weight > session->leader->weight) {
+        if (session->leader) session->runner_up = session->leader->weight;
+        session->leader = entry;
+    } else if (entry->weight > session->runner_up) {
+        session->runner_up = entry->weight;
+    }
 }
 
 /**
- * Extract answer callback type
+ * True once the leader cannot be caught even if every outstanding voter
+ * agrees with the runner-up (session lock held). Weights are at most 1.
  */
-typedef char* (*ExtractAnswerFunc)(const char* response);
+bool vote_session_winner_certain(const VoteSession* session) {
+    if (!session->leader) return false;
+    int outstanding = session->num_voters - session->reported;
+    return session->leader->weight > session->runner_up + outstanding;
+}
 
 /**
- * Voting parallelizer
+ * Vote completion callback (runs on the transport thread)
  */
-typedef struct VotingParallelizer {
-    char* api_key;
-    char* model;
-    int num_voters;
-    ExtractAnswerFunc extract_answer;
-} VotingParallelizer;
+void vote_complete(AnthropicResponse* response, void* user_data) {
+    VotingWorkerArgs* worker = (VotingWorkerArgs*)user_data;
+    VoteSession* session = worker->session;
+
+    pthread_mutex_lock(&session->lock);
+    if (!session->decided) {
+        VoteResult* result = &session->results[worker->index];
+        result->index = worker->index;
+        if (response->text) {
+            result->response = response->text;
+            result->success = true;
+            result->error = NULL;
+            response->text = NULL;
+
+            char* answer = session->extract_answer(result->response);
+            double weight = 1.0;
+            if (session->weight) {
+                weight = session->weight(result->response, answer, worker->index,
+                                         session->weight_user_data);
+                if (weight < 0.0) weight = 0.0;
+                if (weight > 1.0) weight = 1.0;
+            }
+            vote_session_tally(session, answer, weight);
+        } else {
+            result->response = NULL;
+            result->success = false;
+            result->error = strdup(response->error ? response->error : "API call failed");
+        }
+        session->reported++;
+
+        if (session->reported == session->num_voters ||
+            (session->quorum && vote_session_winner_certain(session))) {
+            session->decided = true;
+            pthread_cond_broadcast(&session->cond);
+        }
+    }
+    pthread_mutex_unlock(&session->lock);
+
+    vote_session_release(session);
+}
 
 /**
  * Default answer extractor - returns trimmed first line
@@ -276,96 +595,166 @@ VotingParallelizer* voting_create(const char* api_key, int num_voters) {
     VotingParallelizer* v = (VotingParallelizer*)calloc(1, sizeof(VotingParallelizer));
     v->api_key = strdup(api_key);
     v->model = strdup("claude-sonnet-4-20250514");
+    v->max_voters = num_voters > DEFAULT_MAX_VOTERS ? MAX_VOTERS : DEFAULT_MAX_VOTERS;
     v->num_voters = num_voters > 0 ? num_voters : 3;
+    if (v->num_voters > v->max_voters) v->num_voters = v->max_voters;
     v->extract_answer = default_extract_answer;
+    v->weight = NULL;
+    v->weight_user_data = NULL;
+    v->quorum = false;
+    v->transport = NULL;
+    v->budget = NULL;
+    v->policy = NULL;
     return v;
 }
 
 /**
- * Set custom answer extractor
+ * Charge voters to a token budget (NULL removes it). Each vote asks only
+ * as many voters as the remaining budget can pay for, at least one.
  */
-void voting_set_extractor(VotingParallelizer* v, ExtractAnswerFunc extractor) {
-    v->extract_answer = extractor;
+void voting_set_budget(VotingParallelizer* v, TokenBudget* budget) {
+    v->budget = budget;
 }
 
 /**
- * Get votes and aggregate
+ * Give each voter a deadline, retries and hedging (NULL reverts to the
+ * transport's policy)
  */
-VotingResult* voting_vote(VotingParallelizer* v, const char* prompt) {
-    VoteResult* results = (VoteResult*)calloc(v->num_voters, sizeof(VoteResult));
-    pthread_t* threads = (pthread_t*)calloc(v->num_voters, sizeof(pthread_t));
-    VotingWorkerArgs* args = (VotingWorkerArgs*)calloc(v->num_voters, sizeof(VotingWorkerArgs));
-
-    // Start all voting threads
-    for (int i = 0; i < v->num_voters; i++) {
-        args[i].index = i;
-        args[i].prompt = prompt;
-        args[i].api_key = v->api_key;
-        args[i].model = v->model;
-        args[i].result = &results[i];
+void voting_set_policy(VotingParallelizer* v, const TransportPolicy* policy) {
+    v->policy = policy;
+}
 
-        pthread_create(&threads[i], NULL, vote_worker, &args[i]);
-    }
+/**
+ * Send voter requests through a specific transport
+ */
+void voting_set_transport(VotingParallelizer* v, Transport* transport) {
+    v->transport = transport;
+}
 
-    // Wait for all to complete
-    for (int i = 0; i < v->num_voters; i++) {
-        pthread_join(threads[i], NULL);
-    }
+/**
+ * Set custom answer extractor
+ */
+void voting_set_extractor(VotingParallelizer* v, ExtractAnswerFunc extractor) {
+    v->extract_answer = extractor;
+}
 
-    // Count votes
-    VoteCount* votes = (VoteCount*)calloc(v->num_voters, sizeof(VoteCount));
-    int unique_votes = 0;
+/**
+ * Raise or lower the voter limit (at most MAX_VOTERS); num_voters is
+ * clamped to the new limit
+ */
+void voting_set_max_voters(VotingParallelizer* v, int max_voters) {
+    if (max_voters < 1) max_voters = 1;
+    if (max_voters > MAX_VOTERS) max_voters = MAX_VOTERS;
+    v->max_voters = max_voters;
+    if (v->num_voters > max_voters) v->num_voters = max_voters;
+}
 
-    for (int i = 0; i < v->num_voters; i++) {
-        if (!results[i].success) continue;
+/**
+ * Set the number of voters, clamped to the voter limit
+ */
+void voting_set_num_voters(VotingParallelizer* v, int num_voters) {
+    if (num_voters < 1) num_voters = 1;
+    v->num_voters = num_voters > v->max_voters ? v->max_voters : num_voters;
+}
 
-        char* answer = v->extract_answer(results[i].response);
+/**
+ * Weight each vote, e.g. by a confidence score in the response
+ */
+void voting_set_weight(VotingParallelizer* v, VoteWeightFunc weight, void* user_data) {
+    v->weight = weight;
+    v->weight_user_data = user_data;
+}
 
-        // Find existing vote
-        int found = -1;
-        for (int j = 0; j < unique_votes; j++) {
-            if (strcmp(votes[j].answer, answer) == 0) {
-                found = j;
-                break;
-            }
-        }
+/**
+ * Enable early-exit quorum voting
+ */
+void voting_set_quorum(VotingParallelizer* v, bool enabled) {
+    v->quorum = enabled;
+}
 
-        if (found >= 0) {
-            votes[found].count++;
-            free(answer);
-        } else {
-            votes[unique_votes].answer = answer;
-            votes[unique_votes].count = 1;
-            unique_votes++;
-        }
+/**
+ * Get votes and aggregate
+ */
+VotingResult* voting_vote(VotingParallelizer* v, const char* prompt) {
+    MetricsSpan span;
+    metrics_span_begin(&span, "voting.vote", NULL);
+    AnthropicRequest request = {.api_key = v->api_key, .model = v->model, .prompt = prompt,
+                                .max_tokens = 1024, .no_cache = true, .budget = v->budget,
+                                .policy = v->policy};
+    int num_voters = token_budget_fan_out(v->budget, anthropic_request_estimate_tokens(&request),
+                                          v->num_voters, 1);
+    VoteResult* results = (VoteResult*)calloc(num_voters, sizeof(VoteResult));
+    TransportFuture** futures = (TransportFuture**)calloc(num_voters, sizeof(TransportFuture*));
+
+    VoteSession* session = (VoteSession*)calloc(1, sizeof(VoteSession));
+    pthread_mutex_init(&session->lock, NULL);
+    pthread_cond_init(&session->cond, NULL);
+    atomic_init(&session->refs, 1);
+    session->extract_answer = v->extract_answer;
+    session->weight = v->weight;
+    session->weight_user_data = v->weight_user_data;
+    session->quorum = v->quorum;
+    session->num_voters = num_voters;
+    session->results = results;
+    session->args = (VotingWorkerArgs*)calloc(num_voters, sizeof(VotingWorkerArgs));
+    session->capacity = 4;
+    while (session->capacity < (size_t)num_voters * 2) session->capacity *= 2;
+    session->votes = (VoteCount*)calloc(session->capacity, sizeof(VoteCount));
+
+    // Voters are plain async requests: all of them are in flight at once
+    // without holding a thread each. Answers are tallied as they arrive.
+    Transport* transport = v->transport ? v->transport : transport_default();
+    for (int i = 0; i < num_voters; i++) {
+        pthread_mutex_lock(&session->lock);
+        bool decided = session->decided;
+        pthread_mutex_unlock(&session->lock);
+        if (decided) break;
+
+        session->args[i].index = i;
+        session->args[i].session = session;
+        atomic_fetch_add(&session->refs, 1);
+        futures[i] = transport_submit(transport, &request, vote_complete, &session->args[i]);
     }
 
-    // Find winner
-    int max_count = 0;
-    char* winner = NULL;
-    for (int i = 0; i < unique_votes; i++) {
-        if (votes[i].count > max_count) {
-            max_count = votes[i].count;
-            winner = votes[i].answer;
-        }
+    pthread_mutex_lock(&session->lock);
+    while (!session->decided) {
+        pthread_cond_wait(&session->cond, &session->lock);
     }
 
     // Create result
+    VoteCount* leader = session->leader;
     VotingResult* voting_result = (VotingResult*)calloc(1, sizeof(VotingResult));
-    voting_result->winner = winner ? strdup(winner) : strdup("");
-    voting_result->winner_count = max_count;
-    voting_result->total_votes = v->num_voters;
+    voting_result->winner = strdup(leader ? leader->answer : "");
+    voting_result->winner_count = leader ? leader->count : 0;
+    voting_result->winner_weight = leader ? leader->weight : 0.0;
+    voting_result->unique_answers = session->unique_votes;
+    voting_result->total_votes = num_voters;
+    voting_result->votes_consumed = session->reported;
+    voting_result->early_exit = session->reported < num_voters;
+    voting_result->voters_dropped = v->num_voters - num_voters;
     voting_result->all_responses = results;
-    voting_result->response_count = v->num_voters;
-
-    // Cleanup
-    for (int i = 0; i < unique_votes; i++) {
-        free(votes[i].answer);
+    voting_result->response_count = num_voters;
+    pthread_mutex_unlock(&session->lock);
+
+    // Stragglers are cancelled; their callbacks see the decided session
+    // and leave the results alone
+    for (int i = 0; i < num_voters; i++) {
+        if (!results[i].success && !results[i].error) {
+            results[i].index = i;
+            results[i].error = strdup("Not counted: quorum reached");
+        }
+        if (futures[i]) {
+            transport_cancel(futures[i]);
+            transport_future_release(futures[i]);
+        }
     }
-    free(votes);
-    free(threads);
-    free(args);
+    free(futures);
+    vote_session_release(session);
 
+    metrics_span_set_int(&span, "voting.voters", num_voters);
+    metrics_span_set_int(&span, "voting.votes_consumed", voting_result->votes_consumed);
+    metrics_span_set_int(&span, "voting.winner_count", voting_result->winner_count);
+    metrics_span_end(&span);
     return voting_result;
 }
 
@@ -404,6 +793,7 @@ typedef struct Guardrail {
 typedef struct GuardrailResult {
     char name[MAX_NAME_SIZE];
     bool passed;
+    bool skipped;  // Cancelled or never sent after another guardrail failed
     char* reason;
 } GuardrailResult;
 
@@ -412,56 +802,90 @@ typedef struct GuardrailsResult {
     GuardrailResult* results;
     int result_count;
     char* response;
+    const char* tripped;  // Name of the first failing guardrail, or NULL
+    bool task_cancelled;
+    int requests_cancelled;  // Aborted while in flight
+    int requests_skipped;    // Never sent
+    int max_tokens_saved;    // Token budget of the cancelled and skipped requests
 } GuardrailsResult;
 
-typedef struct GuardrailWorkerArgs {
-    const Guardrail* guardrail;
-    const char* input;
-    const char* api_key;
-    const char* model;
-    GuardrailResult* result;
-} GuardrailWorkerArgs;
-
-typedef struct TaskWorkerArgs {
-    const char* prompt;
-    const char* api_key;
-    const char* model;
-    char** result;
-} TaskWorkerArgs;
-
 /**
- * Guardrail worker thread
+ * State shared by the guardrail and task callbacks of one execution.
+ * Cancelled requests still complete, so the caller waits for all of them.
  */
-void* guardrail_worker(void* args) {
-    GuardrailWorkerArgs* worker = (GuardrailWorkerArgs*)args;
+typedef struct GuardrailRun {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool short_circuit;
+    int tripped;  // Index of the first failing guardrail, -1 while none has
+    int pending;
+    int guardrail_count;
+    const Guardrail* guardrails;
+    GuardrailResult* results;
+    TransportFuture** futures;  // One per guardrail, then the task
+    struct GuardrailCallbackArgs* args;
+    char* task_response;
+    bool task_cancelled;
+    int requests_cancelled;
+} GuardrailRun;
 
-    char prompt[MAX_INPUT_SIZE];
-    snprintf(prompt, sizeof(prompt),
-             "%s\n\nContent: %s\n\nRespond with yes or no and a brief reason.",
-             worker->guardrail->prompt, worker->input);
+typedef struct GuardrailCallbackArgs {
+    GuardrailRun* run;
+    int index;  // guardrail_count for the task
+} GuardrailCallbackArgs;
 
-    char* response = call_anthropic_api(worker->api_key, worker->model, prompt, 256);
+#define GUARDRAIL_MAX_TOKENS 256
+#define GUARDRAIL_TASK_MAX_TOKENS 4096
 
-    strcpy(worker->result->name, worker->guardrail->name);
-    if (response) {
-        worker->result->passed = worker->guardrail->check(response);
-        worker->result->reason = response;
-    } else {
-        worker->result->passed = false;
-        worker->result->reason = strdup("Error: API call failed");
+/**
+ * Cancel every request still in flight (run lock held)
+ */
+void guardrail_run_cancel_others(GuardrailRun* run, int except) {
+    for (int i = 0; i <= run->guardrail_count; i++) {
+        if (i != except && run->futures[i]) transport_cancel(run->futures[i]);
     }
-
-    return NULL;
 }
 
 /**
- * Task worker thread
+ * Guardrail and task completion callback (runs on the transport thread)
  */
-void* task_worker(void* args) {
-    TaskWorkerArgs* worker = (TaskWorkerArgs*)args;
-    *worker->result = call_anthropic_api(worker->api_key, worker->model,
-                                         worker->prompt, 4096);
-    return NULL;
+void guardrail_complete(AnthropicResponse* response, void* user_data) {
+    GuardrailCallbackArgs* worker = (GuardrailCallbackArgs*)user_data;
+    GuardrailRun* run = worker->run;
+
+    pthread_mutex_lock(&run->lock);
+    if (response->cancelled) {
+        run->requests_cancelled++;
+        if (worker->index == run->guardrail_count) {
+            run->task_cancelled = true;
+        } else {
+            run->results[worker->index].skipped = true;
+            run->results[worker->index].reason = strdup("Cancelled: another guardrail failed");
+        }
+    } else if (worker->index == run->guardrail_count) {
+        run->task_response = response->text;
+        response->text = NULL;
+    } else {
+        const Guardrail* guardrail = &run->guardrails[worker->index];
+        GuardrailResult* result = &run->results[worker->index];
+        if (response->text) {
+            result->passed = guardrail->check(response->text);
+            result->reason = response->text;
+            response->text = NULL;
+        } else {
+            result->passed = false;
+            result->reason = strdup("Error: API call failed");
+        }
+
+        if (!result->passed && run->tripped < 0) {
+            run->tripped = worker->index;
+            if (run->short_circuit) guardrail_run_cancel_others(run, worker->index);
+        }
+    }
+
+    run->pending--;
+    pthread_cond_broadcast(&run->cond);
+    pthread_mutex_unlock(&run->lock);
 }
 
 /**
@@ -473,7 +897,8 @@ typedef struct GuardrailsParallelizer {
     char* task_prompt;
     Guardrail guardrails[MAX_GUARDRAILS];
     int guardrail_count;
-    bool stop_on_failure;
+    bool stop_on_failure;  // Also cancels the task and remaining guardrails
+    Transport* transport;  // Not owned; NULL uses the shared default transport
 } GuardrailsParallelizer;
 
 /**
@@ -486,9 +911,17 @@ GuardrailsParallelizer* guardrails_create(const char* api_key, const char* task_
     g->task_prompt = strdup(task_prompt);
     g->guardrail_count = 0;
     g->stop_on_failure = true;
+    g->transport = NULL;
     return g;
 }
 
+/**
+ * Send guardrail and task requests through a specific transport
+ */
+void guardrails_set_transport(GuardrailsParallelizer* g, Transport* transport) {
+    g->transport = transport;
+}
+
 /**
  * Add a guardrail
  */
@@ -509,61 +942,121 @@ bool guardrails_add(GuardrailsParallelizer* g, const char* name,
  * Execute task with parallel guardrails
  */
 GuardrailsResult* guardrails_execute(GuardrailsParallelizer* g, const char* input) {
-    int total_threads = g->guardrail_count + 1;  // guardrails + task
-    pthread_t* threads = (pthread_t*)calloc(total_threads, sizeof(pthread_t));
-
-    // Setup guardrail workers
-    GuardrailResult* guardrail_results = (GuardrailResult*)calloc(g->guardrail_count, sizeof(GuardrailResult));
-    GuardrailWorkerArgs* guardrail_args = (GuardrailWorkerArgs*)calloc(g->guardrail_count, sizeof(GuardrailWorkerArgs));
+    int count = g->guardrail_count;
+    MetricsSpan span;
+    metrics_span_begin(&span, "guardrails.run", NULL);
+    GuardrailRun run;
+    memset(&run, 0, sizeof(run));
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.cond, NULL);
+    run.short_circuit = g->stop_on_failure;
+    run.tripped = -1;
+    run.guardrail_count = count;
+    run.guardrails = g->guardrails;
+    run.results = (GuardrailResult*)calloc(count, sizeof(GuardrailResult));
+    run.futures = (TransportFuture**)calloc(count + 1, sizeof(TransportFuture*));
+    run.args = (GuardrailCallbackArgs*)calloc(count + 1, sizeof(GuardrailCallbackArgs));
+
+    // Prompts are scattered around the input instead of copying it into
+    // one buffer per request
+    struct iovec input_part = {(void*)input, strlen(input)};
+    struct iovec task_parts[] = {{(void*)g->task_prompt, strlen(g->task_prompt)},
+                                 {(void*)"\n\nInput: ", 9}, input_part};
+
+    // Guardrails go out first so a cheap failing check can stop the task
+    // before it is sent
+    Transport* transport = g->transport ? g->transport : transport_default();
+    int skipped = 0, max_tokens_saved = 0;
+    for (int i = 0; i <= count; i++) {
+        bool is_task = i == count;
+        int max_tokens = is_task ? GUARDRAIL_TASK_MAX_TOKENS : GUARDRAIL_MAX_TOKENS;
+
+        pthread_mutex_lock(&run.lock);
+        bool stop = run.short_circuit && run.tripped >= 0;
+        if (stop) {
+            skipped++;
+            max_tokens_saved += max_tokens;
+            if (is_task) {
+                run.task_cancelled = true;
+            } else {
+                run.results[i].skipped = true;
+                run.results[i].reason = strdup("Not run: another guardrail failed");
+            }
+        } else {
+            run.pending++;
+        }
+        pthread_mutex_unlock(&run.lock);
 
-    for (int i = 0; i < g->guardrail_count; i++) {
-        guardrail_args[i].guardrail = &g->guardrails[i];
-        guardrail_args[i].input = input;
-        guardrail_args[i].api_key = g->api_key;
-        guardrail_args[i].model = g->model;
-        guardrail_args[i].result = &guardrail_results[i];
+        if (!is_task) strcpy(run.results[i].name, g->guardrails[i].name);
+        if (stop) continue;
 
-        pthread_create(&threads[i], NULL, guardrail_worker, &guardrail_args[i]);
+        static const char respond[] = "\n\nRespond with yes or no and a brief reason.";
+        struct iovec check_parts[] = {{NULL, 0}, {(void*)"\n\nContent: ", 11}, input_part,
+                                      {(void*)respond, sizeof(respond) - 1}};
+        if (!is_task) {
+            check_parts[0] = (struct iovec){(void*)g->guardrails[i].prompt,
+                                            strlen(g->guardrails[i].prompt)};
+        }
+        AnthropicRequest request = {.api_key = g->api_key, .model = g->model,
+                                    .prompt_iov = is_task ? task_parts : check_parts,
+                                    .prompt_iovcnt = is_task ? 3 : 4,
+                                    .max_tokens = max_tokens};
+        run.args[i].run = &run;
+        run.args[i].index = i;
+        TransportFuture* future = transport_submit(transport, &request, guardrail_complete, &run.args[i]);
+
+        // A guardrail may have failed while this request was being queued
+        pthread_mutex_lock(&run.lock);
+        run.futures[i] = future;
+        if (run.short_circuit && run.tripped >= 0 && run.tripped != i) transport_cancel(future);
+        pthread_mutex_unlock(&run.lock);
     }
 
-    // Setup task worker
-    char task_prompt[MAX_INPUT_SIZE];
-    snprintf(task_prompt, sizeof(task_prompt), "%s\n\nInput: %s", g->task_prompt, input);
-
-    char* task_response = NULL;
-    TaskWorkerArgs task_args = {task_prompt, g->api_key, g->model, &task_response};
-    pthread_create(&threads[g->guardrail_count], NULL, task_worker, &task_args);
-
-    // Wait for all threads
-    for (int i = 0; i < total_threads; i++) {
-        pthread_join(threads[i], NULL);
+    // Wait for guardrails and task
+    pthread_mutex_lock(&run.lock);
+    while (run.pending > 0) {
+        pthread_cond_wait(&run.cond, &run.lock);
     }
+    pthread_mutex_unlock(&run.lock);
 
-    // Check if all guardrails passed
-    bool all_passed = true;
-    for (int i = 0; i < g->guardrail_count; i++) {
-        if (!guardrail_results[i].passed) {
-            all_passed = false;
-            break;
-        }
+    for (int i = 0; i <= count; i++) {
+        if (run.futures[i]) transport_future_release(run.futures[i]);
     }
 
     // Create result
     GuardrailsResult* result = (GuardrailsResult*)calloc(1, sizeof(GuardrailsResult));
-    result->all_passed = all_passed;
-    result->results = guardrail_results;
-    result->result_count = g->guardrail_count;
+    result->all_passed = run.tripped < 0;
+    result->results = run.results;
+    result->result_count = count;
+    result->tripped = run.tripped >= 0 ? run.results[run.tripped].name : NULL;
+    result->task_cancelled = run.task_cancelled;
+    result->requests_cancelled = run.requests_cancelled;
+    result->requests_skipped = skipped;
+
+    // Cancelled requests may have produced part of their output already,
+    // so only their budget is counted
+    if (run.task_cancelled && run.futures[count]) max_tokens_saved += GUARDRAIL_TASK_MAX_TOKENS;
+    for (int i = 0; i < count; i++) {
+        if (run.results[i].skipped && run.futures[i]) max_tokens_saved += GUARDRAIL_MAX_TOKENS;
+    }
+    result->max_tokens_saved = max_tokens_saved;
 
-    if (!g->stop_on_failure || all_passed) {
-        result->response = task_response;
+    if (!g->stop_on_failure || result->all_passed) {
+        result->response = run.task_response;
     } else {
         result->response = NULL;
-        free(task_response);
+        free(run.task_response);
     }
 
-    free(threads);
-    free(guardrail_args);
+    free(run.futures);
+    free(run.args);
+    pthread_mutex_destroy(&run.lock);
+    pthread_cond_destroy(&run.cond);
 
+    metrics_span_set_int(&span, "guardrails.count", count);
+    metrics_span_set_int(&span, "guardrails.requests_cancelled", result->requests_cancelled);
+    metrics_span_set_int(&span, "guardrails.passed", result->all_passed);
+    metrics_span_end(&span);
     return result;
 }
 
@@ -608,10 +1101,36 @@ int main() {
         return 1;
     }
 
+    // Pool for the sectioning parallelizer; voting and guardrails use the transport
+    ThreadPool* pool = thread_pool_create(8);
+    transport_set_mock_responder(mock_anthropic_api);
+
+    // AGENT_METRICS_PORT serves Prometheus metrics on loopback;
+    // AGENT_TRACE_FILE appends one OTLP/JSON line per finished span
+    metrics_init_from_env();
+
+    // Queue requests on the client rather than run into 429s; set these to
+    // the account's limits
+    RateGovernor* governor = transport_enable_governor(transport_default(), 50, 40000);
+
+    // Repeated prompts are served from cache; set AGENT_CACHE_FILE to keep
+    // answers across runs
+    ResponseCache* cache = transport_enable_cache(transport_default(), 256, 3600,
+                                                  getenv("AGENT_CACHE_FILE"));
+
     // Sectioning parallelization
     printf("=== Sectioning Parallelization ===\n");
     SectioningParallelizer* sectioner = sectioning_create(api_key, "Translate to French: %s");
     sectioning_set_concurrency(sectioner, 3);
+    sectioning_set_mode(sectioner, SECTIONING_SLIDING_WINDOW);
+    sectioning_set_pool(sectioner, pool);
+
+    // Sections get 30 s each, retries on 429/529, and a hedge once one
+    // runs past the p95 of recent calls
+    TransportPolicy section_policy = transport_default_policy;
+    section_policy.timeout_ms = 30000;
+    section_policy.hedge_after_ms = TRANSPORT_HEDGE_P95;
+    sectioning_set_policy(sectioner, &section_policy);
 
     const char* sections[] = {
         "Hello, how are you?",
@@ -624,7 +1143,24 @@ int main() {
     SectionResult* results = sectioning_process(sectioner, sections, 4, &result_count);
 
     for (int i = 0; i < result_count; i++) {
-        printf("Section %d: %s -> %s\n", i, results[i].section,
+        printf("Section %d [%.1f-%.1f ms, %d attempt(s)]: %s -> %s\n", i,
+               results[i].start_ms, results[i].finish_ms, results[i].attempts,
+               results[i].section, results[i].success ? results[i].result : results[i].error);
+    }
+
+    section_results_free(results, result_count);
+
+    // An offline batch job; the section the synchronous run already
+    // translated comes from the response cache instead of the batch
+    const char* batch_sections[] = {
+        "Hello, how are you?",
+        "Good night.",
+        "See you tomorrow."
+    };
+    sectioning_set_mode(sectioner, SECTIONING_MESSAGE_BATCH);
+    results = sectioning_process(sectioner, batch_sections, 3, &result_count);
+    for (int i = 0; i < result_count; i++) {
+        printf("Batched section %d: %s -> %s\n", i, results[i].section,
                results[i].success ? results[i].result : results[i].error);
     }
 
@@ -634,12 +1170,31 @@ int main() {
     // Voting parallelization
     printf("\n=== Voting Parallelization ===\n");
     VotingParallelizer* voter = voting_create(api_key, 5);
+    voting_set_quorum(voter, true);
+
+    // A slow voter is duplicated after 2 s rather than holding up the quorum
+    TransportPolicy vote_policy = transport_default_policy;
+    vote_policy.timeout_ms = 20000;
+    vote_policy.hedge_after_ms = 2000;
+    voting_set_policy(voter, &vote_policy);
 
     VotingResult* vote_result = voting_vote(voter, "Is the sky blue? Answer yes or no.");
-    printf("Winner: %s (count: %d/%d)\n", vote_result->winner,
-           vote_result->winner_count, vote_result->total_votes);
+    printf("Winner: %s (count: %d/%d, consumed %d votes)\n", vote_result->winner,
+           vote_result->winner_count, vote_result->total_votes,
+           vote_result->votes_consumed);
+    voting_result_free(vote_result);
 
+    // A budget for about three voters; the vote shrinks to fit it
+    TokenBudget vote_budget;
+    token_budget_init(&vote_budget, 3200);
+    voting_set_budget(voter, &vote_budget);
+    voting_set_quorum(voter, false);
+    vote_result = voting_vote(voter, "Is water wet? Answer yes or no.");
+    printf("Budgeted winner: %s (count: %d/%d, %d voters dropped)\n", vote_result->winner,
+           vote_result->winner_count, vote_result->total_votes, vote_result->voters_dropped);
     voting_result_free(vote_result);
+    token_budget_print(&vote_budget, "Voting", stdout);
+    token_budget_destroy(&vote_budget);
     voting_free(voter);
 
     // Guardrails parallelization
@@ -660,8 +1215,15 @@ int main() {
     printf("All guardrails passed: %s\n", guard_result->all_passed ? "yes" : "no");
     for (int i = 0; i < guard_result->result_count; i++) {
         printf("  %s: %s\n", guard_result->results[i].name,
+               guard_result->results[i].skipped ? "SKIPPED" :
                guard_result->results[i].passed ? "PASSED" : "FAILED");
     }
+    if (guard_result->tripped) {
+        printf("Tripped by %s: task %s, %d cancelled, %d skipped, up to %d tokens saved\n",
+               guard_result->tripped, guard_result->task_cancelled ? "cancelled" : "completed",
+               guard_result->requests_cancelled, guard_result->requests_skipped,
+               guard_result->max_tokens_saved);
+    }
     if (guard_result->response) {
         printf("Response: %.100s...\n", guard_result->response);
     }
@@ -669,5 +1231,16 @@ int main() {
     guardrails_result_free(guard_result);
     guardrails_free(guardrailed);
 
+    thread_pool_destroy(pool);
+
+    rate_governor_print_stats(governor, stdout);
+    metrics_print_summary(stdout);
+    response_cache_print_stats(cache, stdout);
+    transport_set_cache(transport_default(), NULL);
+    response_cache_destroy(cache);
+    transport_set_governor(transport_default(), NULL);
+    rate_governor_destroy(governor);
+    metrics_shutdown();
+
     return 0;
 }
@@ -2,17 +2,31 @@
  * Prompt Chaining Pattern Implementation for C
  * Sequential LLM calls with programmatic checkpoints
  *
- * Note: This is a simplified example. In production, use a proper HTTP library
- * like libcurl and JSON library like cJSON or jansson.
+ * Note: This is a simplified example. API calls go through the shared
+ * transport in anthropic_transport.h. In production, use a JSON library
+ * like cJSON or jansson.
  *
  * Compile with:
- * gcc -o prompt_chaining prompt_chaining.c -lcurl -ljson-c
+ * gcc -o prompt_chaining prompt_chaining.c -pthread -DAGENT_TRANSPORT_CURL -lcurl -ljson-c
+ * (drop -DAGENT_TRANSPORT_CURL -lcurl to run against the mock responder)
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "arena.h"
+#include "anthropic_transport.h"
+#include "string_builder.h"
+
+#define DEFAULT_MAX_TOKENS 4096
+#define CONTEXT_INITIAL_CAPACITY 16
+#define OUTLINE_EARLY_CHECK_CHARS 400
+#define CHAIN_BATCH_DEFAULT_CONCURRENCY 16
 
 // Forward declarations
 typedef struct ChainStep ChainStep;
@@ -26,13 +40,37 @@ typedef bool (*ValidatorFunc)(const char* output);
 typedef void* (*ProcessorFunc)(const char* output);
 
 /**
- * Context holds key-value pairs for the chain execution
+ * Verdict from a streaming validator on a partial output
+ */
+typedef enum {
+    STREAM_CONTINUE,  // Keep streaming
+    STREAM_REJECT     // Stop the call; the step fails
+} StreamVerdict;
+
+typedef StreamVerdict (*StreamValidatorFunc)(const char* partial_output, size_t length);
+typedef void (*StreamCallback)(const char* step_name, const char* delta, size_t length,
+                               void* user_data);
+
+/**
+ * Context slot; keys and values live in the context's arena
+ */
+typedef struct ContextEntry {
+    const char* key;  // NULL marks an empty slot
+    const char* value;
+    uint64_t hash;
+} ContextEntry;
+
+/**
+ * Context holds key-value pairs for the chain execution. A child context
+ * reads through to its parent and shadows it on write, so a run never
+ * copies the initial context.
  */
 typedef struct Context {
-    char** keys;
-    char** values;
+    ContextEntry* slots;  // Open-addressed, capacity is a power of two
     size_t count;
     size_t capacity;
+    const Context* parent;  // Not owned; must outlive the child unchanged
+    Arena arena;
 } Context;
 
 /**
@@ -52,6 +90,8 @@ typedef struct ChainStep {
     PromptTemplateFunc prompt_template;
     ValidatorFunc validator;
     ProcessorFunc processor;
+    StreamValidatorFunc stream_validator;  // Optional, checked on every delta
+    int max_concurrency;  // Batch requests in flight for this step; 0 uses the default
 } ChainStep;
 
 /**
@@ -66,56 +106,98 @@ typedef struct PromptChain {
     ChainHistory** history;
     size_t history_count;
     size_t history_capacity;
+    bool streaming;
+    StreamCallback stream_callback;
+    void* stream_user_data;
 } PromptChain;
 
 // Context functions
+uint64_t context_hash(const char* key) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (const unsigned char* p = (const unsigned char*)key; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
 Context* context_create() {
     Context* ctx = (Context*)malloc(sizeof(Context));
-    ctx->capacity = 10;
+    ctx->capacity = CONTEXT_INITIAL_CAPACITY;
     ctx->count = 0;
-    ctx->keys = (char**)calloc(ctx->capacity, sizeof(char*));
-    ctx->values = (char**)calloc(ctx->capacity, sizeof(char*));
+    ctx->slots = (ContextEntry*)calloc(ctx->capacity, sizeof(ContextEntry));
+    ctx->parent = NULL;
+    arena_init(&ctx->arena, 0);
     return ctx;
 }
 
-void context_set(Context* ctx, const char* key, const char* value) {
-    // Check if key exists
-    for (size_t i = 0; i < ctx->count; i++) {
-        if (strcmp(ctx->keys[i], key) == 0) {
-            free(ctx->values[i]);
-            ctx->values[i] = strdup(value);
-            return;
+/**
+ * Create a copy-on-write view of parent
+ */
+Context* context_create_child(const Context* parent) {
+    Context* ctx = context_create();
+    ctx->parent = parent;
+    return ctx;
+}
+
+/**
+ * Find the slot for key in this context's own table
+ */
+ContextEntry* context_find_slot(ContextEntry* slots, size_t capacity, const char* key,
+                                uint64_t hash) {
+    size_t mask = capacity - 1;
+    size_t index = hash & mask;
+    while (slots[index].key &&
+           (slots[index].hash != hash || strcmp(slots[index].key, key) != 0)) {
+        index = (index + 1) & mask;
+    }
+    return &slots[index];
+}
+
+void context_grow(Context* ctx) {
+    size_t capacity = ctx->capacity * 2;
+    ContextEntry* slots = (ContextEntry*)calloc(capacity, sizeof(ContextEntry));
+    for (size_t i = 0; i < ctx->capacity; i++) {
+        if (ctx->slots[i].key) {
+            *context_find_slot(slots, capacity, ctx->slots[i].key, ctx->slots[i].hash) =
+                ctx->slots[i];
         }
     }
+    free(ctx->slots);
+    ctx->slots = slots;
+    ctx->capacity = capacity;
+}
 
-    // Add new key-value pair
-    if (ctx->count >= ctx->capacity) {
-        ctx->capacity *= 2;
-        ctx->keys = (char**)realloc(ctx->keys, ctx->capacity * sizeof(char*));
-        ctx->values = (char**)realloc(ctx->values, ctx->capacity * sizeof(char*));
+void context_set(Context* ctx, const char* key, const char* value) {
+    // Keep the load factor under 3/4
+    if ((ctx->count + 1) * 4 > ctx->capacity * 3) {
+        context_grow(ctx);
     }
 
-    ctx->keys[ctx->count] = strdup(key);
-    ctx->values[ctx->count] = strdup(value);
-    ctx->count++;
+    uint64_t hash = context_hash(key);
+    ContextEntry* entry = context_find_slot(ctx->slots, ctx->capacity, key, hash);
+    if (!entry->key) {
+        entry->key = arena_strdup(&ctx->arena, key);
+        entry->hash = hash;
+        ctx->count++;
+    }
+
+    // A replaced value stays in the arena until the context is freed
+    entry->value = arena_strdup(&ctx->arena, value);
 }
 
 const char* context_get(Context* ctx, const char* key) {
-    for (size_t i = 0; i < ctx->count; i++) {
-        if (strcmp(ctx->keys[i], key) == 0) {
-            return ctx->values[i];
-        }
+    uint64_t hash = context_hash(key);
+    for (const Context* c = ctx; c; c = c->parent) {
+        ContextEntry* entry = context_find_slot(c->slots, c->capacity, key, hash);
+        if (entry->key) return entry->value;
     }
     return NULL;
 }
 
 void context_free(Context* ctx) {
-    for (size_t i = 0; i < ctx->count; i++) {
-        free(ctx->keys[i]);
-        free(ctx->values[i]);
-    }
-    free(ctx->keys);
-    free(ctx->values);
+    arena_destroy(&ctx->arena);
+    free(ctx->slots);
     free(ctx);
 }
 
@@ -131,9 +213,25 @@ ChainStep* chain_step_create(
     step->prompt_template = prompt_template;
     step->validator = validator;
     step->processor = processor;
+    step->stream_validator = NULL;
+    step->max_concurrency = 0;
     return step;
 }
 
+/**
+ * Attach a validator that can reject a step while its output streams in
+ */
+void chain_step_set_stream_validator(ChainStep* step, StreamValidatorFunc validator) {
+    step->stream_validator = validator;
+}
+
+/**
+ * Limit how many documents a batch runs through this step at once
+ */
+void chain_step_set_concurrency(ChainStep* step, int max_in_flight) {
+    step->max_concurrency = max_in_flight;
+}
+
 void chain_step_free(ChainStep* step) {
     free(step->name);
     free(step);
@@ -150,9 +248,21 @@ PromptChain* prompt_chain_create(const char* api_key, const char* model) {
     chain->history_capacity = 10;
     chain->history_count = 0;
     chain->history = (ChainHistory**)calloc(chain->history_capacity, sizeof(ChainHistory*));
+    chain->streaming = false;
+    chain->stream_callback = NULL;
+    chain->stream_user_data = NULL;
     return chain;
 }
 
+/**
+ * Stream step outputs; callback (optional) receives every text delta
+ */
+void prompt_chain_set_streaming(PromptChain* chain, StreamCallback callback, void* user_data) {
+    chain->streaming = true;
+    chain->stream_callback = callback;
+    chain->stream_user_data = user_data;
+}
+
 void prompt_chain_add_step(PromptChain* chain, ChainStep* step) {
     if (chain->step_count >= chain->step_capacity) {
         chain->step_capacity *= 2;
@@ -165,40 +275,83 @@ void prompt_chain_add_step(PromptChain* chain, ChainStep* step) {
 }
 
 /**
- * Simplified API call - in production, use libcurl
+ * Mock responder used when the transport is built without libcurl
  */
-char* call_anthropic_api(const char* api_key, const char* model, const char* prompt) {
-    // NOTE: This is a placeholder. In production, implement using libcurl:
-    //
-    // 1. Create CURL handle
-    // 2. Set URL to "https://api.anthropic.com/v1/messages"
-    // 3. Set headers: x-api-key, anthropic-version, content-type
-    // 4. Create JSON request body with prompt
-    // 5. Execute request
-    // 6. Parse JSON response
-    // 7. Extract text content
-    // 8. Return result
-
+char* mock_anthropic_api(const AnthropicRequest* request) {
     printf("API Call (mock):\n");
-    printf("Model: %s\n", model);
-    printf("Prompt: %.100s...\n", prompt);
+    printf("Model: %s\n", request->model);
+    printf("Prompt: %.100s...\n", request->prompt);
 
-    // Mock response
+    // Mock response; outline prompts get a numbered outline so they validate
+    if (strncmp(request->prompt, "Create a detailed outline", 25) == 0) {
+        return strdup("1. Introduction\n2. Core concepts\n3. Examples\n4. Conclusion");
+    }
     return strdup("This is a mock LLM response. In production, implement actual API call.");
 }
 
-char* prompt_chain_execute(PromptChain* chain, Context* initial_context) {
-    Context* ctx = context_create();
+/**
+ * Blocking API call through the shared transport
+ */
+char* call_anthropic_api(const char* api_key, const char* model, const char* prompt) {
+    AnthropicRequest request = {.api_key = api_key, .model = model, .prompt = prompt,
+                                .max_tokens = DEFAULT_MAX_TOKENS};
+    return transport_call(transport_default(), &request, NULL);
+}
 
-    // Copy initial context
-    for (size_t i = 0; i < initial_context->count; i++) {
-        context_set(ctx, initial_context->keys[i], initial_context->values[i]);
+/**
+ * Streaming API call; returns NULL if on_delta stops it or it fails
+ */
+char* call_anthropic_api_stream(const char* api_key, const char* model, const char* prompt,
+                                TransportDeltaFunc on_delta, void* user_data) {
+    AnthropicRequest request = {.api_key = api_key, .model = model, .prompt = prompt,
+                                .max_tokens = DEFAULT_MAX_TOKENS};
+    return transport_call_stream(transport_default(), &request, on_delta, user_data, NULL);
+}
+
+/**
+ * Per-step streaming state
+ */
+typedef struct StepStream {
+    PromptChain* chain;
+    ChainStep* step;
+    bool rejected;
+} StepStream;
+
+/**
+ * Delta callback: forward to the user and run the streaming validator
+ */
+bool chain_stream_delta(const char* delta, size_t delta_length,
+                        const char* text, size_t text_length, void* user_data) {
+    StepStream* stream = (StepStream*)user_data;
+
+    if (stream->chain->stream_callback) {
+        stream->chain->stream_callback(stream->step->name, delta, delta_length,
+                                       stream->chain->stream_user_data);
     }
 
+    if (stream->step->stream_validator &&
+        stream->step->stream_validator(text, text_length) == STREAM_REJECT) {
+        stream->rejected = true;
+        return false;
+    }
+    return true;
+}
+
+char* prompt_chain_execute(PromptChain* chain, Context* initial_context) {
+    // Step outputs shadow the initial context without copying it
+    Context* ctx = context_create_child(initial_context);
+
     char* current_output = NULL;
+    MetricsSpan run_span;
+    metrics_span_begin(&run_span, "chain.run", NULL);
+    metrics_span_set_int(&run_span, "chain.steps", (int64_t)chain->step_count);
 
     for (size_t i = 0; i < chain->step_count; i++) {
         ChainStep* step = chain->steps[i];
+        MetricsSpan step_span;
+        metrics_span_begin(&step_span, "chain.step", NULL);
+        metrics_span_set_string(&step_span, "chain.step.name", step->name);
+        metrics_span_set_int(&step_span, "chain.step.index", (int64_t)i);
 
         // Format prompt with current context
         char* prompt = step->prompt_template(ctx);
@@ -207,7 +360,24 @@ char* prompt_chain_execute(PromptChain* chain, Context* initial_context) {
         if (current_output) {
             free(current_output);
         }
-        current_output = call_anthropic_api(chain->api_key, chain->model, prompt);
+        StepStream stream = {chain, step, false};
+        if (chain->streaming) {
+            current_output = call_anthropic_api_stream(chain->api_key, chain->model, prompt,
+                                                       chain_stream_delta, &stream);
+        } else {
+            current_output = call_anthropic_api(chain->api_key, chain->model, prompt);
+        }
+
+        if (!current_output) {
+            fprintf(stderr, "Step '%s' %s\n", step->name,
+                    stream.rejected ? "rejected while streaming" : "API call failed");
+            free(prompt);
+            context_free(ctx);
+            step_span.error = run_span.error = true;
+            metrics_span_end(&step_span);
+            metrics_span_end(&run_span);
+            return NULL;
+        }
 
         // Validate if validator provided
         if (step->validator && !step->validator(current_output)) {
@@ -215,14 +385,19 @@ char* prompt_chain_execute(PromptChain* chain, Context* initial_context) {
             free(prompt);
             free(current_output);
             context_free(ctx);
+            step_span.error = run_span.error = true;
+            metrics_span_end(&step_span);
+            metrics_span_end(&run_span);
             return NULL;
         }
 
         // Process if processor provided
         if (step->processor) {
             void* processed = step->processor(current_output);
-            // In this simplified version, we assume processor returns a string
+            // In this simplified version, we assume processor returns a
+            // malloc'd string; the context keeps its own copy
             context_set(ctx, step->name, (char*)processed);
+            free(processed);
         } else {
             context_set(ctx, step->name, current_output);
         }
@@ -243,15 +418,325 @@ char* prompt_chain_execute(PromptChain* chain, Context* initial_context) {
         chain->history[chain->history_count++] = history_entry;
 
         free(prompt);
+        metrics_span_end(&step_span);
     }
 
     char* result = strdup(current_output);
     free(current_output);
     context_free(ctx);
+    metrics_span_end(&run_span);
 
     return result;
 }
 
+/**
+ * Outcome of one document in a batch run
+ */
+typedef struct ChainDocumentResult {
+    char* output;  // Final step output; NULL if the document failed
+    char* error;   // Why it failed; NULL on success
+    ChainHistory* history;  // One entry per completed step
+    size_t history_count;
+} ChainDocumentResult;
+
+/**
+ * Result of prompt_chain_execute_batch
+ */
+typedef struct ChainBatchResult {
+    ChainDocumentResult* documents;  // In input order
+    size_t count;
+    size_t succeeded;
+    double elapsed_ms;
+} ChainBatchResult;
+
+/**
+ * One document moving through the pipeline
+ */
+typedef struct ChainBatchDocument {
+    struct ChainBatch* batch;
+    size_t index;
+    size_t step;  // Step it is queued for or running
+    Context* ctx;
+    char* prompt;
+    StepStream stream;
+    MetricsSpan span;  // The step in flight, a child of the batch span
+} ChainBatchDocument;
+
+/**
+ * FIFO of document indices waiting for one step
+ */
+typedef struct ChainStepQueue {
+    size_t* items;  // Ring buffer sized to the batch
+    size_t head;
+    size_t length;
+    int in_flight;
+    int limit;
+} ChainStepQueue;
+
+/**
+ * Shared state of a batch run
+ */
+typedef struct ChainBatch {
+    PromptChain* chain;
+    ChainBatchDocument* documents;
+    ChainBatchResult* result;
+    ChainStepQueue* queues;  // One per step
+    size_t count;
+    size_t finished;
+    bool pumping;  // Some thread is submitting; others only enqueue. The
+                   // batch outlives the pump as well as the last document
+    MetricsSpan span;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} ChainBatch;
+
+double chain_monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+void chain_step_queue_push(ChainStepQueue* queue, size_t capacity, size_t item) {
+    queue->items[(queue->head + queue->length) % capacity] = item;
+    queue->length++;
+}
+
+size_t chain_step_queue_pop(ChainStepQueue* queue, size_t capacity) {
+    size_t item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % capacity;
+    queue->length--;
+    return item;
+}
+
+void chain_batch_pump(ChainBatch* batch);
+
+/**
+ * Delta callback for a batch document's streaming request
+ */
+bool chain_batch_delta(const char* delta, size_t delta_length,
+                       const char* text, size_t text_length, void* user_data) {
+    ChainBatchDocument* doc = (ChainBatchDocument*)user_data;
+    return chain_stream_delta(delta, delta_length, text, text_length, &doc->stream);
+}
+
+/**
+ * Completion of one document's step: validate, store the output in its
+ * context, and queue the document for the next step
+ */
+void chain_batch_complete(AnthropicResponse* response, void* user_data) {
+    ChainBatchDocument* doc = (ChainBatchDocument*)user_data;
+    ChainBatch* batch = doc->batch;
+    ChainStep* step = batch->chain->steps[doc->step];
+    ChainDocumentResult* out = &batch->result->documents[doc->index];
+    char* output = response->text;
+    response->text = NULL;
+
+    char error[256] = "";
+    if (!output) {
+        snprintf(error, sizeof(error), "Step '%s' %s", step->name,
+                 doc->stream.rejected ? "rejected while streaming" : "API call failed");
+    } else if (step->validator && !step->validator(output)) {
+        snprintf(error, sizeof(error), "Step '%s' validation failed", step->name);
+    } else {
+        if (step->processor) {
+            void* processed = step->processor(output);
+            context_set(doc->ctx, step->name, (char*)processed);
+            free(processed);
+        } else {
+            context_set(doc->ctx, step->name, output);
+        }
+
+        ChainHistory* entry = &out->history[out->history_count++];
+        entry->step_name = strdup(step->name);
+        entry->prompt = doc->prompt;
+        doc->prompt = NULL;
+        entry->output = output;
+    }
+    free(doc->prompt);
+    doc->prompt = NULL;
+
+    doc->span.error = error[0] != '\0';
+    metrics_span_end(&doc->span);
+
+    bool finished = error[0] || doc->step + 1 == batch->chain->step_count;
+    if (error[0]) {
+        free(output);
+        out->error = strdup(error);
+    } else if (finished) {
+        out->output = strdup(output);
+    }
+    if (finished) {
+        context_free(doc->ctx);
+        doc->ctx = NULL;
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    batch->queues[doc->step].in_flight--;
+    if (!finished) {
+        doc->step++;
+        chain_step_queue_push(&batch->queues[doc->step], batch->count, doc->index);
+    }
+    pthread_mutex_unlock(&batch->lock);
+
+    // A slot opened on this step and maybe work arrived on the next
+    chain_batch_pump(batch);
+
+    // Counted last: once every document is counted and no pump is running
+    // the batch may be freed
+    if (finished) {
+        pthread_mutex_lock(&batch->lock);
+        if (!error[0]) batch->result->succeeded++;
+        if (++batch->finished == batch->count) pthread_cond_broadcast(&batch->done);
+        pthread_mutex_unlock(&batch->lock);
+    }
+}
+
+/**
+ * Submit as much queued work as the step limits allow. Later steps go
+ * first so documents already in the pipeline drain before new ones
+ * enter. Only one thread submits at a time; completions that arrive
+ * meanwhile (inline, in the mock build) just queue and are picked up by
+ * the running pump, so the call stack never grows with the batch.
+ */
+void chain_batch_pump(ChainBatch* batch) {
+    pthread_mutex_lock(&batch->lock);
+    if (batch->pumping) {
+        pthread_mutex_unlock(&batch->lock);
+        return;
+    }
+    batch->pumping = true;
+
+    for (;;) {
+        ChainBatchDocument* doc = NULL;
+        for (size_t k = batch->chain->step_count; k-- > 0 && !doc;) {
+            ChainStepQueue* queue = &batch->queues[k];
+            if (queue->length > 0 && queue->in_flight < queue->limit) {
+                doc = &batch->documents[chain_step_queue_pop(queue, batch->count)];
+                queue->in_flight++;
+            }
+        }
+        if (!doc) break;
+        pthread_mutex_unlock(&batch->lock);
+
+        PromptChain* chain = batch->chain;
+        ChainStep* step = chain->steps[doc->step];
+        doc->prompt = step->prompt_template(doc->ctx);
+        doc->stream = (StepStream){chain, step, false};
+
+        // The request's span is a child of the step's, whichever thread pumps
+        metrics_span_start(&doc->span, "chain.step", metrics_span_context(&batch->span));
+        metrics_span_set_string(&doc->span, "chain.step.name", step->name);
+        metrics_span_set_int(&doc->span, "chain.step.index", (int64_t)doc->step);
+        metrics_span_set_int(&doc->span, "chain.document", (int64_t)doc->index);
+        MetricsSpan* previous_span = metrics_span_attach(&doc->span);
+
+        AnthropicRequest request = {.api_key = chain->api_key, .model = chain->model,
+                                    .prompt = doc->prompt, .max_tokens = DEFAULT_MAX_TOKENS};
+        TransportFuture* future;
+        if (chain->streaming) {
+            future = transport_submit_stream(transport_default(), &request, chain_batch_delta,
+                                             chain_batch_complete, doc);
+        } else {
+            future = transport_submit(transport_default(), &request, chain_batch_complete, doc);
+        }
+        transport_future_release(future);
+        metrics_span_restore(previous_span);
+
+        pthread_mutex_lock(&batch->lock);
+    }
+
+    // A completion answered inline may have counted the last document while
+    // this pump still held the batch; the waiter frees it only after this
+    batch->pumping = false;
+    if (batch->finished == batch->count) pthread_cond_broadcast(&batch->done);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+/**
+ * Run the chain over many documents at once, pipelined: while document i
+ * is at step k, document i+1 can be at step k-1. Each step keeps up to
+ * its concurrency limit of requests in flight, so throughput is set by
+ * the slowest step rather than the sum of all steps. initial_contexts
+ * must stay unchanged until the call returns.
+ */
+ChainBatchResult* prompt_chain_execute_batch(PromptChain* chain, Context** initial_contexts,
+                                             size_t count) {
+    double start = chain_monotonic_ms();
+    ChainBatchResult* result = (ChainBatchResult*)calloc(1, sizeof(ChainBatchResult));
+    result->count = count;
+    result->documents = (ChainDocumentResult*)calloc(count > 0 ? count : 1,
+                                                     sizeof(ChainDocumentResult));
+    if (count == 0 || chain->step_count == 0) {
+        for (size_t i = 0; i < count; i++) {
+            result->documents[i].error = strdup("Chain has no steps");
+        }
+        return result;
+    }
+
+    ChainBatch batch = {0};
+    batch.chain = chain;
+    batch.result = result;
+    batch.count = count;
+    batch.documents = (ChainBatchDocument*)calloc(count, sizeof(ChainBatchDocument));
+    batch.queues = (ChainStepQueue*)calloc(chain->step_count, sizeof(ChainStepQueue));
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.done, NULL);
+    metrics_span_begin(&batch.span, "chain.batch", NULL);
+    metrics_span_set_int(&batch.span, "chain.documents", (int64_t)count);
+
+    for (size_t k = 0; k < chain->step_count; k++) {
+        batch.queues[k].items = (size_t*)malloc(count * sizeof(size_t));
+        int limit = chain->steps[k]->max_concurrency;
+        batch.queues[k].limit = limit > 0 ? limit : CHAIN_BATCH_DEFAULT_CONCURRENCY;
+    }
+
+    // Every document enters at step 0, in input order
+    for (size_t i = 0; i < count; i++) {
+        ChainBatchDocument* doc = &batch.documents[i];
+        doc->batch = &batch;
+        doc->index = i;
+        doc->ctx = context_create_child(initial_contexts[i]);
+        result->documents[i].history =
+            (ChainHistory*)calloc(chain->step_count, sizeof(ChainHistory));
+        chain_step_queue_push(&batch.queues[0], count, i);
+    }
+
+    chain_batch_pump(&batch);
+
+    pthread_mutex_lock(&batch.lock);
+    while (batch.finished < count || batch.pumping) {
+        pthread_cond_wait(&batch.done, &batch.lock);
+    }
+    pthread_mutex_unlock(&batch.lock);
+    metrics_span_set_int(&batch.span, "chain.succeeded", (int64_t)result->succeeded);
+    metrics_span_end(&batch.span);
+
+    for (size_t k = 0; k < chain->step_count; k++) free(batch.queues[k].items);
+    free(batch.queues);
+    free(batch.documents);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.done);
+
+    result->elapsed_ms = chain_monotonic_ms() - start;
+    return result;
+}
+
+void chain_batch_result_free(ChainBatchResult* result) {
+    for (size_t i = 0; i < result->count; i++) {
+        ChainDocumentResult* doc = &result->documents[i];
+        for (size_t j = 0; j < doc->history_count; j++) {
+            free(doc->history[j].step_name);
+            free(doc->history[j].prompt);
+            free(doc->history[j].output);
+        }
+        free(doc->history);
+        free(doc->output);
+        free(doc->error);
+    }
+    free(result->documents);
+    free(result);
+}
+
 void prompt_chain_free(PromptChain* chain) {
     free(chain->api_key);
     free(chain->model);
@@ -275,22 +760,35 @@ void prompt_chain_free(PromptChain* chain) {
 // Example usage
 char* outline_template(Context* ctx) {
     const char* topic = context_get(ctx, "topic");
-    char* prompt = (char*)malloc(1024);
-    snprintf(prompt, 1024, "Create a detailed outline for an article about: %s", topic);
-    return prompt;
+    StringBuilder prompt = {0};
+    string_builder_appendf(&prompt, "Create a detailed outline for an article about: %s", topic);
+    return string_builder_take(&prompt);
 }
 
 bool outline_validator(const char* output) {
     return strstr(output, "1.") != NULL && strstr(output, "2.") != NULL;
 }
 
+StreamVerdict outline_stream_validator(const char* partial_output, size_t length) {
+    // An outline that has not started numbering by now is not going to pass
+    if (length >= OUTLINE_EARLY_CHECK_CHARS && strstr(partial_output, "1.") == NULL) {
+        return STREAM_REJECT;
+    }
+    return STREAM_CONTINUE;
+}
+
+void print_delta(const char* step_name, const char* delta, size_t length, void* user_data) {
+    (void)user_data;
+    printf("[%s] %.*s\n", step_name, (int)length, delta);
+}
+
 char* draft_template(Context* ctx) {
     const char* outline = context_get(ctx, "outline");
-    char* prompt = (char*)malloc(2048);
-    snprintf(prompt, 2048,
+    StringBuilder prompt = {0};
+    string_builder_appendf(&prompt,
         "Expand this outline into a full article:\n%s\n\nWrite in a professional tone with clear examples.",
         outline);
-    return prompt;
+    return string_builder_take(&prompt);
 }
 
 int main() {
@@ -300,16 +798,31 @@ int main() {
         return 1;
     }
 
+    transport_set_mock_responder(mock_anthropic_api);
+
+    // AGENT_METRICS_PORT serves Prometheus metrics on loopback;
+    // AGENT_TRACE_FILE appends one OTLP/JSON line per finished span
+    metrics_init_from_env();
+
+    // Repeated prompts are served from cache; set AGENT_CACHE_FILE to keep
+    // answers across runs
+    ResponseCache* cache = transport_enable_cache(transport_default(), 256, 3600,
+                                                  getenv("AGENT_CACHE_FILE"));
+
     // Create chain
     PromptChain* chain = prompt_chain_create(api_key, "claude-3-5-sonnet-20241022");
 
+    prompt_chain_set_streaming(chain, print_delta, NULL);
+
     // Add steps
-    prompt_chain_add_step(chain, chain_step_create(
+    ChainStep* outline_step = chain_step_create(
         "outline",
         outline_template,
         outline_validator,
         NULL
-    ));
+    );
+    chain_step_set_stream_validator(outline_step, outline_stream_validator);
+    prompt_chain_add_step(chain, outline_step);
 
     prompt_chain_add_step(chain, chain_step_create(
         "draft",
@@ -337,9 +850,42 @@ int main() {
         free(result);
     }
 
+    // Batch: the same chain over many topics, pipelined across steps
+    printf("\n\n=== Batch Execution ===\n");
+    const char* topics[] = {
+        "Vector Databases", "Retrieval-Augmented Generation", "Tool Use in LLMs",
+        "Evaluating Agents", "Prompt Caching", "Streaming Responses"
+    };
+    size_t topic_count = sizeof(topics) / sizeof(topics[0]);
+    Context* batch_contexts[sizeof(topics) / sizeof(topics[0])];
+    for (size_t i = 0; i < topic_count; i++) {
+        batch_contexts[i] = context_create();
+        context_set(batch_contexts[i], "topic", topics[i]);
+    }
+
+    chain->streaming = false;
+    chain_step_set_concurrency(outline_step, 4);
+    ChainBatchResult* batch = prompt_chain_execute_batch(chain, batch_contexts, topic_count);
+
+    printf("Succeeded: %zu/%zu in %.1f ms\n", batch->succeeded, batch->count, batch->elapsed_ms);
+    for (size_t i = 0; i < batch->count; i++) {
+        ChainDocumentResult* doc = &batch->documents[i];
+        printf("  %s: %zu steps, %s\n", topics[i], doc->history_count,
+               doc->output ? "ok" : doc->error);
+    }
+
+    chain_batch_result_free(batch);
+    for (size_t i = 0; i < topic_count; i++) context_free(batch_contexts[i]);
+
     // Cleanup
     context_free(ctx);
     prompt_chain_free(chain);
 
+    metrics_print_summary(stdout);
+    response_cache_print_stats(cache, stdout);
+    transport_set_cache(transport_default(), NULL);
+    response_cache_destroy(cache);
+    metrics_shutdown();
+
     return 0;
 }
@@ -0,0 +1,325 @@
+/**
+ * Shared Token Budgets and Rate Governor for the C Agent Pattern Templates
+ * Keeps every pattern inside its token ceiling and the account's rate limits
+ *
+ * A TokenBudget is a ceiling on the tokens one pattern (a voter, an
+ * evaluator, an orchestrator, an agent) may spend. Requests reserve their
+ * estimated cost before they are sent and settle to the usage the API
+ * reports when they complete, so concurrent fan-out cannot overshoot. A
+ * request that does not fit is refused rather than sent.
+ *
+ * A RateGovernor holds two token buckets, requests per minute and tokens
+ * per minute, shared by every request on a transport. Admission blocks
+ * until both buckets have room, so bursts queue on the client instead of
+ * coming back as 429s. Each bucket starts full and refills continuously.
+ * Threads that must not block poll with rate_governor_try_acquire().
+ *
+ * Usage is counted the way the API meters rate limits: uncached input,
+ * cache writes and output. Budgets also charge cache reads at a tenth,
+ * roughly what they cost.
+ *
+ * Header-only: include it from a template.
+ */
+
+#ifndef RATE_GOVERNOR_H
+#define RATE_GOVERNOR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+/**
+ * Token ceiling for one pattern
+ */
+typedef struct TokenBudget {
+    pthread_mutex_t lock;
+    long limit;     // 0 means unlimited
+    long spent;     // Settled usage
+    long reserved;  // Estimates of requests still in flight
+    int refused;    // Requests that did not fit
+} TokenBudget;
+
+/**
+ * Continuously refilling bucket
+ */
+typedef struct TokenBucket {
+    double capacity;  // Per-minute limit; 0 disables the bucket
+    double level;     // May go negative when a request used more than estimated
+    double refill_per_ms;
+} TokenBucket;
+
+/**
+ * Admission counters for a governor
+ */
+typedef struct RateGovernorStats {
+    long admitted;
+    long delayed;   // Requests that had to wait for room
+    double wait_ms;  // Total time spent waiting
+} RateGovernorStats;
+
+/**
+ * Requests-per-minute and tokens-per-minute limiter shared by a transport
+ */
+typedef struct RateGovernor {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    TokenBucket requests;
+    TokenBucket tokens;
+    struct timespec updated;
+    RateGovernorStats stats;
+} RateGovernor;
+
+/**
+ * Initialize a budget of limit tokens (0 for no limit)
+ */
+static inline void token_budget_init(TokenBudget* budget, long limit) {
+    pthread_mutex_init(&budget->lock, NULL);
+    budget->limit = limit > 0 ? limit : 0;
+    budget->spent = 0;
+    budget->reserved = 0;
+    budget->refused = 0;
+}
+
+static inline void token_budget_destroy(TokenBudget* budget) {
+    pthread_mutex_destroy(&budget->lock);
+}
+
+/**
+ * Reserve an estimated cost; false, with nothing reserved, when the
+ * estimate does not fit in what is left
+ */
+static inline bool token_budget_reserve(TokenBudget* budget, long tokens) {
+    pthread_mutex_lock(&budget->lock);
+    bool fits = budget->limit == 0 || budget->spent + budget->reserved + tokens <= budget->limit;
+    if (fits) {
+        budget->reserved += tokens;
+    } else {
+        budget->refused++;
+    }
+    pthread_mutex_unlock(&budget->lock);
+    return fits;
+}
+
+/**
+ * Replace a reservation with the tokens the request actually used
+ */
+static inline void token_budget_settle(TokenBudget* budget, long reserved, long used) {
+    pthread_mutex_lock(&budget->lock);
+    budget->reserved -= reserved;
+    budget->spent += used;
+    pthread_mutex_unlock(&budget->lock);
+}
+
+/**
+ * Tokens neither spent nor reserved; LONG_MAX for an unlimited or NULL
+ * budget
+ */
+static inline long token_budget_remaining(TokenBudget* budget) {
+    if (!budget) return LONG_MAX;
+    pthread_mutex_lock(&budget->lock);
+    long remaining = budget->limit == 0 ? LONG_MAX
+                                        : budget->limit - budget->spent - budget->reserved;
+    pthread_mutex_unlock(&budget->lock);
+    return remaining > 0 ? remaining : 0;
+}
+
+/**
+ * How many of wanted calls costing per_call tokens each the budget can
+ * still pay for, but never fewer than minimum. Fan-out patterns size
+ * their voters or candidates with it.
+ */
+static inline int token_budget_fan_out(TokenBudget* budget, long per_call, int wanted,
+                                       int minimum) {
+    long remaining = token_budget_remaining(budget);
+    if (remaining == LONG_MAX || per_call <= 0) return wanted;
+    long affordable = remaining / per_call;
+    if (affordable < minimum) affordable = minimum;
+    return affordable < wanted ? (int)affordable : wanted;
+}
+
+static inline void token_budget_print(TokenBudget* budget, const char* label, FILE* out) {
+    pthread_mutex_lock(&budget->lock);
+    if (budget->limit > 0) {
+        fprintf(out, "%s budget: %ld of %ld tokens spent, %d requests refused\n", label,
+                budget->spent, budget->limit, budget->refused);
+    } else {
+        fprintf(out, "%s budget: %ld tokens spent\n", label, budget->spent);
+    }
+    pthread_mutex_unlock(&budget->lock);
+}
+
+static inline double rate_governor_elapsed_ms(const struct timespec* from,
+                                              const struct timespec* to) {
+    return (double)(to->tv_sec - from->tv_sec) * 1000.0 +
+           (double)(to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+static inline void token_bucket_init(TokenBucket* bucket, long per_minute) {
+    bucket->capacity = per_minute > 0 ? (double)per_minute : 0;
+    bucket->level = bucket->capacity;
+    bucket->refill_per_ms = bucket->capacity / 60000.0;
+}
+
+static inline void token_bucket_refill(TokenBucket* bucket, double elapsed_ms) {
+    if (bucket->capacity == 0) return;
+    bucket->level += elapsed_ms * bucket->refill_per_ms;
+    if (bucket->level > bucket->capacity) bucket->level = bucket->capacity;
+}
+
+/**
+ * Milliseconds until the bucket holds amount; 0 if it already does
+ */
+static inline double token_bucket_wait_ms(const TokenBucket* bucket, double amount) {
+    if (bucket->capacity == 0 || bucket->level >= amount) return 0;
+    return (amount - bucket->level) / bucket->refill_per_ms;
+}
+
+/**
+ * Create a governor; a limit of 0 leaves that dimension unlimited
+ */
+static inline RateGovernor* rate_governor_create(long requests_per_minute,
+                                                 long tokens_per_minute) {
+    RateGovernor* governor = (RateGovernor*)calloc(1, sizeof(RateGovernor));
+    pthread_mutex_init(&governor->lock, NULL);
+    pthread_cond_init(&governor->cond, NULL);
+    token_bucket_init(&governor->requests, requests_per_minute);
+    token_bucket_init(&governor->tokens, tokens_per_minute);
+    clock_gettime(CLOCK_MONOTONIC, &governor->updated);
+    return governor;
+}
+
+static inline void rate_governor_refill(RateGovernor* governor) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = rate_governor_elapsed_ms(&governor->updated, &now);
+    governor->updated = now;
+    token_bucket_refill(&governor->requests, elapsed);
+    token_bucket_refill(&governor->tokens, elapsed);
+}
+
+/**
+ * An estimate above the per-minute limit waits for a full bucket instead
+ * of forever
+ */
+static inline double rate_governor_amount(const RateGovernor* governor, long tokens) {
+    double amount = (double)tokens;
+    if (governor->tokens.capacity > 0 && amount > governor->tokens.capacity) {
+        amount = governor->tokens.capacity;
+    }
+    return amount;
+}
+
+/**
+ * Take one request of amount tokens out of both buckets if they have
+ * room; otherwise take nothing and return the milliseconds until they
+ * will. Called with the lock held.
+ */
+static inline double rate_governor_take_locked(RateGovernor* governor, double amount) {
+    rate_governor_refill(governor);
+    double wait_ms = token_bucket_wait_ms(&governor->requests, 1);
+    double token_wait_ms = token_bucket_wait_ms(&governor->tokens, amount);
+    if (token_wait_ms > wait_ms) wait_ms = token_wait_ms;
+    if (wait_ms > 0) return wait_ms;
+
+    if (governor->requests.capacity > 0) governor->requests.level -= 1;
+    if (governor->tokens.capacity > 0) governor->tokens.level -= amount;
+    governor->stats.admitted++;
+    return 0;
+}
+
+/**
+ * Block until one request of estimated tokens fits in both buckets, then
+ * take it out
+ */
+static inline void rate_governor_acquire(RateGovernor* governor, long tokens) {
+    double amount = rate_governor_amount(governor, tokens);
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    bool delayed = false;
+
+    pthread_mutex_lock(&governor->lock);
+    for (;;) {
+        double wait_ms = rate_governor_take_locked(governor, amount);
+        if (wait_ms <= 0) break;
+
+        // Refill is time-based; a settle that frees room wakes waiters early
+        delayed = true;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        long wait_ns = (long)(wait_ms * 1e6) + 1;
+        deadline.tv_sec += wait_ns / 1000000000L;
+        deadline.tv_nsec += wait_ns % 1000000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&governor->cond, &governor->lock, &deadline);
+    }
+
+    if (delayed) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        governor->stats.delayed++;
+        governor->stats.wait_ms += rate_governor_elapsed_ms(&started, &now);
+    }
+    pthread_mutex_unlock(&governor->lock);
+}
+
+/**
+ * Acquire without blocking, for threads that must never wait such as an
+ * event loop: 0 once admitted, otherwise the milliseconds to wait before
+ * trying again with nothing taken. waited_ms is how long the caller has
+ * already held the request back, for the delay counters.
+ */
+static inline double rate_governor_try_acquire(RateGovernor* governor, long tokens,
+                                               double waited_ms) {
+    pthread_mutex_lock(&governor->lock);
+    double wait_ms = rate_governor_take_locked(governor, rate_governor_amount(governor, tokens));
+    if (wait_ms <= 0 && waited_ms > 0) {
+        governor->stats.delayed++;
+        governor->stats.wait_ms += waited_ms;
+    }
+    pthread_mutex_unlock(&governor->lock);
+    return wait_ms;
+}
+
+/**
+ * Correct the token bucket once a request's real usage is known
+ */
+static inline void rate_governor_settle(RateGovernor* governor, long estimated, long used) {
+    if (governor->tokens.capacity == 0) return;
+    pthread_mutex_lock(&governor->lock);
+    double amount = rate_governor_amount(governor, estimated);
+    governor->tokens.level += amount - (double)used;
+    if (governor->tokens.level > governor->tokens.capacity) {
+        governor->tokens.level = governor->tokens.capacity;
+    }
+    pthread_cond_broadcast(&governor->cond);
+    pthread_mutex_unlock(&governor->lock);
+}
+
+static inline RateGovernorStats rate_governor_get_stats(RateGovernor* governor) {
+    pthread_mutex_lock(&governor->lock);
+    RateGovernorStats stats = governor->stats;
+    pthread_mutex_unlock(&governor->lock);
+    return stats;
+}
+
+static inline void rate_governor_print_stats(RateGovernor* governor, FILE* out) {
+    RateGovernorStats stats = rate_governor_get_stats(governor);
+    fprintf(out, "Rate governor: %ld requests admitted, %ld delayed (%.0f ms waiting)\n",
+            stats.admitted, stats.delayed, stats.wait_ms);
+}
+
+static inline void rate_governor_destroy(RateGovernor* governor) {
+    if (!governor) return;
+    pthread_mutex_destroy(&governor->lock);
+    pthread_cond_destroy(&governor->cond);
+    free(governor);
+}
+
+#endif // RATE_GOVERNOR_H
@@ -0,0 +1,399 @@
+/**
+ * Shared Response Cache for the C Agent Pattern Templates
+ * Content-addressed cache of Messages API responses
+ *
+ * Entries are keyed on a 128-bit hash of (model, system prompt, prompt,
+ * max_tokens), where the prompt includes any cached prefix block. The
+ * memory tier is an LRU list indexed by a chained hash table. An optional
+ * disk tier is a direct-mapped table of fixed-size slots in an mmap'd
+ * file, so cached answers survive restarts and can be shared by later
+ * runs; responses larger than a slot stay memory-only. Entries expire
+ * after the cache's TTL (0 keeps them until evicted).
+ *
+ * Attach a cache to a transport with transport_set_cache() to use it from
+ * every call_anthropic_api in a template. The cache is thread-safe; the
+ * disk file is not locked against other processes writing it at the same
+ * time.
+ *
+ * Header-only: include it from a template and compile with -pthread.
+ */
+
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define RESPONSE_CACHE_DISK_MAGIC 0x31434341u  // "ACC1"
+#define RESPONSE_CACHE_DISK_SLOT_SIZE 16384
+#define RESPONSE_CACHE_DEFAULT_DISK_SLOTS 1024
+
+/**
+ * Cache key: two independent 64-bit hashes of the request fields
+ */
+typedef struct ResponseCacheKey {
+    uint64_t hi;
+    uint64_t lo;
+} ResponseCacheKey;
+
+/**
+ * Counters reported by response_cache_get_stats()
+ */
+typedef struct ResponseCacheStats {
+    size_t memory_hits;
+    size_t disk_hits;
+    size_t misses;
+    size_t stores;
+    size_t evictions;
+    size_t expirations;
+    size_t entries;
+} ResponseCacheStats;
+
+typedef struct ResponseCacheEntry {
+    ResponseCacheKey key;
+    char* text;
+    size_t length;
+    time_t expires_at;  // 0 never expires
+    struct ResponseCacheEntry* lru_prev;
+    struct ResponseCacheEntry* lru_next;
+    struct ResponseCacheEntry* bucket_next;
+} ResponseCacheEntry;
+
+/**
+ * On-disk slot; a zero length marks an empty or half-written slot
+ */
+typedef struct ResponseCacheDiskSlot {
+    ResponseCacheKey key;
+    int64_t expires_at;
+    uint32_t length;
+    char data[RESPONSE_CACHE_DISK_SLOT_SIZE - 2 * sizeof(uint64_t) - sizeof(int64_t) -
+              sizeof(uint32_t)];
+} ResponseCacheDiskSlot;
+
+typedef struct ResponseCacheDiskHeader {
+    uint32_t magic;
+    uint32_t slot_size;
+    uint64_t slot_count;
+} ResponseCacheDiskHeader;
+
+typedef struct ResponseCache {
+    pthread_mutex_t lock;
+    ResponseCacheEntry** buckets;
+    size_t bucket_count;  // Power of two
+    size_t max_entries;
+    int ttl_seconds;
+    ResponseCacheEntry* lru_head;  // Most recently used
+    ResponseCacheEntry* lru_tail;
+    ResponseCacheStats stats;
+    // Optional disk tier
+    int disk_fd;
+    void* disk_map;
+    size_t disk_map_size;
+    ResponseCacheDiskSlot* disk_slots;
+    size_t disk_slot_count;
+} ResponseCache;
+
+static inline void response_cache_hash_byte(ResponseCacheKey* key, unsigned char c) {
+    key->hi = (key->hi ^ c) * 1099511628211ULL;
+    key->lo = (key->lo + c + 1) * 0x9E3779B97F4A7C15ULL;
+    key->lo ^= key->lo >> 29;
+}
+
+/**
+ * Hash one field into both halves of the key. Fields are followed by a
+ * separator so ("ab", "c") and ("a", "bc") hash differently.
+ */
+static inline void response_cache_hash_field(ResponseCacheKey* key, const char* data, size_t length) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < length; i++) {
+        response_cache_hash_byte(key, p[i]);
+    }
+    response_cache_hash_byte(key, 0xFF);
+}
+
+/**
+ * Build the key for a request whose prompt is given in pieces; it equals
+ * the key of the joined prompt. system_prompt and prefix may be NULL.
+ */
+static inline ResponseCacheKey response_cache_key_iov(const char* model, const char* system_prompt,
+                                                      const char* prefix,
+                                                      const struct iovec* prompt, int prompt_count,
+                                                      int max_tokens) {
+    ResponseCacheKey key = {1469598103934665603ULL, 0x243F6A8885A308D3ULL};
+    char tokens[16];
+    int tokens_length = snprintf(tokens, sizeof(tokens), "%d", max_tokens);
+
+    response_cache_hash_field(&key, model, strlen(model));
+    if (system_prompt) {
+        response_cache_hash_field(&key, system_prompt, strlen(system_prompt));
+    } else {
+        response_cache_hash_field(&key, "", 0);
+    }
+    if (prefix) {
+        response_cache_hash_field(&key, prefix, strlen(prefix));
+    }
+    for (int i = 0; i < prompt_count; i++) {
+        const unsigned char* p = (const unsigned char*)prompt[i].iov_base;
+        for (size_t j = 0; j < prompt[i].iov_len; j++) {
+            response_cache_hash_byte(&key, p[j]);
+        }
+    }
+    response_cache_hash_byte(&key, 0xFF);
+    response_cache_hash_field(&key, tokens, (size_t)tokens_length);
+    return key;
+}
+
+/**
+ * Build the key for a request; system_prompt and prefix may be NULL
+ */
+static inline ResponseCacheKey response_cache_key(const char* model, const char* system_prompt,
+                                                  const char* prefix, const char* prompt,
+                                                  int max_tokens) {
+    struct iovec piece = {(void*)prompt, strlen(prompt)};
+    return response_cache_key_iov(model, system_prompt, prefix, &piece, 1, max_tokens);
+}
+
+/**
+ * Create a cache holding up to max_entries responses in memory
+ */
+static inline ResponseCache* response_cache_create(size_t max_entries, int ttl_seconds) {
+    ResponseCache* cache = (ResponseCache*)calloc(1, sizeof(ResponseCache));
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->max_entries = max_entries > 0 ? max_entries : 1;
+    cache->ttl_seconds = ttl_seconds > 0 ? ttl_seconds : 0;
+    cache->bucket_count = 16;
+    while (cache->bucket_count < cache->max_entries) cache->bucket_count *= 2;
+    cache->buckets = (ResponseCacheEntry**)calloc(cache->bucket_count, sizeof(ResponseCacheEntry*));
+    cache->disk_fd = -1;
+    return cache;
+}
+
+/**
+ * Back the cache with an mmap'd file of slot_count slots (0 uses the
+ * default). An existing file with a matching layout is reused.
+ */
+static inline bool response_cache_attach_disk(ResponseCache* cache, const char* path, size_t slot_count) {
+    if (slot_count == 0) slot_count = RESPONSE_CACHE_DEFAULT_DISK_SLOTS;
+    size_t map_size = sizeof(ResponseCacheDiskHeader) + slot_count * sizeof(ResponseCacheDiskSlot);
+    map_size = (map_size + 4095) & ~(size_t)4095;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "Response cache: cannot open %s\n", path);
+        return false;
+    }
+
+    struct stat st;
+    bool fresh = fstat(fd, &st) != 0 || (size_t)st.st_size != map_size;
+    if (ftruncate(fd, (off_t)map_size) != 0) {
+        fprintf(stderr, "Response cache: cannot size %s\n", path);
+        close(fd);
+        return false;
+    }
+
+    void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Response cache: cannot map %s\n", path);
+        close(fd);
+        return false;
+    }
+
+    ResponseCacheDiskHeader* header = (ResponseCacheDiskHeader*)map;
+    if (fresh || header->magic != RESPONSE_CACHE_DISK_MAGIC ||
+        header->slot_size != sizeof(ResponseCacheDiskSlot) || header->slot_count != slot_count) {
+        memset(map, 0, map_size);
+        header->magic = RESPONSE_CACHE_DISK_MAGIC;
+        header->slot_size = sizeof(ResponseCacheDiskSlot);
+        header->slot_count = slot_count;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache->disk_fd = fd;
+    cache->disk_map = map;
+    cache->disk_map_size = map_size;
+    cache->disk_slots = (ResponseCacheDiskSlot*)((char*)map + sizeof(ResponseCacheDiskHeader));
+    cache->disk_slot_count = slot_count;
+    pthread_mutex_unlock(&cache->lock);
+    return true;
+}
+
+static inline bool response_cache_key_equal(ResponseCacheKey a, ResponseCacheKey b) {
+    return a.hi == b.hi && a.lo == b.lo;
+}
+
+static inline ResponseCacheEntry** response_cache_bucket(ResponseCache* cache, ResponseCacheKey key) {
+    return &cache->buckets[key.lo & (cache->bucket_count - 1)];
+}
+
+static inline void response_cache_lru_unlink(ResponseCache* cache, ResponseCacheEntry* entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else cache->lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else cache->lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static inline void response_cache_lru_push(ResponseCache* cache, ResponseCacheEntry* entry) {
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head) cache->lru_head->lru_prev = entry;
+    cache->lru_head = entry;
+    if (!cache->lru_tail) cache->lru_tail = entry;
+}
+
+/**
+ * Unlink and free a memory entry (cache lock held)
+ */
+static inline void response_cache_remove(ResponseCache* cache, ResponseCacheEntry* entry) {
+    ResponseCacheEntry** link = response_cache_bucket(cache, entry->key);
+    while (*link != entry) link = &(*link)->bucket_next;
+    *link = entry->bucket_next;
+    response_cache_lru_unlink(cache, entry);
+    cache->stats.entries--;
+    free(entry->text);
+    free(entry);
+}
+
+/**
+ * Insert or refresh a memory entry, evicting the least recently used one
+ * when full (cache lock held)
+ */
+static inline void response_cache_insert(ResponseCache* cache, ResponseCacheKey key,
+                                         const char* text, size_t length, time_t expires_at) {
+    ResponseCacheEntry** bucket = response_cache_bucket(cache, key);
+    for (ResponseCacheEntry* e = *bucket; e; e = e->bucket_next) {
+        if (response_cache_key_equal(e->key, key)) {
+            response_cache_remove(cache, e);
+            break;
+        }
+    }
+
+    if (cache->stats.entries >= cache->max_entries && cache->lru_tail) {
+        response_cache_remove(cache, cache->lru_tail);
+        cache->stats.evictions++;
+    }
+
+    ResponseCacheEntry* entry = (ResponseCacheEntry*)calloc(1, sizeof(ResponseCacheEntry));
+    entry->key = key;
+    entry->text = strndup(text, length);
+    entry->length = length;
+    entry->expires_at = expires_at;
+    entry->bucket_next = *bucket;
+    *bucket = entry;
+    response_cache_lru_push(cache, entry);
+    cache->stats.entries++;
+}
+
+/**
+ * Look up a response; returns a malloc'd copy or NULL on a miss
+ */
+static inline char* response_cache_get(ResponseCache* cache, ResponseCacheKey key) {
+    time_t now = time(NULL);
+    char* text = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    for (ResponseCacheEntry* e = *response_cache_bucket(cache, key); e; e = e->bucket_next) {
+        if (!response_cache_key_equal(e->key, key)) continue;
+        if (e->expires_at && e->expires_at <= now) {
+            response_cache_remove(cache, e);
+            cache->stats.expirations++;
+            break;
+        }
+        response_cache_lru_unlink(cache, e);
+        response_cache_lru_push(cache, e);
+        text = strndup(e->text, e->length);
+        cache->stats.memory_hits++;
+        break;
+    }
+
+    if (!text && cache->disk_slots) {
+        ResponseCacheDiskSlot* slot = &cache->disk_slots[key.lo % cache->disk_slot_count];
+        if (slot->length > 0 && response_cache_key_equal(slot->key, key)) {
+            if (slot->expires_at && slot->expires_at <= (int64_t)now) {
+                slot->length = 0;
+                cache->stats.expirations++;
+            } else {
+                text = strndup(slot->data, slot->length);
+                cache->stats.disk_hits++;
+                // Promote to the memory tier
+                response_cache_insert(cache, key, slot->data, slot->length,
+                                      (time_t)slot->expires_at);
+            }
+        }
+    }
+
+    if (!text) cache->stats.misses++;
+    pthread_mutex_unlock(&cache->lock);
+    return text;
+}
+
+/**
+ * Store a response in the memory tier and, if it fits, the disk tier
+ */
+static inline void response_cache_put(ResponseCache* cache, ResponseCacheKey key, const char* text) {
+    size_t length = strlen(text);
+    time_t expires_at = cache->ttl_seconds ? time(NULL) + cache->ttl_seconds : 0;
+
+    pthread_mutex_lock(&cache->lock);
+    response_cache_insert(cache, key, text, length, expires_at);
+    cache->stats.stores++;
+
+    if (cache->disk_slots && length <= sizeof(cache->disk_slots[0].data)) {
+        ResponseCacheDiskSlot* slot = &cache->disk_slots[key.lo % cache->disk_slot_count];
+        // Clear the length first so a crash mid-write leaves an empty slot
+        slot->length = 0;
+        slot->key = key;
+        slot->expires_at = (int64_t)expires_at;
+        memcpy(slot->data, text, length);
+        slot->length = (uint32_t)length;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Snapshot the hit/miss counters
+ */
+static inline ResponseCacheStats response_cache_get_stats(ResponseCache* cache) {
+    pthread_mutex_lock(&cache->lock);
+    ResponseCacheStats stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+    return stats;
+}
+
+/**
+ * Print the counters in one line
+ */
+static inline void response_cache_print_stats(ResponseCache* cache, FILE* out) {
+    ResponseCacheStats stats = response_cache_get_stats(cache);
+    fprintf(out, "Response cache: %zu memory hits, %zu disk hits, %zu misses, %zu entries\n",
+            stats.memory_hits, stats.disk_hits, stats.misses, stats.entries);
+}
+
+/**
+ * Free the cache; the disk file is flushed and kept
+ */
+static inline void response_cache_destroy(ResponseCache* cache) {
+    if (!cache) return;
+    while (cache->lru_head) {
+        response_cache_remove(cache, cache->lru_head);
+    }
+    free(cache->buckets);
+    if (cache->disk_map) {
+        msync(cache->disk_map, cache->disk_map_size, MS_ASYNC);
+        munmap(cache->disk_map, cache->disk_map_size);
+    }
+    if (cache->disk_fd >= 0) close(cache->disk_fd);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+#endif // RESPONSE_CACHE_H
@@ -2,21 +2,30 @@
  * Routing Pattern Implementation for C
  * Classification-based routing of inputs to specialized handlers
  *
- * Note: This is a simplified example. In production, use a proper HTTP library
- * like libcurl and JSON library like cJSON or jansson.
+ * Note: This is a simplified example. API calls go through the shared
+ * transport in anthropic_transport.h. In production, use a JSON library
+ * like cJSON or jansson.
  *
  * Compile with:
- * gcc -o routing routing.c -lcurl -ljson-c
+ * gcc -o routing routing.c -pthread -DAGENT_TRANSPORT_CURL -lcurl -ljson-c
+ * (drop -DAGENT_TRANSPORT_CURL -lcurl to run against the mock responder)
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "thread_pool.h"
+#include "anthropic_transport.h"
+#include "string_builder.h"
 
 // Maximum sizes
 #define MAX_CATEGORIES 20
-#define MAX_INPUT_SIZE 4096
 #define MAX_OUTPUT_SIZE 16384
 #define MAX_CATEGORY_NAME 64
 #define MAX_DESCRIPTION 256
@@ -33,6 +42,7 @@ typedef struct ClassificationResult {
     char category[MAX_CATEGORY_NAME];
     double confidence;
     char reasoning[MAX_DESCRIPTION];
+    bool local;  // Decided by the keyword index, no API call
 } ClassificationResult;
 
 /**
@@ -50,6 +60,362 @@ typedef struct Route {
     void* user_data;
 } Route;
 
+/**
+ * Local pre-classifier: a keyword index compiled from route descriptions
+ * (plus any extra keywords). Words are lowercased and lightly stemmed, and
+ * each term maps to the set of classes it appears in. A term shared by k
+ * classes adds 1/k to each, and confidence is top / (top + runner-up + 1),
+ * so one distinctive word scores 0.5 and three score 0.75.
+ */
+#define KEYWORD_MAX_LEN 32
+
+typedef struct KeywordTerm {
+    char term[KEYWORD_MAX_LEN];  // Empty slot if term[0] == '\0'
+    uint32_t classes;            // Bit i set if the term belongs to class i
+} KeywordTerm;
+
+typedef struct KeywordIndex {
+    KeywordTerm* terms;  // Open addressing, capacity is a power of two
+    size_t capacity;
+    size_t count;
+} KeywordIndex;
+
+/**
+ * Counters reported by router_get_stats()
+ */
+typedef struct ClassifierStats {
+    size_t local_hits;     // Answered by the keyword index
+    size_t llm_fallbacks;  // Below the threshold, sent to the LLM
+} ClassifierStats;
+
+/**
+ * Words too common in descriptions to say anything about a route
+ */
+static const char* const keyword_stopwords[] = {
+    "a", "an", "and", "are", "as", "at", "be", "by", "for", "from", "in", "into", "is", "it",
+    "of", "on", "or", "that", "the", "this", "to", "with", "question", "questions", "request",
+    "requests", "task", "tasks", NULL
+};
+
+bool keyword_is_stopword(const char* term) {
+    for (int i = 0; keyword_stopwords[i]; i++) {
+        if (strcmp(keyword_stopwords[i], term) == 0) return true;
+    }
+    return false;
+}
+
+/**
+ * Strip common suffixes so "programming" and "program" meet
+ */
+size_t keyword_stem(char* term, size_t length) {
+    static const char* const suffixes[] = {"ations", "ation", "ings", "ing", "ies", "ed", "es", "s",
+                                           NULL};
+    for (int i = 0; suffixes[i]; i++) {
+        size_t n = strlen(suffixes[i]);
+        if (length >= n + 3 && memcmp(term + length - n, suffixes[i], n) == 0) {
+            if (n == 1 && term[length - 2] == 's') break;  // "class", "access"
+            length -= n;
+            // "programm" -> "program"
+            if (length >= 4 && term[length - 1] == term[length - 2] &&
+                !strchr("aeiousl", term[length - 1])) {
+                length--;
+            }
+            break;
+        }
+    }
+    term[length] = '\0';
+    return length;
+}
+
+/**
+ * Read the next word from *cursor as a normalized term; false at the end
+ */
+bool keyword_next(const char** cursor, char term[KEYWORD_MAX_LEN]) {
+    const char* s = *cursor;
+    while (*s && !isalnum((unsigned char)*s)) s++;
+    if (!*s) {
+        *cursor = s;
+        return false;
+    }
+    size_t length = 0;
+    for (; isalnum((unsigned char)*s); s++) {
+        if (length < KEYWORD_MAX_LEN - 1) term[length++] = (char)tolower((unsigned char)*s);
+    }
+    *cursor = s;
+    keyword_stem(term, length);
+    return true;
+}
+
+uint64_t keyword_hash(const char* term) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *term; term++) {
+        hash ^= (unsigned char)*term;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Slot holding term, or the empty slot where it belongs
+ */
+KeywordTerm* keyword_index_slot(const KeywordIndex* index, const char* term) {
+    size_t mask = index->capacity - 1;
+    for (size_t i = keyword_hash(term) & mask;; i = (i + 1) & mask) {
+        KeywordTerm* slot = &index->terms[i];
+        if (slot->term[0] == '\0' || strcmp(slot->term, term) == 0) return slot;
+    }
+}
+
+void keyword_index_add(KeywordIndex* index, const char* term, int class_index) {
+    if (index->count * 2 >= index->capacity) {
+        KeywordIndex grown = {0};
+        grown.capacity = index->capacity ? index->capacity * 2 : 64;
+        grown.terms = (KeywordTerm*)calloc(grown.capacity, sizeof(KeywordTerm));
+        for (size_t i = 0; i < index->capacity; i++) {
+            if (index->terms[i].term[0]) {
+                *keyword_index_slot(&grown, index->terms[i].term) = index->terms[i];
+            }
+        }
+        grown.count = index->count;
+        free(index->terms);
+        *index = grown;
+    }
+
+    KeywordTerm* slot = keyword_index_slot(index, term);
+    if (slot->term[0] == '\0') {
+        strcpy(slot->term, term);
+        index->count++;
+    }
+    slot->classes |= 1u << class_index;
+}
+
+/**
+ * Index every word of text under class_index; stopwords are skipped unless
+ * the text is an explicit keyword list
+ */
+void keyword_index_add_text(KeywordIndex* index, const char* text, int class_index,
+                            bool skip_stopwords) {
+    char term[KEYWORD_MAX_LEN];
+    const char* cursor = text;
+    while (keyword_next(&cursor, term)) {
+        if (term[0] && !(skip_stopwords && keyword_is_stopword(term))) {
+            keyword_index_add(index, term, class_index);
+        }
+    }
+}
+
+/**
+ * Best class for input and its confidence; -1 if no term matched
+ */
+int keyword_index_classify(const KeywordIndex* index, const char* input, int class_count,
+                           double* confidence) {
+    double scores[32] = {0};
+    *confidence = 0.0;
+    if (index->count == 0) return -1;
+
+    char term[KEYWORD_MAX_LEN];
+    const char* cursor = input;
+    while (keyword_next(&cursor, term)) {
+        KeywordTerm* slot = keyword_index_slot(index, term);
+        if (slot->term[0] == '\0') continue;
+        double weight = 1.0 / __builtin_popcount(slot->classes);
+        for (int c = 0; c < class_count; c++) {
+            if (slot->classes & (1u << c)) scores[c] += weight;
+        }
+    }
+
+    int best = -1;
+    double top = 0.0, second = 0.0;
+    for (int c = 0; c < class_count; c++) {
+        if (scores[c] > top) {
+            second = top;
+            top = scores[c];
+            best = c;
+        } else if (scores[c] > second) {
+            second = scores[c];
+        }
+    }
+    if (best >= 0) *confidence = top / (top + second + 1.0);
+    return best;
+}
+
+void keyword_index_free(KeywordIndex* index) {
+    free(index->terms);
+    *index = (KeywordIndex){0};
+}
+
+/**
+ * Speculative execution: while the classification call is in flight, the
+ * most likely route (or model) is already running. Its output is kept if
+ * the classification agrees and cancelled otherwise. Tokens spent on
+ * cancelled work count as waste, and speculation pauses once the waste
+ * reaches the token budget.
+ */
+typedef struct SpeculationStats {
+    size_t started;
+    size_t kept;
+    size_t discarded;
+    size_t wasted_tokens;  // Input, cache and output tokens of discarded work
+} SpeculationStats;
+
+/**
+ * Speculation settings and counters shared by Router and ModelRouter
+ */
+typedef struct Speculator {
+    bool enabled;
+    double min_confidence;  // Speculate only on a guess at least this likely
+    size_t token_budget;    // Waste allowed before speculation stops; 0 is unlimited
+    atomic_size_t started;
+    atomic_size_t kept;
+    atomic_size_t discarded;
+    atomic_size_t wasted_tokens;
+} Speculator;
+
+void speculator_init(Speculator* s) {
+    s->enabled = false;
+    s->min_confidence = 0.3;
+    s->token_budget = 0;
+    atomic_init(&s->started, 0);
+    atomic_init(&s->kept, 0);
+    atomic_init(&s->discarded, 0);
+    atomic_init(&s->wasted_tokens, 0);
+}
+
+/**
+ * Whether to speculate on a guess with this confidence
+ */
+bool speculator_allows(const Speculator* s, double confidence) {
+    return s->enabled && confidence >= s->min_confidence &&
+           (s->token_budget == 0 || atomic_load(&s->wasted_tokens) < s->token_budget);
+}
+
+/**
+ * Count a finished speculation; usage is what it spent
+ */
+void speculator_record(Speculator* s, bool kept, const AnthropicUsage* usage) {
+    if (kept) {
+        atomic_fetch_add(&s->kept, 1);
+        return;
+    }
+    atomic_fetch_add(&s->discarded, 1);
+    atomic_fetch_add(&s->wasted_tokens,
+                     (size_t)(usage->input_tokens + usage->cache_creation_input_tokens +
+                              usage->cache_read_input_tokens + usage->output_tokens));
+}
+
+SpeculationStats speculator_get_stats(Speculator* s) {
+    SpeculationStats stats = {atomic_load(&s->started), atomic_load(&s->kept),
+                              atomic_load(&s->discarded), atomic_load(&s->wasted_tokens)};
+    return stats;
+}
+
+void speculation_stats_print(const char* name, SpeculationStats stats, FILE* out) {
+    fprintf(out, "%s: %zu started, %zu kept, %zu discarded, %zu wasted tokens\n", name,
+            stats.started, stats.kept, stats.discarded, stats.wasted_tokens);
+}
+
+/**
+ * A route handler running ahead of its classification
+ */
+typedef struct SpeculativeRun {
+    const Route* route;
+    const char* input;  // Borrowed; the run is always joined before route returns
+    char* result;
+    atomic_bool cancelled;
+    TransportFuture* future;  // The handler's API call in flight, if any
+    AnthropicUsage usage;     // Of the handler's API calls
+    pthread_mutex_t lock;
+    TaskGroup group;
+    const MetricsSpanContext* parent_span;  // The routing span that started the run
+} SpeculativeRun;
+
+// Run whose handler is executing on this thread
+static _Thread_local SpeculativeRun* speculative_run_current = NULL;
+
+/**
+ * Blocking call through the shared transport. Inside a speculative handler
+ * the call can be cancelled and its usage is charged to the run.
+ */
+char* routing_transport_call(const AnthropicRequest* request) {
+    SpeculativeRun* run = speculative_run_current;
+    if (!run) return transport_call(transport_default(), request, NULL);
+    if (atomic_load(&run->cancelled)) return NULL;
+
+    TransportFuture* future = transport_submit(transport_default(), request, NULL, NULL);
+    pthread_mutex_lock(&run->lock);
+    run->future = future;
+    if (atomic_load(&run->cancelled)) transport_cancel(future);
+    pthread_mutex_unlock(&run->lock);
+
+    transport_future_wait(future);
+    pthread_mutex_lock(&run->lock);
+    run->future = NULL;
+    pthread_mutex_unlock(&run->lock);
+
+    AnthropicUsage usage;
+    char* text = transport_future_take_text(future, &usage);
+    anthropic_usage_add(&run->usage, &usage);
+    return text;
+}
+
+/**
+ * Pool job: run the speculative handler
+ */
+void speculative_run_job(void* args) {
+    SpeculativeRun* run = (SpeculativeRun*)args;
+    SpeculativeRun* outer = speculative_run_current;
+    speculative_run_current = run;
+    MetricsSpan span;
+    metrics_span_begin(&span, "routing.handler", run->parent_span);
+    metrics_span_set_string(&span, "routing.category", run->route->category);
+    metrics_span_set_int(&span, "routing.speculative", 1);
+    run->result = run->route->handler(run->input, run->route->user_data);
+    span.error = run->result == NULL && !atomic_load(&run->cancelled);
+    metrics_span_end(&span);
+    speculative_run_current = outer;
+}
+
+/**
+ * Start route's handler on the pool
+ */
+SpeculativeRun* speculative_run_start(ThreadPool* pool, Speculator* s, const Route* route,
+                                      const char* input) {
+    SpeculativeRun* run = (SpeculativeRun*)calloc(1, sizeof(SpeculativeRun));
+    run->route = route;
+    run->input = input;
+    atomic_init(&run->cancelled, false);
+    pthread_mutex_init(&run->lock, NULL);
+    task_group_init(&run->group);
+    run->parent_span = metrics_current_span_context();
+    atomic_fetch_add(&s->started, 1);
+    thread_pool_submit(pool, &run->group, speculative_run_job, run);
+    return run;
+}
+
+/**
+ * Join a run. A kept run returns the handler's result; otherwise its API
+ * call in flight is cancelled, later ones are refused, and the output is
+ * dropped. A handler that does not call the API runs to completion.
+ */
+char* speculative_run_finish(ThreadPool* pool, Speculator* s, SpeculativeRun* run, bool keep) {
+    if (!keep) {
+        pthread_mutex_lock(&run->lock);
+        atomic_store(&run->cancelled, true);
+        if (run->future) transport_cancel(run->future);
+        pthread_mutex_unlock(&run->lock);
+    }
+    task_group_wait(pool, &run->group);
+
+    char* result = keep ? run->result : NULL;
+    if (!keep) free(run->result);
+    speculator_record(s, keep, &run->usage);
+
+    task_group_destroy(&run->group);
+    pthread_mutex_destroy(&run->lock);
+    free(run);
+    return result;
+}
+
 /**
  * Router that classifies and routes inputs
  */
@@ -61,81 +427,110 @@ typedef struct Router {
     double confidence_threshold;
     RouteHandler fallback_handler;
     void* fallback_user_data;
+    KeywordIndex keywords;  // Local first tier, built from the routes
+    bool local_classifier;
+    atomic_size_t local_hits;
+    atomic_size_t llm_fallbacks;
+    Speculator speculation;
+    atomic_size_t route_counts[MAX_CATEGORIES];  // Inputs routed to each route
+    atomic_size_t routed;
+    ThreadPool* pool;  // Runs handlers off the caller; not owned, NULL uses the default pool
+    size_t batch_size;  // Inputs per router_classify_batch request
 } Router;
 
 /**
- * Simplified API call - in production, use libcurl
+ * Whether word occurs in the first length bytes of text
  */
-char* call_anthropic_api(const char* api_key, const char* model,
-                         const char* prompt, int max_tokens) {
-    // NOTE: This is a placeholder. In production, implement using libcurl:
-    //
-    // Example with libcurl:
-    // CURL *curl = curl_easy_init();
-    // struct curl_slist *headers = NULL;
-    // headers = curl_slist_append(headers, "Content-Type: application/json");
-    // headers = curl_slist_append(headers, api_key_header);
-    // headers = curl_slist_append(headers, "anthropic-version: 2023-06-01");
-    // curl_easy_setopt(curl, CURLOPT_URL, "https://api.anthropic.com/v1/messages");
-    // curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    // curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_body);
-    // ...
+static bool mock_segment_has(const char* text, size_t length, const char* word) {
+    const char* hit = strstr(text, word);
+    return hit && hit + strlen(word) <= text + length;
+}
 
+/**
+ * Mock responder used when the transport is built without libcurl
+ */
+char* mock_anthropic_api(const AnthropicRequest* request) {
     printf("API Call (mock):\n");
-    printf("Model: %s\n", model);
-    printf("Max tokens: %d\n", max_tokens);
-    printf("Prompt: %.100s...\n", prompt);
+    printf("Model: %s\n", request->model);
+    printf("Max tokens: %d\n", request->max_tokens);
+    printf("Prompt: %.100s...\n", request->prompt);
+
+    // Batch classification: one entry per numbered input
+    if (request->cached_prefix && strstr(request->cached_prefix, "each numbered input")) {
+        StringBuilder response = {0};
+        string_builder_append_str(&response, "{\"results\": [");
+        int index = 0;
+        for (const char* p = strstr(request->prompt, "Input "); p; ) {
+            const char* next = strstr(p + 1, "\n\nInput ");
+            size_t length = next ? (size_t)(next - p) : strlen(p);
+            const char* category = "general";
+            if (mock_segment_has(p, length, "sort") || mock_segment_has(p, length, "code")) {
+                category = "code";
+            } else if (mock_segment_has(p, length, "+") || mock_segment_has(p, length, "equation")) {
+                category = "math";
+            }
+            string_builder_appendf(&response,
+                "%s{\"index\": %d, \"category\": \"%s\", \"confidence\": 0.9, "
+                "\"reasoning\": \"Mock batch classification\"}",
+                index > 0 ? ", " : "", index + 1, category);
+            index++;
+            p = next ? next + 2 : NULL;
+        }
+        string_builder_append_str(&response, "]}");
+        return string_builder_take(&response);
+    }
 
     // Mock response - return classification JSON
     return strdup("{\"category\": \"general\", \"confidence\": 0.85, \"reasoning\": \"Mock classification\"}");
 }
 
+/**
+ * Blocking API call through the shared transport (a libcurl multi handle
+ * when built with AGENT_TRANSPORT_CURL)
+ */
+char* call_anthropic_api(const char* api_key, const char* model,
+                         const char* prompt, int max_tokens) {
+    AnthropicRequest request = {.api_key = api_key, .model = model, .prompt = prompt,
+                                .max_tokens = max_tokens};
+    return routing_transport_call(&request);
+}
+
+/**
+ * Blocking call whose prompt is scattered over parts; a large input is
+ * escaped straight into the request body instead of into a prompt buffer
+ */
+char* call_anthropic_api_iov(const char* api_key, const char* model,
+                             const struct iovec* parts, int part_count, int max_tokens) {
+    AnthropicRequest request = {.api_key = api_key, .model = model, .prompt_iov = parts,
+                                .prompt_iovcnt = part_count, .max_tokens = max_tokens};
+    return routing_transport_call(&request);
+}
+
+/**
+ * Blocking call with an instruction followed by the user's input
+ */
+char* call_anthropic_api_input(const char* api_key, const char* model, const char* instruction,
+                               const char* input, int max_tokens) {
+    struct iovec parts[] = {{(void*)instruction, strlen(instruction)},
+                            {(void*)input, strlen(input)}};
+    return call_anthropic_api_iov(api_key, model, parts, 2, max_tokens);
+}
+
 /**
  * Parse classification JSON response
  */
 bool parse_classification(const char* json, ClassificationResult* result) {
-    // Simplified JSON parsing - use cJSON or jansson in production
-
-    // Find category
-    const char* cat_start = strstr(json, "\"category\"");
-    if (cat_start) {
-        cat_start = strchr(cat_start + 10, '"');
-        if (cat_start) {
-            cat_start++;
-            const char* cat_end = strchr(cat_start, '"');
-            if (cat_end) {
-                size_t len = cat_end - cat_start;
-                if (len >= MAX_CATEGORY_NAME) len = MAX_CATEGORY_NAME - 1;
-                strncpy(result->category, cat_start, len);
-                result->category[len] = '\0';
-            }
-        }
-    }
+    JsonToken tokens[32];
+    JsonDoc doc;
+    uint64_t parse_started = metrics_now_ns();
+    JsonStatus status = json_parse_embedded(&doc, json, tokens, 32);
+    metrics_observe_since(METRIC_PARSE_TIME, parse_started);
+    if (status != JSON_OK) return false;
 
-    // Find confidence
-    const char* conf_start = strstr(json, "\"confidence\"");
-    if (conf_start) {
-        conf_start = strchr(conf_start + 12, ':');
-        if (conf_start) {
-            result->confidence = atof(conf_start + 1);
-        }
-    }
-
-    // Find reasoning
-    const char* reason_start = strstr(json, "\"reasoning\"");
-    if (reason_start) {
-        reason_start = strchr(reason_start + 11, '"');
-        if (reason_start) {
-            reason_start++;
-            const char* reason_end = strchr(reason_start, '"');
-            if (reason_end) {
-                size_t len = reason_end - reason_start;
-                if (len >= MAX_DESCRIPTION) len = MAX_DESCRIPTION - 1;
-                strncpy(result->reasoning, reason_start, len);
-                result->reasoning[len] = '\0';
-            }
-        }
-    }
+    json_get_string(&doc, 0, "category", result->category, sizeof(result->category));
+    json_get_string(&doc, 0, "reasoning", result->reasoning, sizeof(result->reasoning));
+    result->confidence = json_number(&doc, json_object_get(&doc, 0, "confidence"),
+                                     result->confidence);
 
     return strlen(result->category) > 0;
 }
@@ -150,11 +545,22 @@ Router* router_create(const char* api_key, const char* model) {
     router->route_count = 0;
     router->confidence_threshold = 0.7;
     router->fallback_handler = NULL;
+    router->local_classifier = true;
+    atomic_init(&router->local_hits, 0);
+    atomic_init(&router->llm_fallbacks, 0);
+    speculator_init(&router->speculation);
+    for (int i = 0; i < MAX_CATEGORIES; i++) {
+        atomic_init(&router->route_counts[i], 0);
+    }
+    atomic_init(&router->routed, 0);
+    router->pool = NULL;
+    router->batch_size = 16;
     return router;
 }
 
 /**
- * Set confidence threshold
+ * Set confidence threshold; it also decides when the local classifier is
+ * sure enough to skip the LLM
  */
 void router_set_threshold(Router* router, double threshold) {
     router->confidence_threshold = threshold;
@@ -168,6 +574,45 @@ void router_set_fallback(Router* router, RouteHandler handler, void* user_data)
     router->fallback_user_data = user_data;
 }
 
+/**
+ * Run speculative handlers on a specific pool (shared with other patterns)
+ */
+void router_set_pool(Router* router, ThreadPool* pool) {
+    router->pool = pool;
+}
+
+/**
+ * Inputs packed into each router_classify_batch request
+ */
+void router_set_batch_size(Router* router, size_t batch_size) {
+    router->batch_size = batch_size > 0 ? batch_size : 1;
+}
+
+/**
+ * Start the likely route's handler while the LLM classifies (off by
+ * default). Only guesses at least min_confidence likely are tried, and
+ * speculation stops once discarded runs have used token_budget tokens
+ * (0 for no limit). Handlers must be safe to run and throw away: their
+ * API calls are cancelled, but other side effects are not undone.
+ */
+void router_set_speculation(Router* router, bool enabled, double min_confidence,
+                            size_t token_budget) {
+    router->speculation.enabled = enabled;
+    router->speculation.min_confidence = min_confidence;
+    router->speculation.token_budget = token_budget;
+}
+
+SpeculationStats router_get_speculation_stats(Router* router) {
+    return speculator_get_stats(&router->speculation);
+}
+
+/**
+ * Answer confident classifications from the keyword index (on by default)
+ */
+void router_set_local_classifier(Router* router, bool enabled) {
+    router->local_classifier = enabled;
+}
+
 /**
  * Add a route to the router
  */
@@ -183,36 +628,119 @@ bool router_add_route(Router* router, const char* category,
     strncpy(route->description, description, MAX_DESCRIPTION - 1);
     route->handler = handler;
     route->user_data = user_data;
+    keyword_index_add_text(&router->keywords, route->category, (int)router->route_count, true);
+    keyword_index_add_text(&router->keywords, route->description, (int)router->route_count, true);
     router->route_count++;
 
     return true;
 }
 
 /**
- * Classify an input
+ * Give the local classifier extra words for a route ("tree, pointer, compile")
  */
-ClassificationResult* router_classify(Router* router, const char* input) {
-    // Build classification prompt
-    char prompt[MAX_INPUT_SIZE * 2];
-    char categories[MAX_INPUT_SIZE];
-    categories[0] = '\0';
+bool router_add_keywords(Router* router, const char* category, const char* keywords) {
+    for (size_t i = 0; i < router->route_count; i++) {
+        if (strcmp(router->routes[i].category, category) == 0) {
+            keyword_index_add_text(&router->keywords, keywords, (int)i, false);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * How often the local classifier answered without an API call
+ */
+ClassifierStats router_get_stats(Router* router) {
+    ClassifierStats stats = {atomic_load(&router->local_hits),
+                             atomic_load(&router->llm_fallbacks)};
+    return stats;
+}
+
+void classifier_stats_print(const char* name, ClassifierStats stats, FILE* out) {
+    size_t total = stats.local_hits + stats.llm_fallbacks;
+    fprintf(out, "%s: %zu local, %zu LLM (%.0f%% local hit rate)\n", name, stats.local_hits,
+            stats.llm_fallbacks, total ? 100.0 * stats.local_hits / total : 0.0);
+}
+
+/**
+ * Remember which route an input went to; the counts are the prior that
+ * speculation falls back on
+ */
+void router_record_route(Router* router, const char* category) {
+    for (size_t i = 0; i < router->route_count; i++) {
+        if (strcmp(router->routes[i].category, category) == 0) {
+            atomic_fetch_add(&router->route_counts[i], 1);
+            atomic_fetch_add(&router->routed, 1);
+            return;
+        }
+    }
+}
+
+/**
+ * Keyword tier. Returns a result when it is confident; otherwise NULL,
+ * with its best guess (or -1) in *guess
+ */
+ClassificationResult* router_classify_local(Router* router, const char* input, int* guess,
+                                            double* guess_confidence) {
+    *guess = -1;
+    *guess_confidence = 0.0;
+    if (!router->local_classifier) return NULL;
+
+    double confidence;
+    int best = keyword_index_classify(&router->keywords, input, (int)router->route_count,
+                                      &confidence);
+    if (best >= 0 && confidence >= router->confidence_threshold) {
+        atomic_fetch_add(&router->local_hits, 1);
+        ClassificationResult* result =
+            (ClassificationResult*)calloc(1, sizeof(ClassificationResult));
+        strcpy(result->category, router->routes[best].category);
+        result->confidence = confidence;
+        strcpy(result->reasoning, "Keyword match");
+        result->local = true;
+        router_record_route(router, result->category);
+        return result;
+    }
+    atomic_fetch_add(&router->llm_fallbacks, 1);
+    *guess = best;
+    *guess_confidence = confidence;
+    return NULL;
+}
 
+/**
+ * Start the LLM classification of input
+ */
+TransportFuture* router_submit_classification(Router* router, const char* input) {
+    // Build classification prompt; the input itself is not copied
+    StringBuilder categories = {0};
+    string_builder_append_str(&categories,
+        "Classify the following input into one of these categories:\n");
     for (size_t i = 0; i < router->route_count; i++) {
-        char cat_line[MAX_CATEGORY_NAME + MAX_DESCRIPTION + 10];
-        snprintf(cat_line, sizeof(cat_line), "%s: %s\n",
-                 router->routes[i].category, router->routes[i].description);
-        strcat(categories, cat_line);
+        string_builder_appendf(&categories, "%s: %s\n",
+                               router->routes[i].category, router->routes[i].description);
     }
+    string_builder_append_str(&categories, "\nInput: ");
 
-    snprintf(prompt, sizeof(prompt),
-        "Classify the following input into one of these categories:\n"
-        "%s\n"
-        "Input: %s\n\n"
+    static const char format[] =
+        "\n\n"
         "Respond in JSON format:\n"
-        "{\"category\": \"category_name\", \"confidence\": 0.0-1.0, \"reasoning\": \"explanation\"}",
-        categories, input);
+        "{\"category\": \"category_name\", \"confidence\": 0.0-1.0, \"reasoning\": \"explanation\"}";
+    struct iovec parts[] = {{categories.data, categories.length},
+                            {(void*)input, strlen(input)},
+                            {(void*)format, sizeof(format) - 1}};
+
+    AnthropicRequest request = {.api_key = router->api_key, .model = router->model,
+                                .prompt_iov = parts, .prompt_iovcnt = 3, .max_tokens = 256};
+    TransportFuture* future = transport_submit(transport_default(), &request, NULL, NULL);
+    string_builder_free(&categories);
+    return future;
+}
 
-    char* response = call_anthropic_api(router->api_key, router->model, prompt, 256);
+/**
+ * Wait for a submitted classification and parse it; NULL on failure
+ */
+ClassificationResult* router_finish_classification(Router* router, TransportFuture* future) {
+    char* response = transport_future_take_text(future, NULL);
     if (!response) {
         return NULL;
     }
@@ -225,51 +753,359 @@ ClassificationResult* router_classify(Router* router, const char* input) {
     }
 
     free(response);
+    router_record_route(router, result->category);
     return result;
 }
 
 /**
- * Route an input to the appropriate handler
+ * Classify an input
  */
-char* router_route(Router* router, const char* input) {
-    ClassificationResult* classification = router_classify(router, input);
-    if (!classification) {
-        if (router->fallback_handler) {
-            return router->fallback_handler(input, router->fallback_user_data);
+ClassificationResult* router_classify(Router* router, const char* input) {
+    int guess;
+    double guess_confidence;
+    ClassificationResult* result = router_classify_local(router, input, &guess,
+                                                         &guess_confidence);
+    if (result) return result;
+    return router_finish_classification(router, router_submit_classification(router, input));
+}
+
+/**
+ * Route to speculate on: the keyword tier's guess if it had one, else the
+ * most frequent route so far (Laplace-smoothed share of inputs)
+ */
+int router_speculation_guess(Router* router, int guess, double* confidence) {
+    if (guess >= 0) return guess;
+
+    size_t routed = atomic_load(&router->routed);
+    size_t best_count = 0;
+    for (size_t i = 0; i < router->route_count; i++) {
+        size_t count = atomic_load(&router->route_counts[i]);
+        if (count > best_count) {
+            best_count = count;
+            guess = (int)i;
         }
-        return NULL;
     }
+    if (guess >= 0) {
+        *confidence = (double)(best_count + 1) / (double)(routed + router->route_count);
+    }
+    return guess;
+}
 
-    printf("Classification: %s (confidence: %.2f)\n",
-           classification->category, classification->confidence);
-
-    // Find matching route
-    Route* matching_route = NULL;
+/**
+ * Route for a classification, or NULL if none matches confidently enough
+ */
+Route* router_match(Router* router, const ClassificationResult* classification) {
+    if (!classification || classification->confidence < router->confidence_threshold) {
+        return NULL;
+    }
     for (size_t i = 0; i < router->route_count; i++) {
         if (strcmp(router->routes[i].category, classification->category) == 0) {
-            matching_route = &router->routes[i];
-            break;
+            return &router->routes[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Run route's handler, or the fallback when route is NULL
+ */
+char* router_dispatch(Router* router, const Route* route, const char* input) {
+    if (route) {
+        return route->handler(input, route->user_data);
+    }
+    if (router->fallback_handler) {
+        return router->fallback_handler(input, router->fallback_user_data);
+    }
+    return NULL;
+}
+
+/**
+ * Route an input to the appropriate handler
+ */
+char* router_route(Router* router, const char* input) {
+    MetricsSpan span;
+    metrics_span_begin(&span, "routing.route", NULL);
+    int guess;
+    double guess_confidence;
+    ClassificationResult* classification = router_classify_local(router, input, &guess,
+                                                                 &guess_confidence);
+    ThreadPool* pool = router->pool ? router->pool : thread_pool_default();
+    SpeculativeRun* run = NULL;
+    if (!classification) {
+        TransportFuture* future = router_submit_classification(router, input);
+        guess = router_speculation_guess(router, guess, &guess_confidence);
+        if (guess >= 0 && speculator_allows(&router->speculation, guess_confidence)) {
+            printf("Speculating on: %s (%.2f)\n", router->routes[guess].category,
+                   guess_confidence);
+            run = speculative_run_start(pool, &router->speculation, &router->routes[guess],
+                                        input);
         }
+        classification = router_finish_classification(router, future);
     }
 
+    if (!classification) {
+        if (run) speculative_run_finish(pool, &router->speculation, run, false);
+        metrics_span_set_string(&span, "routing.category", "fallback");
+        char* fallback = router->fallback_handler
+                             ? router->fallback_handler(input, router->fallback_user_data)
+                             : NULL;
+        span.error = fallback == NULL;
+        metrics_span_end(&span);
+        return fallback;
+    }
+    metrics_span_set_string(&span, "routing.category", classification->category);
+    metrics_span_set_int(&span, "routing.local", classification->local);
+    metrics_span_set_int(&span, "routing.speculated", run != NULL);
+
+    printf("Classification: %s (confidence: %.2f%s)\n", classification->category,
+           classification->confidence, classification->local ? ", local" : "");
+
+    Route* matching_route = router_match(router, classification);
     char* result = NULL;
 
-    if (matching_route && classification->confidence >= router->confidence_threshold) {
-        result = matching_route->handler(input, matching_route->user_data);
-    } else if (router->fallback_handler) {
-        result = router->fallback_handler(input, router->fallback_user_data);
+    if (run && run->route == matching_route) {
+        result = speculative_run_finish(pool, &router->speculation, run, true);
+    } else {
+        if (run) {
+            printf("Speculation discarded\n");
+            speculative_run_finish(pool, &router->speculation, run, false);
+        }
+        result = router_dispatch(router, matching_route, input);
     }
 
     free(classification);
+    span.error = result == NULL;
+    metrics_span_end(&span);
     return result;
 }
 
+/**
+ * Stable part of a batch classification request, sent as a prompt-cached
+ * prefix so its cost is shared by every input in every batch
+ */
+char* router_batch_prefix(Router* router) {
+    StringBuilder prefix = {0};
+    string_builder_append_str(&prefix,
+        "Classify each numbered input into one of these categories:\n");
+    for (size_t i = 0; i < router->route_count; i++) {
+        string_builder_appendf(&prefix, "%s: %s\n",
+                               router->routes[i].category, router->routes[i].description);
+    }
+    string_builder_append_str(&prefix,
+        "\nRespond in JSON format, with one entry per input in order:\n"
+        "{\"results\": [{\"index\": 1, \"category\": \"category_name\", "
+        "\"confidence\": 0.0-1.0, \"reasoning\": \"explanation\"}]}");
+    return string_builder_take(&prefix);
+}
+
+/**
+ * Submit inputs positions[0..count) as one numbered batch
+ */
+TransportFuture* router_submit_batch(Router* router, const char* prefix,
+                                     const char* const* inputs, const size_t* positions,
+                                     size_t count) {
+    // Labels go in one buffer and the inputs are sent in place;
+    // ends[i] is where the label before input i stops
+    StringBuilder labels = {0};
+    size_t* ends = (size_t*)malloc(count * sizeof(size_t));
+    for (size_t i = 0; i < count; i++) {
+        string_builder_appendf(&labels, "%sInput %zu: ", i > 0 ? "\n\n" : "", i + 1);
+        ends[i] = labels.length;
+    }
+
+    struct iovec* parts = (struct iovec*)malloc(2 * count * sizeof(struct iovec));
+    size_t start = 0;
+    for (size_t i = 0; i < count; i++) {
+        parts[2 * i] = (struct iovec){labels.data + start, ends[i] - start};
+        parts[2 * i + 1] = (struct iovec){(void*)inputs[positions[i]],
+                                          strlen(inputs[positions[i]])};
+        start = ends[i];
+    }
+
+    AnthropicRequest request = {.api_key = router->api_key, .model = router->model,
+                                .cached_prefix = prefix, .prompt_iov = parts,
+                                .prompt_iovcnt = (int)(2 * count),
+                                .max_tokens = 64 + 128 * (int)count};
+    TransportFuture* future = transport_submit(transport_default(), &request, NULL, NULL);
+    free(parts);
+    free(ends);
+    string_builder_free(&labels);
+    return future;
+}
+
+/**
+ * Fill results from a batch response; returns how many inputs it answered
+ */
+size_t router_parse_batch(Router* router, const char* response, const size_t* positions,
+                          size_t count, ClassificationResult* results, bool* answered) {
+    JsonDoc doc = {0};
+    const char* start = response ? strchr(response, '{') : NULL;
+    uint64_t parse_started = metrics_now_ns();
+    bool parsed = start && json_parse_alloc(&doc, start, strlen(start)) == JSON_OK;
+    metrics_observe_since(METRIC_PARSE_TIME, parse_started);
+    if (!parsed) {
+        json_doc_free(&doc);
+        return 0;
+    }
+
+    size_t filled = 0;
+    int list = json_object_get(&doc, 0, "results");
+    int next = 0;
+    for (int item = json_first_child(&doc, list); item >= 0;
+         item = json_next_child(&doc, list, item), next++) {
+        // Trust the index if given, else the order
+        int index = (int)json_number(&doc, json_object_get(&doc, item, "index"), next + 1) - 1;
+        if (index < 0 || (size_t)index >= count || answered[index]) continue;
+
+        ClassificationResult* result = &results[positions[index]];
+        json_get_string(&doc, item, "category", result->category, sizeof(result->category));
+        json_get_string(&doc, item, "reasoning", result->reasoning, sizeof(result->reasoning));
+        result->confidence = json_number(&doc, json_object_get(&doc, item, "confidence"), 0.0);
+        if (result->category[0] == '\0') continue;
+
+        answered[index] = true;
+        router_record_route(router, result->category);
+        filled++;
+    }
+    json_doc_free(&doc);
+    return filled;
+}
+
+/**
+ * Classify many inputs. Inputs the keyword tier is sure of are answered
+ * locally; the rest are packed batch_size to a request, with the category
+ * list sent once per request as a prompt-cached prefix, and all requests
+ * are in flight together. Inputs a batch response leaves out are retried
+ * one by one. Returns count results (free the array); an input that could
+ * not be classified has an empty category.
+ */
+ClassificationResult* router_classify_batch(Router* router, const char* const* inputs,
+                                            size_t count) {
+    ClassificationResult* results =
+        (ClassificationResult*)calloc(count > 0 ? count : 1, sizeof(ClassificationResult));
+    size_t* pending = (size_t*)malloc((count > 0 ? count : 1) * sizeof(size_t));
+    size_t pending_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        int guess;
+        double guess_confidence;
+        ClassificationResult* local = router_classify_local(router, inputs[i], &guess,
+                                                            &guess_confidence);
+        if (local) {
+            results[i] = *local;
+            free(local);
+        } else {
+            pending[pending_count++] = i;
+        }
+    }
+
+    size_t batch_size = router->batch_size;
+    size_t batch_count = (pending_count + batch_size - 1) / batch_size;
+    TransportFuture** futures =
+        (TransportFuture**)malloc((batch_count > 0 ? batch_count : 1) * sizeof(TransportFuture*));
+    char* prefix = router_batch_prefix(router);
+    for (size_t b = 0; b < batch_count; b++) {
+        size_t first = b * batch_size;
+        size_t n = pending_count - first < batch_size ? pending_count - first : batch_size;
+        futures[b] = router_submit_batch(router, prefix, inputs, pending + first, n);
+    }
+    free(prefix);
+
+    bool* answered = (bool*)calloc(pending_count > 0 ? pending_count : 1, sizeof(bool));
+    for (size_t b = 0; b < batch_count; b++) {
+        size_t first = b * batch_size;
+        size_t n = pending_count - first < batch_size ? pending_count - first : batch_size;
+        char* response = transport_future_take_text(futures[b], NULL);
+        router_parse_batch(router, response, pending + first, n, results, answered + first);
+        free(response);
+    }
+
+    // Anything the batches missed goes through the single-input prompt
+    size_t retry_count = 0;
+    for (size_t p = 0; p < pending_count; p++) {
+        if (!answered[p]) pending[retry_count++] = pending[p];
+    }
+    TransportFuture** retries =
+        (TransportFuture**)malloc((retry_count > 0 ? retry_count : 1) * sizeof(TransportFuture*));
+    for (size_t r = 0; r < retry_count; r++) {
+        retries[r] = router_submit_classification(router, inputs[pending[r]]);
+    }
+    for (size_t r = 0; r < retry_count; r++) {
+        ClassificationResult* single = router_finish_classification(router, retries[r]);
+        if (single) {
+            results[pending[r]] = *single;
+            free(single);
+        }
+    }
+
+    free(retries);
+    free(answered);
+    free(futures);
+    free(pending);
+    return results;
+}
+
+/**
+ * One handler run of a routed batch
+ */
+typedef struct RouteBatchJob {
+    Router* router;
+    const char* input;
+    const ClassificationResult* classification;
+    char** result;
+    const MetricsSpanContext* parent_span;
+} RouteBatchJob;
+
+void route_batch_job(void* args) {
+    RouteBatchJob* job = (RouteBatchJob*)args;
+    const ClassificationResult* classification =
+        job->classification->category[0] ? job->classification : NULL;
+    MetricsSpan span;
+    metrics_span_begin(&span, "routing.handler", job->parent_span);
+    metrics_span_set_string(&span, "routing.category",
+                            classification ? classification->category : "fallback");
+    *job->result = router_dispatch(job->router, router_match(job->router, classification),
+                                   job->input);
+    span.error = *job->result == NULL;
+    metrics_span_end(&span);
+}
+
+/**
+ * Classify inputs with router_classify_batch, then run every handler in
+ * parallel on the pool. Returns count results (free each and the array);
+ * NULL where no handler produced one.
+ */
+char** router_route_batch(Router* router, const char* const* inputs, size_t count) {
+    MetricsSpan span;
+    metrics_span_begin(&span, "routing.batch", NULL);
+    metrics_span_set_int(&span, "routing.inputs", (long)count);
+    ClassificationResult* classifications = router_classify_batch(router, inputs, count);
+    char** results = (char**)calloc(count > 0 ? count : 1, sizeof(char*));
+    RouteBatchJob* jobs = (RouteBatchJob*)malloc((count > 0 ? count : 1) * sizeof(RouteBatchJob));
+
+    ThreadPool* pool = router->pool ? router->pool : thread_pool_default();
+    TaskGroup group;
+    task_group_init(&group);
+    for (size_t i = 0; i < count; i++) {
+        jobs[i] = (RouteBatchJob){router, inputs[i], &classifications[i], &results[i],
+                                  metrics_span_context(&span)};
+        thread_pool_submit(pool, &group, route_batch_job, &jobs[i]);
+    }
+    task_group_wait(pool, &group);
+    task_group_destroy(&group);
+    metrics_span_end(&span);
+
+    free(jobs);
+    free(classifications);
+    return results;
+}
+
 /**
  * Free router resources
  */
 void router_free(Router* router) {
     free(router->api_key);
     free(router->model);
+    keyword_index_free(&router->keywords);
     free(router);
 }
 
@@ -289,6 +1125,13 @@ typedef struct ModelRouter {
     char* standard_model;
     char* powerful_model;
     char* classification_model;
+    KeywordIndex keywords;  // Indexed by Complexity
+    double local_threshold;
+    atomic_size_t local_hits;
+    atomic_size_t llm_fallbacks;
+    Speculator speculation;
+    atomic_size_t level_counts[COMPLEXITY_COMPLEX + 1];  // Inputs sent to each level
+    atomic_size_t assessed;
 } ModelRouter;
 
 /**
@@ -301,25 +1144,114 @@ ModelRouter* model_router_create(const char* api_key) {
     router->standard_model = strdup("claude-sonnet-4-20250514");
     router->powerful_model = strdup("claude-opus-4-20250514");
     router->classification_model = strdup("claude-sonnet-4-20250514");
+
+    // Cue words for each level; one distinctive word is enough at the
+    // default threshold, mixed cues go to the LLM
+    keyword_index_add_text(&router->keywords,
+        "what, who, when, where, define, capital, convert, sum, plus, minus, times, "
+        "list, name, spell, translate", COMPLEXITY_SIMPLE, false);
+    keyword_index_add_text(&router->keywords,
+        "explain, why, how, describe, implement, debug, summarize, example, difference",
+        COMPLEXITY_MODERATE, false);
+    keyword_index_add_text(&router->keywords,
+        "analyze, analysis, design, prove, architecture, optimize, tradeoff, complexity, "
+        "strategy, evaluate, research, story, essay, refactor, concurrent, distributed",
+        COMPLEXITY_COMPLEX, false);
+    router->local_threshold = 0.5;
+    atomic_init(&router->local_hits, 0);
+    atomic_init(&router->llm_fallbacks, 0);
+    speculator_init(&router->speculation);
+    for (int c = 0; c <= COMPLEXITY_COMPLEX; c++) {
+        atomic_init(&router->level_counts[c], 0);
+    }
+    atomic_init(&router->assessed, 0);
     return router;
 }
 
 /**
- * Assess complexity of input
+ * Send the request to the likely model while the assessment call runs
+ * (off by default); budget and confidence work as in
+ * router_set_speculation. A wrong guess is cancelled.
  */
-Complexity model_router_assess(ModelRouter* router, const char* input) {
-    char prompt[MAX_INPUT_SIZE];
-    snprintf(prompt, sizeof(prompt),
-        "Assess the complexity of handling this request:\n\n"
-        "%s\n\n"
+void model_router_set_speculation(ModelRouter* router, bool enabled, double min_confidence,
+                                  size_t token_budget) {
+    router->speculation.enabled = enabled;
+    router->speculation.min_confidence = min_confidence;
+    router->speculation.token_budget = token_budget;
+}
+
+SpeculationStats model_router_get_speculation_stats(ModelRouter* router) {
+    return speculator_get_stats(&router->speculation);
+}
+
+/**
+ * Confidence the keyword tier needs to skip the assessment call; above 1
+ * always asks the LLM
+ */
+void model_router_set_threshold(ModelRouter* router, double threshold) {
+    router->local_threshold = threshold;
+}
+
+/**
+ * Add cue words for a complexity level
+ */
+void model_router_add_keywords(ModelRouter* router, Complexity complexity, const char* keywords) {
+    keyword_index_add_text(&router->keywords, keywords, complexity, false);
+}
+
+/**
+ * How often the keyword tier answered without an API call
+ */
+ClassifierStats model_router_get_stats(ModelRouter* router) {
+    ClassifierStats stats = {atomic_load(&router->local_hits),
+                             atomic_load(&router->llm_fallbacks)};
+    return stats;
+}
+
+/**
+ * Keyword tier for assessment. Returns true with *level set when it is
+ * confident; otherwise its best guess (or -1) is left in *guess
+ */
+bool model_router_assess_local(ModelRouter* router, const char* input, Complexity* level,
+                               int* guess, double* guess_confidence) {
+    *guess = keyword_index_classify(&router->keywords, input, COMPLEXITY_COMPLEX + 1,
+                                    guess_confidence);
+    if (*guess >= 0 && *guess_confidence >= router->local_threshold) {
+        atomic_fetch_add(&router->local_hits, 1);
+        *level = (Complexity)*guess;
+        return true;
+    }
+    atomic_fetch_add(&router->llm_fallbacks, 1);
+    return false;
+}
+
+/**
+ * Start the LLM assessment of input
+ */
+TransportFuture* model_router_submit_assessment(ModelRouter* router, const char* input) {
+    static const char heading[] = "Assess the complexity of handling this request:\n\n";
+    static const char rubric[] =
+        "\n\n"
         "Consider:\n"
         "- simple: Direct factual answers, simple calculations, basic questions\n"
         "- moderate: Analysis, explanations, moderate coding tasks\n"
         "- complex: Deep analysis, complex reasoning, creative writing, complex code\n\n"
-        "Respond with just: simple, moderate, or complex",
-        input);
+        "Respond with just: simple, moderate, or complex";
+    struct iovec parts[] = {{(void*)heading, sizeof(heading) - 1},
+                            {(void*)input, strlen(input)},
+                            {(void*)rubric, sizeof(rubric) - 1}};
 
-    char* response = call_anthropic_api(router->api_key, router->classification_model, prompt, 32);
+    AnthropicRequest request = {.api_key = router->api_key,
+                                .model = router->classification_model, .prompt_iov = parts,
+                                .prompt_iovcnt = 3, .max_tokens = 32};
+    return transport_submit(transport_default(), &request, NULL, NULL);
+}
+
+/**
+ * Wait for a submitted assessment; moderate if it failed
+ */
+Complexity model_router_finish_assessment(TransportFuture* future) {
+    char* response = transport_future_take_text(future, NULL);
     if (!response) {
         return COMPLEXITY_MODERATE;
     }
@@ -335,29 +1267,123 @@ Complexity model_router_assess(ModelRouter* router, const char* input) {
     return result;
 }
 
+/**
+ * Assess complexity of input
+ */
+Complexity model_router_assess(ModelRouter* router, const char* input) {
+    Complexity level;
+    int guess;
+    double guess_confidence;
+    if (model_router_assess_local(router, input, &level, &guess, &guess_confidence)) {
+        return level;
+    }
+    return model_router_finish_assessment(model_router_submit_assessment(router, input));
+}
+
+/**
+ * Model that handles a complexity level
+ */
+const char* model_router_model(ModelRouter* router, Complexity complexity) {
+    switch (complexity) {
+        case COMPLEXITY_SIMPLE:
+            return router->fast_model;
+        case COMPLEXITY_COMPLEX:
+            return router->powerful_model;
+        default:
+            return router->standard_model;
+    }
+}
+
+/**
+ * Level to speculate on: the keyword tier's guess if it had one, else the
+ * most frequent level so far (Laplace-smoothed share of inputs)
+ */
+int model_router_speculation_guess(ModelRouter* router, int guess, double* confidence) {
+    if (guess >= 0) return guess;
+
+    size_t assessed = atomic_load(&router->assessed);
+    size_t best_count = 0;
+    for (int c = 0; c <= COMPLEXITY_COMPLEX; c++) {
+        size_t count = atomic_load(&router->level_counts[c]);
+        if (count > best_count) {
+            best_count = count;
+            guess = c;
+        }
+    }
+    if (guess >= 0) {
+        *confidence = (double)(best_count + 1) / (double)(assessed + COMPLEXITY_COMPLEX + 1);
+    }
+    return guess;
+}
+
 /**
  * Route to appropriate model and get response
  */
 char* model_router_route(ModelRouter* router, const char* input) {
-    Complexity complexity = model_router_assess(router, input);
+    MetricsSpan span;
+    metrics_span_begin(&span, "routing.model_route", NULL);
+    Complexity complexity;
+    int guess;
+    double guess_confidence;
+    if (!model_router_assess_local(router, input, &complexity, &guess, &guess_confidence)) {
+        TransportFuture* assessment = model_router_submit_assessment(router, input);
+
+        // Send the request to the likely model while the assessment runs
+        TransportFuture* speculative = NULL;
+        guess = model_router_speculation_guess(router, guess, &guess_confidence);
+        if (guess >= 0 && speculator_allows(&router->speculation, guess_confidence)) {
+            AnthropicRequest request = {.api_key = router->api_key,
+                                        .model = model_router_model(router, (Complexity)guess),
+                                        .prompt = input, .max_tokens = 4096};
+            printf("Speculating on model: %s (%.2f)\n", request.model, guess_confidence);
+            atomic_fetch_add(&router->speculation.started, 1);
+            speculative = transport_submit(transport_default(), &request, NULL, NULL);
+        }
+
+        complexity = model_router_finish_assessment(assessment);
+        if (speculative) {
+            if ((int)complexity == guess) {
+                atomic_fetch_add(&router->level_counts[complexity], 1);
+                atomic_fetch_add(&router->assessed, 1);
+                printf("Using speculative model: %s\n", model_router_model(router, complexity));
+                AnthropicUsage usage;
+                char* text = transport_future_take_text(speculative, &usage);
+                speculator_record(&router->speculation, true, &usage);
+                metrics_span_set_string(&span, "routing.model",
+                                        model_router_model(router, complexity));
+                metrics_span_set_int(&span, "routing.speculated", 1);
+                span.error = text == NULL;
+                metrics_span_end(&span);
+                return text;
+            }
+            printf("Speculation discarded\n");
+            transport_cancel(speculative);
+            AnthropicUsage usage;
+            free(transport_future_take_text(speculative, &usage));
+            speculator_record(&router->speculation, false, &usage);
+        }
+    }
+    atomic_fetch_add(&router->level_counts[complexity], 1);
+    atomic_fetch_add(&router->assessed, 1);
 
-    const char* model;
+    const char* model = model_router_model(router, complexity);
     switch (complexity) {
         case COMPLEXITY_SIMPLE:
-            model = router->fast_model;
             printf("Using fast model: %s\n", model);
             break;
         case COMPLEXITY_COMPLEX:
-            model = router->powerful_model;
             printf("Using powerful model: %s\n", model);
             break;
         default:
-            model = router->standard_model;
             printf("Using standard model: %s\n", model);
             break;
     }
 
-    return call_anthropic_api(router->api_key, model, input, 4096);
+    metrics_span_set_string(&span, "routing.model", model);
+    char* response = call_anthropic_api(router->api_key, model, input, 4096);
+    span.error = response == NULL;
+    metrics_span_end(&span);
+    return response;
 }
 
 /**
@@ -369,29 +1395,27 @@ void model_router_free(ModelRouter* router) {
     free(router->standard_model);
     free(router->powerful_model);
     free(router->classification_model);
+    keyword_index_free(&router->keywords);
     free(router);
 }
 
 // Example handlers
 char* handle_code_question(const char* input, void* user_data) {
     const char* api_key = (const char*)user_data;
-    char prompt[MAX_INPUT_SIZE];
-    snprintf(prompt, sizeof(prompt), "As a coding expert, answer: %s", input);
-    return call_anthropic_api(api_key, "claude-sonnet-4-20250514", prompt, 4096);
+    return call_anthropic_api_input(api_key, "claude-sonnet-4-20250514",
+                                    "As a coding expert, answer: ", input, 4096);
 }
 
 char* handle_math_question(const char* input, void* user_data) {
     const char* api_key = (const char*)user_data;
-    char prompt[MAX_INPUT_SIZE];
-    snprintf(prompt, sizeof(prompt), "As a math expert, solve: %s", input);
-    return call_anthropic_api(api_key, "claude-sonnet-4-20250514", prompt, 4096);
+    return call_anthropic_api_input(api_key, "claude-sonnet-4-20250514",
+                                    "As a math expert, solve: ", input, 4096);
 }
 
 char* handle_general_question(const char* input, void* user_data) {
     const char* api_key = (const char*)user_data;
-    char prompt[MAX_INPUT_SIZE];
-    snprintf(prompt, sizeof(prompt), "Answer this question: %s", input);
-    return call_anthropic_api(api_key, "claude-sonnet-4-20250514", prompt, 4096);
+    return call_anthropic_api_input(api_key, "claude-sonnet-4-20250514",
+                                    "Answer this question: ", input, 4096);
 }
 
 char* handle_fallback(const char* input, void* user_data) {
@@ -406,6 +1430,17 @@ int main() {
         return 1;
     }
 
+    transport_set_mock_responder(mock_anthropic_api);
+
+    // AGENT_METRICS_PORT serves Prometheus metrics on loopback;
+    // AGENT_TRACE_FILE appends one OTLP/JSON line per finished span
+    metrics_init_from_env();
+
+    // Repeated prompts are served from cache; set AGENT_CACHE_FILE to keep
+    // answers across runs
+    ResponseCache* cache = transport_enable_cache(transport_default(), 256, 3600,
+                                                  getenv("AGENT_CACHE_FILE"));
+
     // Create router
     printf("=== Category Router ===\n");
     Router* router = router_create(api_key, NULL);
@@ -422,6 +1457,10 @@ int main() {
     router_add_route(router, "general",
                      "General knowledge questions",
                      handle_general_question, (void*)api_key);
+    router_add_keywords(router, "code", "implement, function, compile, algorithm, tree, "
+                        "binary, pointer, bug, struct");
+    router_add_keywords(router, "math", "solve, equation, integral, sum, prime, algebra");
+    router_set_speculation(router, true, 0.3, 20000);
 
     // Route a query
     char* result = router_route(router, "How do I implement a binary search tree?");
@@ -430,11 +1469,46 @@ int main() {
         free(result);
     }
 
+    // No keyword cues: the LLM classifier decides
+    result = router_route(router, "Tell me something interesting about octopuses");
+    if (result) {
+        printf("Result: %s\n", result);
+        free(result);
+    }
+
+    // A weak keyword cue: the general handler starts while the LLM decides
+    result = router_route(router, "What is the general idea behind plate tectonics?");
+    if (result) {
+        printf("Result: %s\n", result);
+        free(result);
+    }
+
+    // Bulk tickets: one classification request per batch, handlers in parallel
+    printf("\n=== Batch Routing ===\n");
+    const char* tickets[] = {
+        "My merge sort code crashes on empty arrays",
+        "What is 17 + 25?",
+        "Who painted the Mona Lisa?",
+        "Why does my code leak memory?",
+        "Solve the equation 3x = 12",
+    };
+    size_t ticket_count = sizeof(tickets) / sizeof(tickets[0]);
+    router_set_batch_size(router, 4);
+    char** answers = router_route_batch(router, tickets, ticket_count);
+    for (size_t i = 0; i < ticket_count; i++) {
+        printf("Ticket %zu: %.60s\n", i + 1, answers[i] ? answers[i] : "(no answer)");
+        free(answers[i]);
+    }
+    free(answers);
+
+    classifier_stats_print("Local classifier", router_get_stats(router), stdout);
+    speculation_stats_print("Speculation", router_get_speculation_stats(router), stdout);
     router_free(router);
 
     // Model-based routing
     printf("\n=== Model Router ===\n");
     ModelRouter* model_router = model_router_create(api_key);
+    model_router_set_speculation(model_router, true, 0.3, 20000);
 
     char* model_result = model_router_route(model_router, "What is 2+2?");
     if (model_result) {
@@ -448,7 +1522,23 @@ int main() {
         free(model_result);
     }
 
+    // Mixed cues: the assessment call runs alongside a guess at the model
+    model_result = model_router_route(model_router, "How would you design a cache?");
+    if (model_result) {
+        printf("Mixed query result: %s\n", model_result);
+        free(model_result);
+    }
+
+    classifier_stats_print("Local assessment", model_router_get_stats(model_router), stdout);
+    speculation_stats_print("Model speculation", model_router_get_speculation_stats(model_router),
+                            stdout);
     model_router_free(model_router);
 
+    metrics_print_summary(stdout);
+    response_cache_print_stats(cache, stdout);
+    transport_set_cache(transport_default(), NULL);
+    response_cache_destroy(cache);
+    metrics_shutdown();
+
     return 0;
 }
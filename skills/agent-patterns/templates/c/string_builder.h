@@ -0,0 +1,147 @@
+/**
+ * Shared String Builder for the C Agent Pattern Templates
+ * Growable, NUL-terminated buffer for prompts and request bodies
+ *
+ * Appends are amortized O(1): the builder tracks its length, so nothing is
+ * rescanned the way strcat rescans, and capacity doubles when it runs out,
+ * so nothing is ever truncated. string_builder_appendf formats straight
+ * into the free space and only formats a second time when it had to grow.
+ * string_builder_take hands the finished string to the caller.
+ *
+ * A zero-initialized StringBuilder is empty and ready to use.
+ *
+ * Header-only: include it from a template.
+ */
+
+#ifndef STRING_BUILDER_H
+#define STRING_BUILDER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+typedef struct StringBuilder {
+    char* data;      // NULL until the first append
+    size_t length;   // Bytes used, excluding the terminating NUL
+    size_t capacity;
+} StringBuilder;
+
+/**
+ * Make room for at least extra more bytes plus the NUL
+ */
+static inline void string_builder_reserve(StringBuilder* sb, size_t extra) {
+    if (sb->length + extra + 1 <= sb->capacity) return;
+    size_t capacity = sb->capacity ? sb->capacity : 256;
+    while (capacity < sb->length + extra + 1) capacity *= 2;
+    sb->data = (char*)realloc(sb->data, capacity);
+    sb->capacity = capacity;
+}
+
+/**
+ * Append length bytes
+ */
+static inline void string_builder_append(StringBuilder* sb, const char* data, size_t length) {
+    string_builder_reserve(sb, length);
+    if (length > 0) memcpy(sb->data + sb->length, data, length);
+    sb->length += length;
+    sb->data[sb->length] = '\0';
+}
+
+/**
+ * Append a NUL-terminated string
+ */
+static inline void string_builder_append_str(StringBuilder* sb, const char* s) {
+    string_builder_append(sb, s, strlen(s));
+}
+
+/**
+ * Append printf-style formatted text
+ */
+static inline void string_builder_appendf(StringBuilder* sb, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    va_list retry;
+    va_copy(retry, args);
+
+    size_t space = sb->capacity > sb->length ? sb->capacity - sb->length : 0;
+    int length = vsnprintf(space ? sb->data + sb->length : NULL, space, format, args);
+    va_end(args);
+    if (length < 0) {
+        va_end(retry);
+        return;
+    }
+    if ((size_t)length >= space) {
+        string_builder_reserve(sb, (size_t)length);
+        vsnprintf(sb->data + sb->length, (size_t)length + 1, format, retry);
+    }
+    va_end(retry);
+    sb->length += (size_t)length;
+}
+
+/**
+ * Append bytes escaped for the inside of a JSON string
+ */
+static inline void string_builder_append_json(StringBuilder* sb, const char* data, size_t length) {
+    const char* run = data;
+    const char* end = data + length;
+    for (const char* s = data; s < end; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c != '"' && c != '\\' && c >= 0x20) continue;
+
+        string_builder_append(sb, run, s - run);
+        switch (c) {
+            case '"':  string_builder_append(sb, "\\\"", 2); break;
+            case '\\': string_builder_append(sb, "\\\\", 2); break;
+            case '\n': string_builder_append(sb, "\\n", 2); break;
+            case '\r': string_builder_append(sb, "\\r", 2); break;
+            case '\t': string_builder_append(sb, "\\t", 2); break;
+            default:   string_builder_appendf(sb, "\\u%04x", c); break;
+        }
+        run = s + 1;
+    }
+    string_builder_append(sb, run, end - run);
+}
+
+/**
+ * Append a string as a quoted, escaped JSON string
+ */
+static inline void string_builder_append_json_string(StringBuilder* sb, const char* s) {
+    string_builder_append(sb, "\"", 1);
+    string_builder_append_json(sb, s, strlen(s));
+    string_builder_append(sb, "\"", 1);
+}
+
+/**
+ * Current contents; "" before the first append
+ */
+static inline const char* string_builder_cstr(const StringBuilder* sb) {
+    return sb->data ? sb->data : "";
+}
+
+/**
+ * Drop the contents but keep the memory for reuse
+ */
+static inline void string_builder_clear(StringBuilder* sb) {
+    sb->length = 0;
+    if (sb->data) sb->data[0] = '\0';
+}
+
+/**
+ * Hand the string to the caller (free it) and leave the builder empty
+ */
+static inline char* string_builder_take(StringBuilder* sb) {
+    char* data = sb->data ? sb->data : strdup("");
+    *sb = (StringBuilder){0};
+    return data;
+}
+
+/**
+ * Free the builder's memory
+ */
+static inline void string_builder_free(StringBuilder* sb) {
+    free(sb->data);
+    *sb = (StringBuilder){0};
+}
+
+#endif // STRING_BUILDER_H
@@ -0,0 +1,402 @@
+/**
+ * Shared Worker Pool for the C Agent Pattern Templates
+ * Long-lived, work-stealing thread pool used by the parallel patterns
+ *
+ * Each worker owns a job deque. Workers pop their own jobs LIFO and steal
+ * from the other deques FIFO when they run dry. Jobs submitted from outside
+ * the pool are spread round-robin across the deques. Jobs are stored by
+ * value, so submitting a job never allocates unless a deque has to grow.
+ *
+ * Callers that fan out work track it with a TaskGroup (usually on the
+ * stack) and block in task_group_wait(). A pool worker that waits on a
+ * group keeps running queued jobs instead of sleeping, so nested fan-out
+ * (an orchestrator worker that runs a sectioning job, for example) cannot
+ * starve the pool.
+ *
+ * Time jobs spend queued is recorded in the METRIC_QUEUE_WAIT histogram.
+ *
+ * Header-only: include it from a template and compile with -pthread.
+ */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+// Pool sizing. API calls block for seconds, so the default pool is
+// deliberately wider than the number of cores.
+#define THREAD_POOL_MAX_THREADS 256
+#define THREAD_POOL_MIN_DEFAULT_THREADS 8
+#define THREAD_POOL_THREADS_PER_CPU 4
+#define THREAD_POOL_INITIAL_QUEUE 64
+
+typedef struct ThreadPool ThreadPool;
+typedef struct TaskGroup TaskGroup;
+
+/**
+ * Job function type
+ */
+typedef void (*ThreadPoolJobFunc)(void* arg);
+
+/**
+ * Queued job
+ */
+typedef struct ThreadPoolJob {
+    ThreadPoolJobFunc func;
+    void* arg;
+    TaskGroup* group;
+    uint64_t queued_ns;  // metrics_now_ns() at submit
+} ThreadPoolJob;
+
+/**
+ * Per-worker job deque (owner uses the tail, thieves use the head)
+ */
+typedef struct WorkerQueue {
+    pthread_mutex_t lock;
+    ThreadPoolJob* jobs;
+    size_t capacity;
+    size_t head;
+    size_t count;
+} WorkerQueue;
+
+/**
+ * Completion tracker for a batch of jobs
+ */
+typedef struct TaskGroup {
+    atomic_int pending;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} TaskGroup;
+
+/**
+ * Worker thread arguments
+ */
+typedef struct PoolWorker {
+    ThreadPool* pool;
+    int index;
+    pthread_t thread;
+} PoolWorker;
+
+/**
+ * Thread pool
+ */
+typedef struct ThreadPool {
+    PoolWorker* workers;
+    WorkerQueue* queues;
+    int thread_count;
+    atomic_uint next_queue;
+    atomic_int queued;
+    atomic_bool shutting_down;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;
+} ThreadPool;
+
+// Pool and worker index of the calling thread, if it is a pool worker
+static _Thread_local ThreadPool* thread_pool_current = NULL;
+static _Thread_local int thread_pool_current_index = -1;
+
+/**
+ * Push a job onto the tail of a deque, growing it if needed
+ */
+static inline void worker_queue_push(WorkerQueue* q, ThreadPoolJob job) {
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->capacity) {
+        size_t new_capacity = q->capacity * 2;
+        ThreadPoolJob* jobs = (ThreadPoolJob*)malloc(new_capacity * sizeof(ThreadPoolJob));
+        for (size_t i = 0; i < q->count; i++) {
+            jobs[i] = q->jobs[(q->head + i) % q->capacity];
+        }
+        free(q->jobs);
+        q->jobs = jobs;
+        q->capacity = new_capacity;
+        q->head = 0;
+    }
+    q->jobs[(q->head + q->count) % q->capacity] = job;
+    q->count++;
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Pop a job from the tail (owner) or head (thief) of a deque
+ */
+static inline bool worker_queue_pop(WorkerQueue* q, bool steal, ThreadPoolJob* job) {
+    pthread_mutex_lock(&q->lock);
+    if (q->count == 0) {
+        pthread_mutex_unlock(&q->lock);
+        return false;
+    }
+    if (steal) {
+        *job = q->jobs[q->head];
+        q->head = (q->head + 1) % q->capacity;
+    } else {
+        *job = q->jobs[(q->head + q->count - 1) % q->capacity];
+    }
+    q->count--;
+    pthread_mutex_unlock(&q->lock);
+    return true;
+}
+
+/**
+ * Take the next runnable job: own deque first, then steal
+ */
+static inline bool thread_pool_take(ThreadPool* pool, int self, ThreadPoolJob* job) {
+    if (self >= 0 && worker_queue_pop(&pool->queues[self], false, job)) {
+        return true;
+    }
+
+    int start = self >= 0 ? self + 1 : 0;
+    for (int i = 0; i < pool->thread_count; i++) {
+        int victim = (start + i) % pool->thread_count;
+        if (victim == self) continue;
+        if (worker_queue_pop(&pool->queues[victim], true, job)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Run a job and signal its group
+ */
+static inline void thread_pool_run_job(ThreadPool* pool, ThreadPoolJob* job) {
+    atomic_fetch_sub(&pool->queued, 1);
+    metrics_observe_since(METRIC_QUEUE_WAIT, job->queued_ns);
+    metrics_count(METRIC_POOL_JOBS, 1);
+    job->func(job->arg);
+
+    // Decrement under the lock so a waiter cannot destroy the group while
+    // the last job is still signalling it
+    TaskGroup* group = job->group;
+    if (group) {
+        pthread_mutex_lock(&group->lock);
+        if (atomic_fetch_sub(&group->pending, 1) == 1) {
+            pthread_cond_broadcast(&group->done);
+        }
+        pthread_mutex_unlock(&group->lock);
+    }
+}
+
+/**
+ * Pool worker thread function
+ */
+static void* thread_pool_worker_main(void* args) {
+    PoolWorker* worker = (PoolWorker*)args;
+    ThreadPool* pool = worker->pool;
+    thread_pool_current = pool;
+    thread_pool_current_index = worker->index;
+
+    for (;;) {
+        ThreadPoolJob job;
+        if (thread_pool_take(pool, worker->index, &job)) {
+            thread_pool_run_job(pool, &job);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->idle_lock);
+        while (atomic_load(&pool->queued) == 0 && !atomic_load(&pool->shutting_down)) {
+            pthread_cond_wait(&pool->idle, &pool->idle_lock);
+        }
+        bool done = atomic_load(&pool->shutting_down) && atomic_load(&pool->queued) == 0;
+        pthread_mutex_unlock(&pool->idle_lock);
+
+        if (done) break;
+    }
+
+    return NULL;
+}
+
+/**
+ * Create a thread pool (thread_count <= 0 picks a default size)
+ */
+static inline ThreadPool* thread_pool_create(int thread_count) {
+    if (thread_count <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = (int)(cpus > 0 ? cpus : 1) * THREAD_POOL_THREADS_PER_CPU;
+        if (thread_count < THREAD_POOL_MIN_DEFAULT_THREADS) {
+            thread_count = THREAD_POOL_MIN_DEFAULT_THREADS;
+        }
+    }
+    if (thread_count > THREAD_POOL_MAX_THREADS) thread_count = THREAD_POOL_MAX_THREADS;
+
+    ThreadPool* pool = (ThreadPool*)calloc(1, sizeof(ThreadPool));
+    pool->thread_count = thread_count;
+    pool->queues = (WorkerQueue*)calloc(thread_count, sizeof(WorkerQueue));
+    pool->workers = (PoolWorker*)calloc(thread_count, sizeof(PoolWorker));
+    atomic_init(&pool->next_queue, 0);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->shutting_down, false);
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    for (int i = 0; i < thread_count; i++) {
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+        pool->queues[i].capacity = THREAD_POOL_INITIAL_QUEUE;
+        pool->queues[i].jobs = (ThreadPoolJob*)malloc(THREAD_POOL_INITIAL_QUEUE * sizeof(ThreadPoolJob));
+    }
+
+    for (int i = 0; i < thread_count; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pthread_create(&pool->workers[i].thread, NULL, thread_pool_worker_main, &pool->workers[i]);
+    }
+
+    return pool;
+}
+
+/**
+ * Number of worker threads in the pool
+ */
+static inline int thread_pool_size(const ThreadPool* pool) {
+    return pool->thread_count;
+}
+
+/**
+ * Initialize a task group
+ */
+static inline void task_group_init(TaskGroup* group) {
+    atomic_init(&group->pending, 0);
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_cond_init(&group->done, NULL);
+}
+
+/**
+ * Release task group resources (the group must be idle)
+ */
+static inline void task_group_destroy(TaskGroup* group) {
+    pthread_mutex_destroy(&group->lock);
+    pthread_cond_destroy(&group->done);
+}
+
+/**
+ * Submit a job, optionally tracked by a group
+ */
+static inline void thread_pool_submit(ThreadPool* pool, TaskGroup* group,
+                                      ThreadPoolJobFunc func, void* arg) {
+    ThreadPoolJob job = {func, arg, group, metrics_now_ns()};
+    if (group) atomic_fetch_add(&group->pending, 1);
+
+    // Workers keep their own jobs local; outside callers spread the load
+    int target;
+    if (thread_pool_current == pool) {
+        target = thread_pool_current_index;
+    } else {
+        target = (int)(atomic_fetch_add(&pool->next_queue, 1) % (unsigned)pool->thread_count);
+    }
+
+    atomic_fetch_add(&pool->queued, 1);
+    worker_queue_push(&pool->queues[target], job);
+
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_signal(&pool->idle);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+/**
+ * Wait until every job in the group has finished
+ */
+static inline void task_group_wait(ThreadPool* pool, TaskGroup* group) {
+    bool is_worker = thread_pool_current == pool;
+
+    while (atomic_load(&group->pending) > 0) {
+        // Pool workers help drain the queues instead of blocking a thread
+        if (is_worker) {
+            ThreadPoolJob job;
+            if (thread_pool_take(pool, thread_pool_current_index, &job)) {
+                thread_pool_run_job(pool, &job);
+                continue;
+            }
+        }
+
+        pthread_mutex_lock(&group->lock);
+        if (atomic_load(&group->pending) > 0) {
+            if (is_worker) {
+                // Re-check the queues periodically for newly submitted jobs
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += 1000000;
+                if (deadline.tv_nsec >= 1000000000L) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&group->done, &group->lock, &deadline);
+            } else {
+                pthread_cond_wait(&group->done, &group->lock);
+            }
+        }
+        pthread_mutex_unlock(&group->lock);
+    }
+
+    // Synchronize with the final signal before the caller reuses the group
+    pthread_mutex_lock(&group->lock);
+    pthread_mutex_unlock(&group->lock);
+}
+
+/**
+ * Drain outstanding jobs, stop the workers and free the pool
+ */
+static inline void thread_pool_destroy(ThreadPool* pool) {
+    if (!pool) return;
+
+    pthread_mutex_lock(&pool->idle_lock);
+    atomic_store(&pool->shutting_down, true);
+    pthread_cond_broadcast(&pool->idle);
+    pthread_mutex_unlock(&pool->idle_lock);
+
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+        free(pool->queues[i].jobs);
+    }
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->queues);
+    free(pool->workers);
+    free(pool);
+}
+
+// Process-wide default pool shared by every parallelizer that has not
+// been given its own pool
+static ThreadPool* thread_pool_default_instance = NULL;
+static int thread_pool_default_threads = 0;
+static pthread_once_t thread_pool_default_once = PTHREAD_ONCE_INIT;
+
+static void thread_pool_default_shutdown(void) {
+    thread_pool_destroy(thread_pool_default_instance);
+    thread_pool_default_instance = NULL;
+}
+
+static void thread_pool_default_init(void) {
+    thread_pool_default_instance = thread_pool_create(thread_pool_default_threads);
+    atexit(thread_pool_default_shutdown);
+}
+
+/**
+ * Set the size of the shared default pool (call before first use)
+ */
+static inline bool thread_pool_set_default_size(int thread_count) {
+    if (thread_pool_default_instance) return false;
+    thread_pool_default_threads = thread_count;
+    return true;
+}
+
+/**
+ * Get the shared default pool, creating it on first use
+ */
+static inline ThreadPool* thread_pool_default(void) {
+    pthread_once(&thread_pool_default_once, thread_pool_default_init);
+    return thread_pool_default_instance;
+}
+
+#endif // THREAD_POOL_H